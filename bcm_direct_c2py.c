@@ -10,17 +10,44 @@
 // 
 // compile and link the bcm library with
 //
-// gcc -shared -o bcm_direct_c2py.so -fPIC bcm_direct_c2py.c -l bcm2835
+// gcc -shared -o bcm_direct_c2py.so -fPIC bcm_direct_c2py.c -l bcm2835 -lpthread -lm
+//
+// or use the Makefile, which optimises for the Pi model given (make PI=zero, 3 or 4, see the Makefile)
+//
+// add -DNO_BCM2835 (and leave out -l bcm2835) to build without the bcm2835 library, for example on a PC
+// where only the spidev and emulator backends are available
+//
+// the pixel blending uses NEON when it is enabled by the compiler (always on 64 bit, -mfpu=neon on a 32 bit Pi 2 or later,
+// the Pi Zero and Pi 1 do not have it) and SSE2 or AVX2 on a PC, otherwise plain C
 //
 // for more details see http://simpaul.com/round_display
 
 
 
+#ifndef NO_BCM2835
 #include <bcm2835.h>    // if this gives errors check the above website for installation instructions
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h> 
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+#endif
 #include "bcm_direct_c2py.h"
 
 // pin numbers are hte BCM values
@@ -37,1038 +64,6924 @@
                           // 2 top of screen is by connector 
                           // 3 connector at bottom of screen
 
-// global pointer for the rendering workspace
-// this maintains a memory to build a screen before it is updated on the device
-// this allows for faster updates of complex images
-unsigned short * RenderSpace = NULL; 
-unsigned short * ReferenceSpace = NULL;
+// dirty rectangle tracking
+// every change to the render space records the area it touched, so ScreenUpdateDirty only needs to send those parts
+// rather than the full 240x240x2 bytes.
+#define MAX_DIRTY_RECTS  32
+#define CLIP_DEPTH       16     // clip rectangles that can be pushed, see PushClipRect
+#define WINDOW_OVERHEAD  11     // bytes sent by SetScreenWriteArea, 3 commands and 8 data bytes
 
+typedef struct
+{
+    short x0,y0,x1,y1;          // inclusive, same as SetScreenWriteArea
+} DirtyRect;
 
-// main this should not be used directly as this is a library
-int main(int argc, char **argv)
+typedef struct
 {
-    printf("bcm_direct_c2py is a library for use with Python\n");
-      
-    return 0;
+    DirtyRect rect[MAX_DIRTY_RECTS];
+    int count;
+} DirtyRegion;
+
+#define DEFAULT_TRANSFER_CHUNK  4096
+#define COVERAGE_WIDTH  242
+#define COVERAGE_FULL   131072      // a fully covered pixel (2 x 256 x 256, see CoverSegment)
+#define FRAME_HISTORY   1024        // frames kept for the percentiles
+#define DRAW_THREADS_MAX   8        // bands a draw list can be split into, see SetDrawThreads
+
+// the Makefile passes the model and flags it built with, see GetBuildInfo
+#ifndef C2PY_BUILD
+#define C2PY_BUILD      "built by hand"
+#endif
+
+#ifdef C2PY_STATS
+#ifndef __GNUC__
+#error C2PY_STATS needs gcc or clang, for the cleanup attribute
+#endif
+typedef struct
+{
+    long long start, end;       // CLOCK_MONOTONIC nanoseconds
+    int kind;                   // STAT_ kind
+    int thread;                 // 0 for the caller, 1 for the flush thread
+} TraceEvent;
+#endif
+
+
+// transport backends
+// all the SPI and GPIO access goes through one of these, so the same library can drive the display
+// through the bcm2835 library, through the Linux spidev driver, or draw into an in-memory GC9A01 emulator
+// when there is no Pi (or no display) attached. Select one with SelectBackend before initBCMHardware.
+typedef struct
+{
+    const char * name;
+    bool (*init)(DisplayContext * display);                         // open the bus and reset the display
+    void (*exit)(DisplayContext * display);
+    void (*command)(DisplayContext * display, unsigned char cmd);   // one command byte with D/C low
+    void (*data)(DisplayContext * display, const unsigned char * data, unsigned int length);  // data bytes with D/C high
+    void (*delay)(unsigned int millis);
+    bool (*tearsetup)(DisplayContext * display, int pin);           // start (or with -1 stop) watching the TE pin
+    bool (*tearwait)(DisplayContext * display, unsigned int timeoutus, long long * edge);   // wait for the next rising edge,
+                                                                                            // false on timeout
+} DisplayBackend;
+
+
+// display context
+// everything about one display, so that one process can drive several of them, each on its own chip select
+// or SPI bus. CreateDisplay makes one with the settings the library has always used, and every function
+// that draws on or talks to a display is passed the one to use
+struct DisplayContext
+{
+    // how the display is connected, these can be changed before initBCMHardware
+    const DisplayBackend * Backend;
+    int DCPin;                          // BCM GPIO numbers, CIR_DC and CIR_RES by default
+    int ResetPin;
+    int ChipSelect;                     // 0 or 1 for CE0 or CE1 with the bcm2835 backend
+    unsigned int SpiSpeed;              // Hz, or 0 for the backend's usual speed
+    int Orientation;                    // see USE_HORIZONTAL
+    bool HardwareOpen;                  // between initBCMHardware and exitBCMHardware
+
+    // the rendering workspace
+    // this maintains a memory to build a screen before it is updated on the device
+    // this allows for faster updates of complex images
+    unsigned short * RenderSpace;
+    unsigned short * ReferenceSpace;
+
+    // dirty rectangle tracking, see above
+    DirtyRegion ScreenDamage;           // changed since the last screen update
+    DirtyRegion ReferenceDamage;        // changed since the reference image was last set or restored
+
+    // counters so the saving can be confirmed from Python
+    unsigned long long FlushBytesSent;
+    unsigned long long FlushBytesSaved;
+
+    // transfer staging buffer
+    // pixels are byte swapped into this and sent in large chunks (bcm2835_spi_writenb or one spidev message)
+    // rather than as two single byte transfers per pixel, each of which waits on the SPI FIFO
+    unsigned int TransferChunkSize;     // 0 selects the original byte at a time loop
+    unsigned char * TransferBuffer;
+
+    // transfer format, see SetTransferFormat
+    // the render space is always RGB565, but the pixels can go to the display as RGB444, packed as they are sent
+    int TransferBits;                   // 16 or 12
+    bool TransferDither;                // ordered dither before the low bits are dropped
+
+    // double buffering
+    // ScreenUpdateAsync copies the changed areas into the flush space and a separate thread sends them to the display
+    // so the caller can draw the next frame while the current one is still going out over SPI.
+    // each display has its own thread, so displays on different buses are sent at the same time
+    unsigned short * FlushSpace;
+    DirtyRegion FlushRegion;            // the areas of the flush space waiting to be sent
+    pthread_t FlushThreadId;
+    pthread_mutex_t FlushLock;
+    pthread_cond_t FlushWake;
+    pthread_cond_t FlushDone;
+    bool FlushThreadRunning;
+    bool FlushThreadStop;
+    bool FlushPending;
+
+    // content diff, see SetContentDiff
+    // ShadowSpace is a copy of what has been sent to the panel's GRAM, as the render space holds it, so an update can
+    // be compared with it and only the parts of the rows that really changed sent. It is only used once it holds a
+    // whole screen (ShadowValid), which is cleared whenever the panel could have something else
+    unsigned short * ShadowSpace;
+    bool ShadowValid;
+    int DiffThreshold;                  // percentage of the pixels changed above which the areas are sent as they were
+    unsigned long long DiffUpdates;
+    unsigned long long DiffCompared;
+    unsigned long long DiffChanged;
+    unsigned long long DiffRows;
+    unsigned long long DiffFull;
+
+    // tearing effect (TE) pacing
+    // the GC9A01 pulses its TE pin as it starts each scan of the panel. With a GPIO wired to it, screen updates
+    // wait for the pulse and start writing just behind the scan line, so the panel never shows half of one frame
+    // and half of the next. Times are CLOCK_MONOTONIC nanoseconds
+    int TearingPin;                     // the GPIO the TE pin is wired to, -1 for no pacing
+    long long TearingPeriod;            // measured time of one scan of the panel
+    long long TearingLastEdge;          // the edge the last frame started on
+    long long TearingNsPerByte;         // how long the bus takes for each byte, learnt from each transfer
+    unsigned int TearingFrames;         // flushes started on an edge
+    unsigned int TearingTimeouts;       // no edge seen, so the flush went ahead anyway
+    unsigned int TearingMissed;         // scans that went by with no new frame between two flushes
+    unsigned int TearingSplit;          // frames too slow for one scan, split over more than one
+    unsigned int TearingOverruns;       // bands that finished after the scan line came round again
+    long long TearingLatencySum;        // edge to first byte, for the mean, maximum and jitter
+    long long TearingLatencySquares;
+    long long TearingLatencyMax;
+
+    // polygon coverage
+    // the polygon fill adds up how much of each pixel the shape covers here before writing any of them,
+    // so every pixel is only blended once however many edges pass through it.
+    // one int per pixel plus a spare column, allocated the first time a polygon is drawn
+    int * CoverageSpace;
+    short CoverRowLeft[240];            // the cells used in each row, so the fill only looks at those
+    short CoverRowRight[240];
+
+    // render space byte order
+    // normally the render space holds each pixel as a native unsigned short, which on the (little endian) Pi
+    // means the bytes are the wrong way round for the display and every update has to swap them.
+    // with PanelByteOrder set the pixels are stored already swapped, so the memory is exactly what the
+    // GC9A01 expects and updates can send it with no per pixel work.
+    // colours passed in and returned by the functions are always the normal 16 bit value either way.
+    bool PanelByteOrder;
+
+    // circular mask
+    // the panel is a 240 pixel circle, so about a fifth of the 240x240 render space is in corners that can never be seen.
+    // VisibleLeft and VisibleRight hold the first and last pixel of each row that is at least partly inside the circle,
+    // and the fills, copies and screen updates only touch those. With the mask off they are the full width.
+    bool CircularMask;
+    short VisibleLeft[240];
+    short VisibleRight[240];
+
+    // clip rectangle
+    // the drawing only changes pixels inside ClipX0..ClipX1, ClipY0..ClipY1, normally the whole render space.
+    // PushClipRect narrows it (saving the one before on ClipStack) so a widget can draw into its own part of the
+    // screen, and PopClipRect goes back. DrawLeft and DrawRight are the visible spans trimmed to it, which the fills
+    // and copies keep to, and the lines are clipped to it before they are drawn so the pixels need no checks
+    short ClipX0, ClipY0, ClipX1, ClipY1;
+    DirtyRect ClipStack[CLIP_DEPTH];
+    int ClipDepth;
+    short DrawLeft[240];
+    short DrawRight[240];
+
+    // hardware scrolling, see SetScrollArea
+    // rows ScrollTop to ScrollTop+ScrollCount-1 of the render space (and the panel's GRAM) are a ring, and the panel
+    // shows it starting ScrollOffset rows in. ScrollStart is the start address that needs, in the panel's own line
+    // order, and is sent after the pixels of the next screen update so the new rows are there before they are shown
+    short ScrollTop, ScrollCount;
+    short ScrollOffset;
+    int ScrollStart;
+    int ScrollSent;                     // the start address the panel has, -1 to send it whatever it is
+    int FlushScrollStart;               // ScrollStart for the frame handed to the flush thread
+
+    // frame loop timings, see RunFrameLoop
+    unsigned int FrameDrawTimes[FRAME_HISTORY];     // microseconds
+    unsigned int FrameFlushTimes[FRAME_HISTORY];
+    unsigned int FrameCount;
+    unsigned int FrameDropped;
+    long long FrameBusy;                // total drawing and sending time, against the time the loop ran for
+    long long FrameElapsed;
+    volatile bool FrameLoopStop;
+
+    // banded drawing, see SetDrawThreads
+    // ExecuteDrawList cuts the render space into DrawThreads bands of rows, and the caller and a worker thread for each
+    // of the other bands run the same drawing commands, each clipped to its own band. A band has a context of its own
+    // (BandContext, its BandOwner pointing back here) so the clipping and the changed areas are kept apart
+    int DrawThreads;
+    DisplayContext * BandContext[DRAW_THREADS_MAX];
+    DisplayContext * BandOwner;
+    pthread_t BandThreadId[DRAW_THREADS_MAX];
+    int BandThreadCount;                // workers running, DrawThreads-1 once started
+    pthread_mutex_t BandLock;
+    pthread_cond_t BandWake;
+    pthread_cond_t BandDone;
+    unsigned int BandGeneration;        // counted up for each set of commands handed to the workers
+    int BandPending;                    // workers still drawing them
+    bool BandStop;
+    const unsigned char * BandCmds;
+    unsigned int BandLength;
+
+#ifdef C2PY_STATS
+    // instrumentation, see the instrumentation section
+    unsigned long long Stats[STAT_KINDS][STAT_VALUES];
+    int StatKind;                       // the primitive being drawn, which the pixels are counted against
+    int StatDepth;                      // primitives used by other primitives count as part of the outer one
+    long long StatStart;
+    long long StatLastFrame;            // when the last screen update started
+    unsigned int StatHistogram[STAT_HISTOGRAM];
+    TraceEvent * Trace;                 // StartTrace's events
+    unsigned int TraceSize;
+    unsigned int TraceCount;            // also added to by the flush thread, so updated atomically
+#endif
+
+    // bcm2835 backend
+    int Bcm2835DCLevel;                 // saves rewriting the D/C pin when it is already right
+
+    // spidev backend
+    char SpidevPath[64];
+    int SpidevFd;
+    int SpidevGpioFd;                   // line handle for the D/C and reset pins
+    int SpidevDCLevel;
+    int SpidevTearFd;                   // line event for the TE pin
+
+    // emulator backend, see the emulator section
+    unsigned short EmulatorGRAM[240*240];
+    unsigned char EmulatorCmd;          // the command the data bytes belong to
+    unsigned char EmulatorArgs[6];
+    unsigned int EmulatorArgCount;
+    int EmulatorHighByte;               // first byte of a pixel, waiting for the second
+    unsigned char EmulatorColmod;       // pixel format, 0x55 for 16 bits or 0x53 for 12
+    unsigned int EmulatorBits;          // 12 bit pixels arrive a byte and a half at a time
+    int EmulatorBitCount;
+    unsigned short EmulatorXs, EmulatorXe, EmulatorYs, EmulatorYe;
+    unsigned short EmulatorX, EmulatorY;
+    unsigned char EmulatorMadctl;
+    unsigned short EmulatorScrollTop, EmulatorScrollCount, EmulatorScrollStart;
+    unsigned int EmulatorClockHz;       // 0 makes transfers instant
+    struct timespec EmulatorWireFree;   // when the emulated bus finishes the data already sent
+    unsigned int EmulatorScanHz;        // how often the emulated panel scans its GRAM, and sends a TE pulse
+    long long EmulatorScanStart;        // when the first scan started
+    long long EmulatorScanPass;         // the scan the last row written was compared with, -1 for none
+    int EmulatorScanAhead;              // whether the scan line was below that row
+    int EmulatorLastRow;                // the row of the last pixel written
+    unsigned int EmulatorTears;
+};
+
+static inline long long NowNs(void)
+{
+struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000000LL + now.tv_nsec);
 }
 
+static void SleepUntilNs(long long when)
+{
+struct timespec until;
 
-// BCM hardware initialisation
-// for now this configures the SPI port and the relevant pins for the circular display
-// future updates will add more flexibility to this
-// note due to the low lever BCM driver, if the code is not called as root then the init and SPI begin will fail
-bool initBCMHardware(void)
+    until.tv_sec  = when / 1000000000LL;
+    until.tv_nsec = when % 1000000000LL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+
+// instrumentation
+// built in with -DC2PY_STATS, otherwise the macros are empty and it costs nothing at all. Each public drawing
+// function starts a scope for its kind of primitive (STAT_ in the header), which counts the call and its time when
+// the function returns however it returns. The pixels are counted where they are written, against whichever
+// primitive is running, and the sending counts the pixels, bytes and commands that go out on the bus
+#ifdef C2PY_STATS
+static void TraceAdd(DisplayContext * display, int kind, int thread, long long start, long long end)
 {
-    if (!bcm2835_init())
-    {
-      printf("bcm2835_init failed. Are you running as root??\n");
-      return (false);
-    }
+unsigned int slot;
+
+    if (display->Trace == NULL)
+        return;
+    slot = __atomic_fetch_add(&display->TraceCount, 1, __ATOMIC_RELAXED);
+    if (slot >= display->TraceSize)
+        return;                         // full, the count still shows how many were missed
+    display->Trace[slot].start = start;
+    display->Trace[slot].end = end;
+    display->Trace[slot].kind = kind;
+    display->Trace[slot].thread = thread;
+}
 
-    if (!bcm2835_spi_begin())
+static DisplayContext * StatBegin(DisplayContext * display, int kind)
+{
+long long now;
+int bucket;
+
+    if (display->StatDepth++ != 0)
+        return (display);
+    now = NowNs();
+    display->StatKind = kind;
+    display->StatStart = now;
+    if (kind == STAT_FLUSH)
     {
-      printf("bcm2835_spi_begin failed. Are you running as root??\n");
-      return (false);
+        // a frame is from the start of one screen update to the next
+        if (display->StatLastFrame != 0)
+        {
+            bucket = (int)((now - display->StatLastFrame) / 1000000);
+            display->StatHistogram[(bucket < STAT_HISTOGRAM) ? bucket : STAT_HISTOGRAM - 1]++;
+        }
+        display->StatLastFrame = now;
     }
+    return (display);
+}
 
-    bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);        // The default
-    bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);                     // The default
-    bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_4);       // about 32Mhz  Seems to work on PI3 and PI0 with no noticable issues
-                                                                    // if issues occur reduce this to DIVIDER_8 or even 16 
-    bcm2835_spi_chipSelect(BCM2835_SPI_CS0);                        // The default - possible to change, but not tested
-    bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);        // the default - active low chip select (this is most common)
+static void StatEnd(DisplayContext ** scope)
+{
+DisplayContext * display = *scope;
+long long now;
+
+    if (--display->StatDepth != 0)
+        return;
+    now = NowNs();
+    display->Stats[display->StatKind][STAT_CALLS]++;
+    display->Stats[display->StatKind][STAT_TIME] += now - display->StatStart;
+    TraceAdd(display, display->StatKind, 0, display->StatStart, now);
+}
 
+// the end of sending a set of areas, from the caller or the flush thread, which never send at the same time
+static void StatSend(DisplayContext * display, long long start)
+{
+long long now;
+int thread;
+
+    now = NowNs();
+    thread = (display->FlushThreadRunning && pthread_equal(pthread_self(), display->FlushThreadId)) ? 1 : 0;
+    display->Stats[STAT_SEND][STAT_CALLS]++;
+    display->Stats[STAT_SEND][STAT_TIME] += now - start;
+    TraceAdd(display, STAT_SEND, thread, start, now);
+}
 
-    // setup the DC and RES pins  
-    bcm2835_gpio_fsel(CIR_RES, BCM2835_GPIO_FSEL_OUTP);             // for the Ciruclar display a manual reset is needed
-    bcm2835_gpio_fsel(CIR_DC,  BCM2835_GPIO_FSEL_OUTP);             // and a separate pin for Command/Data selection
+#define STATS_SCOPE(display, kind)      DisplayContext * statscope __attribute__((cleanup(StatEnd))) = StatBegin(display, kind)
+#define COUNT_PIXELS(display, count)    (display->Stats[display->StatKind][STAT_PIXELS] += (count))
+#define COUNT_BLENDS(display, count)    (display->Stats[display->StatKind][STAT_PIXELS] += (count), \
+                                         display->Stats[display->StatKind][STAT_BLENDED] += (count))
+#define COUNT_SPI(display, bytes, commands) (display->Stats[STAT_SEND][STAT_BYTES] += (bytes), \
+                                         display->Stats[STAT_SEND][STAT_COMMANDS] += (commands))
+#define COUNT_SENT(display, count)      (display->Stats[STAT_SEND][STAT_PIXELS] += (count))
+#else
+#define STATS_SCOPE(display, kind)
+#define COUNT_PIXELS(display, count)
+#define COUNT_BLENDS(display, count)
+#define COUNT_SPI(display, bytes, commands)
+#define COUNT_SENT(display, count)
+#endif
+
+
+static inline unsigned short SwapBytes(unsigned short colour)
+{
+    return ((colour>>8) | (colour<<8));
+}
 
-    bcm2835_gpio_write(CIR_RES, LOW);                               //reset the chip
-    bcm2835_gpio_write(CIR_DC, HIGH); 
+// convert a colour to and from the way it is stored in the render space
+static inline unsigned short ToRender(DisplayContext * display, unsigned short colour)
+{
+    return (display->PanelByteOrder ? SwapBytes(colour) : colour);
+}
 
-    bcm2835_delay(20);
-    bcm2835_gpio_write(CIR_RES, HIGH);                              // release the reset to the chip
-    bcm2835_delay(20);
-    return (true);
+static inline unsigned short FromRender(DisplayContext * display, unsigned short stored)
+{
+    return (display->PanelByteOrder ? SwapBytes(stored) : stored);
 }
 
 
-// exitBCMHardware 
-// this releases any allocated memory and clearnly shuts down the SPI driver and low level BCM control
-void exitBCMHardware(void)
+// circular mask and clip rectangle, see the display context
+// the visible spans trimmed to the clip rectangle, rows outside it have nothing to draw on
+static void BuildDrawSpans(DisplayContext * display)
 {
-    //printf("Exiting hardware\n");
-    bcm2835_spi_end();
-    bcm2835_close();
+int y;
 
+    for (y = 0; y < 240; y++)
+    {
+        display->DrawLeft[y] = 240;
+        display->DrawRight[y] = -1;
+        if ((y >= display->ClipY0) && (y <= display->ClipY1))
+        {
+            display->DrawLeft[y] = (display->VisibleLeft[y] > display->ClipX0) ? display->VisibleLeft[y] : display->ClipX0;
+            display->DrawRight[y] = (display->VisibleRight[y] < display->ClipX1) ? display->VisibleRight[y] : display->ClipX1;
+        }
+    }
+}
 
-    //printf("RenderSpace about to be freed\n");
-    //printf("renderspace = %p\n",RenderSpace);
+static void BuildVisibleSpans(DisplayContext * display)
+{
+int x,y,dx,dy;
 
-    if (RenderSpace !=NULL)
+    for (y = 0; y < 240; y++)
     {
-        free(RenderSpace);
-        RenderSpace = NULL;
-        //printf("RenderSpace was freed\n");
+        // in half pixels, the distance from the centre to the nearest edge of the row and of each pixel
+        dy = (y < 120) ? (238 - 2*y) : (2*y - 240);
+        x = 0;
+        if (display->CircularMask)
+        {
+            for (x = 0; x < 120; x++)
+            {
+                dx = 238 - 2*x;
+                if ((dx*dx + dy*dy) < 240*240)
+                    break;
+            }
+        }
+        display->VisibleLeft[y] = x;
+        display->VisibleRight[y] = 239 - x;
     }
-    //else
-        //printf("RenderSpace was not created\n");
-
 
-    if (ReferenceSpace !=NULL)
+    // any row of a scrolling area can be shown anywhere in it, so they all get the widest span in the area
+    x = 240;
+    for (y = display->ScrollTop; y < display->ScrollTop + display->ScrollCount; y++)
+        if (display->VisibleLeft[y] < x)
+            x = display->VisibleLeft[y];
+    for (y = display->ScrollTop; y < display->ScrollTop + display->ScrollCount; y++)
     {
-        free(ReferenceSpace);
-        ReferenceSpace = NULL;
-        //printf("ReferenceSpace was freed\n");
+        display->VisibleLeft[y] = x;
+        display->VisibleRight[y] = 239 - x;
     }
+    BuildDrawSpans(display);
 }
 
-
-// initCircularDisp
-// this function configures the circular display itself.
-// the code is based on a sample found online which has a number of undocumented settings
-// where page numbers and details are given the information has been taken from the GalaxyCore GC9A01 Rev1.0 datasheet
-// see the Simpaul.com web page for download/link
-// note I have commented out as many of the undocumented commands as I can and most seem to ahve no effect on the output
-// however the 0x66 and 0x67 commands certainly do affect the output
-void initCircularDisp(void)
+// trims a range of columns on a row to the visible part, returning false if none of it can be seen
+static inline bool ClipToVisible(DisplayContext * display, int y, int * first, int * last)
 {
+    if (*first < display->VisibleLeft[y])
+        *first = display->VisibleLeft[y];
+    if (*last > display->VisibleRight[y])
+        *last = display->VisibleRight[y];
+    return (*first <= *last);
+}
 
-    // create some memory space for a render buffer
-    // this is used to allow multiple display changes to be done without having multiple screen updates
-    // this means the updated image can be created and then sent to the display in one update
-    // this gives a much smoother output without obvious on screen drawing. 
-    RenderSpace = (unsigned short *) malloc (240*240*2);
-    if (RenderSpace ==NULL)
-        printf("ERROR - RenderSpace was not created\n");
-
-    //sdoCmdU8(0xEB);    //*** not listed
-    //sdoDataU8(0x14);
-    
-    sdoCmdU8(0xFE);    //inter register enable 1 P172         
-    sdoCmdU8(0xEF);    //inter register enable 2 P173
-/*
-    sdoCmdU8(0xEB);    //*** not listed
-    sdoDataU8(0x14);
-
-    sdoCmdU8(0x84);    //*** not listed     
-    sdoDataU8(0x40);
-
-    sdoCmdU8(0x85);    //*** not listed       
-    sdoDataU8(0xFF);
-
-    sdoCmdU8(0x86);    //*** not listed   
-    sdoDataU8(0xFF);
-
-    sdoCmdU8(0x87);    //*** not listed             
-    sdoDataU8(0xFF);
-
-    sdoCmdU8(0x88);           
-    sdoDataU8(0x0A);
-
-    sdoCmdU8(0x89);           
-    sdoDataU8(0x21);
-
-    sdoCmdU8(0x8A);           
-    sdoDataU8(0x00);
-
-    sdoCmdU8(0x8B);           
-    sdoDataU8(0x80);
-
-    sdoCmdU8(0x8C);           
-    sdoDataU8(0x01);
-
-    sdoCmdU8(0x8D);           
-    sdoDataU8(0x01);
-
-    sdoCmdU8(0x8E);           
-    sdoDataU8(0xFF);
-
-    sdoCmdU8(0x8F);           
-    sdoDataU8(0xFF);
-*/
+// the same for drawing, which also keeps inside the clip rectangle
+static inline bool ClipToDrawable(DisplayContext * display, int y, int * first, int * last)
+{
+    if (*first < display->DrawLeft[y])
+        *first = display->DrawLeft[y];
+    if (*last > display->DrawRight[y])
+        *last = display->DrawRight[y];
+    return (*first <= *last);
+}
 
-    sdoCmdU8(0xB6);    //Display function control P158
-    sdoDataU8(0x00);   //Must be zero         
-    sdoDataU8(0x00);   //Defines shift register directions
 
-    sdoCmdU8(0x36);    // Memory access control datasheet P127 
-    if(USE_HORIZONTAL==0)
-      sdoDataU8(0xE8); // sample code showed this a 18 but that didn't work
-    if(USE_HORIZONTAL==1)
-      sdoDataU8(0x28);
-    if(USE_HORIZONTAL==2)
-      sdoDataU8(0x48);
-    if(USE_HORIZONTAL==3)
-      sdoDataU8(0x88);
+static void StopFlushThread(DisplayContext * display);
+static void StopBandThreads(DisplayContext * display);
 
-    sdoCmdU8(0x3A);    //COLMOD Pixel Fomrat Set  P135        
-    sdoDataU8(0x55);   //RGB Mode Ignored, MCU Mode set to 16 Bits per Pixel
-                            //colour is 5 Red, 6 Green, 5 Blue
 
-/*
-    sdoCmdU8(0x90);    //*** not listed            
-    sdoDataU8(0x08);
-    sdoDataU8(0x08);
-    sdoDataU8(0x08);
-    sdoDataU8(0x08);
-
-    sdoCmdU8(0xBD);    //*** not listed             
-    sdoDataU8(0x06);
-
-    sdoCmdU8(0xBC);    //*** not listed         
-    sdoDataU8(0x00);   
-
-    sdoCmdU8(0xFF);    //*** not listed           
-    sdoDataU8(0x60);
-    sdoDataU8(0x01);
-    sdoDataU8(0x04);
-*/
-    sdoCmdU8(0xC3);    //Power Control 2 P 168          
-    sdoDataU8(0x13);
-    sdoCmdU8(0xC4);    //Power Control 3 P 169        
-    sdoDataU8(0x13);
+#ifndef NO_BCM2835
+// bcm2835 backend
+// this is the original direct register access, it needs root but is the fastest on the Pi
+// there is only one SPI0, so displays on CE0 and CE1 share it. The library is opened by the first display and closed by
+// the last, and each transfer takes the lock and sets the chip select and clock for its display if another was using it
+static pthread_mutex_t Bcm2835Lock = PTHREAD_MUTEX_INITIALIZER;
+static int Bcm2835Users = 0;
+static DisplayContext * Bcm2835Selected = NULL;   // the display the SPI is set up for
 
-    sdoCmdU8(0xC9);    //Power Control 4 P 170        
-    sdoDataU8(0x22);
-/*
-    sdoCmdU8(0xBE);    //*** not listed           
-    sdoDataU8(0x11);
+static void Bcm2835Select(DisplayContext * display)
+{
+unsigned int divider;
 
-    sdoCmdU8(0xE1);    //*** not listed       
-    sdoDataU8(0x10);
-    sdoDataU8(0x0E);
+    if (display == Bcm2835Selected)
+        return;
 
-    sdoCmdU8(0xDF);    //*** not listed     
-    sdoDataU8(0x21);
-    sdoDataU8(0x0c);
-    sdoDataU8(0x02);
-*/
-    sdoCmdU8(0xF0);    //SET_GAMMA1  P 174
-    sdoDataU8(0x45);
-    sdoDataU8(0x09);
-    sdoDataU8(0x08);
-    sdoDataU8(0x08);
-    sdoDataU8(0x26);
-    sdoDataU8(0x2A);
-
-    sdoCmdU8(0xF1);    //SET_GAMMA2  P 176 
-    sdoDataU8(0x43);
-    sdoDataU8(0x70);
-    sdoDataU8(0x72);
-    sdoDataU8(0x36);
-    sdoDataU8(0x37); 
-    sdoDataU8(0x6F);
-
-
-    sdoCmdU8(0xF2);    //SET_GAMMA3  P 178 
-    sdoDataU8(0x45);
-    sdoDataU8(0x09);
-    sdoDataU8(0x08);
-    sdoDataU8(0x08);
-    sdoDataU8(0x26);
-    sdoDataU8(0x2A);
-
-    sdoCmdU8(0xF3);    //SET_GAMMA4  P 180
-    sdoDataU8(0x43);
-    sdoDataU8(0x70);
-    sdoDataU8(0x72);
-    sdoDataU8(0x36);
-    sdoDataU8(0x37);
-    sdoDataU8(0x6F);
-/*
-    sdoCmdU8(0xED);    //*** not listed      
-    sdoDataU8(0x1B);
-    sdoDataU8(0x0B);
-
-    sdoCmdU8(0xAE);    //*** not listed          
-    sdoDataU8(0x77);
-
-    sdoCmdU8(0xCD);    //*** not listed           
-    sdoDataU8(0x63);       
-
-
-    sdoCmdU8(0x70);    //*** not listed           
-    sdoDataU8(0x07);
-    sdoDataU8(0x07);
-    sdoDataU8(0x04);
-    sdoDataU8(0x0E);
-    sdoDataU8(0x0F);
-    sdoDataU8(0x09);
-    sdoDataU8(0x07);
-    sdoDataU8(0x08);
-    sdoDataU8(0x03);
-*/
-    sdoCmdU8(0xE8);    //Frame Rate P164           
-    sdoDataU8(0x34);   //4 dot inversion
-/*
-    sdoCmdU8(0x62);    //*** not listed          
-    sdoDataU8(0x18);
-    sdoDataU8(0x0D);
-    sdoDataU8(0x71);
-    sdoDataU8(0xED);
-    sdoDataU8(0x70);
-    sdoDataU8(0x70);
-    sdoDataU8(0x18);
-    sdoDataU8(0x0F);
-    sdoDataU8(0x71);
-    sdoDataU8(0xEF);
-    sdoDataU8(0x70);
-    sdoDataU8(0x70);
-
-    sdoCmdU8(0x63);    //*** not listed             
-    sdoDataU8(0x18);
-    sdoDataU8(0x11);
-    sdoDataU8(0x71);
-    sdoDataU8(0xF1);
-    sdoDataU8(0x70);
-    sdoDataU8(0x70);
-    sdoDataU8(0x18);
-    sdoDataU8(0x13);
-    sdoDataU8(0x71);
-    sdoDataU8(0xF3);
-    sdoDataU8(0x70);
-    sdoDataU8(0x70);
-
-    sdoCmdU8(0x64);    //*** not listed             
-    sdoDataU8(0x28);
-    sdoDataU8(0x29);
-    sdoDataU8(0xF1);
-    sdoDataU8(0x01);
-    sdoDataU8(0xF1);
-    sdoDataU8(0x00);
-    sdoDataU8(0x07);
+    divider = BCM2835_SPI_CLOCK_DIVIDER_4;                          // about 32Mhz  Seems to work on PI3 and PI0 with no noticable issues
+    if (display->SpiSpeed != 0)                                     // if issues occur reduce this to DIVIDER_8 or even 16
+    {
+        // from the 250MHz core clock, the divider has to be even
+        divider = (250000000 + display->SpiSpeed - 1) / display->SpiSpeed;
+        divider = (divider + 1) & ~1;
+        if (divider < 2)
+            divider = 2;
+        if (divider > 65534)
+            divider = 65534;
+    }
+    bcm2835_spi_setClockDivider(divider);
+    bcm2835_spi_chipSelect(display->ChipSelect ? BCM2835_SPI_CS1 : BCM2835_SPI_CS0);
+    display->Bcm2835DCLevel = -1;                                   // in case the D/C pin is shared with the other display
+    Bcm2835Selected = display;
+}
 
-*/
+static void Bcm2835SetDC(DisplayContext * display, int level)
+{
+    if (level != display->Bcm2835DCLevel)
+    {
+        bcm2835_gpio_write(display->DCPin, level);
+        display->Bcm2835DCLevel = level;
+    }
+}
 
-    sdoCmdU8(0x66);    //*** not listed            
-    sdoDataU8(0x3C);   // seem to affect how pixels are displayed
-    sdoDataU8(0x00);
-    sdoDataU8(0xCD);
-    sdoDataU8(0x67);
-    sdoDataU8(0x45);
-    sdoDataU8(0x45);
-    sdoDataU8(0x10);
-    sdoDataU8(0x00);
-    sdoDataU8(0x00);
-    sdoDataU8(0x00);
+// note due to the low lever BCM driver, if the code is not called as root then the init and SPI begin will fail
+static bool Bcm2835Init(DisplayContext * display)
+{
+    pthread_mutex_lock(&Bcm2835Lock);
+    if (Bcm2835Users == 0)
+    {
+        if (!bcm2835_init())
+        {
+          printf("bcm2835_init failed. Are you running as root??\n");
+          pthread_mutex_unlock(&Bcm2835Lock);
+          return (false);
+        }
 
-    
+        if (!bcm2835_spi_begin())
+        {
+          printf("bcm2835_spi_begin failed. Are you running as root??\n");
+          bcm2835_close();
+          pthread_mutex_unlock(&Bcm2835Lock);
+          return (false);
+        }
 
-    sdoCmdU8(0x67);    //*** not listed              
-    sdoDataU8(0x00);   // seem to affect how pixels are displayed 
-    sdoDataU8(0x3C);       
-    sdoDataU8(0x00);
-    sdoDataU8(0x00);
-    sdoDataU8(0x00);
-    sdoDataU8(0x01);
-    sdoDataU8(0x54);    
-    sdoDataU8(0x10);
-    sdoDataU8(0x32);    
-    sdoDataU8(0x98);
+        bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);    // The default
+        bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);                 // The default
+        bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);    // the default - active low chip select (this is most common)
+        bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS1, LOW);
+        Bcm2835Selected = NULL;
+    }
+    Bcm2835Users++;
+    Bcm2835Select(display);
 
-/*
 
-    sdoCmdU8(0x74);    //*** not listed            
-    sdoDataU8(0x10);   
-    sdoDataU8(0x85);   
-    sdoDataU8(0x80);
-    sdoDataU8(0x00);
-    sdoDataU8(0x00);
-    sdoDataU8(0x4E);
-    sdoDataU8(0x00);         
-
-    sdoCmdU8(0x98);    //*** not listed             
-    sdoDataU8(0x3e);
-    sdoDataU8(0x07);
-*/
-    sdoCmdU8(0x35);    //Tearing Effect Line ON P125
-    sdoDataU8(0x01);   //turned on.
+    // setup the DC and RES pins  
+    bcm2835_gpio_fsel(display->ResetPin, BCM2835_GPIO_FSEL_OUTP);   // for the Ciruclar display a manual reset is needed
+    bcm2835_gpio_fsel(display->DCPin,  BCM2835_GPIO_FSEL_OUTP);     // and a separate pin for Command/Data selection
 
-    sdoCmdU8(0x21);    //  Invert screen colours
+    bcm2835_gpio_write(display->ResetPin, LOW);                     //reset the chip
+    bcm2835_gpio_write(display->DCPin, HIGH); 
+    display->Bcm2835DCLevel = HIGH;
+    pthread_mutex_unlock(&Bcm2835Lock);
 
-    sdoCmdU8(0x11);    //Sleep Out Mode P103   - turns off sleep mode - i.e. turn on the screen
-    bcm2835_delay(120);
-    sdoCmdU8(0x29);    //Display On P 110
     bcm2835_delay(20);
-
-    //printf ("circular setup complete\n");
-
+    bcm2835_gpio_write(display->ResetPin, HIGH);                    // release the reset to the chip
+    bcm2835_delay(20);
+    return (true);
 }
 
-// low level driver using SPI direct to write 8 bit value out as a command
-// as it's a command, make sure to set the D/C pin low = Command
-void sdoCmdU8( unsigned char byteval)
+static void Bcm2835Exit(DisplayContext * display)
 {
-    bcm2835_gpio_write(CIR_DC, LOW);    
-    bcm2835_spi_transfer(byteval);
+    pthread_mutex_lock(&Bcm2835Lock);
+    if (display->TearingPin >= 0)
+        bcm2835_gpio_clr_ren(display->TearingPin);
+    if (Bcm2835Selected == display)
+        Bcm2835Selected = NULL;
+    if (--Bcm2835Users == 0)
+    {
+        bcm2835_spi_end();
+        bcm2835_close();
+    }
+    display->Bcm2835DCLevel = -1;
+    pthread_mutex_unlock(&Bcm2835Lock);
 }
 
-// low level driver using SPI direct to write 16 bit value out as Data
-// as it's a data, make sure to set the D/C pin high = data
-void sdoDataU16( unsigned short intval)
+static void Bcm2835Command(DisplayContext * display, unsigned char cmd)
 {
-    bcm2835_gpio_write(CIR_DC, HIGH);    
-    bcm2835_spi_transfer(intval>>8);
-    bcm2835_spi_transfer(intval&0xff);
+    pthread_mutex_lock(&Bcm2835Lock);
+    Bcm2835Select(display);
+    Bcm2835SetDC(display, LOW);
+    bcm2835_spi_transfer(cmd);
+    pthread_mutex_unlock(&Bcm2835Lock);
 }
-// low level driver using SPI direct to write 8 bit value out as Data
-// as it's a data, make sure to set the D/C pin high = data
-void sdoDataU8( unsigned char byteval)
+
+static void Bcm2835Data(DisplayContext * display, const unsigned char * data, unsigned int length)
 {
-    bcm2835_gpio_write(CIR_DC, HIGH);    
-    bcm2835_spi_transfer(byteval);
+    pthread_mutex_lock(&Bcm2835Lock);
+    Bcm2835Select(display);
+    Bcm2835SetDC(display, HIGH);
+    if (length == 1)
+        bcm2835_spi_transfer(*data);
+    else
+        bcm2835_spi_writenb((char *)data, length);
+    pthread_mutex_unlock(&Bcm2835Lock);
 }
 
-
-
-// low level ClearScreen
-// 
-// this optimised version can do over 600 full screen updated per minute when using the 
-// BCM2835_SPI_CLOCK_DIVIDER_4     = 4,       /*!< 4 = 62.5MHz on Rpi2, 100MHz on RPI3. Dont expect this speed to work reliably. */
-// on RPI3 this seems totally stable
-//
-//
-// This now supports the render space to allow background updates to occur prior to screen updates
-//
-void clearScreenDirect(unsigned short bcolour)
+static void Bcm2835Delay(unsigned int millis)
 {
-    int i;
-    unsigned short * sourcePtr;
-
-    if (RenderSpace !=NULL)
-    {
-        sourcePtr = RenderSpace;
-        for (i=0;i<(240*240);i++)
-        {
-            *(sourcePtr++) = bcolour;
-        }
-    }
-    ScreenUpdate();
+    bcm2835_delay(millis);
 }
 
-
-// writing a BMP 24bit 240x240 image from the raw data
-// outputs covnert each 24 bit value to 16 bit combined and then updates the render space
-// when done, full screen update is performed
-void RGB240x240Direct(unsigned char * rawdata,bool update  )
-{
-  unsigned char * counter;
-  unsigned short colour;
-  unsigned int offset;
-  if (      (rawdata[10]!=54)                       // data in the right place
-         || (rawdata[14]!=40)                       // right type of header
-         || (rawdata[18]!=240) || (rawdata[19]!=0)  // right x size
-         || (rawdata[22]!=240) || (rawdata[23]!=0)  // right y size
-         || (rawdata[28]!=24))                      // right bits per pixel                 
-    printf("not a valid 240x240 image\n");
-  else
-  {
-    //printf("valid file format\n");
-    
-    counter = rawdata + 54; //  skip past the headers
-    //note BMP has 1st pixel as lower left which is the line 239 on the display
-    for (short y=240;y>0;y--)
+// the TE pin uses the rising edge detect, which latches the edge until it is cleared
+static bool Bcm2835TearSetup(DisplayContext * display, int pin)
+{
+    pthread_mutex_lock(&Bcm2835Lock);
+    if (display->TearingPin >= 0)
+        bcm2835_gpio_clr_ren(display->TearingPin);
+    if (pin >= 0)
     {
-      offset = (y-1)*240;
-      for (short x=0; x<240;x++)
-      {
-        colour  = RGBto16bit(*(counter+2), *(counter+1), *(counter));
-        // BMP has colour with Green first, then Blue then Red
-        RenderSpace[x+offset]=colour;
-       
-        counter=counter+3;
-      }
+        bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
+        bcm2835_gpio_set_pud(pin, BCM2835_GPIO_PUD_DOWN);
+        bcm2835_gpio_ren(pin);
     }
-    if(update)
-        ScreenUpdate();
-  }
+    pthread_mutex_unlock(&Bcm2835Lock);
+    return (true);
 }
 
-// makes a copy of the render space to a buffer
-// only created the reference image space if this is used 
-// as most time the python code would not need it
-void SetRefernceImage(void)
+// polled, as the bcm2835 library has no interrupts, sleeping a little between each look
+static bool Bcm2835TearWait(DisplayContext * display, unsigned int timeoutus, long long * edge)
 {
-    if(ReferenceSpace ==NULL)
+long long start,now;
+
+    bcm2835_gpio_set_eds(display->TearingPin);       // forget any edge from before now
+    start = NowNs();
+    do
     {
-        ReferenceSpace = (unsigned short *)malloc(240*240*2);
-        if(ReferenceSpace ==NULL)
+        SleepUntilNs(NowNs() + 20000);
+        now = NowNs();
+        if (bcm2835_gpio_eds(display->TearingPin))
         {
-            printf("Error unable to create reference space\n");
+            bcm2835_gpio_set_eds(display->TearingPin);
+            *edge = now;
+            return (true);
         }
-    }
-         
-    if ((RenderSpace !=NULL) && (ReferenceSpace !=NULL))
-    {
-        memcpy(ReferenceSpace,RenderSpace,240*240*2);
-    }
+    } while ((now - start) < timeoutus*1000LL);
+    return (false);
 }
 
+static const DisplayBackend Bcm2835Backend = { "bcm2835", Bcm2835Init, Bcm2835Exit, Bcm2835Command, Bcm2835Data, Bcm2835Delay,
+                                        Bcm2835TearSetup, Bcm2835TearWait };
+#endif
 
-//restore the reference to the render space
-void RestoreReferenceImage(void)
-{
-    if ((RenderSpace !=NULL) && (ReferenceSpace !=NULL))
-    {
-        memcpy(RenderSpace,ReferenceSpace,240*240*2);
-    }
-}
 
+#ifdef __linux__
+// spidev backend
+// uses the kernel SPI driver (dtparam=spi=on) and the GPIO character device for the D/C and reset pins
+// so it does not need root, only membership of the spi and gpio groups
+#define SPIDEV_SPEED_HZ     32000000        // the same as the bcm2835 DIVIDER_4 setting
+#define SPIDEV_MAX_TRANSFER 4096            // the default spidev bufsiz, larger blocks are split
 
+static void SpidevSetPins(DisplayContext * display, int dc, int reset)
+{
+struct gpiohandle_data values;
 
+    memset(&values, 0, sizeof(values));
+    values.values[0] = dc;
+    values.values[1] = reset;
+    ioctl(display->SpidevGpioFd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &values);
+    display->SpidevDCLevel = dc;
+}
 
-// SetScreenWriteArea
-// define the start and end pixels to be updated
-// note these are inclusive values
-// i.e. writing will be from Xstart up to and including Xend and same for the Y axis
-// hence full screen is 0,0 to 239,239
-void SetScreenWriteArea(unsigned char Xstart,unsigned char Ystart,unsigned char Xend,unsigned char Yend)
+static void SpidevDelay(unsigned int millis)
 {
-    if((Xend<240) && (Yend<240) &&(Xstart<=Xend)&& (Ystart<=Yend))
-    {
-        sdoCmdU8(0x2a);             // select Column address P111
-        sdoDataU16(Xstart);
-        sdoDataU16(Xend);
-
-        sdoCmdU8(0x2b);             // select Row Address Set P113
-        sdoDataU16(Ystart);
-        sdoDataU16(Yend);
+    usleep(millis * 1000);
+}
 
-        sdoCmdU8(0x2c);            // Memory Write P 115
-                                   // sets the display to receive data
+static bool SpidevInit(DisplayContext * display)
+{
+unsigned char mode = SPI_MODE_0;
+unsigned char bits = 8;
+unsigned int speed;
+struct gpiohandle_request request;
+int chip;
+
+    display->SpidevFd = open(display->SpidevPath, O_RDWR);
+    if (display->SpidevFd < 0)
+    {
+        printf("unable to open %s, is SPI enabled and are you in the spi group??\n", display->SpidevPath);
+        return (false);
     }
-    else
+    speed = (display->SpiSpeed != 0) ? display->SpiSpeed : SPIDEV_SPEED_HZ;
+    if ((ioctl(display->SpidevFd, SPI_IOC_WR_MODE, &mode) < 0) ||
+        (ioctl(display->SpidevFd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+        (ioctl(display->SpidevFd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0))
     {
-        // invalid co-ordinates
-        printf("SetScreenWriteArea Invalid Co-ordinates\n");
+        printf("unable to set mode 0, 8 bits and %u Hz on %s\n", speed, display->SpidevPath);
+        close(display->SpidevFd);
+        display->SpidevFd = -1;
+        return (false);
     }
-}
 
+    chip = open("/dev/gpiochip0", O_RDONLY);
+    if (chip < 0)
+    {
+        printf("unable to open /dev/gpiochip0\n");
+        close(display->SpidevFd);
+        display->SpidevFd = -1;
+        return (false);
+    }
 
-// SetPixelDirect
-// individual pixel setting, this is direct and updates the screen immediatle
-// use this for updating direct to the screen (use for small changes)
-// work on the Render space and do screen update for large changes
-void  SetPixelDirect(unsigned short xpos, unsigned short ypos, unsigned short colour)
-{
-    if((xpos>239) || (ypos>239))
-        printf("SetPixel writing to invalid\n");
-    else
+    memset(&request, 0, sizeof(request));
+    request.lineoffsets[0] = display->DCPin;
+    request.lineoffsets[1] = display->ResetPin;
+    request.lines = 2;
+    request.flags = GPIOHANDLE_REQUEST_OUTPUT;
+    request.default_values[0] = 1;          // data
+    request.default_values[1] = 0;          // reset the chip
+    strcpy(request.consumer_label, "bcm_direct_c2py");
+    if (ioctl(chip, GPIO_GET_LINEHANDLE_IOCTL, &request) < 0)
     {
-        sdoCmdU8(0x2a);             // select Column address P111
-        sdoDataU16(xpos);
-        sdoDataU16(xpos);
+        printf("unable to claim the D/C and reset pins\n");
+        close(chip);
+        close(display->SpidevFd);
+        display->SpidevFd = -1;
+        return (false);
+    }
+    close(chip);
+    display->SpidevGpioFd = request.fd;
+    display->SpidevDCLevel = 1;
 
-        sdoCmdU8(0x2b);             // select Row Address Set P113
-        sdoDataU16(ypos);
-        sdoDataU16(ypos);
+    SpidevDelay(20);
+    SpidevSetPins(display, 1, 1);                    // release the reset to the chip
+    SpidevDelay(20);
+    return (true);
+}
+
+static void SpidevExit(DisplayContext * display)
+{
+    if (display->SpidevTearFd >= 0)
+        close(display->SpidevTearFd);
+    display->SpidevTearFd = -1;
+    if (display->SpidevGpioFd >= 0)
+        close(display->SpidevGpioFd);
+    if (display->SpidevFd >= 0)
+        close(display->SpidevFd);
+    display->SpidevGpioFd = -1;
+    display->SpidevFd = -1;
+}
 
-        sdoCmdU8(0x2c);             // write the data value
-        sdoDataU16(colour);
+static void SpidevWrite(DisplayContext * display, const unsigned char * data, unsigned int length)
+{
+struct spi_ioc_transfer transfer;
+unsigned int block;
 
-        // this makes sure the render image is kept in sync with the direct updates
-        RenderSpace[(xpos)+(ypos)*240]=colour;
+    while (length > 0)
+    {
+        block = (length > SPIDEV_MAX_TRANSFER) ? SPIDEV_MAX_TRANSFER : length;
+        memset(&transfer, 0, sizeof(transfer));
+        transfer.tx_buf = (unsigned long)data;
+        transfer.len = block;
+        transfer.speed_hz = (display->SpiSpeed != 0) ? display->SpiSpeed : SPIDEV_SPEED_HZ;
+        transfer.bits_per_word = 8;
+        ioctl(display->SpidevFd, SPI_IOC_MESSAGE(1), &transfer);
+        data += block;
+        length -= block;
     }
 }
 
-
-// SetPixel
-// updates a pixel in the renderspace with checking to make sure the co-ordinates are valid
-// this prevents screen wrap round or invalid memory access
-void SetPixel(short xpos, short ypos, unsigned short colour)
+static void SpidevCommand(DisplayContext * display, unsigned char cmd)
 {
-    if((xpos>=0)&&(xpos<240)&&(ypos>=0)&&(ypos<240))
-        RenderSpace[xpos+ypos*240]=colour;
-   // else
-   //     printf("trying to write outside screen\n");
+    if (display->SpidevDCLevel != 0)
+        SpidevSetPins(display, 0, 1);
+    SpidevWrite(display, &cmd, 1);
 }
 
+static void SpidevData(DisplayContext * display, const unsigned char * data, unsigned int length)
+{
+    if (display->SpidevDCLevel != 1)
+        SpidevSetPins(display, 1, 1);
+    SpidevWrite(display, data, length);
+}
 
-// DrawCircle
-//
-// indirect circle writing
-// this stores the data in the Render space only
-// use the ScreenUpdate to output this and any other updates
-// note use of shorts for x,y to allow for circle origins outside of the screen 
-void DrawCircle (short x0, short y0, short r, unsigned short colour)
+// the TE pin is claimed as a line event, so the kernel catches the edge and the wait can sleep in poll
+static bool SpidevTearSetup(DisplayContext * display, int pin)
 {
-int a=0;
-int b=r;     
-    while(a<=b)
+struct gpioevent_request request;
+int chip;
+
+    if (display->SpidevTearFd >= 0)
+        close(display->SpidevTearFd);
+    display->SpidevTearFd = -1;
+    if (pin < 0)
+        return (true);
+
+    chip = open("/dev/gpiochip0", O_RDONLY);
+    if (chip < 0)
     {
-        SetPixel((x0-b),(y0-a),colour);
-        SetPixel((x0+b),(y0-a),colour);                   
-        SetPixel((x0-a),(y0+b),colour);                         
-        SetPixel((x0-a),(y0-b),colour);           
-        SetPixel((x0+b),(y0+a),colour);                        
-        SetPixel((x0+a),(y0-b),colour);      
-        SetPixel((x0+a),(y0+b),colour);         
-        SetPixel((x0-b),(y0+a),colour);
-        a+=1;
-        if((a*a+b*b)>(r*r))
-            b-=1;
+        printf("unable to open /dev/gpiochip0\n");
+        return (false);
+    }
+    memset(&request, 0, sizeof(request));
+    request.lineoffset = pin;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+    strcpy(request.consumer_label, "bcm_direct_c2py TE");
+    if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &request) < 0)
+    {
+        printf("unable to claim the TE pin %d\n", pin);
+        close(chip);
+        return (false);
     }
+    close(chip);
+    display->SpidevTearFd = request.fd;
+    return (true);
 }
 
-
-// DrawRectangle
-// draw a box in the render space
-void DrawRectangle(short Xstart,short Ystart, short Xend, short Yend, unsigned short colour)
+static bool SpidevTearWait(DisplayContext * display, unsigned int timeoutus, long long * edge)
 {
+struct pollfd wait;
+struct gpioevent_data event;
 
-    // note we can use integer maths routines here as the lines are by defintion horizontal or vertical.
+    wait.fd = display->SpidevTearFd;
+    wait.events = POLLIN;
 
-    // first the two horrizonal lines
-    DrawLineIntMaths(Xstart,Ystart,Xend,Ystart,colour);
-    DrawLineIntMaths(Xstart,Yend,Xend,Yend,colour);
-    // then the two vertical ones
-    DrawLineIntMaths(Xstart,Ystart,Xstart,Yend,colour);
-    DrawLineIntMaths(Xend,Ystart,Xend,Yend,colour);
+    // forget any edge from before now
+    while ((poll(&wait, 1, 0) > 0) && (read(display->SpidevTearFd, &event, sizeof(event)) == sizeof(event)))
+        ;
 
+    if ((poll(&wait, 1, (timeoutus + 999) / 1000) <= 0) || (read(display->SpidevTearFd, &event, sizeof(event)) != sizeof(event)))
+        return (false);
+    *edge = NowNs();
+    return (true);
 }
 
+static const DisplayBackend SpidevBackend = { "spidev", SpidevInit, SpidevExit, SpidevCommand, SpidevData, SpidevDelay,
+                                       SpidevTearSetup, SpidevTearWait };
+#endif
 
-// pixel mixing, used to do the anti-alising on the lines.
-// note the intensity is a short with 256 being eqivalent to 100% intensity
-void updatePixel(short x, short y, unsigned short colour, unsigned short intensity)
-{
-short current;
-short red0,green0,blue0;
-short red1,green1,blue1;
-unsigned short oldintensity;
-    // check it's valid space
-    if( (x>=0)&&(x<240)&&(y>=0)&&(y<240))     
-    {
-        if (intensity>245)  // if more than 95% just assume 100%
-        {
-            RenderSpace[x+y*240]=colour;
-        }
-        else
-        {
-            // work out the reletive intesities of red green and blue from the old and new pixels.
-            oldintensity = 256 - intensity;
 
-            //printf("new,old  intensity is %d     %d\n",newintensity,oldintensity);
+// emulator backend
+// an in-memory GC9A01 that decodes the column/row address and memory write commands into its own GRAM
+// nothing leaves the process, so the library can be tested off the Pi, and frames can be saved as PPM or PNG
+// the transfers can also be made to take as long as they would on the wire, to time things realistically
+
+// the wire time is added up and only slept for once it is worth it, so single byte transfers stay cheap
+static void EmulatorWireTime(DisplayContext * display, unsigned int bytes)
+{
+struct timespec now;
+long long nsec;
 
-            current = RenderSpace[x+y*240];
+    if (display->EmulatorClockHz == 0)
+        return;
 
-            red0 =   (current&0xf800)>>11;
-            green0 = (current&0x07E0)>>5;
-            blue0 =  (current&0x001F);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((display->EmulatorWireFree.tv_sec < now.tv_sec) ||
+        ((display->EmulatorWireFree.tv_sec == now.tv_sec) && (display->EmulatorWireFree.tv_nsec < now.tv_nsec)))
+        display->EmulatorWireFree = now;
 
-            // update the colour but only if different
-            red1 = (colour&0xf800)>>11;
-            green1 = (colour&0x07E0)>>5;
-            blue1 = (colour&0x001F);
+    nsec = display->EmulatorWireFree.tv_nsec + (bytes * 8000000000LL) / display->EmulatorClockHz;
+    display->EmulatorWireFree.tv_sec  += nsec / 1000000000;
+    display->EmulatorWireFree.tv_nsec  = nsec % 1000000000;
 
-            //mix them
-            red0 =   ((red1   * intensity) + (red0   * oldintensity) +128)>>8;
-            if (red0>0x1F)
-                red0 = 0x1F;
-            green0 = ((green1 * intensity) + (green0 * oldintensity) +128)>>8;
-            if (green0>0x3F)
-                green0 = 0x3F;
-            blue0 =  ((blue1  * intensity) + (blue0  * oldintensity) +128)>>8;
-            if (blue0>0x1F)
-                blue0 = 0x1F;
-            //write it back
+    nsec = (display->EmulatorWireFree.tv_sec - now.tv_sec) * 1000000000LL + (display->EmulatorWireFree.tv_nsec - now.tv_nsec);
+    if (nsec > 100000)
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &display->EmulatorWireFree, NULL);
+}
 
-            RenderSpace[x+y*240]=(red0<<11)+(green0<<5)+(blue0);
-        }
+// tearing check
+// the emulated panel scans its GRAM from the top down once every 1/EmulatorScanHz. If the scan line and the row
+// being written pass each other during one scan then that scan showed part of the old picture and part of the new,
+// which is a tear. This is checked each time a block of pixels finishes on the emulated wire
+static void EmulatorScanCheck(DisplayContext * display)
+{
+long long now,period,pass;
+int scanrow,ahead;
+
+    if ((display->EmulatorScanHz == 0) || (display->EmulatorLastRow < 0))
+        return;
+
+    now = NowNs();
+    if (display->EmulatorClockHz != 0)
+        now = display->EmulatorWireFree.tv_sec * 1000000000LL + display->EmulatorWireFree.tv_nsec;
+    period = 1000000000LL / display->EmulatorScanHz;
+    pass = (now - display->EmulatorScanStart) / period;
+    scanrow = (int)(((now - display->EmulatorScanStart) % period) * 240 / period);
+    if ((scanrow - display->EmulatorLastRow < 2) && (display->EmulatorLastRow - scanrow < 2))
+        return;                             // too close to tell which side it is
+
+    ahead = (scanrow > display->EmulatorLastRow);
+    if ((pass == display->EmulatorScanPass) && (ahead != display->EmulatorScanAhead))
+    {
+        display->EmulatorTears++;
+        pass = -1;                          // only once for each scan
     }
+    display->EmulatorScanPass = pass;
+    display->EmulatorScanAhead = ahead;
 }
 
-
-
-// support functions for the floating point Drawline algorythm
-// fractional part of x
-float fpart(float x)
+static bool EmulatorInit(DisplayContext * display)
 {
-    return (x - floor(x));
+    memset(display->EmulatorGRAM, 0, sizeof(display->EmulatorGRAM));
+    display->EmulatorScanStart = NowNs();
+    display->EmulatorScanPass = -1;
+    display->EmulatorLastRow = -1;
+    display->EmulatorCmd = 0;
+    display->EmulatorArgCount = 0;
+    display->EmulatorHighByte = -1;
+    display->EmulatorBitCount = 0;
+    display->EmulatorScrollTop = 0;
+    display->EmulatorScrollCount = 240;
+    display->EmulatorScrollStart = 0;
+    return (true);
 }
 
-float rfpart(float x)
+static void EmulatorExit(DisplayContext * display)
 {
-    return (1 - fpart(x));
 }
 
+static void EmulatorCommand(DisplayContext * display, unsigned char cmd)
+{
+    EmulatorWireTime(display, 1);
+    display->EmulatorCmd = cmd;
+    display->EmulatorArgCount = 0;
+    display->EmulatorHighByte = -1;
+    display->EmulatorBitCount = 0;          // and any half pixel is dropped
+    if (cmd == 0x2c)                        // Memory Write starts again at the top left of the window
+    {
+        display->EmulatorX = display->EmulatorXs;
+        display->EmulatorY = display->EmulatorYs;
+        // a window above the last one is taken as the start of the next frame, which has not torn yet
+        if (display->EmulatorYs < display->EmulatorLastRow)
+            display->EmulatorScanPass = -1;
+        display->EmulatorLastRow = display->EmulatorYs;
+        EmulatorScanCheck(display);
+    }
+}
+
+// writes one pixel to the emulated GRAM and moves on through the window, wrapping back to the start at the end
+// as the GC9A01 does
+static void EmulatorPutPixel(DisplayContext * display, unsigned short pixel)
+{
+    if ((display->EmulatorX < 240) && (display->EmulatorY < 240))
+        display->EmulatorGRAM[display->EmulatorX + display->EmulatorY*240] = pixel;
+    display->EmulatorLastRow = display->EmulatorY;
+
+    if (display->EmulatorX++ >= display->EmulatorXe)
+    {
+        display->EmulatorX = display->EmulatorXs;
+        if (display->EmulatorY++ >= display->EmulatorYe)
+            display->EmulatorY = display->EmulatorYs;
+    }
+}
+
+static void EmulatorData(DisplayContext * display, const unsigned char * data, unsigned int length)
+{
+unsigned int i,pixel,red,green,blue;
+
+    EmulatorWireTime(display, length);
+    for (i = 0; i < length; i++)
+    {
+        switch (display->EmulatorCmd)
+        {
+            case 0x2a:                      // Column Address Set, start and end as 16 bit values
+            case 0x2b:                      // Row Address Set
+                if (display->EmulatorArgCount < 4)
+                    display->EmulatorArgs[display->EmulatorArgCount++] = data[i];
+                if (display->EmulatorArgCount == 4)
+                {
+                    if (display->EmulatorCmd == 0x2a)
+                    {
+                        display->EmulatorXs = (display->EmulatorArgs[0]<<8) | display->EmulatorArgs[1];
+                        display->EmulatorXe = (display->EmulatorArgs[2]<<8) | display->EmulatorArgs[3];
+                    }
+                    else
+                    {
+                        display->EmulatorYs = (display->EmulatorArgs[0]<<8) | display->EmulatorArgs[1];
+                        display->EmulatorYe = (display->EmulatorArgs[2]<<8) | display->EmulatorArgs[3];
+                    }
+                    display->EmulatorArgCount++;     // ignore anything more
+                }
+                break;
+
+            case 0x3a:                      // COLMOD
+                display->EmulatorColmod = data[i];
+                break;
+
+            case 0x36:                      // Memory Access Control, only MY matters here, for the scrolling
+                display->EmulatorMadctl = data[i];
+                break;
+
+            case 0x33:                      // Vertical Scrolling Definition, top, scrolling and bottom lines
+            case 0x37:                      // Vertical Scrolling Start Address
+                if (display->EmulatorArgCount < 6)
+                    display->EmulatorArgs[display->EmulatorArgCount++] = data[i];
+                if ((display->EmulatorCmd == 0x33) && (display->EmulatorArgCount == 6))
+                {
+                    display->EmulatorScrollTop = (display->EmulatorArgs[0]<<8) | display->EmulatorArgs[1];
+                    display->EmulatorScrollCount = (display->EmulatorArgs[2]<<8) | display->EmulatorArgs[3];
+                }
+                if ((display->EmulatorCmd == 0x37) && (display->EmulatorArgCount == 2))
+                    display->EmulatorScrollStart = (display->EmulatorArgs[0]<<8) | display->EmulatorArgs[1];
+                break;
+
+            case 0x2c:                      // Memory Write, 16 bit pixels high byte first
+            case 0x3c:                      // Write Memory Continue
+                if ((display->EmulatorColmod & 7) == 3)
+                {
+                    // 12 bits, kept as RGB565 by repeating the top bits of each colour into the bottom
+                    display->EmulatorBits = (display->EmulatorBits<<8) | data[i];
+                    display->EmulatorBitCount += 8;
+                    if (display->EmulatorBitCount < 12)
+                        break;
+                    display->EmulatorBitCount -= 12;
+                    pixel = (display->EmulatorBits >> display->EmulatorBitCount) & 0xfff;
+                    red = pixel>>8;
+                    green = (pixel>>4) & 0xf;
+                    blue = pixel & 0xf;
+                    EmulatorPutPixel(display, (((red<<1) | (red>>3))<<11) | (((green<<2) | (green>>2))<<5) | ((blue<<1) | (blue>>3)));
+                    break;
+                }
+                if (display->EmulatorHighByte < 0)
+                {
+                    display->EmulatorHighByte = data[i];
+                    break;
+                }
+                EmulatorPutPixel(display, (display->EmulatorHighByte<<8) | data[i]);
+                display->EmulatorHighByte = -1;
+                break;
+
+            default:                        // the set up commands have no effect on the emulated picture
+                break;
+        }
+    }
+    if ((display->EmulatorCmd == 0x2c) || (display->EmulatorCmd == 0x3c))
+        EmulatorScanCheck(display);
+}
+
+static void EmulatorDelay(unsigned int millis)
+{
+}
+
+// the software TE pulse, at the start of each emulated scan. Any pin number turns it on
+static bool EmulatorTearSetup(DisplayContext * display, int pin)
+{
+    return (true);
+}
+
+static bool EmulatorTearWait(DisplayContext * display, unsigned int timeoutus, long long * edge)
+{
+long long now,period,next;
+
+    if (display->EmulatorScanHz == 0)
+        return (false);
+    period = 1000000000LL / display->EmulatorScanHz;
+    now = NowNs();
+    next = display->EmulatorScanStart + ((now - display->EmulatorScanStart) / period + 1) * period;
+    if ((next - now) > timeoutus*1000LL)
+        return (false);
+    SleepUntilNs(next);
+    *edge = next;
+    return (true);
+}
+
+static const DisplayBackend EmulatorBackend = { "emulator", EmulatorInit, EmulatorExit, EmulatorCommand, EmulatorData, EmulatorDelay,
+                                         EmulatorTearSetup, EmulatorTearWait };
+
+
+// the backend a new display uses, the bcm2835 one by default if it has been built in
+#ifndef NO_BCM2835
+static const DisplayBackend * DefaultBackend = &Bcm2835Backend;
+#else
+static const DisplayBackend * DefaultBackend = &EmulatorBackend;
+#endif
+
+
+// CreateDisplay
+// makes a new display context with the settings the library has always used, CE0 with D/C on 24 and reset on 25,
+// then change any of these before initBCMHardware. Returns NULL if there is not the memory for it
+DisplayContext * CreateDisplay(void)
+{
+DisplayContext * display;
+
+    display = (DisplayContext *) calloc(1, sizeof(DisplayContext));
+    if (display == NULL)
+    {
+        printf("Error unable to create a display\n");
+        return (NULL);
+    }
+
+    display->Backend = DefaultBackend;
+    display->DCPin = CIR_DC;
+    display->ResetPin = CIR_RES;
+    display->Orientation = USE_HORIZONTAL;
+    display->TransferChunkSize = DEFAULT_TRANSFER_CHUNK;
+    display->TransferBits = 16;
+    pthread_mutex_init(&display->FlushLock, NULL);
+    pthread_cond_init(&display->FlushWake, NULL);
+    pthread_cond_init(&display->FlushDone, NULL);
+    pthread_mutex_init(&display->BandLock, NULL);
+    pthread_cond_init(&display->BandWake, NULL);
+    pthread_cond_init(&display->BandDone, NULL);
+    display->DrawThreads = 1;
+    display->TearingPin = -1;
+    display->TearingPeriod = 16666667;
+    display->TearingNsPerByte = 250;
+    display->CircularMask = true;
+    display->ClipX1 = 239;
+    display->ClipY1 = 239;
+    display->Bcm2835DCLevel = -1;
+    strcpy(display->SpidevPath, "/dev/spidev0.0");
+    display->SpidevFd = -1;
+    display->SpidevGpioFd = -1;
+    display->SpidevDCLevel = -1;
+    display->SpidevTearFd = -1;
+    display->EmulatorHighByte = -1;
+    display->EmulatorColmod = 0x55;
+    display->EmulatorXe = 239;
+    display->EmulatorYe = 239;
+    display->EmulatorClockHz = 32000000;
+    display->EmulatorScanHz = 60;
+    display->EmulatorScanPass = -1;
+    display->EmulatorLastRow = -1;
+    return (display);
+}
+
+// DestroyDisplay
+// shuts the display down if it is still running and frees the context
+void DestroyDisplay(DisplayContext * display)
+{
+    if (display == NULL)
+        return;
+
+    exitBCMHardware(display);
+    pthread_mutex_destroy(&display->FlushLock);
+    pthread_cond_destroy(&display->FlushWake);
+    pthread_cond_destroy(&display->FlushDone);
+    pthread_mutex_destroy(&display->BandLock);
+    pthread_cond_destroy(&display->BandWake);
+    pthread_cond_destroy(&display->BandDone);
+#ifdef C2PY_STATS
+    free(display->Trace);
+#endif
+    free(display);
+}
+
+// GetBuildInfo
+// how this copy of the library was built, so a .so lying around can be told apart from another
+const char * GetBuildInfo(void)
+{
+    return (C2PY_BUILD
+#ifdef NO_BCM2835
+            ", no bcm2835"
+#endif
+#ifdef C2PY_STATS
+            ", stats"
+#endif
+#if defined(__ARM_NEON)
+            ", neon"
+#elif defined(__AVX2__)
+            ", avx2"
+#elif defined(__SSE2__)
+            ", sse2"
+#endif
+            );
+}
+
+
+// SelectBackend
+// chooses how the display is driven, call this before initBCMHardware
+//   "bcm2835"                  the bcm2835 library (the default when it is built in)
+//   "spidev" or "spidev:/dev/spidev0.1"    the kernel SPI driver, optionally naming the device
+//   "emulator"                 the in-memory GC9A01 emulator
+// returns false if the name is not known or that backend was not built in
+bool SelectBackend(DisplayContext * display, const char * name)
+{
+#ifndef NO_BCM2835
+    if (strcmp(name, "bcm2835") == 0)
+    {
+        display->Backend = &Bcm2835Backend;
+        return (true);
+    }
+#endif
+#ifdef __linux__
+    if (strncmp(name, "spidev", 6) == 0)
+    {
+        if (name[6] == ':')
+        {
+            strncpy(display->SpidevPath, name + 7, sizeof(display->SpidevPath) - 1);
+            display->SpidevPath[sizeof(display->SpidevPath) - 1] = 0;
+        }
+        else if (name[6] != 0)
+            return (false);
+        display->Backend = &SpidevBackend;
+        return (true);
+    }
+#endif
+    if (strcmp(name, "emulator") == 0)
+    {
+        display->Backend = &EmulatorBackend;
+        return (true);
+    }
+
+    printf("SelectBackend unknown or unavailable backend %s\n", name);
+    return (false);
+}
+
+// SetDisplayPins
+// the BCM numbers of the D/C and reset pins, and the chip select (0 or 1) used by the bcm2835 backend
+// with spidev the chip select is part of the device name instead. Call this before initBCMHardware
+void SetDisplayPins(DisplayContext * display, int dc, int reset, int chipselect)
+{
+    display->DCPin = dc;
+    display->ResetPin = reset;
+    display->ChipSelect = chipselect;
+}
+
+// SetSpiSpeed
+// the SPI clock in Hz, or 0 for the usual 32MHz. Call this before initBCMHardware
+void SetSpiSpeed(DisplayContext * display, unsigned int hz)
+{
+    display->SpiSpeed = hz;
+}
+
+// SetDisplayOrientation
+// which way up the picture is, 0 to 3 as USE_HORIZONTAL. Call this before initCircularDisp
+void SetDisplayOrientation(DisplayContext * display, int orientation)
+{
+    display->Orientation = orientation & 3;
+}
+
+
+// emulator controls
+// the SPI clock rate the emulator models, 0 for instant transfers
+void SetEmulatorClock(DisplayContext * display, unsigned int hz)
+{
+    display->EmulatorClockHz = hz;
+}
+
+// how often the emulated panel scans and sends a TE pulse, default 60 a second, 0 for no TE pulses
+void SetEmulatorScanRate(DisplayContext * display, unsigned int hz)
+{
+    display->EmulatorScanHz = hz;
+    display->EmulatorScanPass = -1;
+}
+
+// the number of emulated scans that showed part of two different frames
+unsigned int EmulatorGetTears(DisplayContext * display)
+{
+    return (display->EmulatorTears);
+}
+
+// reads a pixel back from the emulated display memory
+unsigned short EmulatorGetPixel(DisplayContext * display, unsigned short xpos, unsigned short ypos)
+{
+    if ((xpos < 240) && (ypos < 240))
+        return (display->EmulatorGRAM[xpos + ypos*240]);
+    return (0);
+}
+
+// the GRAM row the emulated panel shows on a row of the screen, moved by the vertical scrolling
+// the scrolling is in the panel's own line order, which is upside down to the rows written when MADCTL has MY set
+static int EmulatorShownRow(DisplayContext * display, int y)
+{
+int line,top,count;
+
+    top = display->EmulatorScrollTop;
+    count = display->EmulatorScrollCount;
+    line = (display->EmulatorMadctl & 0x80) ? 239 - y : y;
+    if ((count != 0) && (line >= top) && (line < top + count))
+        line = top + (((line - top + display->EmulatorScrollStart - top) % count) + count) % count;
+    return ((display->EmulatorMadctl & 0x80) ? 239 - line : line);
+}
+
+// what the emulated panel shows at a point, which is the display memory moved by any hardware scrolling
+unsigned short EmulatorGetScreenPixel(DisplayContext * display, unsigned short xpos, unsigned short ypos)
+{
+    if ((xpos < 240) && (ypos < 240))
+        return (display->EmulatorGRAM[xpos + EmulatorShownRow(display, ypos)*240]);
+    return (0);
+}
+
+
+// CRC used by the PNG chunks, done bit by bit as speed does not matter here
+static unsigned int PngCrc(unsigned int crc, const unsigned char * data, unsigned int length)
+{
+unsigned int i;
+int bit;
+
+    crc = ~crc;
+    for (i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return (~crc);
+}
+
+static void PngPut32(unsigned char * dest, unsigned int value)
+{
+    dest[0] = value >> 24;
+    dest[1] = value >> 16;
+    dest[2] = value >> 8;
+    dest[3] = value;
+}
+
+static void PngChunk(FILE * file, const char * type, const unsigned char * data, unsigned int length)
+{
+unsigned char word[4];
+unsigned int crc;
+
+    PngPut32(word, length);
+    fwrite(word, 1, 4, file);
+    fwrite(type, 1, 4, file);
+    if (length != 0)
+        fwrite(data, 1, length, file);      // the IEND chunk has no data
+    crc = PngCrc(0, (const unsigned char *)type, 4);
+    crc = PngCrc(crc, data, length);
+    PngPut32(word, crc);
+    fwrite(word, 1, 4, file);
+}
+
+
+// EmulatorSaveFrame
+// saves the emulated display as an image, PNG if the name ends in .png otherwise a binary PPM
+// the PNG is written uncompressed (stored deflate blocks) so no zlib is needed
+bool EmulatorSaveFrame(DisplayContext * display, const char * path)
+{
+FILE * file;
+unsigned char * rgb;
+unsigned char * zdata;
+unsigned char header[13];
+unsigned int i,rawsize,zsize,block,pos,adlera,adlerb;
+unsigned short pixel;
+const char * ext;
+
+    // expand the RGB565 values to 8 bits per colour, each row starting with PNG's filter type byte
+    rawsize = 240*(1 + 240*3);
+    rgb = (unsigned char *) malloc(rawsize);
+    if (rgb == NULL)
+        return (false);
+    pos = 0;
+    for (i = 0; i < 240*240; i++)
+    {
+        if ((i % 240) == 0)
+            rgb[pos++] = 0;
+        pixel = display->EmulatorGRAM[(i % 240) + EmulatorShownRow(display, i / 240)*240];
+        rgb[pos++] = ((pixel >> 11)        * 255 + 15) / 31;
+        rgb[pos++] = (((pixel >> 5) & 0x3f) * 255 + 31) / 63;
+        rgb[pos++] = ((pixel & 0x1f)       * 255 + 15) / 31;
+    }
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        free(rgb);
+        printf("EmulatorSaveFrame unable to create %s\n", path);
+        return (false);
+    }
+
+    ext = strrchr(path, '.');
+    if ((ext != NULL) && (strcasecmp(ext, ".png") == 0))
+    {
+        // zlib stream of stored blocks, each up to 65535 bytes with a 5 byte header, then the Adler-32
+        zsize = 2 + rawsize + 5*((rawsize + 65534)/65535) + 4;
+        zdata = (unsigned char *) malloc(zsize);
+        if (zdata == NULL)
+        {
+            fclose(file);
+            free(rgb);
+            return (false);
+        }
+        zdata[0] = 0x78;
+        zdata[1] = 0x01;
+        pos = 2;
+        for (i = 0; i < rawsize; i += block)
+        {
+            block = ((rawsize - i) > 65535) ? 65535 : (rawsize - i);
+            zdata[pos++] = ((i + block) == rawsize) ? 1 : 0;    // last block flag
+            zdata[pos++] = block & 0xff;
+            zdata[pos++] = block >> 8;
+            zdata[pos++] = ~block & 0xff;
+            zdata[pos++] = (~block >> 8) & 0xff;
+            memcpy(zdata + pos, rgb + i, block);
+            pos += block;
+        }
+        adlera = 1;
+        adlerb = 0;
+        for (i = 0; i < rawsize; i++)
+        {
+            adlera = (adlera + rgb[i]) % 65521;
+            adlerb = (adlerb + adlera) % 65521;
+        }
+        PngPut32(zdata + pos, (adlerb << 16) | adlera);
+
+        PngPut32(header, 240);                  // width
+        PngPut32(header + 4, 240);              // height
+        header[8]  = 8;                         // bits per colour
+        header[9]  = 2;                         // RGB
+        header[10] = 0;
+        header[11] = 0;
+        header[12] = 0;
+
+        fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+        PngChunk(file, "IHDR", header, 13);
+        PngChunk(file, "IDAT", zdata, zsize);
+        PngChunk(file, "IEND", NULL, 0);
+        free(zdata);
+    }
+    else
+    {
+        fprintf(file, "P6\n240 240\n255\n");
+        for (i = 0; i < 240; i++)
+            fwrite(rgb + i*(1 + 240*3) + 1, 1, 240*3, file);
+    }
+
+    fclose(file);
+    free(rgb);
+    return (true);
+}
+
+
+
+// main this should not be used directly as this is a library
+// but when built as a program it draws a test pattern on the emulator and saves it, as a quick check
+// of a build that needs no display attached, e.g. gcc -o c2py_check -DNO_BCM2835 bcm_direct_c2py.c -lpthread -lm
+int main(int argc, char **argv)
+{
+DisplayContext * display;
+
+    printf("bcm_direct_c2py is a library for use with Python\n");
+
+    display = CreateDisplay();
+    if (display == NULL)
+        return 1;
+    SelectBackend(display, "emulator");
+    SetEmulatorClock(display, 0);
+    if (initBCMHardware(display))
+    {
+        initCircularDisp(display);
+        clearScreenDirect(display, 0x0000);
+        for (short radius = 0; radius < 240; radius += 8)
+        {
+            DrawLineAA(display, 0, 0, radius, 239, radius<<11);
+            DrawLineAA(display, 239, 0, 0, radius, (radius<<5)&0x07E0);
+        }
+        DrawCircle(display, 120, 120, 100, 0xFFFF);
+        DrawLineWideAA(display, 120, 120, 190, 60, 0x001F, 10);
+        ScreenUpdate(display);
+        EmulatorSaveFrame(display, (argc > 1) ? argv[1] : "bcm_direct_c2py.ppm");
+    }
+    DestroyDisplay(display);
+    return 0;
+}
+
+
+// BCM hardware initialisation
+// this configures the SPI port and the relevant pins for the circular display using the selected backend
+// note with the bcm2835 backend, if the code is not called as root then the init and SPI begin will fail
+bool initBCMHardware(DisplayContext * display)
+{
+    if (display->HardwareOpen)
+        return (true);
+    display->HardwareOpen = display->Backend->init(display);
+    return (display->HardwareOpen);
+}
+
+
+// exitBCMHardware 
+// this releases any allocated memory and clearnly shuts down the SPI driver and low level BCM control
+void exitBCMHardware(DisplayContext * display)
+{
+    //printf("Exiting hardware\n");
+    StopFlushThread(display);
+    StopBandThreads(display);
+    if (display->HardwareOpen)
+        display->Backend->exit(display);
+    display->HardwareOpen = false;
+
+    if (display->TransferBuffer != NULL)
+    {
+        free(display->TransferBuffer);
+        display->TransferBuffer = NULL;
+    }
+
+    if (display->CoverageSpace != NULL)
+    {
+        free(display->CoverageSpace);
+        display->CoverageSpace = NULL;
+    }
+
+    //printf("RenderSpace about to be freed\n");
+    //printf("renderspace = %p\n",RenderSpace);
+
+    if (display->RenderSpace !=NULL)
+    {
+        free(display->RenderSpace);
+        display->RenderSpace = NULL;
+        //printf("RenderSpace was freed\n");
+    }
+    //else
+        //printf("RenderSpace was not created\n");
+
+
+    if (display->ReferenceSpace !=NULL)
+    {
+        free(display->ReferenceSpace);
+        display->ReferenceSpace = NULL;
+        //printf("ReferenceSpace was freed\n");
+    }
+
+    if (display->FlushSpace !=NULL)
+    {
+        free(display->FlushSpace);
+        display->FlushSpace = NULL;
+    }
+
+    if (display->ShadowSpace !=NULL)
+    {
+        free(display->ShadowSpace);
+        display->ShadowSpace = NULL;
+    }
+}
+
+
+// initCircularDisp
+// this function configures the circular display itself.
+// the code is based on a sample found online which has a number of undocumented settings
+// where page numbers and details are given the information has been taken from the GalaxyCore GC9A01 Rev1.0 datasheet
+// see the Simpaul.com web page for download/link
+// note I have commented out as many of the undocumented commands as I can and most seem to ahve no effect on the output
+// however the 0x66 and 0x67 commands certainly do affect the output
+void initCircularDisp(DisplayContext * display)
+{
+
+    // create some memory space for a render buffer
+    // this is used to allow multiple display changes to be done without having multiple screen updates
+    // this means the updated image can be created and then sent to the display in one update
+    // this gives a much smoother output without obvious on screen drawing. 
+    // cleared, as the corners outside the circle are never filled or sent and would otherwise read back as anything
+    // initialised again, the one there is cleared and kept, so views of it from GetRenderSpace stay valid
+    WaitForFlush(display);
+    if (display->RenderSpace !=NULL)
+        memset(display->RenderSpace, 0, 240*240*2);
+    else
+        display->RenderSpace = (unsigned short *) calloc (240*240, 2);
+    if (display->RenderSpace ==NULL)
+        printf("ERROR - display->RenderSpace was not created\n");
+    BuildVisibleSpans(display);
+    display->ShadowValid = false;       // whatever the panel had before
+
+    //sdoCmdU8(0xEB);    //*** not listed
+    //sdoDataU8(0x14);
+    
+    sdoCmdU8(display, 0xFE);    //inter register enable 1 P172         
+    sdoCmdU8(display, 0xEF);    //inter register enable 2 P173
+/*
+    sdoCmdU8(display, 0xEB);    //*** not listed
+    sdoDataU8(display, 0x14);
+
+    sdoCmdU8(display, 0x84);    //*** not listed     
+    sdoDataU8(display, 0x40);
+
+    sdoCmdU8(display, 0x85);    //*** not listed       
+    sdoDataU8(display, 0xFF);
+
+    sdoCmdU8(display, 0x86);    //*** not listed   
+    sdoDataU8(display, 0xFF);
+
+    sdoCmdU8(display, 0x87);    //*** not listed             
+    sdoDataU8(display, 0xFF);
+
+    sdoCmdU8(display, 0x88);           
+    sdoDataU8(display, 0x0A);
+
+    sdoCmdU8(display, 0x89);           
+    sdoDataU8(display, 0x21);
+
+    sdoCmdU8(display, 0x8A);           
+    sdoDataU8(display, 0x00);
+
+    sdoCmdU8(display, 0x8B);           
+    sdoDataU8(display, 0x80);
+
+    sdoCmdU8(display, 0x8C);           
+    sdoDataU8(display, 0x01);
+
+    sdoCmdU8(display, 0x8D);           
+    sdoDataU8(display, 0x01);
+
+    sdoCmdU8(display, 0x8E);           
+    sdoDataU8(display, 0xFF);
+
+    sdoCmdU8(display, 0x8F);           
+    sdoDataU8(display, 0xFF);
+*/
+
+    sdoCmdU8(display, 0xB6);    //Display function control P158
+    sdoDataU8(display, 0x00);   //Must be zero         
+    sdoDataU8(display, 0x00);   //Defines shift register directions
+
+    sdoCmdU8(display, 0x36);    // Memory access control datasheet P127 
+    if(display->Orientation==0)
+      sdoDataU8(display, 0xE8); // sample code showed this a 18 but that didn't work
+    if(display->Orientation==1)
+      sdoDataU8(display, 0x28);
+    if(display->Orientation==2)
+      sdoDataU8(display, 0x48);
+    if(display->Orientation==3)
+      sdoDataU8(display, 0x88);
+
+    sdoCmdU8(display, 0x3A);    //COLMOD Pixel Fomrat Set  P135        
+    sdoDataU8(display, (display->TransferBits == 12) ? 0x53 : 0x55);   //RGB Mode Ignored, MCU Mode set to 16 Bits per Pixel
+                            //colour is 5 Red, 6 Green, 5 Blue (or 4 of each with SetTransferFormat 12)
+
+/*
+    sdoCmdU8(display, 0x90);    //*** not listed            
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x08);
+
+    sdoCmdU8(display, 0xBD);    //*** not listed             
+    sdoDataU8(display, 0x06);
+
+    sdoCmdU8(display, 0xBC);    //*** not listed         
+    sdoDataU8(display, 0x00);   
+
+    sdoCmdU8(display, 0xFF);    //*** not listed           
+    sdoDataU8(display, 0x60);
+    sdoDataU8(display, 0x01);
+    sdoDataU8(display, 0x04);
+*/
+    sdoCmdU8(display, 0xC3);    //Power Control 2 P 168          
+    sdoDataU8(display, 0x13);
+    sdoCmdU8(display, 0xC4);    //Power Control 3 P 169        
+    sdoDataU8(display, 0x13);
+
+    sdoCmdU8(display, 0xC9);    //Power Control 4 P 170        
+    sdoDataU8(display, 0x22);
+/*
+    sdoCmdU8(display, 0xBE);    //*** not listed           
+    sdoDataU8(display, 0x11);
+
+    sdoCmdU8(display, 0xE1);    //*** not listed       
+    sdoDataU8(display, 0x10);
+    sdoDataU8(display, 0x0E);
+
+    sdoCmdU8(display, 0xDF);    //*** not listed     
+    sdoDataU8(display, 0x21);
+    sdoDataU8(display, 0x0c);
+    sdoDataU8(display, 0x02);
+*/
+    sdoCmdU8(display, 0xF0);    //SET_GAMMA1  P 174
+    sdoDataU8(display, 0x45);
+    sdoDataU8(display, 0x09);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x26);
+    sdoDataU8(display, 0x2A);
+
+    sdoCmdU8(display, 0xF1);    //SET_GAMMA2  P 176 
+    sdoDataU8(display, 0x43);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x72);
+    sdoDataU8(display, 0x36);
+    sdoDataU8(display, 0x37); 
+    sdoDataU8(display, 0x6F);
+
+
+    sdoCmdU8(display, 0xF2);    //SET_GAMMA3  P 178 
+    sdoDataU8(display, 0x45);
+    sdoDataU8(display, 0x09);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x26);
+    sdoDataU8(display, 0x2A);
+
+    sdoCmdU8(display, 0xF3);    //SET_GAMMA4  P 180
+    sdoDataU8(display, 0x43);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x72);
+    sdoDataU8(display, 0x36);
+    sdoDataU8(display, 0x37);
+    sdoDataU8(display, 0x6F);
+/*
+    sdoCmdU8(display, 0xED);    //*** not listed      
+    sdoDataU8(display, 0x1B);
+    sdoDataU8(display, 0x0B);
+
+    sdoCmdU8(display, 0xAE);    //*** not listed          
+    sdoDataU8(display, 0x77);
+
+    sdoCmdU8(display, 0xCD);    //*** not listed           
+    sdoDataU8(display, 0x63);       
+
+
+    sdoCmdU8(display, 0x70);    //*** not listed           
+    sdoDataU8(display, 0x07);
+    sdoDataU8(display, 0x07);
+    sdoDataU8(display, 0x04);
+    sdoDataU8(display, 0x0E);
+    sdoDataU8(display, 0x0F);
+    sdoDataU8(display, 0x09);
+    sdoDataU8(display, 0x07);
+    sdoDataU8(display, 0x08);
+    sdoDataU8(display, 0x03);
+*/
+    sdoCmdU8(display, 0xE8);    //Frame Rate P164           
+    sdoDataU8(display, 0x34);   //4 dot inversion
+/*
+    sdoCmdU8(display, 0x62);    //*** not listed          
+    sdoDataU8(display, 0x18);
+    sdoDataU8(display, 0x0D);
+    sdoDataU8(display, 0x71);
+    sdoDataU8(display, 0xED);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x18);
+    sdoDataU8(display, 0x0F);
+    sdoDataU8(display, 0x71);
+    sdoDataU8(display, 0xEF);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x70);
+
+    sdoCmdU8(display, 0x63);    //*** not listed             
+    sdoDataU8(display, 0x18);
+    sdoDataU8(display, 0x11);
+    sdoDataU8(display, 0x71);
+    sdoDataU8(display, 0xF1);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x18);
+    sdoDataU8(display, 0x13);
+    sdoDataU8(display, 0x71);
+    sdoDataU8(display, 0xF3);
+    sdoDataU8(display, 0x70);
+    sdoDataU8(display, 0x70);
+
+    sdoCmdU8(display, 0x64);    //*** not listed             
+    sdoDataU8(display, 0x28);
+    sdoDataU8(display, 0x29);
+    sdoDataU8(display, 0xF1);
+    sdoDataU8(display, 0x01);
+    sdoDataU8(display, 0xF1);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x07);
+
+*/
+
+    sdoCmdU8(display, 0x66);    //*** not listed            
+    sdoDataU8(display, 0x3C);   // seem to affect how pixels are displayed
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0xCD);
+    sdoDataU8(display, 0x67);
+    sdoDataU8(display, 0x45);
+    sdoDataU8(display, 0x45);
+    sdoDataU8(display, 0x10);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x00);
+
+    
+
+    sdoCmdU8(display, 0x67);    //*** not listed              
+    sdoDataU8(display, 0x00);   // seem to affect how pixels are displayed 
+    sdoDataU8(display, 0x3C);       
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x01);
+    sdoDataU8(display, 0x54);    
+    sdoDataU8(display, 0x10);
+    sdoDataU8(display, 0x32);    
+    sdoDataU8(display, 0x98);
+
+/*
+
+    sdoCmdU8(display, 0x74);    //*** not listed            
+    sdoDataU8(display, 0x10);   
+    sdoDataU8(display, 0x85);   
+    sdoDataU8(display, 0x80);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x00);
+    sdoDataU8(display, 0x4E);
+    sdoDataU8(display, 0x00);         
+
+    sdoCmdU8(display, 0x98);    //*** not listed             
+    sdoDataU8(display, 0x3e);
+    sdoDataU8(display, 0x07);
+*/
+    sdoCmdU8(display, 0x35);    //Tearing Effect Line ON P125
+    sdoDataU8(display, 0x01);   //turned on.
+
+    sdoCmdU8(display, 0x21);    //  Invert screen colours
+
+    sdoCmdU8(display, 0x11);    //Sleep Out Mode P103   - turns off sleep mode - i.e. turn on the screen
+    display->Backend->delay(120);
+    sdoCmdU8(display, 0x29);    //Display On P 110
+    display->Backend->delay(20);
+
+    //printf ("circular setup complete\n");
+
+}
+
+// the bus writes themselves, used by the flush thread (which must not wait for itself) and by functions that
+// have already waited for it. The sdo functions below are the same for everything else, after waiting for the flush
+// so what they send can not end up in the middle of a frame
+static void BusCmdU8(DisplayContext * display, unsigned char byteval)
+{
+    COUNT_SPI(display, 1, 1);
+    display->Backend->command(display, byteval);
+}
+
+static void BusDataU16(DisplayContext * display, unsigned short intval)
+{
+unsigned char bytes[2];
+
+    bytes[0] = intval>>8;
+    bytes[1] = intval&0xff;
+    COUNT_SPI(display, 2, 0);
+    display->Backend->data(display, bytes, 2);
+}
+
+static void BusDataU8(DisplayContext * display, unsigned char byteval)
+{
+    COUNT_SPI(display, 1, 0);
+    display->Backend->data(display, &byteval, 1);
+}
+
+static void BusDataBuffer(DisplayContext * display, const unsigned char * data, unsigned int length)
+{
+    COUNT_SPI(display, length, 0);
+    display->Backend->data(display, data, length);
+}
+
+// SetScreenWriteArea without the wait
+static void BusWriteArea(DisplayContext * display, unsigned char Xstart,unsigned char Ystart,unsigned char Xend,unsigned char Yend)
+{
+unsigned char area[4];
+
+    if((Xend<240) && (Yend<240) &&(Xstart<=Xend)&& (Ystart<=Yend))
+    {
+        // the 16 bit start and end values are sent as one block, the high bytes are always 0
+        area[0] = 0;
+        area[2] = 0;
+
+        BusCmdU8(display, 0x2a);             // select Column address P111
+        area[1] = Xstart;
+        area[3] = Xend;
+        BusDataBuffer(display, area, 4);
+
+        BusCmdU8(display, 0x2b);             // select Row Address Set P113
+        area[1] = Ystart;
+        area[3] = Yend;
+        BusDataBuffer(display, area, 4);
+
+        BusCmdU8(display, 0x2c);            // Memory Write P 115
+                                   // sets the display to receive data
+    }
+    else
+    {
+        // invalid co-ordinates
+        printf("SetScreenWriteArea Invalid Co-ordinates\n");
+    }
+}
+
+// low level driver using SPI direct to write 8 bit value out as a command
+// as it's a command, make sure to set the D/C pin low = Command
+void sdoCmdU8(DisplayContext * display,  unsigned char byteval)
+{
+    WaitForFlush(display);
+    BusCmdU8(display, byteval);
+}
+
+// low level driver using SPI direct to write 16 bit value out as Data
+// as it's a data, make sure to set the D/C pin high = data
+void sdoDataU16(DisplayContext * display,  unsigned short intval)
+{
+    WaitForFlush(display);
+    BusDataU16(display, intval);
+}
+// low level driver using SPI direct to write 8 bit value out as Data
+// as it's a data, make sure to set the D/C pin high = data
+void sdoDataU8(DisplayContext * display,  unsigned char byteval)
+{
+    WaitForFlush(display);
+    BusDataU8(display, byteval);
+}
+
+// low level driver using SPI direct to write a block of bytes out as Data in a single transfer
+void sdoDataBuffer(DisplayContext * display, const unsigned char * data, unsigned int length)
+{
+    WaitForFlush(display);
+    BusDataBuffer(display, data, length);
+}
+
+
+// the staging buffer itself, without waiting for the flush thread as that is where it is first needed
+static bool AllocTransferBuffer(DisplayContext * display, unsigned int bytes)
+{
+unsigned char * buffer;
+
+    bytes &= ~1;                    // whole pixels only
+    if (bytes > 240*240*2)
+        bytes = 240*240*2;
+
+    if (bytes == 0)
+    {
+        free(display->TransferBuffer);
+        display->TransferBuffer = NULL;
+    }
+    else
+    {
+        buffer = (unsigned char *) realloc(display->TransferBuffer, bytes);
+        if (buffer == NULL)
+        {
+            printf("Error unable to create the transfer buffer\n");
+            return (false);
+        }
+        display->TransferBuffer = buffer;
+    }
+    display->TransferChunkSize = bytes;
+    return (true);
+}
+
+// SetTransferChunkSize
+// sets the size in bytes of the blocks used to send pixel data to the display
+// larger blocks mean fewer calls into the SPI driver, 0 goes back to sending a byte at a time
+// returns false if the staging buffer could not be allocated
+bool SetTransferChunkSize(DisplayContext * display, unsigned int bytes)
+{
+    WaitForFlush(display);
+    return (AllocTransferBuffer(display, bytes));
+}
+
+
+// SetTransferFormat
+// how the pixels go to the display, 16 bits (RGB565, as always) or 12 bits (RGB444) which is a quarter fewer bytes
+// on the wire, so about a third more frames a second when the SPI bus is what holds it back. The render space and
+// everything drawn stay RGB565, the pixels are only cut down as they are sent, with dither set the low bits are
+// spread in the same 4x4 pattern as the image loading so gradients do not band.
+// once the hardware is open the display's COLMOD is changed straight away, otherwise initCircularDisp sets it.
+// what is already on the panel is not sent again. returns false for any other number of bits
+bool SetTransferFormat(DisplayContext * display, int bits, bool dither)
+{
+    if ((bits != 16) && (bits != 12))
+    {
+        printf("SetTransferFormat %d bits per pixel is not supported\n", bits);
+        return (false);
+    }
+
+    WaitForFlush(display);
+    display->TransferBits = bits;
+    display->TransferDither = dither;
+    display->ShadowValid = false;
+    if (display->HardwareOpen)
+    {
+        sdoCmdU8(display, 0x3A);    // COLMOD
+        sdoDataU8(display, (bits == 12) ? 0x53 : 0x55);
+    }
+    return (true);
+}
+
+
+
+// cost in bytes on the SPI bus of sending a rectangle as its own write window
+static int RectCost(const DirtyRect * r)
+{
+    return ((r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1) * 2 + WINDOW_OVERHEAD);
+}
+
+// the same as it is really sent, which is a quarter less for the pixels with RGB444 transfers
+// the planning keeps to RectCost, the choices it makes hardly change with the pixel size
+static int RectBytes(const DisplayContext * display, const DirtyRect * r)
+{
+int pixels;
+
+    pixels = (r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1);
+    if (display->TransferBits == 12)
+        return ((pixels*3 + 1)/2 + WINDOW_OVERHEAD);
+    return (pixels*2 + WINDOW_OVERHEAD);
+}
+
+static DirtyRect RectUnion(const DirtyRect * a, const DirtyRect * b)
+{
+DirtyRect u;
+    u.x0 = (a->x0 < b->x0) ? a->x0 : b->x0;
+    u.y0 = (a->y0 < b->y0) ? a->y0 : b->y0;
+    u.x1 = (a->x1 > b->x1) ? a->x1 : b->x1;
+    u.y1 = (a->y1 > b->y1) ? a->y1 : b->y1;
+    return (u);
+}
+
+
+// AddDirtyRect
+// adds an area to a damage list, clipped to the screen
+// rectangles are merged whenever a single window would cost no more bytes than sending both
+// and if the list is full the new area is merged with whichever entry grows the least
+static void AddDirtyRect(DirtyRegion * region, int x0, int y0, int x1, int y1)
+{
+DirtyRect r,u;
+int i,best,bestgrowth,growth;
+
+    if (x0 < 0)   x0 = 0;
+    if (y0 < 0)   y0 = 0;
+    if (x1 > 239) x1 = 239;
+    if (y1 > 239) y1 = 239;
+    if ((x0 > x1) || (y0 > y1))
+        return;                 // nothing visible
+
+    r.x0 = x0; r.y0 = y0; r.x1 = x1; r.y1 = y1;
+
+    i = 0;
+    while (i < region->count)
+    {
+        DirtyRect * e = &region->rect[i];
+
+        // already covered, this is the common case for wide lines and rectangles
+        if ((r.x0 >= e->x0) && (r.x1 <= e->x1) && (r.y0 >= e->y0) && (r.y1 <= e->y1))
+            return;
+
+        u = RectUnion(&r, e);
+        if (RectCost(&u) <= (RectCost(&r) + RectCost(e)))
+        {
+            // cheaper as one, so remove the entry and try again with the bigger area
+            r = u;
+            region->rect[i] = region->rect[--region->count];
+            i = 0;
+        }
+        else
+            i++;
+    }
+
+    if (region->count == MAX_DIRTY_RECTS)
+    {
+        best = 0;
+        bestgrowth = 0x7fffffff;
+        for (i = 0; i < region->count; i++)
+        {
+            u = RectUnion(&r, &region->rect[i]);
+            growth = RectCost(&u) - RectCost(&region->rect[i]);
+            if (growth < bestgrowth)
+            {
+                bestgrowth = growth;
+                best = i;
+            }
+        }
+        region->rect[best] = RectUnion(&r, &region->rect[best]);
+    }
+    else
+        region->rect[region->count++] = r;
+}
+
+
+// MarkDirtyArea
+// records that part of the render space has changed so that ScreenUpdateDirty will send it
+// the drawing routines do this themselves, this is only needed if the render space is changed some other way
+void MarkDirtyArea(DisplayContext * display, short Xstart, short Ystart, short Xend, short Yend)
+{
+    AddDirtyRect(&display->ScreenDamage,    Xstart, Ystart, Xend, Yend);
+    AddDirtyRect(&display->ReferenceDamage, Xstart, Ystart, Xend, Yend);
+}
+
+// MarkDrawnArea
+// the drawing routines' version, which leaves out anything outside the clip rectangle as it cannot have changed
+static void MarkDrawnArea(DisplayContext * display, int Xstart, int Ystart, int Xend, int Yend)
+{
+    if (Xstart < display->ClipX0)
+        Xstart = display->ClipX0;
+    if (Ystart < display->ClipY0)
+        Ystart = display->ClipY0;
+    if (Xend > display->ClipX1)
+        Xend = display->ClipX1;
+    if (Yend > display->ClipY1)
+        Yend = display->ClipY1;
+    if ((Xstart <= Xend) && (Ystart <= Yend))
+        MarkDirtyArea(display, Xstart, Ystart, Xend, Yend);
+}
+
+
+// MarkLineArea
+// a diagonal line only covers a thin band of its bounding box, so long lines are recorded as a chain
+// of smaller boxes along their length, which AddDirtyRect then joins back up wherever that is cheaper
+// the number of pieces only depends on the direction and length so parallel lines split the same way
+// the end points are 16.16 fixed point, the same as the line drawing uses
+static void MarkLineArea(DisplayContext * display, int x0, int y0, int x1, int y1, int margin)
+{
+int i,pieces;
+long long dx,dy;
+int xa,ya,xb,yb;
+
+    dx = (long long)x1 - x0;
+    dy = (long long)y1 - y0;
+    pieces = (int)(((llabs(dx) < llabs(dy)) ? llabs(dx) : llabs(dy)) / (24<<16)) + 1;
+    if (pieces > 8)
+        pieces = 8;
+
+    for (i = 0; i < pieces; i++)
+    {
+        xa = x0 + (int)((dx * i) / pieces);
+        ya = y0 + (int)((dy * i) / pieces);
+        xb = x0 + (int)((dx * (i+1)) / pieces);
+        yb = y0 + (int)((dy * (i+1)) / pieces);
+        MarkDrawnArea(display, (short)(((xa<xb)?xa:xb)>>16) - margin, (short)(((ya<yb)?ya:yb)>>16) - margin,
+                      (short)(((xa>xb)?xa:xb)>>16) + margin, (short)(((ya>yb)?ya:yb)>>16) + margin);
+    }
+}
+
+
+// the ordered (Bayer) dither pattern, used by the image conversion and the RGB444 transfers
+static const unsigned char BayerMatrix[4][4] =
+{
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+// RGB444 transfers
+// with TransferBits at 12 each pixel goes as 4 bits of red, green and blue, two pixels to every three bytes.
+// the dither adds part of a 4 bit step from the pattern before the low bits are dropped. It follows the screen
+// position, so an area sent again on its own comes out exactly as it did in a full update
+static inline unsigned int ToRGB444(unsigned short colour, int x, int y, bool dither)
+{
+int red,green,blue,level;
+
+    red = colour>>11;
+    green = (colour>>5) & 0x3f;
+    blue = colour & 0x1f;
+    if (dither)
+    {
+        // one 4 bit step is 2 of the 5 bit levels and 4 of the 6 bit ones
+        level = BayerMatrix[y&3][x&3];
+        red += level>>3;
+        green += level>>2;
+        blue += level>>3;
+        if (red > 31)    red = 31;
+        if (green > 63)  green = 63;
+        if (blue > 31)   blue = 31;
+    }
+    return (((red>>1)<<8) | ((green>>2)<<4) | (blue>>1));
+}
+
+// packs an area in RGB444 into the staging buffer, which is sent each time it fills. Without one (or with one too
+// small for a pair of pixels) each pair goes on its own. The pixels run on from one row to the next, so an odd
+// pixel at the end goes with 4 spare bits that the display drops when the next command starts
+static void SendRenderRect444(DisplayContext * display, const unsigned short * source, const DirtyRect * r)
+{
+int x,y;
+const unsigned short * sourcePtr;
+unsigned int pixel,held,limit,used;
+unsigned char pair[3];
+unsigned char * buffer;
+bool odd,dither;
+
+    buffer = display->TransferBuffer;
+    limit = display->TransferChunkSize - display->TransferChunkSize % 3;
+    if ((buffer == NULL) || (limit == 0))
+    {
+        buffer = pair;
+        limit = 3;
+    }
+    dither = display->TransferDither;
+
+    used = 0;
+    held = 0;
+    odd = false;
+    for (y = r->y0; y <= r->y1; y++)
+    {
+        sourcePtr = source + r->x0 + y*240;
+        for (x = r->x0; x <= r->x1; x++)
+        {
+            pixel = ToRGB444(FromRender(display, *(sourcePtr++)), x, y, dither);
+            if (!odd)
+            {
+                held = pixel;
+                odd = true;
+                continue;
+            }
+            buffer[used++] = held>>4;
+            buffer[used++] = ((held&0xf)<<4) | (pixel>>8);
+            buffer[used++] = pixel&0xff;
+            odd = false;
+            if (used == limit)
+            {
+                BusDataBuffer(display, buffer, used);
+                used = 0;
+            }
+        }
+    }
+    if (odd)
+    {
+        if ((used + 2) > limit)
+        {
+            BusDataBuffer(display, buffer, used);
+            used = 0;
+        }
+        buffer[used++] = held>>4;
+        buffer[used++] = (held&0xf)<<4;
+    }
+    if (used != 0)
+        BusDataBuffer(display, buffer, used);
+}
+
+
+// send part of a render space (normally RenderSpace, or FlushSpace from the flush thread) to the display
+// the area is inclusive, the same as SetScreenWriteArea
+static void SendRenderRect(DisplayContext * display, const unsigned short * source, const DirtyRect * r)
+{
+int x,y;
+const unsigned short * sourcePtr;
+unsigned short pixel;
+unsigned char * destPtr;
+unsigned int used;
+
+    // the staging buffer is only created when first needed, which can be on the flush thread
+    if ((display->TransferChunkSize != 0) && (display->TransferBuffer == NULL))
+        AllocTransferBuffer(display, display->TransferChunkSize);
+
+    BusWriteArea(display, r->x0, r->y0, r->x1, r->y1);
+
+    if (display->TransferBits == 12)
+        SendRenderRect444(display, source, r);
+    else if (display->TransferBuffer == NULL)
+    {
+        // original byte at a time version, kept for comparison
+        for (y = r->y0; y <= r->y1; y++)
+        {
+            sourcePtr = source + r->x0 + y*240;
+            for (x = r->x0; x <= r->x1; x++)
+            {
+                pixel = FromRender(display, *sourcePtr);
+                BusDataU8(display, pixel>>8);
+                BusDataU8(display, pixel&0xff);
+                sourcePtr++;
+            }
+        }
+    }
+    else if (display->PanelByteOrder)
+    {
+        // the render space is already in the display byte order so it is sent as it is, with no copying
+        // full width areas are one continuous block of memory, otherwise it goes a row at a time
+        if ((r->x0 == 0) && (r->x1 == 239))
+            BusDataBuffer(display, (const unsigned char *)(source + r->y0*240), (r->y1 - r->y0 + 1)*240*2);
+        else
+        {
+            for (y = r->y0; y <= r->y1; y++)
+                BusDataBuffer(display, (const unsigned char *)(source + r->x0 + y*240), (r->x1 - r->x0 + 1)*2);
+        }
+    }
+    else
+    {
+        // swap each pixel into the display byte order in the staging buffer, sending it each time it fills
+        destPtr = display->TransferBuffer;
+        used = 0;
+        for (y = r->y0; y <= r->y1; y++)
+        {
+            sourcePtr = source + r->x0 + y*240;
+            for (x = r->x0; x <= r->x1; x++)
+            {
+                *(destPtr++) = (*sourcePtr)>>8;
+                *(destPtr++) = (*sourcePtr)&0xff;
+                sourcePtr++;
+                used += 2;
+                if (used == display->TransferChunkSize)
+                {
+                    BusDataBuffer(display, display->TransferBuffer, used);
+                    destPtr = display->TransferBuffer;
+                    used = 0;
+                }
+            }
+        }
+        if (used != 0)
+            BusDataBuffer(display, display->TransferBuffer, used);
+    }
+    display->FlushBytesSent += RectBytes(display, r);
+    COUNT_SENT(display, (r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1));
+}
+
+
+// PlanVisibleBands
+// splits an area into the parts inside the circle. Each row could be its own window, but every window costs
+// WINDOW_OVERHEAD bytes, so rows are grouped into bands each sent as one window as wide as its widest row.
+// best[] is the cheapest way to send the rows above each row, found by trying every band that could end there.
+// the bands are returned from the top down, the same order as a full screen update, and the number of them
+static int PlanVisibleBands(DisplayContext * display, const DirtyRect * r, DirtyRect * bands)
+{
+int best[241],start[241],ends[240];
+int rows,i,j,y,left,right,first,last,cost,count,used;
+
+    if (!display->CircularMask)
+    {
+        bands[0] = *r;
+        return (1);
+    }
+
+    rows = r->y1 - r->y0 + 1;
+    best[0] = 0;
+    for (j = 1; j <= rows; j++)
+    {
+        // a row with nothing visible in the area can be left out altogether
+        first = r->x0;
+        last = r->x1;
+        if (!ClipToVisible(display, r->y0 + j - 1, &first, &last))
+        {
+            best[j] = best[j-1];
+            start[j] = j;
+            continue;
+        }
+
+        best[j] = 0x7fffffff;
+        left = 240;
+        right = -1;
+        for (i = j - 1; i >= 0; i--)
+        {
+            first = r->x0;
+            last = r->x1;
+            if (ClipToVisible(display, r->y0 + i, &first, &last))
+            {
+                if (first < left)  left = first;
+                if (last > right)  right = last;
+            }
+            cost = best[i] + (right - left + 1)*(j - i)*2 + WINDOW_OVERHEAD;
+            if (cost < best[j])
+            {
+                best[j] = cost;
+                start[j] = i;
+            }
+        }
+    }
+
+    // then work back up from the bottom to find where the bands split
+    count = 0;
+    j = rows;
+    while (j > 0)
+    {
+        if (start[j] != j)
+            ends[count++] = j;
+        j = (start[j] == j) ? j - 1 : start[j];
+    }
+    used = 0;
+    while (count > 0)
+    {
+        j = ends[--count];
+        i = start[j];
+        bands[used].x0 = 240;
+        bands[used].x1 = -1;
+        for (y = r->y0 + i; y < r->y0 + j; y++)
+        {
+            first = r->x0;
+            last = r->x1;
+            if (ClipToVisible(display, y, &first, &last))
+            {
+                if (first < bands[used].x0)  bands[used].x0 = first;
+                if (last > bands[used].x1)   bands[used].x1 = last;
+            }
+        }
+        bands[used].y0 = r->y0 + i;
+        bands[used].y1 = r->y0 + j - 1;
+        used++;
+    }
+    return (used);
+}
+
+// sends only the parts of an area that are inside the circle
+static void SendVisibleRect(DisplayContext * display, const unsigned short * source, const DirtyRect * r)
+{
+DirtyRect bands[240];
+int i,count;
+
+    count = PlanVisibleBands(display, r, bands);
+    for (i = 0; i < count; i++)
+        SendRenderRect(display, source, &bands[i]);
+}
+
+
+// SendPacedBand
+// the panel shows a row as it was when the scan line last passed it. So that a scan shows all of the old frame or
+// all of the new, every row has to be written after scan number pass (counted from the TE edge) has read it and
+// before the next scan does. A band starting right behind the scan line gets almost two scans to be written,
+// which is more than a full screen needs at 32MHz. A band that is too slow for that is sent in smaller parts,
+// and a part that has missed its chance waits for the scan line to come round again, chasing it down the screen
+static void SendPacedBand(DisplayContext * display, const unsigned short * source, DirtyRect band, long long edge, int * pass)
+{
+long long rowtime,duration,open,close,start,end;
+DirtyRect part;
+
+    rowtime = display->TearingPeriod / 240;
+    while (band.y0 <= band.y1)
+    {
+        part = band;
+        for (;;)
+        {
+            duration = RectBytes(display, &part) * display->TearingNsPerByte;
+            open = edge + (*pass)*display->TearingPeriod + part.y0*rowtime;
+            if (((part.y1 - part.y0)*rowtime) > duration)
+                open += (part.y1 - part.y0)*rowtime - duration;     // quicker than the scan, so it must not catch it up
+            close = edge + (*pass + 1)*display->TearingPeriod + part.y1*rowtime - display->TearingPeriod/32;
+            if (((open + duration) <= close) || (part.y0 == part.y1))
+                break;
+            part.y1 = part.y0 + (part.y1 - part.y0)/2;
+        }
+
+        start = NowNs();
+        if (start < open)
+        {
+            SleepUntilNs(open);
+            start = NowNs();
+        }
+        else if (((start + duration) > close) && (part.y0 != part.y1))
+        {
+            // too late for this scan, so this part waits for the next
+            (*pass)++;
+            continue;
+        }
+
+        SendRenderRect(display, source, &part);
+        end = NowNs();
+        if (end > (close + display->TearingPeriod/32))
+            display->TearingOverruns++;
+        display->TearingNsPerByte += ((end - start) / RectBytes(display, &part) - display->TearingNsPerByte) / 4;
+        if (display->TearingNsPerByte < 1)
+            display->TearingNsPerByte = 1;
+        band.y0 = part.y1 + 1;
+    }
+}
+
+// SendPacedRegion
+// waits for the TE edge and then sends the areas top down behind the scan line, keeping the statistics
+static void SendPacedRegion(DisplayContext * display, const unsigned short * source, const DirtyRegion * region)
+{
+DirtyRegion sorted;
+DirtyRect bands[240];
+DirtyRect r;
+long long edge,latency,scans;
+int i,j,count,pass;
+
+    // in the order the panel scans, so each area is written behind the scan line
+    sorted = *region;
+    for (i = 1; i < sorted.count; i++)
+    {
+        r = sorted.rect[i];
+        for (j = i; (j > 0) && (sorted.rect[j-1].y0 > r.y0); j--)
+            sorted.rect[j] = sorted.rect[j-1];
+        sorted.rect[j] = r;
+    }
+
+    if (!display->Backend->tearwait(display, (unsigned int)(display->TearingPeriod*2/1000) + 10000, &edge))
+    {
+        // no pulse, perhaps the display is asleep, so send it anyway rather than hang
+        display->TearingTimeouts++;
+        for (i = 0; i < sorted.count; i++)
+            SendVisibleRect(display, source, &sorted.rect[i]);
+        return;
+    }
+    latency = NowNs() - edge;
+
+    // the period is refined from the edges, and if only a few scans went by since the last frame
+    // then the ones in between were missed (longer gaps are taken as the application having nothing to show)
+    if (display->TearingLastEdge != 0)
+    {
+        scans = (edge - display->TearingLastEdge + display->TearingPeriod/2) / display->TearingPeriod;
+        if ((scans >= 1) && (scans <= 4))
+        {
+            display->TearingPeriod += ((edge - display->TearingLastEdge)/scans - display->TearingPeriod) / 8;
+            display->TearingMissed += scans - 1;
+        }
+    }
+    display->TearingLastEdge = edge;
+
+    display->TearingLatencySum += latency;
+    display->TearingLatencySquares += (latency/1000) * (latency/1000);
+    if (latency > display->TearingLatencyMax)
+        display->TearingLatencyMax = latency;
+
+    pass = 0;
+    for (i = 0; i < sorted.count; i++)
+    {
+        count = PlanVisibleBands(display, &sorted.rect[i], bands);
+        for (j = 0; j < count; j++)
+            SendPacedBand(display, source, bands[j], edge, &pass);
+    }
+    display->TearingFrames++;
+    if (pass > 0)
+        display->TearingSplit++;
+}
+
+
+// PlanDirtyRegion
+// decides how a set of changed areas will be sent, replacing them with the single window covering
+// them all if that costs no more than the separate windows. returns the number of bytes it will take
+static int PlanDirtyRegion(DirtyRegion * region)
+{
+DirtyRect bounds;
+int i,cost;
+
+    if (region->count == 0)
+        return (0);
+
+    bounds = region->rect[0];
+    cost = 0;
+    for (i = 0; i < region->count; i++)
+    {
+        bounds = RectUnion(&bounds, &region->rect[i]);
+        cost += RectCost(&region->rect[i]);
+    }
+
+    if (RectCost(&bounds) <= cost)
+    {
+        region->rect[0] = bounds;
+        region->count = 1;
+        cost = RectCost(&bounds);
+    }
+    return (cost);
+}
+
+
+// sends the scrolling start address if the panel does not have it already, after the pixels of each update
+static void SendScrollStart(DisplayContext * display, int start)
+{
+    if (start == display->ScrollSent)
+        return;
+    BusCmdU8(display, 0x37);        // Vertical Scrolling Start Address
+    BusDataU16(display, start);
+    display->ScrollSent = start;
+}
+
+
+// content diff
+// full frames (a video, or a picture made by PIL every tick) change every pixel of the render space, so the damage
+// tracking sends all of it even when most of it is the same as last time. With a shadow of the panel's GRAM each
+// row of an update is compared with what the panel has, and only the part from the first to the last changed pixel
+// is kept, which AddDirtyRect joins up into windows as usual. Above the threshold it is not worth the extra windows
+// and the areas go as they were
+
+// DiffSpan
+// narrows first..last to the first and last pixels of a row that differ from the shadow, comparing four pixels at
+// a time as 64 bit words. false if none do
+static bool DiffSpan(const unsigned short * row, const unsigned short * shadow, int * first, int * last)
+{
+unsigned long long a,b;
+int x0,x1;
+
+    x0 = *first;
+    x1 = *last;
+    while (x0 + 3 <= x1)
+    {
+        memcpy(&a, row + x0, 8);
+        memcpy(&b, shadow + x0, 8);
+        if (a != b)
+            break;
+        x0 += 4;
+    }
+    while ((x0 <= x1) && (row[x0] == shadow[x0]))
+        x0++;
+    if (x0 > x1)
+        return (false);
+
+    while (x1 - 3 >= x0)
+    {
+        memcpy(&a, row + x1 - 3, 8);
+        memcpy(&b, shadow + x1 - 3, 8);
+        if (a != b)
+            break;
+        x1 -= 4;
+    }
+    while (row[x1] == shadow[x1])
+        x1--;
+    *first = x0;
+    *last = x1;
+    return (true);
+}
+
+// DiffRegion
+// compares the visible part of a set of areas with the shadow and returns the parts that changed, planned for sending.
+// the shadow is brought up to date with them either way
+static void DiffRegion(DisplayContext * display, const unsigned short * source, const DirtyRegion * region, DirtyRegion * changed)
+{
+const DirtyRect * r;
+int i,y,first,last,offset,rows;
+unsigned long long compared,differ;
+
+    changed->count = 0;
+    compared = 0;
+    differ = 0;
+    rows = 0;
+    for (i = 0; i < region->count; i++)
+    {
+        r = &region->rect[i];
+        for (y = r->y0; y <= r->y1; y++)
+        {
+            first = r->x0;
+            last = r->x1;
+            if (!ClipToVisible(display, y, &first, &last))
+                continue;
+            compared += last - first + 1;
+            offset = y*240;
+            if (display->ShadowValid && !DiffSpan(source + offset, display->ShadowSpace + offset, &first, &last))
+                continue;
+            memcpy(display->ShadowSpace + offset + first, source + offset + first, (last - first + 1)*2);
+            AddDirtyRect(changed, first, y, last, y);
+            differ += last - first + 1;
+            rows++;
+        }
+    }
+
+    if (!display->ShadowValid)
+    {
+        // nothing to compare with yet, it can be used once a whole screen has been sent
+        *changed = *region;
+        if ((region->count == 1) && (region->rect[0].x0 == 0) && (region->rect[0].y0 == 0) &&
+            (region->rect[0].x1 == 239) && (region->rect[0].y1 == 239))
+            display->ShadowValid = true;
+        return;
+    }
+
+    display->DiffUpdates++;
+    display->DiffCompared += compared;
+    display->DiffChanged += differ;
+    display->DiffRows += rows;
+    if (differ*100 > compared*display->DiffThreshold)
+    {
+        *changed = *region;
+        display->DiffFull++;
+    }
+    else
+        PlanDirtyRegion(changed);
+}
+
+
+// send a planned set of areas from a render space and count the bytes saved against a full update
+static void SendDirtyRegion(DisplayContext * display, const unsigned short * source, const DirtyRegion * region)
+{
+DirtyRegion changed;
+int i;
+unsigned long long sent;
+#ifdef C2PY_STATS
+long long start = NowNs();
+#endif
+
+    sent = display->FlushBytesSent;
+    if (display->ShadowSpace != NULL)
+    {
+        DiffRegion(display, source, region, &changed);
+        region = &changed;
+    }
+    if (display->TearingPin >= 0)
+        SendPacedRegion(display, source, region);
+    else
+        for (i = 0; i < region->count; i++)
+            SendVisibleRect(display, source, &region->rect[i]);
+    // against one full frame, several windows or paced bands can come to more than that, which saves nothing
+    sent = display->FlushBytesSent - sent;
+    if (sent < 240*240*2 + WINDOW_OVERHEAD)
+        display->FlushBytesSaved += (240*240*2 + WINDOW_OVERHEAD) - sent;
+#ifdef C2PY_STATS
+    StatSend(display, start);
+#endif
+}
+
+
+// the flush thread
+// waits for ScreenUpdateAsync to hand over a frame, sends it, and then signals it is done
+// there is one for each display that uses ScreenUpdateAsync, arg is the display
+static void * FlushThread(void * arg)
+{
+DisplayContext * display = (DisplayContext *) arg;
+
+    pthread_mutex_lock(&display->FlushLock);
+    while (!display->FlushThreadStop)
+    {
+        if (!display->FlushPending)
+        {
+            pthread_cond_wait(&display->FlushWake, &display->FlushLock);
+            continue;
+        }
+
+        // the SPI transfer happens without the lock held, the caller only waits if it needs the bus
+        pthread_mutex_unlock(&display->FlushLock);
+        SendDirtyRegion(display, display->FlushSpace, &display->FlushRegion);
+        SendScrollStart(display, display->FlushScrollStart);
+        pthread_mutex_lock(&display->FlushLock);
+
+        display->FlushPending = false;
+        pthread_cond_broadcast(&display->FlushDone);
+    }
+    pthread_mutex_unlock(&display->FlushLock);
+    return (NULL);
+}
+
+static bool StartFlushThread(DisplayContext * display)
+{
+    if (display->FlushThreadRunning)
+        return (true);
+
+    if (display->FlushSpace == NULL)
+    {
+        display->FlushSpace = (unsigned short *) malloc(240*240*2);
+        if (display->FlushSpace == NULL)
+        {
+            printf("Error unable to create flush space\n");
+            return (false);
+        }
+    }
+
+    display->FlushThreadStop = false;
+    display->FlushPending = false;
+    if (pthread_create(&display->FlushThreadId, NULL, FlushThread, display) != 0)
+    {
+        printf("Error unable to start the flush thread\n");
+        return (false);
+    }
+    display->FlushThreadRunning = true;
+    return (true);
+}
+
+static void StopFlushThread(DisplayContext * display)
+{
+    if (!display->FlushThreadRunning)
+        return;
+
+    pthread_mutex_lock(&display->FlushLock);
+    while (display->FlushPending)
+        pthread_cond_wait(&display->FlushDone, &display->FlushLock);
+    display->FlushThreadStop = true;
+    pthread_cond_signal(&display->FlushWake);
+    pthread_mutex_unlock(&display->FlushLock);
+
+    pthread_join(display->FlushThreadId, NULL);
+    display->FlushThreadRunning = false;
+}
+
+
+// WaitForFlush
+// blocks until the frame handed to the flush thread has been completely sent
+// anything that uses the SPI bus or changes how the render space is sent calls this first
+void WaitForFlush(DisplayContext * display)
+{
+    if (!display->FlushThreadRunning)
+        return;
+
+    pthread_mutex_lock(&display->FlushLock);
+    while (display->FlushPending)
+        pthread_cond_wait(&display->FlushDone, &display->FlushLock);
+    pthread_mutex_unlock(&display->FlushLock);
+}
+
+
+
+// low level ClearScreen
+// 
+// this optimised version can do over 600 full screen updated per minute when using the 
+// BCM2835_SPI_CLOCK_DIVIDER_4     = 4,       /*!< 4 = 62.5MHz on Rpi2, 100MHz on RPI3. Dont expect this speed to work reliably. */
+// on RPI3 this seems totally stable
+//
+//
+// This now supports the render space to allow background updates to occur prior to screen updates
+//
+void clearScreenDirect(DisplayContext * display, unsigned short bcolour)
+{
+    int i,y;
+    unsigned short * sourcePtr;
+
+    STATS_SCOPE(display, STAT_FILL);
+
+    if (display->RenderSpace !=NULL)
+    {
+        bcolour = ToRender(display, bcolour);
+        // only the visible part of each row, the corners are never sent
+        for (y=0;y<240;y++)
+        {
+            sourcePtr = display->RenderSpace + display->VisibleLeft[y] + y*240;
+            for (i=display->VisibleLeft[y];i<=display->VisibleRight[y];i++)
+            {
+                *(sourcePtr++) = bcolour;
+            }
+            COUNT_PIXELS(display, display->VisibleRight[y] - display->VisibleLeft[y] + 1);
+        }
+        MarkDirtyArea(display, 0,0,239,239);
+    }
+    ScreenUpdate(display);
+}
+
+
+// image conversion
+// 24 and 32 bit pixels are converted to 16 bit a row at a time, optionally with an ordered (Bayer) dither which
+// adds a little to each pixel in a fixed 4x4 pattern before the low bits are dropped, to break up the banding
+// in smooth gradients (BayerMatrix, above the screen updates). Without the dither the result is the same as RGBto16bit.
+
+// convert count pixels of pixelbytes each (3 or 4) with the red and blue at the given offsets and green at 1
+// the results go to dest as stored in the render space, swapped when panelorder is set. dither5 and dither6 are the
+// amounts to add for each pixel for the 5 and 6 bit colours, or NULL for no dither
+typedef void (*ConvertRowFunction)(unsigned short * dest, const unsigned char * source, int count, int pixelbytes,
+                                   int redoffset, int blueoffset, const unsigned char * dither5, const unsigned char * dither6,
+                                   bool panelorder);
+
+static void ConvertRowScalar(unsigned short * dest, const unsigned char * source, int count, int pixelbytes,
+                             int redoffset, int blueoffset, const unsigned char * dither5, const unsigned char * dither6,
+                             bool panelorder)
+{
+int x;
+unsigned int red,green,blue;
+
+    for (x = 0; x < count; x++)
+    {
+        red   = source[redoffset];
+        green = source[1];
+        blue  = source[blueoffset];
+        if (dither5 != NULL)
+        {
+            red   += dither5[x];
+            green += dither6[x];
+            blue  += dither5[x];
+            if (red > 255)   red = 255;
+            if (green > 255) green = 255;
+            if (blue > 255)  blue = 255;
+        }
+        dest[x] = ((red>>3)<<11) | ((green>>2)<<5) | (blue>>3);
+        if (panelorder)
+            dest[x] = SwapBytes(dest[x]);
+        source += pixelbytes;
+    }
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+// which byte of which 16 byte block holds each colour of each pixel, 0x80 gives 0 in pshufb. The byte of colour c
+// of pixel p in block b is p*size + c - b*16. Fixed data so any number of threads can use it
+static const unsigned char ConvertGathers[2][3][4][16] =     // [3 or 4 byte pixels][colour offset][which 16 bytes][pixel]
+{
+    {   // 3 byte pixels
+        {
+            {0x00,0x03,0x06,0x09,0x0C,0x0F,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x02,0x05,0x08,0x0B,0x0E,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x01,0x04,0x07,0x0A,0x0D},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80}
+        },
+        {
+            {0x01,0x04,0x07,0x0A,0x0D,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x00,0x03,0x06,0x09,0x0C,0x0F,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x02,0x05,0x08,0x0B,0x0E},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80}
+        },
+        {
+            {0x02,0x05,0x08,0x0B,0x0E,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x01,0x04,0x07,0x0A,0x0D,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x00,0x03,0x06,0x09,0x0C,0x0F},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80}
+        }
+    },
+    {   // 4 byte pixels
+        {
+            {0x00,0x04,0x08,0x0C,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x00,0x04,0x08,0x0C,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x00,0x04,0x08,0x0C,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x00,0x04,0x08,0x0C}
+        },
+        {
+            {0x01,0x05,0x09,0x0D,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x01,0x05,0x09,0x0D,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x01,0x05,0x09,0x0D,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x01,0x05,0x09,0x0D}
+        },
+        {
+            {0x02,0x06,0x0A,0x0E,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x02,0x06,0x0A,0x0E,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x02,0x06,0x0A,0x0E,0x80,0x80,0x80,0x80},
+            {0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x02,0x06,0x0A,0x0E}
+        }
+    }
+};
+
+// 16 pixels at a time. pshufb (SSSE3) gathers each colour from the packed pixels into its own register,
+// the processor is checked before this is used
+__attribute__((target("ssse3")))
+static void ConvertRowSSSE3(unsigned short * dest, const unsigned char * source, int count, int pixelbytes,
+                            int redoffset, int blueoffset, const unsigned char * dither5, const unsigned char * dither6,
+                            bool panelorder)
+{
+const unsigned char (*gather)[4][16];
+__m128i block[4],colour[3],red,green,blue,low,high,zero;
+int x,c,part;
+
+    gather = ConvertGathers[pixelbytes-3];
+
+    zero = _mm_setzero_si128();
+    for (x = 0; x + 16 <= count; x += 16)
+    {
+        for (part = 0; part < pixelbytes; part++)
+            block[part] = _mm_loadu_si128((const __m128i *)(source + x*pixelbytes + part*16));
+        for (c = 0; c < 3; c++)
+        {
+            colour[c] = zero;
+            for (part = 0; part < pixelbytes; part++)
+                colour[c] = _mm_or_si128(colour[c], _mm_shuffle_epi8(block[part], _mm_loadu_si128((const __m128i *)gather[c][part])));
+        }
+        red   = colour[redoffset];
+        green = colour[1];
+        blue  = colour[blueoffset];
+        if (dither5 != NULL)
+        {
+            red   = _mm_adds_epu8(red,   _mm_loadu_si128((const __m128i *)(dither5 + x)));
+            green = _mm_adds_epu8(green, _mm_loadu_si128((const __m128i *)(dither6 + x)));
+            blue  = _mm_adds_epu8(blue,  _mm_loadu_si128((const __m128i *)(dither5 + x)));
+        }
+        // drop the low bits while still bytes, then spread to 16 bits and put together
+        red   = _mm_and_si128(red,   _mm_set1_epi8((char)0xF8));
+        green = _mm_and_si128(green, _mm_set1_epi8((char)0xFC));
+        blue  = _mm_srli_epi16(_mm_and_si128(blue, _mm_set1_epi8((char)0xF8)), 3);
+
+        low  = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_unpacklo_epi8(red, zero), 8),
+                                         _mm_slli_epi16(_mm_unpacklo_epi8(green, zero), 3)), _mm_unpacklo_epi8(blue, zero));
+        high = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_unpackhi_epi8(red, zero), 8),
+                                         _mm_slli_epi16(_mm_unpackhi_epi8(green, zero), 3)), _mm_unpackhi_epi8(blue, zero));
+        if (panelorder)
+        {
+            low  = _mm_or_si128(_mm_slli_epi16(low, 8),  _mm_srli_epi16(low, 8));
+            high = _mm_or_si128(_mm_slli_epi16(high, 8), _mm_srli_epi16(high, 8));
+        }
+        _mm_storeu_si128((__m128i *)(dest + x), low);
+        _mm_storeu_si128((__m128i *)(dest + x + 8), high);
+    }
+    ConvertRowScalar(dest + x, source + x*pixelbytes, count - x, pixelbytes, redoffset, blueoffset,
+                     (dither5 != NULL) ? dither5 + x : NULL, (dither6 != NULL) ? dither6 + x : NULL, panelorder);
+}
+#endif
+
+#if defined(__ARM_NEON)
+// 16 pixels at a time, vld3/vld4 separate the colours as they load
+static void ConvertRowNEON(unsigned short * dest, const unsigned char * source, int count, int pixelbytes,
+                           int redoffset, int blueoffset, const unsigned char * dither5, const unsigned char * dither6,
+                           bool panelorder)
+{
+uint8x16x3_t three;
+uint8x16x4_t four;
+uint8x16_t colour[3],red,green,blue;
+uint16x8_t low,high;
+int x;
+
+    for (x = 0; x + 16 <= count; x += 16)
+    {
+        if (pixelbytes == 3)
+        {
+            three = vld3q_u8(source + x*3);
+            colour[0] = three.val[0];
+            colour[1] = three.val[1];
+            colour[2] = three.val[2];
+        }
+        else
+        {
+            four = vld4q_u8(source + x*4);
+            colour[0] = four.val[0];
+            colour[1] = four.val[1];
+            colour[2] = four.val[2];
+        }
+        red   = colour[redoffset];
+        green = colour[1];
+        blue  = colour[blueoffset];
+        if (dither5 != NULL)
+        {
+            red   = vqaddq_u8(red,   vld1q_u8(dither5 + x));
+            green = vqaddq_u8(green, vld1q_u8(dither6 + x));
+            blue  = vqaddq_u8(blue,  vld1q_u8(dither5 + x));
+        }
+        // the usual NEON packing, red in the top then green and blue shifted in below it
+        low  = vshll_n_u8(vget_low_u8(red), 8);
+        low  = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(green), 8), 5);
+        low  = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(blue), 8), 11);
+        high = vshll_n_u8(vget_high_u8(red), 8);
+        high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(green), 8), 5);
+        high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(blue), 8), 11);
+        if (panelorder)
+        {
+            low  = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(low)));
+            high = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(high)));
+        }
+        vst1q_u16(dest + x, low);
+        vst1q_u16(dest + x + 8, high);
+    }
+    ConvertRowScalar(dest + x, source + x*pixelbytes, count - x, pixelbytes, redoffset, blueoffset,
+                     (dither5 != NULL) ? dither5 + x : NULL, (dither6 != NULL) ? dither6 + x : NULL, panelorder);
+}
+#endif
+
+static ConvertRowFunction ConvertRow = NULL;
+
+static void ChooseConvertKernel(void)
+{
+    ConvertRow = ConvertRowScalar;
+#if defined(__ARM_NEON)
+    ConvertRow = ConvertRowNEON;
+#elif defined(__SSE2__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("ssse3"))
+        ConvertRow = ConvertRowSSSE3;
+#endif
+}
+
+
+// DrawImageRows
+// the common part of the image loading, places a width x height image with its top left at x,y and crops
+// whatever is off screen. row points at the top row and stride is the bytes from one row to the next,
+// negative for images stored bottom row first
+static void DrawImageRows(DisplayContext * display, const unsigned char * row, int stride, int width, int height, int format, int x, int y, bool dither)
+{
+int pixelbytes,redoffset,blueoffset;
+int firstcol,lastcol,count,line,col,screeny,left,right;
+unsigned char dither5[240],dither6[240];
+const unsigned char * sourcePtr;
+unsigned short * destPtr;
+
+    if ((display->RenderSpace == NULL) || (width <= 0) || (height <= 0))
+        return;
+    if (ConvertRow == NULL)
+        ChooseConvertKernel();
+
+    switch (format)
+    {
+        case IMAGE_RGB888:    pixelbytes = 3; redoffset = 0; blueoffset = 2; break;
+        case IMAGE_BGR888:    pixelbytes = 3; redoffset = 2; blueoffset = 0; break;
+        case IMAGE_RGBA8888:  pixelbytes = 4; redoffset = 0; blueoffset = 2; break;
+        case IMAGE_BGRA8888:  pixelbytes = 4; redoffset = 2; blueoffset = 0; break;
+        case IMAGE_RGB565:
+        case IMAGE_RGB565_BE: pixelbytes = 2; redoffset = 0; blueoffset = 0; break;
+        default:
+            printf("unknown image format %d\n", format);
+            return;
+    }
+
+    firstcol = (x < 0) ? -x : 0;
+    lastcol  = ((x + width) > 240) ? (239 - x) : (width - 1);
+    if (firstcol > lastcol)
+        return;
+
+    for (line = 0; line < height; line++)
+    {
+        screeny = y + line;
+        if ((screeny < 0) || (screeny > 239))
+            continue;
+        // only the part of the row inside the circle
+        left = x + firstcol;
+        right = x + lastcol;
+        if (!ClipToDrawable(display, screeny, &left, &right))
+            continue;
+        count = right - left + 1;
+        sourcePtr = row + (long)line*stride + (left - x)*pixelbytes;
+        destPtr = display->RenderSpace + left + screeny*240;
+        COUNT_PIXELS(display, count);
+
+        if (pixelbytes == 2)
+        {
+            // already 16 bit, just needs to end up in the right byte order
+            if ((format == IMAGE_RGB565_BE) == display->PanelByteOrder)
+                memcpy(destPtr, sourcePtr, count*2);
+            else
+                for (col = 0; col < count; col++)
+                    destPtr[col] = sourcePtr[col*2+1] | (sourcePtr[col*2]<<8);
+            continue;
+        }
+
+        if (dither)
+        {
+            // the pattern is fixed to the screen, so images placed at different offsets still line up
+            for (col = 0; col < count; col++)
+            {
+                dither5[col] = BayerMatrix[screeny & 3][(left + col) & 3] >> 1;
+                dither6[col] = BayerMatrix[screeny & 3][(left + col) & 3] >> 2;
+            }
+        }
+        ConvertRow(destPtr, sourcePtr, count, pixelbytes, redoffset, blueoffset, dither ? dither5 : NULL, dither ? dither6 : NULL,
+                   display->PanelByteOrder);
+    }
+    MarkDrawnArea(display, x, y, x + width - 1, y + height - 1);
+}
+
+
+// LoadRawImage
+// draws an image of plain pixels with no header, packed with no gaps between rows, with its top left at x,y
+// see the IMAGE_ formats in the header. Anything off screen is cropped, and it is not sent to the screen until the next update
+void LoadRawImage(DisplayContext * display, const unsigned char * data, unsigned short width, unsigned short height, int format, short x, short y, bool bottomup, bool dither)
+{
+int pixelbytes,stride;
+
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    pixelbytes = ((format == IMAGE_RGB565) || (format == IMAGE_RGB565_BE)) ? 2 :
+                 ((format == IMAGE_RGBA8888) || (format == IMAGE_BGRA8888)) ? 4 : 3;
+    stride = width * pixelbytes;
+    if (bottomup)
+        DrawImageRows(display, data + (long)(height - 1)*stride, -stride, width, height, format, x, y, dither);
+    else
+        DrawImageRows(display, data, stride, width, height, format, x, y, dither);
+}
+
+
+static inline unsigned int ReadLE16(const unsigned char * data)
+{
+    return (data[0] | (data[1]<<8));
+}
+
+static inline unsigned int ReadLE32(const unsigned char * data)
+{
+    return (data[0] | (data[1]<<8) | (data[2]<<16) | ((unsigned int)data[3]<<24));
+}
+
+// LoadBMP
+// draws a 24 or 32 bit uncompressed BMP file of any size with its top left at x,y
+// both the usual bottom up and top down (negative height) files are handled
+// length is the size of the data, used to check the file is complete, or 0 to trust the header
+bool LoadBMP(DisplayContext * display, const unsigned char * data, unsigned int length, short x, short y, bool dither)
+{
+unsigned int offset,headersize,bits,compression;
+int width,height,rows,stride;
+
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    if ((length != 0) && (length < 54))
+    {
+        printf("not a valid BMP image, too short\n");
+        return (false);
+    }
+    offset      = ReadLE32(data + 10);
+    headersize  = ReadLE32(data + 14);
+    width       = (int)ReadLE32(data + 18);
+    height      = (int)ReadLE32(data + 22);
+    bits        = ReadLE16(data + 28);
+    compression = ReadLE32(data + 30);
+
+    // nothing real is bigger than 32767 pixels either way, which keeps the row size well inside an int
+    if ((data[0] != 'B') || (data[1] != 'M') || (headersize < 40) || (width <= 0) || (width > 32767) ||
+        (height == 0) || (height < -32767) || (height > 32767))
+    {
+        printf("not a valid BMP image\n");
+        return (false);
+    }
+    rows = (height > 0) ? height : -height;
+    // bit fields have three masks after the 54 byte headers
+    if ((compression == 3) && (length != 0) && (length < 66))
+    {
+        printf("not a valid BMP image, too short\n");
+        return (false);
+    }
+    // 32 bit files are often marked as bit fields, which is fine as long as they are the usual layout
+    if (!(((bits == 24) && (compression == 0)) ||
+          ((bits == 32) && ((compression == 0) ||
+                            ((compression == 3) && (ReadLE32(data + 54) == 0x00FF0000) &&
+                             (ReadLE32(data + 58) == 0x0000FF00) && (ReadLE32(data + 62) == 0x000000FF))))))
+    {
+        printf("only uncompressed 24 and 32 bit BMP images are supported\n");
+        return (false);
+    }
+
+    // each row is padded to a multiple of 4 bytes
+    stride = ((width * bits + 31) / 32) * 4;
+    if ((length != 0) && (((unsigned long long)offset + (unsigned long long)stride * rows) > length))
+    {
+        printf("BMP image is incomplete\n");
+        return (false);
+    }
+
+    if (height > 0)
+        DrawImageRows(display, data + offset + (size_t)(height - 1)*stride, -stride, width, height,
+                      (bits == 24) ? IMAGE_BGR888 : IMAGE_BGRA8888, x, y, dither);
+    else
+        DrawImageRows(display, data + offset, stride, width, rows,
+                      (bits == 24) ? IMAGE_BGR888 : IMAGE_BGRA8888, x, y, dither);
+    return (true);
+}
+
+
+// writing a BMP 24bit 240x240 image from the raw data
+// this now takes any BMP that LoadBMP can, and then updates the screen if asked
+void RGB240x240Direct(DisplayContext * display, unsigned char * rawdata,bool update  )
+{
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    if (LoadBMP(display, rawdata, 0, 0, 0, false) && update)
+        ScreenUpdate(display);
+}
+
+// makes a copy of the render space to a buffer
+// only created the reference image space if this is used 
+// as most time the python code would not need it
+void SetRefernceImage(DisplayContext * display)
+{
+    if(display->ReferenceSpace ==NULL)
+    {
+        display->ReferenceSpace = (unsigned short *)malloc(240*240*2);
+        if(display->ReferenceSpace ==NULL)
+        {
+            printf("Error unable to create reference space\n");
+        }
+    }
+         
+    if ((display->RenderSpace !=NULL) && (display->ReferenceSpace !=NULL))
+    {
+        memcpy(display->ReferenceSpace,display->RenderSpace,240*240*2);
+        display->ReferenceDamage.count = 0;
+    }
+}
+
+
+//restore the reference to the render space
+// only the areas drawn over since the reference was set or last restored need copying back
+// and those same areas are then marked for the next ScreenUpdateDirty
+void RestoreReferenceImage(DisplayContext * display)
+{
+int i,y,offset,first,last;
+DirtyRect * r;
+
+    STATS_SCOPE(display, STAT_RESTORE);
+
+    if ((display->RenderSpace !=NULL) && (display->ReferenceSpace !=NULL))
+    {
+        for (i = 0; i < display->ReferenceDamage.count; i++)
+        {
+            r = &display->ReferenceDamage.rect[i];
+            for (y = r->y0; y <= r->y1; y++)
+            {
+                first = r->x0;
+                last = r->x1;
+                if (!ClipToVisible(display, y, &first, &last))
+                    continue;
+                offset = first + y*240;
+                memcpy(display->RenderSpace+offset, display->ReferenceSpace+offset, (last - first + 1)*2);
+                COUNT_PIXELS(display, last - first + 1);
+            }
+            AddDirtyRect(&display->ScreenDamage, r->x0, r->y0, r->x1, r->y1);
+        }
+        display->ReferenceDamage.count = 0;
+    }
+}
+
+
+
+
+// SetScreenWriteArea
+// define the start and end pixels to be updated
+// note these are inclusive values
+// i.e. writing will be from Xstart up to and including Xend and same for the Y axis
+// hence full screen is 0,0 to 239,239
+void SetScreenWriteArea(DisplayContext * display, unsigned char Xstart,unsigned char Ystart,unsigned char Xend,unsigned char Yend)
+{
+    WaitForFlush(display);
+    BusWriteArea(display, Xstart, Ystart, Xend, Yend);
+}
+
+
+// SetPixelDirect
+// individual pixel setting, this is direct and updates the screen immediatle
+// use this for updating direct to the screen (use for small changes)
+// work on the Render space and do screen update for large changes
+void  SetPixelDirect(DisplayContext * display, unsigned short xpos, unsigned short ypos, unsigned short colour)
+{
+unsigned int pixel;
+unsigned char bytes[2];
+
+    STATS_SCOPE(display, STAT_PIXEL);
+
+    if((xpos>239) || (ypos>239))
+        printf("SetPixel writing to invalid\n");
+    else
+    {
+        WaitForFlush(display);
+        SetScreenWriteArea(display, xpos, ypos, xpos, ypos);     // single pixel window
+        if (display->TransferBits == 12)
+        {
+            // one RGB444 pixel and 4 spare bits
+            pixel = ToRGB444(colour, xpos, ypos, display->TransferDither);
+            bytes[0] = pixel>>4;
+            bytes[1] = (pixel&0xf)<<4;
+            sdoDataBuffer(display, bytes, 2);
+        }
+        else
+            sdoDataU16(display, colour);                         // write the data value
+
+        // this makes sure the render image is kept in sync with the direct updates
+        display->RenderSpace[(xpos)+(ypos)*240]=ToRender(display, colour);
+        if (display->ShadowSpace != NULL)
+            display->ShadowSpace[(xpos)+(ypos)*240] = display->RenderSpace[(xpos)+(ypos)*240];
+        COUNT_PIXELS(display, 1);
+
+        // the screen is already up to date, but the render space no longer matches the reference
+        AddDirtyRect(&display->ReferenceDamage, xpos, ypos, xpos, ypos);
+    }
+}
+
+
+// PlotPixel
+// the checked pixel write used inside the drawing routines, anything outside the clip rectangle is left out
+// the routines record their own changed area once, rather than per pixel as SetPixel does
+static inline void PlotPixel(DisplayContext * display, int xpos, int ypos, unsigned short colour)
+{
+    if((xpos>=display->ClipX0)&&(xpos<=display->ClipX1)&&(ypos>=display->ClipY0)&&(ypos<=display->ClipY1))
+    {
+        display->RenderSpace[xpos+ypos*240]=ToRender(display, colour);
+        COUNT_PIXELS(display, 1);
+    }
+   // else
+   //     printf("trying to write outside screen\n");
+}
+
+
+// the same with the colour already as stored and the clip rectangle passed in
+static inline void PlotInside(unsigned short * space, const DirtyRect * clip, int xpos, int ypos, unsigned short stored)
+{
+    if((xpos>=clip->x0)&&(xpos<=clip->x1)&&(ypos>=clip->y0)&&(ypos<=clip->y1))
+        space[xpos+ypos*240]=stored;
+}
+
+
+// SetPixel
+// updates a pixel in the renderspace with checking to make sure the co-ordinates are valid
+// this prevents screen wrap round or invalid memory access
+void SetPixel(DisplayContext * display, short xpos, short ypos, unsigned short colour)
+{
+    STATS_SCOPE(display, STAT_PIXEL);
+
+    PlotPixel(display, xpos, ypos, colour);
+    MarkDrawnArea(display, xpos, ypos, xpos, ypos);
+}
+
+
+// GetPixel
+// reads back a pixel from the render space, returns 0 if outside the screen
+unsigned short GetPixel(DisplayContext * display, short xpos, short ypos)
+{
+    if((display->RenderSpace!=NULL)&&(xpos>=0)&&(xpos<240)&&(ypos>=0)&&(ypos<240))
+        return (FromRender(display, display->RenderSpace[xpos+ypos*240]));
+    return (0);
+}
+
+
+// GetRenderSpace
+// hands out the render space itself, so Python can build a frame in it with numpy or PIL (see renderspace.py)
+// without a copy or a conversion. It is there from initCircularDisp until exitBCMHardware, NULL otherwise.
+// what is written there is not seen by the drawing commands' tracking, so mark it with MarkDirtyArea
+// (or send it all with ScreenUpdate), and as the panel's byte order if SetPanelByteOrder is on
+unsigned short * GetRenderSpace(DisplayContext * display, short * width, short * height, short * stride, bool * panelorder)
+{
+    WaitForFlush(display);
+    *width = 240;
+    *height = 240;
+    *stride = 240;
+    *panelorder = display->PanelByteOrder;
+    return (display->RenderSpace);
+}
+
+
+// SetPanelByteOrder
+// selects whether the render space is kept in the display's byte order (true) or the native order (false)
+// any existing render and reference images are converted, so the picture is unchanged
+void SetPanelByteOrder(DisplayContext * display, bool panelorder)
+{
+int i;
+
+    if (panelorder == display->PanelByteOrder)
+        return;
+
+    WaitForFlush(display);
+
+    for (i = 0; i < 240*240; i++)
+    {
+        if (display->RenderSpace != NULL)
+            display->RenderSpace[i] = SwapBytes(display->RenderSpace[i]);
+        if (display->ReferenceSpace != NULL)
+            display->ReferenceSpace[i] = SwapBytes(display->ReferenceSpace[i]);
+    }
+    display->PanelByteOrder = panelorder;
+    display->ShadowValid = false;
+}
+
+
+// SetCircularMask
+// with the mask on (the default) the corners outside the round panel are skipped by the fills, image copies and
+// screen updates. Turn it off for a square panel, or to use the whole render space for something else.
+// the corners are not kept up to date while it is on, so redraw before turning it off
+void SetCircularMask(DisplayContext * display, bool enable)
+{
+    if (enable == display->CircularMask)
+        return;
+
+    WaitForFlush(display);
+    display->CircularMask = enable;
+    display->ShadowValid = false;       // the corners were not kept
+    BuildVisibleSpans(display);
+    MarkDirtyArea(display, 0, 0, 239, 239);
+}
+
+
+// PushClipRect
+// keeps all the drawing inside x0,y0 to x1,y1 (inclusive) until PopClipRect, so a widget can draw into its own part of
+// the screen without touching the rest. The area is also kept inside any clip rectangle already set, so they can nest.
+// returns false if too many are pushed (CLIP_DEPTH), the clip is then left as it was
+bool PushClipRect(DisplayContext * display, short x0, short y0, short x1, short y1)
+{
+DirtyRect * saved;
+
+    if (display->ClipDepth >= CLIP_DEPTH)
+    {
+        printf("PushClipRect too many clip rectangles\n");
+        return (false);
+    }
+
+    saved = &display->ClipStack[display->ClipDepth++];
+    saved->x0 = display->ClipX0;
+    saved->y0 = display->ClipY0;
+    saved->x1 = display->ClipX1;
+    saved->y1 = display->ClipY1;
+    // an empty area is kept as one, so nothing is drawn
+    display->ClipX0 = (x0 > saved->x0) ? x0 : saved->x0;
+    display->ClipY0 = (y0 > saved->y0) ? y0 : saved->y0;
+    display->ClipX1 = (x1 < saved->x1) ? x1 : saved->x1;
+    display->ClipY1 = (y1 < saved->y1) ? y1 : saved->y1;
+    BuildDrawSpans(display);
+    return (true);
+}
+
+// PopClipRect
+// goes back to the clip rectangle before the last PushClipRect, the whole render space once they are all popped
+void PopClipRect(DisplayContext * display)
+{
+DirtyRect * saved;
+
+    if (display->ClipDepth == 0)
+        return;
+
+    saved = &display->ClipStack[--display->ClipDepth];
+    display->ClipX0 = saved->x0;
+    display->ClipY0 = saved->y0;
+    display->ClipX1 = saved->x1;
+    display->ClipY1 = saved->y1;
+    BuildDrawSpans(display);
+}
+
+
+// hardware scrolling
+// the GC9A01 can show a band of its rows turned round by any number of rows, as a ring, so a ticker or a list moves
+// by sending just the rows coming into view instead of the whole band. The render space is not moved, it stays the
+// same as the panel's memory, so the new rows are drawn wherever ScrollRow says that screen row is kept.
+// scrolling by a number of rows that divides into the area keeps each step's new rows in one piece of the render space.
+// the panel scrolls along its own lines, which are the screen's columns in orientations 0 and 1 (those swap rows
+// and columns), so it is only used in orientations 2 and 3. In 3 (MY set) the panel's lines run bottom up
+
+// the panel line the scrolling area starts on
+static int ScrollFirstLine(DisplayContext * display)
+{
+    if (display->ScrollCount == 0)
+        return (0);
+    return ((display->Orientation == 3) ? 240 - display->ScrollTop - display->ScrollCount : display->ScrollTop);
+}
+
+// SetScrollArea
+// rows top to top+count-1 become the scrolling area, showing the render space as it is. count 0 stops the scrolling.
+// the area is marked to be sent by the next update, as its rows can now be shown further out at the sides.
+// call after initBCMHardware, returns false if the rows are not on the screen or the orientation cannot scroll
+bool SetScrollArea(DisplayContext * display, short top, short count)
+{
+unsigned char area[6];
+int first,lines;
+
+    if ((display->Orientation == 0) || (display->Orientation == 1))
+    {
+        printf("SetScrollArea the panel scrolls sideways in orientation %d\n", display->Orientation);
+        return (false);
+    }
+    if ((top < 0) || (count < 0) || ((top + count) > 240))
+    {
+        printf("SetScrollArea rows %d to %d are not on the screen\n", top, top + count - 1);
+        return (false);
+    }
+    if (!display->HardwareOpen)
+    {
+        printf("SetScrollArea needs the hardware to be initialised first\n");
+        return (false);
+    }
+
+    WaitForFlush(display);
+    display->ScrollTop = (count == 0) ? 0 : top;
+    display->ScrollCount = count;
+    display->ScrollOffset = 0;
+    first = ScrollFirstLine(display);
+    display->ScrollStart = first;
+
+    // top fixed lines, scrolling lines and bottom fixed lines, adding up to the 240 lines of the panel
+    // with no scrolling it is all one area that is never moved
+    lines = (count == 0) ? 240 : count;
+    area[0] = first>>8;
+    area[1] = first&0xff;
+    area[2] = lines>>8;
+    area[3] = lines&0xff;
+    area[4] = (240 - first - lines)>>8;
+    area[5] = (240 - first - lines)&0xff;
+    sdoCmdU8(display, 0x33);    // Vertical Scrolling Definition
+    sdoDataBuffer(display, area, 6);
+    display->ScrollSent = -1;
+    SendScrollStart(display, first);
+
+    BuildVisibleSpans(display);
+    if (count != 0)
+        MarkDirtyArea(display, 0, top, 239, top + count - 1);
+    return (true);
+}
+
+// ScrollArea
+// moves what the scrolling area shows up by lines rows, or down if it is negative. The rows coming into view are
+// filled with colour and marked to be sent by the next screen update, which then sends the new start address after
+// them so they are never seen before they are drawn. Returns the render space row of the first new row (the top one)
+// for drawing on, or -1 with no scrolling area
+short ScrollArea(DisplayContext * display, short lines, unsigned short colour)
+{
+int count,fresh,screenrow,row,i,x;
+unsigned short * destPtr;
+
+    STATS_SCOPE(display, STAT_FILL);
+
+    count = display->ScrollCount;
+    if ((count == 0) || (display->RenderSpace == NULL))
+        return (-1);
+
+    fresh = abs(lines);
+    if (fresh > count)
+        fresh = count;
+    screenrow = (lines > 0) ? display->ScrollTop + count - fresh : display->ScrollTop;
+
+    display->ScrollOffset = (((display->ScrollOffset + lines) % count) + count) % count;
+    display->ScrollStart = ScrollFirstLine(display) +
+                           ((display->Orientation == 3) ? (count - display->ScrollOffset) % count : display->ScrollOffset);
+
+    colour = ToRender(display, colour);
+    for (i = 0; i < fresh; i++)
+    {
+        row = ScrollRow(display, screenrow + i);
+        destPtr = display->RenderSpace + display->VisibleLeft[row] + row*240;
+        for (x = display->VisibleLeft[row]; x <= display->VisibleRight[row]; x++)
+            *(destPtr++) = colour;
+        COUNT_PIXELS(display, display->VisibleRight[row] - display->VisibleLeft[row] + 1);
+        MarkDirtyArea(display, display->VisibleLeft[row], row, display->VisibleRight[row], row);
+    }
+    return (ScrollRow(display, screenrow));
+}
+
+// ScrollRow
+// the render space row that is shown on a row of the screen, the same row outside the scrolling area
+short ScrollRow(DisplayContext * display, short row)
+{
+    if ((row < display->ScrollTop) || (row >= (display->ScrollTop + display->ScrollCount)))
+        return (row);
+    return (display->ScrollTop + (row - display->ScrollTop + display->ScrollOffset) % display->ScrollCount);
+}
+
+
+// DrawCircle
+//
+// indirect circle writing
+// this stores the data in the Render space only
+// use the ScreenUpdate to output this and any other updates
+// note use of shorts for x,y to allow for circle origins outside of the screen 
+void DrawCircle (DisplayContext * display, short x0, short y0, short r, unsigned short colour)
+{
+int a=0;
+int b=r;
+unsigned short * centre;
+DirtyRect clip;
+
+    STATS_SCOPE(display, STAT_CIRCLE);
+
+    // nothing to draw if it is all outside the clip rectangle, and no checks on the pixels if it is all inside
+    if ((r < 0) || ((x0+r) < display->ClipX0) || ((x0-r) > display->ClipX1) || ((y0+r) < display->ClipY0) || ((y0-r) > display->ClipY1))
+        return;
+    MarkDrawnArea(display, x0-r, y0-r, x0+r, y0+r);
+    if (((x0-r) >= display->ClipX0) && ((x0+r) <= display->ClipX1) && ((y0-r) >= display->ClipY0) && ((y0+r) <= display->ClipY1))
+    {
+        colour = ToRender(display, colour);
+        centre = display->RenderSpace + x0 + y0*240;
+        while(a<=b)
+        {
+            centre[-b - a*240] = colour;
+            centre[ b - a*240] = colour;
+            centre[-a + b*240] = colour;
+            centre[-a - b*240] = colour;
+            centre[ b + a*240] = colour;
+            centre[ a - b*240] = colour;
+            centre[ a + b*240] = colour;
+            centre[-b + a*240] = colour;
+            COUNT_PIXELS(display, 8);
+            a+=1;
+            if((a*a+b*b)>(r*r))
+                b-=1;
+        }
+        return;
+    }
+
+    // otherwise each pixel is checked, against a copy of the clip so it is not read back after every write
+    colour = ToRender(display, colour);
+    clip.x0 = display->ClipX0;
+    clip.y0 = display->ClipY0;
+    clip.x1 = display->ClipX1;
+    clip.y1 = display->ClipY1;
+    while(a<=b)
+    {
+        PlotInside(display->RenderSpace, &clip, (x0-b),(y0-a),colour);
+        PlotInside(display->RenderSpace, &clip, (x0+b),(y0-a),colour);
+        PlotInside(display->RenderSpace, &clip, (x0-a),(y0+b),colour);
+        PlotInside(display->RenderSpace, &clip, (x0-a),(y0-b),colour);
+        PlotInside(display->RenderSpace, &clip, (x0+b),(y0+a),colour);
+        PlotInside(display->RenderSpace, &clip, (x0+a),(y0-b),colour);
+        PlotInside(display->RenderSpace, &clip, (x0+a),(y0+b),colour);
+        PlotInside(display->RenderSpace, &clip, (x0-b),(y0+a),colour);
+        COUNT_PIXELS(display, 8);              // counted before the clipping
+        a+=1;
+        if((a*a+b*b)>(r*r))
+            b-=1;
+    }
+}
+
+
+// DrawRectangle
+// draw a box in the render space
+void DrawRectangle(DisplayContext * display, short Xstart,short Ystart, short Xend, short Yend, unsigned short colour)
+{
+
+    STATS_SCOPE(display, STAT_LINE);
+
+    // note we can use integer maths routines here as the lines are by defintion horizontal or vertical.
+
+    // first the two horrizonal lines
+    DrawLineIntMaths(display, Xstart,Ystart,Xend,Ystart,colour);
+    DrawLineIntMaths(display, Xstart,Yend,Xend,Yend,colour);
+    // then the two vertical ones
+    DrawLineIntMaths(display, Xstart,Ystart,Xstart,Yend,colour);
+    DrawLineIntMaths(display, Xend,Ystart,Xend,Yend,colour);
+
+}
+
+
+// BlitRGB565
+// copies a block of 16 bit pixels into the render space with its top left corner at x,y
+// the pixels are little endian byte pairs, as a Python array('H') or numpy uint16 array holds them
+// any part off screen is clipped
+void BlitRGB565(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, const unsigned char * pixels)
+{
+int row,col,firstcol,lastcol,left,right;
+const unsigned char * sourcePtr;
+unsigned short * destPtr;
+
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    if ((display->RenderSpace == NULL) || (width == 0) || (height == 0))
+        return;
+
+    firstcol = (x < 0) ? -x : 0;
+    lastcol  = ((x + width) > 240) ? (239 - x) : (width - 1);
+    if (firstcol > lastcol)
+        return;
+
+    for (row = 0; row < height; row++)
+    {
+        if (((y + row) < 0) || ((y + row) > 239))
+            continue;
+        left = x + firstcol;
+        right = x + lastcol;
+        if (!ClipToDrawable(display, y + row, &left, &right))
+            continue;
+        sourcePtr = pixels + (row*width + left - x)*2;
+        destPtr = display->RenderSpace + left + (y + row)*240;
+        COUNT_PIXELS(display, right - left + 1);
+        for (col = left; col <= right; col++)
+        {
+            *(destPtr++) = ToRender(display, sourcePtr[0] | (sourcePtr[1]<<8));
+            sourcePtr += 2;
+        }
+    }
+    MarkDrawnArea(display, x, y, x + width - 1, y + height - 1);
+}
+
+
+// pixel mixing
+// each of red green and blue is mixed as (new * intensity + old * (256 - intensity) + 128) / 256, where
+// 256 is 100% intensity, and anything over 245 (95%) just takes the new colour.
+// the largest value is 63 * 256 + 128 so this all fits in 16 bits, which lets the vector versions do 8 or 16 at a time
+static inline unsigned short BlendPixel(unsigned short current, unsigned short colour, unsigned int intensity)
+{
+unsigned int oldintensity;
+
+    if (intensity>245)  // if more than 95% just assume 100%
+        return (colour);
+
+    oldintensity = 256 - intensity;
+    return ( (((((colour>>11)     )*intensity + ((current>>11)     )*oldintensity + 128)>>8)<<11)
+           | (((((colour>>5 )&0x3F)*intensity + ((current>>5 )&0x3F)*oldintensity + 128)>>8)<<5 )
+           |  ((((colour     )&0x1F)*intensity + ((current     )&0x1F)*oldintensity + 128)>>8) );
+}
+
+
+// blend spans
+// mixes count pixels of the render space at dest with either a single colour (source NULL) or a row of colours,
+// using either one intensity for them all (coverage NULL) or one per pixel. The colours are normal 16 bit values
+// and dest is as stored in the render space, so swapped when panelorder (the display's PanelByteOrder) is set.
+typedef void (*BlendSpanFunction)(unsigned short * dest, const unsigned short * source, unsigned short colour,
+                                  const unsigned short * coverage, unsigned short intensity, int count, bool panelorder);
+
+static void BlendSpanScalar(unsigned short * dest, const unsigned short * source, unsigned short colour,
+                            const unsigned short * coverage, unsigned short intensity, int count, bool panelorder)
+{
+int x;
+
+    for (x = 0; x < count; x++)
+    {
+        if (source != NULL)
+            colour = source[x];
+        if (coverage != NULL)
+            intensity = coverage[x];
+        if (panelorder)
+            dest[x] = SwapBytes(BlendPixel(SwapBytes(dest[x]), colour, intensity));
+        else
+            dest[x] = BlendPixel(dest[x], colour, intensity);
+    }
+}
+
+#if defined(__SSE2__)
+// 8 pixels at a time in 16 bit lanes
+static void BlendSpanSSE2(unsigned short * dest, const unsigned short * source, unsigned short colour,
+                          const unsigned short * coverage, unsigned short intensity, int count, bool panelorder)
+{
+const __m128i mask5 = _mm_set1_epi16(0x1F);
+const __m128i mask6 = _mm_set1_epi16(0x3F);
+const __m128i full  = _mm_set1_epi16(256);
+const __m128i round = _mm_set1_epi16(128);
+const __m128i sign  = _mm_set1_epi16((short)0x8000);
+const __m128i limit = _mm_set1_epi16((short)(245 ^ 0x8000));
+__m128i d,s,i,inv,red,green,blue,result,keep;
+int x;
+
+    for (x = 0; x + 8 <= count; x += 8)
+    {
+        d = _mm_loadu_si128((const __m128i *)(dest + x));
+        if (panelorder)
+            d = _mm_or_si128(_mm_slli_epi16(d, 8), _mm_srli_epi16(d, 8));
+        s = (source != NULL)   ? _mm_loadu_si128((const __m128i *)(source + x))   : _mm_set1_epi16((short)colour);
+        i = (coverage != NULL) ? _mm_loadu_si128((const __m128i *)(coverage + x)) : _mm_set1_epi16((short)intensity);
+        inv = _mm_sub_epi16(full, i);
+
+        red   = _mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(s, 11), i), _mm_mullo_epi16(_mm_srli_epi16(d, 11), inv));
+        green = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(s, 5), mask6), i),
+                              _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), mask6), inv));
+        blue  = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(s, mask5), i), _mm_mullo_epi16(_mm_and_si128(d, mask5), inv));
+        red   = _mm_srli_epi16(_mm_add_epi16(red,   round), 8);
+        green = _mm_srli_epi16(_mm_add_epi16(green, round), 8);
+        blue  = _mm_srli_epi16(_mm_add_epi16(blue,  round), 8);
+        result = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(red, 11), _mm_slli_epi16(green, 5)), blue);
+
+        // over 245 takes the new colour, compared unsigned by flipping the top bit
+        keep = _mm_cmpgt_epi16(_mm_xor_si128(i, sign), limit);
+        result = _mm_or_si128(_mm_and_si128(keep, s), _mm_andnot_si128(keep, result));
+
+        if (panelorder)
+            result = _mm_or_si128(_mm_slli_epi16(result, 8), _mm_srli_epi16(result, 8));
+        _mm_storeu_si128((__m128i *)(dest + x), result);
+    }
+    BlendSpanScalar(dest + x, (source != NULL) ? source + x : NULL, colour,
+                    (coverage != NULL) ? coverage + x : NULL, intensity, count - x, panelorder);
+}
+
+#if defined(__GNUC__)
+// the same 16 at a time, built for AVX2 whatever the compiler options and only used if the processor has it
+__attribute__((target("avx2")))
+static void BlendSpanAVX2(unsigned short * dest, const unsigned short * source, unsigned short colour,
+                          const unsigned short * coverage, unsigned short intensity, int count, bool panelorder)
+{
+const __m256i mask5 = _mm256_set1_epi16(0x1F);
+const __m256i mask6 = _mm256_set1_epi16(0x3F);
+const __m256i full  = _mm256_set1_epi16(256);
+const __m256i round = _mm256_set1_epi16(128);
+const __m256i limit = _mm256_set1_epi16(246);
+__m256i d,s,i,inv,red,green,blue,result,keep;
+int x;
+
+    for (x = 0; x + 16 <= count; x += 16)
+    {
+        d = _mm256_loadu_si256((const __m256i *)(dest + x));
+        if (panelorder)
+            d = _mm256_or_si256(_mm256_slli_epi16(d, 8), _mm256_srli_epi16(d, 8));
+        s = (source != NULL)   ? _mm256_loadu_si256((const __m256i *)(source + x))   : _mm256_set1_epi16((short)colour);
+        i = (coverage != NULL) ? _mm256_loadu_si256((const __m256i *)(coverage + x)) : _mm256_set1_epi16((short)intensity);
+        inv = _mm256_sub_epi16(full, i);
+
+        red   = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(s, 11), i), _mm256_mullo_epi16(_mm256_srli_epi16(d, 11), inv));
+        green = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(s, 5), mask6), i),
+                                 _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(d, 5), mask6), inv));
+        blue  = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(s, mask5), i), _mm256_mullo_epi16(_mm256_and_si256(d, mask5), inv));
+        red   = _mm256_srli_epi16(_mm256_add_epi16(red,   round), 8);
+        green = _mm256_srli_epi16(_mm256_add_epi16(green, round), 8);
+        blue  = _mm256_srli_epi16(_mm256_add_epi16(blue,  round), 8);
+        result = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(red, 11), _mm256_slli_epi16(green, 5)), blue);
+
+        // over 245 takes the new colour (i > 245 unsigned is the same as max(i,246) == i)
+        keep = _mm256_cmpeq_epi16(_mm256_max_epu16(i, limit), i);
+        result = _mm256_blendv_epi8(result, s, keep);
+
+        if (panelorder)
+            result = _mm256_or_si256(_mm256_slli_epi16(result, 8), _mm256_srli_epi16(result, 8));
+        _mm256_storeu_si256((__m256i *)(dest + x), result);
+    }
+    BlendSpanSSE2(dest + x, (source != NULL) ? source + x : NULL, colour,
+                  (coverage != NULL) ? coverage + x : NULL, intensity, count - x, panelorder);
+}
+#endif
+#endif
+
+#if defined(__ARM_NEON)
+// 8 pixels at a time in 16 bit lanes
+static void BlendSpanNEON(unsigned short * dest, const unsigned short * source, unsigned short colour,
+                          const unsigned short * coverage, unsigned short intensity, int count, bool panelorder)
+{
+const uint16x8_t mask5 = vdupq_n_u16(0x1F);
+const uint16x8_t mask6 = vdupq_n_u16(0x3F);
+const uint16x8_t full  = vdupq_n_u16(256);
+const uint16x8_t round = vdupq_n_u16(128);
+const uint16x8_t limit = vdupq_n_u16(245);
+uint16x8_t d,s,i,inv,red,green,blue,result;
+int x;
+
+    for (x = 0; x + 8 <= count; x += 8)
+    {
+        d = vld1q_u16(dest + x);
+        if (panelorder)
+            d = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(d)));
+        s = (source != NULL)   ? vld1q_u16(source + x)   : vdupq_n_u16(colour);
+        i = (coverage != NULL) ? vld1q_u16(coverage + x) : vdupq_n_u16(intensity);
+        inv = vsubq_u16(full, i);
+
+        red   = vmlaq_u16(vmulq_u16(vshrq_n_u16(s, 11), i), vshrq_n_u16(d, 11), inv);
+        green = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(s, 5), mask6), i), vandq_u16(vshrq_n_u16(d, 5), mask6), inv);
+        blue  = vmlaq_u16(vmulq_u16(vandq_u16(s, mask5), i), vandq_u16(d, mask5), inv);
+        red   = vshrq_n_u16(vaddq_u16(red,   round), 8);
+        green = vshrq_n_u16(vaddq_u16(green, round), 8);
+        blue  = vshrq_n_u16(vaddq_u16(blue,  round), 8);
+        result = vorrq_u16(vorrq_u16(vshlq_n_u16(red, 11), vshlq_n_u16(green, 5)), blue);
+
+        // over 245 takes the new colour
+        result = vbslq_u16(vcgtq_u16(i, limit), s, result);
+
+        if (panelorder)
+            result = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(result)));
+        vst1q_u16(dest + x, result);
+    }
+    BlendSpanScalar(dest + x, (source != NULL) ? source + x : NULL, colour,
+                    (coverage != NULL) ? coverage + x : NULL, intensity, count - x, panelorder);
+}
+#endif
+
+
+// the blend kernel in use, picked the first time it is needed unless chosen with SelectBlendKernel
+static BlendSpanFunction BlendSpan = NULL;
+static const char * BlendKernelName = "scalar";
+
+static void ChooseBlendKernel(void)
+{
+    BlendSpan = BlendSpanScalar;
+    BlendKernelName = "scalar";
+#if defined(__ARM_NEON)
+    BlendSpan = BlendSpanNEON;
+    BlendKernelName = "neon";
+#elif defined(__SSE2__)
+    BlendSpan = BlendSpanSSE2;
+    BlendKernelName = "sse2";
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        BlendSpan = BlendSpanAVX2;
+        BlendKernelName = "avx2";
+    }
+#endif
+#endif
+}
+
+static inline void BlendRenderSpan(DisplayContext * display, unsigned short * dest, const unsigned short * source, unsigned short colour,
+                                   const unsigned short * coverage, unsigned short intensity, int count)
+{
+    if (BlendSpan == NULL)
+        ChooseBlendKernel();
+    COUNT_BLENDS(display, count);
+    BlendSpan(dest, source, colour, coverage, intensity, count, display->PanelByteOrder);
+}
+
+// SelectBlendKernel
+// choose the blending code, mainly for testing and comparing them
+// "scalar" is always available, "neon", "sse2" and "avx2" only where the library was built for them and the processor has them
+// NULL or "" goes back to the best available
+bool SelectBlendKernel(const char * name)
+{
+    if ((name == NULL) || (name[0] == 0))
+    {
+        ChooseBlendKernel();
+        return (true);
+    }
+    if (strcmp(name, "scalar") == 0)
+    {
+        BlendSpan = BlendSpanScalar;
+        BlendKernelName = "scalar";
+        return (true);
+    }
+#if defined(__ARM_NEON)
+    if (strcmp(name, "neon") == 0)
+    {
+        BlendSpan = BlendSpanNEON;
+        BlendKernelName = "neon";
+        return (true);
+    }
+#endif
+#if defined(__SSE2__)
+    if (strcmp(name, "sse2") == 0)
+    {
+        BlendSpan = BlendSpanSSE2;
+        BlendKernelName = "sse2";
+        return (true);
+    }
+#if defined(__GNUC__)
+    if ((strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        BlendSpan = BlendSpanAVX2;
+        BlendKernelName = "avx2";
+        return (true);
+    }
+#endif
+#endif
+    printf("blend kernel %s is not available\n", name);
+    return (false);
+}
+
+const char * GetBlendKernel(void)
+{
+    if (BlendSpan == NULL)
+        ChooseBlendKernel();
+    return (BlendKernelName);
+}
+
+
+// BlendCoverage
+// mixes a single colour into a block of the render space with a separate intensity for each pixel (256 = 100%),
+// e.g. an anti-aliased shape or character drawn elsewhere. coverage holds width*height values (array('H') in Python)
+void BlendCoverage(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, unsigned short colour, const unsigned short * coverage)
+{
+int row,firstcol,lastcol,left,right;
+
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    if ((display->RenderSpace == NULL) || (width == 0) || (height == 0))
+        return;
+
+    firstcol = (x < 0) ? -x : 0;
+    lastcol  = ((x + width) > 240) ? (239 - x) : (width - 1);
+    if (firstcol > lastcol)
+        return;
+
+    for (row = 0; row < height; row++)
+    {
+        if (((y + row) < 0) || ((y + row) > 239))
+            continue;
+        left = x + firstcol;
+        right = x + lastcol;
+        if (!ClipToDrawable(display, y + row, &left, &right))
+            continue;
+        BlendRenderSpan(display, display->RenderSpace + left + (y + row)*240, NULL, colour,
+                        coverage + row*width + left - x, 0, right - left + 1);
+    }
+    MarkDrawnArea(display, x, y, x + width - 1, y + height - 1);
+}
+
+
+// BlendImageRGB565
+// the same as BlitRGB565 but mixed with what is already there at the given intensity (256 = 100%)
+// for overlays and cross fades between images
+void BlendImageRGB565(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, const unsigned char * pixels, unsigned short intensity)
+{
+int row,col,firstcol,lastcol,left,right;
+unsigned short line[240];
+const unsigned char * sourcePtr;
+
+    STATS_SCOPE(display, STAT_IMAGE);
+
+    if ((display->RenderSpace == NULL) || (width == 0) || (height == 0))
+        return;
+
+    firstcol = (x < 0) ? -x : 0;
+    lastcol  = ((x + width) > 240) ? (239 - x) : (width - 1);
+    if (firstcol > lastcol)
+        return;
+
+    for (row = 0; row < height; row++)
+    {
+        if (((y + row) < 0) || ((y + row) > 239))
+            continue;
+        left = x + firstcol;
+        right = x + lastcol;
+        if (!ClipToDrawable(display, y + row, &left, &right))
+            continue;
+        // the image may not be aligned, so the row is copied out first
+        sourcePtr = pixels + (row*width + left - x)*2;
+        for (col = 0; col <= (right - left); col++)
+            line[col] = sourcePtr[col*2] | (sourcePtr[col*2+1]<<8);
+        BlendRenderSpan(display, display->RenderSpace + left + (y + row)*240, line, 0, NULL, intensity, right - left + 1);
+    }
+    MarkDrawnArea(display, x, y, x + width - 1, y + height - 1);
+}
+
+
+// FadeToColour
+// mixes the whole render space (or what is inside the clip rectangle) towards a colour, intensity 256 being all the way
+void FadeToColour(DisplayContext * display, unsigned short colour, unsigned short intensity)
+{
+int y;
+
+    STATS_SCOPE(display, STAT_FILL);
+
+    if (display->RenderSpace == NULL)
+        return;
+    if (!display->CircularMask && (display->ClipDepth == 0))
+        BlendRenderSpan(display, display->RenderSpace, NULL, colour, NULL, intensity, 240*240);
+    else
+        for (y = display->ClipY0; y <= display->ClipY1; y++)
+            if (display->DrawLeft[y] <= display->DrawRight[y])
+                BlendRenderSpan(display, display->RenderSpace + display->DrawLeft[y] + y*240, NULL, colour, NULL, intensity,
+                                display->DrawRight[y] - display->DrawLeft[y] + 1);
+    MarkDrawnArea(display, 0, 0, 239, 239);
+}
+
+
+// pixel mixing, used to do the anti-alising on the lines.
+// note the intensity is a short with 256 being eqivalent to 100% intensity
+void updatePixel(DisplayContext * display, short x, short y, unsigned short colour, unsigned short intensity)
+{
+    STATS_SCOPE(display, STAT_PIXEL);
+
+    // check it's valid space, and inside the clip rectangle
+    if( (x>=display->ClipX0)&&(x<=display->ClipX1)&&(y>=display->ClipY0)&&(y<=display->ClipY1))
+    {
+        display->RenderSpace[x+y*240] = ToRender(display, BlendPixel(FromRender(display, display->RenderSpace[x+y*240]), colour, intensity));
+        COUNT_BLENDS(display, 1);
+    }
+}
+
+
+
+// support functions for the Drawline algorythm
+// these are based on integer maths with a fix position decimal at the 16bit boundary
+unsigned int fpartI(int x)      // x is 16 bits to 1
+{
+    return ((unsigned int)((x&0xffff)>>8));
+}
+
+unsigned int rfpartI(int x)     // x is 16 bits to 1
+{
+    return (256 - (unsigned int)((x&0xffff)>>8));
+}
+
+// round to the nearest whole number, halves away from zero as round() does
+static inline int RoundFixed(int x)
+{
+    if (x < 0)
+        return (-((-x + 0x8000) & ~0xffff));
+    return ((x + 0x8000) & ~0xffff);
+}
+
+// convert to 16.16, for the float versions of the line drawing kept for compatibility
+static inline int ToFixed(float x)
+{
+    return ((int)lrintf(x * 65536.0f));
+}
+
+
+// the whole numbers k >= 0 for which lo <= start + k*step < hi, trimming first and last (which start as the range to try)
+// returns false if there are none
+static bool LinearSpan(long long start, long long step, long long lo, long long hi, int * first, int * last)
+{
+long long low,high;
+
+    if (step == 0)
+        return ((start >= lo) && (start < hi) && (*first <= *last));
+
+    if (step > 0)
+    {
+        // ceiling of (lo - start)/step and floor of (hi - 1 - start)/step
+        low  = lo - start;
+        low  = (low > 0) ? (low + step - 1)/step : -((-low)/step);
+        high = hi - 1 - start;
+        high = (high >= 0) ? high/step : -((-high + step - 1)/step);
+    }
+    else
+    {
+        step = -step;
+        low  = start - hi + 1;
+        low  = (low > 0) ? (low + step - 1)/step : -((-low)/step);
+        high = start - lo;
+        high = (high >= 0) ? high/step : -((-high + step - 1)/step);
+    }
+    if (low > *first)
+        *first = (low > *last) ? *last + 1 : (int)low;
+    if (high < *last)
+        *last = (high < *first) ? *first - 1 : (int)high;
+    return (*first <= *last);
+}
+
+
+// the main part of an anti-aliased line, steps first to last along it with the two pixels across at intery (16.16)
+// blended by how close the line is to each, or both filled. checked leaves out the pixels across that are outside
+// the clip rectangle, the steps along have already been trimmed to it
+static inline void WuRun(DisplayContext * display, int first, int last, int intery, int gradient, unsigned short colour,
+                         bool steep, bool fill, bool checked)
+{
+int x,across,along,lo,hi,minor;
+unsigned short * space;
+unsigned short * p;
+unsigned short stored;
+bool panelorder;
+
+    space = display->RenderSpace;
+    panelorder = display->PanelByteOrder;
+    stored = ToRender(display, colour);
+    along = steep ? 240 : 1;
+    across = steep ? 1 : 240;
+    lo = steep ? display->ClipX0 : display->ClipY0;
+    hi = steep ? display->ClipX1 : display->ClipY1;
+    if (fill)
+        COUNT_PIXELS(display, 2*(last - first + 1));
+    else
+        COUNT_BLENDS(display, 2*(last - first + 1));
+    for (x = first; x <= last; x++, intery += gradient)
+    {
+        minor = intery >> 16;
+        p = space + x*along + minor*across;
+        if (!checked || ((minor >= lo) && (minor <= hi)))
+        {
+            if (fill)
+                p[0] = stored;
+            else if (panelorder)
+                p[0] = SwapBytes(BlendPixel(SwapBytes(p[0]), colour, rfpartI(intery)));
+            else
+                p[0] = BlendPixel(p[0], colour, rfpartI(intery));
+        }
+        if (!checked || ((minor + 1 >= lo) && (minor + 1 <= hi)))
+        {
+            if (fill)
+                p[across] = stored;
+            else if (panelorder)
+                p[across] = SwapBytes(BlendPixel(SwapBytes(p[across]), colour, fpartI(intery)));
+            else
+                p[across] = BlendPixel(p[across], colour, fpartI(intery));
+        }
+    }
+}
+
+
+// python easy call for access using shorts.  See below for actual algorythm
+void DrawLineAA(DisplayContext * display, short x0,short y0, short x1, short y1, unsigned short colour)
+{
+    STATS_SCOPE(display, STAT_LINE_AA);
+
+    DrawLineFixed(display, x0*65536, y0*65536, x1*65536, y1*65536, colour, false);
+}
+
+
+// the float version, now just converted to 16.16 and drawn by DrawLineFixed
+void DrawLineFloat(DisplayContext * display, float x0,float y0, float x1, float y1, unsigned short colour,bool fill)
+{
+    STATS_SCOPE(display, STAT_LINE_AA);
+
+    DrawLineFixed(display, ToFixed(x0), ToFixed(y0), ToFixed(x1), ToFixed(y1), colour, fill);
+}
+
+
+//version of the line drawing routine that uses 16.16 fixed point mathematics including anti aliasing
+// this code is based on Xiaolin Wu's algorythm, details of which can be found at:
+// https://en.wikipedia.org/wiki/Xiaolin_Wu%27s_line_algorithm
+// this is slower than the raw integer version shown below, but does look much cleaner on the display
+// it used to be done in floats, which the Pi Zero is slow at, this gives the same results to within 1 in each colour
+void DrawLineFixed(DisplayContext * display, int x0,int y0, int x1, int y1, unsigned short colour,bool fill)
+{
+bool steep =false;
+int temp;
+int deltax,deltay;
+int gradient ;
+int xend,yend;
+int xgap;
+int xpxl1,ypxl1,xpxl2,ypxl2;
+int intery;
+int majorlo,majorhi,minorlo,minorhi,first,last,outerfirst,outerlast,innerfirst,innerlast;
+long long start;
+
+    STATS_SCOPE(display, STAT_LINE_AA);
+
+    // the end points are rounded and the anti-aliasing touches the pixel either side, so allow 2 pixels spare
+    MarkLineArea(display, x0, y0, x1, y1, 2);
+
+    // only the whole pixels are compared, as the float version did, so nearly 45 degree lines pick the same direction
+    if((abs(y1 - y0)>>16) > (abs(x1 - x0)>>16))
+        steep = true;
+    
+    if (steep)      // Y or X as the main direction Steep = true if more Y than X change
+    {
+        temp = y0;
+        y0 = x0;
+        x0 = temp;
+
+        temp = y1;
+        y1 = x1;
+        x1 = temp;
+    }
+
+    if (x0 > x1) 
+    {
+        temp = x1;
+        x1 = x0;
+        x0 = temp;
+
+        temp = y1;
+        y1 = y0;
+        y0 = temp;
+    }
+    
+    deltax = x1 - x0;
+    deltay = y1 - y0;
+
+    if (deltax == 0)
+        gradient  = 65536;      // 16 bit nominal 1.0
+    else
+        gradient  = (int)(((long long)deltay<<16) / deltax);
+
+    // handle first endpoint
+    xend = RoundFixed(x0);
+    yend = y0 + (int)(((long long)gradient * (xend - x0)) >> 16);
+    xgap = 65536 - ((x0 + 0x8000) & 0xffff);    // 1 - fractional part of x0+0.5
+    xpxl1 = xend>>16;     // this will be used in the main loop
+    ypxl1 = yend>>16;
+
+    if (steep)
+    {
+        updatePixel(display, ypxl1,   xpxl1,  colour, (rfpartI(yend) * xgap)>>16);
+        updatePixel(display, ypxl1+1, xpxl1,  colour, (fpartI (yend) * xgap)>>16);
+    }
+    else
+    {
+        updatePixel(display, xpxl1, ypxl1  ,  colour, (rfpartI(yend) * xgap)>>16);
+        updatePixel(display, xpxl1, ypxl1+1,  colour, (fpartI(yend) * xgap)>>16);
+    }
+    intery = yend + gradient; // first y-intersection for the main loop
+    
+    // handle second endpoint
+    xend = RoundFixed(x1);
+    yend = y1 + (int)(((long long)gradient * (xend - x1)) >> 16);
+    xgap = (x1 + 0x8000) & 0xffff;             // fractional part of x1+0.5
+    xpxl2 = xend>>16; //this will be used in the main loop
+    ypxl2 = yend>>16;
+
+    if (steep)
+    {
+        updatePixel(display, ypxl2  , xpxl2, colour, (rfpartI(yend) * xgap)>>16);
+        updatePixel(display, ypxl2+1, xpxl2, colour, (fpartI(yend) * xgap)>>16);
+    }
+    else
+    {
+        updatePixel(display, xpxl2, ypxl2,   colour, (rfpartI(yend) * xgap)>>16);
+        updatePixel(display, xpxl2, ypxl2+1, colour, (fpartI(yend) * xgap)>>16);
+    }
+    
+    // main loop, only over the part inside the clip rectangle, as the steps where one of the two pixels is inside it
+    // and of those the ones in the middle where both are, which need no checks
+    majorlo = steep ? display->ClipY0 : display->ClipX0;
+    majorhi = steep ? display->ClipY1 : display->ClipX1;
+    minorlo = steep ? display->ClipX0 : display->ClipY0;
+    minorhi = steep ? display->ClipX1 : display->ClipY1;
+    first = (xpxl1 + 1 > majorlo) ? xpxl1 + 1 : majorlo;
+    last = (xpxl2 - 1 < majorhi) ? xpxl2 - 1 : majorhi;
+    if (first > last)
+        return;
+    start = intery + (long long)(first - xpxl1 - 1) * gradient;
+
+    outerfirst = 0;
+    outerlast = last - first;
+    if (!LinearSpan(start, gradient, (minorlo - 1) * 65536LL, (minorhi + 1) * 65536LL, &outerfirst, &outerlast))
+        return;
+    innerfirst = outerfirst;
+    innerlast = outerlast;
+    if (!LinearSpan(start, gradient, minorlo * 65536LL, minorhi * 65536LL, &innerfirst, &innerlast))
+    {
+        // the line runs along the edge of the clip, so all of it is checked
+        innerfirst = outerlast + 1;
+        innerlast = outerlast;
+    }
+
+    WuRun(display, first + outerfirst, first + innerfirst - 1, (int)(start + (long long)outerfirst*gradient), gradient,
+          colour, steep, fill, true);
+    WuRun(display, first + innerfirst, first + innerlast, (int)(start + (long long)innerfirst*gradient), gradient,
+          colour, steep, fill, false);
+    WuRun(display, first + innerlast + 1, first + outerlast, (int)(start + (long long)(innerlast + 1)*gradient), gradient,
+          colour, steep, fill, true);
+}
+
+
+// the steps of a Bresenham line that are inside the clip rectangle, drawn with no checks on the pixels
+// the line goes major steps along (x for a shallow line, y for a steep one) from major0,minor0 and minor
+// steps across in direction dir. The first and last steps inside are worked out directly from the error term
+// rather than stepping to them, so a line starting far off screen costs no more than one that does not
+static void BresenhamRun(DisplayContext * display, int major0, int minor0, int majordelta, int minordelta, int dir,
+                         bool steep, unsigned short colour)
+{
+int majorlo,majorhi,minorlo,minorhi,first,last,m,step,incmajor,incboth,across;
+long long low,high;
+unsigned short * p;
+
+    majorlo = steep ? display->ClipY0 : display->ClipX0;
+    majorhi = steep ? display->ClipY1 : display->ClipX1;
+    minorlo = steep ? display->ClipX0 : display->ClipY0;
+    minorhi = steep ? display->ClipX1 : display->ClipY1;
+
+    // the steps inside the clip along the line
+    first = (majorlo > major0) ? majorlo - major0 : 0;
+    last = ((majorhi - major0) < majordelta) ? majorhi - major0 : majordelta;
+
+    // and the steps across that are inside it, as m steps across happen after step k when
+    // m = ceiling((2*minordelta*k - majordelta) / (2*majordelta))
+    low = (dir > 0) ? minorlo - minor0 : minor0 - minorhi;
+    high = (dir > 0) ? minorhi - minor0 : minor0 - minorlo;
+    if ((majordelta == 0) || (minordelta == 0))
+    {
+        if ((low > 0) || (high < 0))
+            return;
+    }
+    else
+    {
+        if (high < 0)
+            return;
+        if (low > 0)
+        {
+            low = (2LL*majordelta*(low - 1) + majordelta) / (2LL*minordelta) + 1;
+            if (low > first)
+                first = (low > last) ? last + 1 : (int)low;
+        }
+        high = (2LL*majordelta*high + majordelta) / (2LL*minordelta);
+        if (high < last)
+            last = (int)high;
+    }
+    if (first > last)
+        return;
+
+    // the position and error term at the first step, then on as the original loop did
+    m = 0;
+    if (majordelta != 0)
+    {
+        low = 2LL*minordelta*first - majordelta;
+        m = (low > 0) ? (int)((low + 2LL*majordelta - 1) / (2LL*majordelta)) : -(int)((-low) / (2LL*majordelta));
+    }
+    step = (int)(2LL*minordelta*(first + 1) - majordelta - 2LL*m*majordelta);
+    incmajor = 2 * minordelta;
+    incboth = 2 * (minordelta - majordelta);
+    across = steep ? dir : dir*240;
+    if (steep)
+        p = display->RenderSpace + (minor0 + dir*m) + (major0 + first)*240;
+    else
+        p = display->RenderSpace + (major0 + first) + (minor0 + dir*m)*240;
+
+    COUNT_PIXELS(display, last - first + 1);
+    colour = ToRender(display, colour);
+    *p = colour;
+    for (; first < last; first++)
+    {
+        p += steep ? 240 : 1;
+        if (step <= 0)
+            step += incmajor;
+        else
+        {
+            step += incboth;
+            p += across;
+        }
+        *p = colour;
+    }
+}
+
+// DrawLine
+// simple line drawing in the render space
+// allows for lines on and off screen, only the part inside the clip rectangle is drawn
+// Bresenham's Line Drawing Algorithm is used for this, which provides a fast integer only drawing routine
+// https://www.includehelp.com/computer-graphics/bresenhams-line-drawing-algorithm.aspx explains the logic behind it
+// this has however been optimised for direction and for X or Y priority
+void DrawLineIntMaths(DisplayContext * display, short Xstart,short Ystart, short Xend, short Yend, unsigned short colour)
+{
+int Xdelta,Ydelta;
+short temp;
+int dir;
+
+
+    STATS_SCOPE(display, STAT_LINE);
+
+    //printf("OLD CODE\n");
+    MarkDrawnArea(display, (Xstart<Xend)?Xstart:Xend, (Ystart<Yend)?Ystart:Yend,
+                  (Xstart>Xend)?Xstart:Xend, (Ystart>Yend)?Ystart:Yend);
+
+    Xdelta = Xend-Xstart;
+    Ydelta = Yend-Ystart;
+
+
+    if (abs(Xdelta)>abs(Ydelta))
+    {
+        // X direction is larger or equal  
+
+        // make sure the lines always go from lowX to high X
+        // makes the rest of the code simpler
+        if(Xstart>Xend)
+        {
+            temp=Xend;
+            Xend = Xstart;
+            Xstart=temp;
+
+            temp = Yend;
+            Yend= Ystart;
+            Ystart = temp;
+        }
+
+        Xdelta = Xend-Xstart;
+        Ydelta = Yend-Ystart;
+
+        if (Yend<Ystart)
+        {
+            dir =-1;
+            Ydelta = -Ydelta;
+        }
+        else
+        {
+            dir=1;       
+        }
+        BresenhamRun(display, Xstart, Ystart, Xdelta, Ydelta, dir, false, colour);
+    }
+    else
+    {
+        // y Direction is the mayority
+        if(Ystart>Yend)
+        {
+            temp=Xend;
+            Xend = Xstart;
+            Xstart=temp;
+
+            temp = Yend;
+            Yend= Ystart;
+            Ystart = temp;
+        }
+
+        Xdelta = Xend-Xstart;
+        Ydelta = Yend-Ystart;
+
+        if (Xend<Xstart)
+        {
+            dir =-1;
+            Xdelta = -Xdelta;
+        }
+        else
+        {
+            dir=1;       
+        }
+        BresenhamRun(display, Ystart, Xstart, Ydelta, Xdelta, dir, true, colour);
+    }
+}
+
+// routines for drawing lines wider than 1 pixel
+// the first provides a fast integer parameter version which is good for calling in python
+// the second is the one that does the actual work.
+// integer square root, used for the line length
+static unsigned long long SqrtInt(unsigned long long value)
+{
+unsigned long long root = 0;
+unsigned long long bit = 1ULL << 62;
+
+    while (bit > value)
+        bit >>= 2;
+    while (bit != 0)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return (root);
+}
+
+
+// sine in 16.16 fixed point, for the shapes below (so no floating point is needed)
+// the angle is in hundredths of a degree, and whole degrees are looked up and the rest interpolated
+static const int SineTable[91] =
+{
+        0,  1144,  2287,  3430,  4572,  5712,  6850,  7987,  9121, 10252,
+    11380, 12505, 13626, 14742, 15855, 16962, 18064, 19161, 20252, 21336,
+    22415, 23486, 24550, 25607, 26656, 27697, 28729, 29753, 30767, 31772,
+    32768, 33754, 34729, 35693, 36647, 37590, 38521, 39441, 40348, 41243,
+    42126, 42995, 43852, 44695, 45525, 46341, 47143, 47930, 48703, 49461,
+    50203, 50931, 51643, 52339, 53020, 53684, 54332, 54963, 55578, 56175,
+    56756, 57319, 57865, 58393, 58903, 59396, 59870, 60326, 60764, 61183,
+    61584, 61966, 62328, 62672, 62997, 63303, 63589, 63856, 64104, 64332,
+    64540, 64729, 64898, 65048, 65177, 65287, 65376, 65446, 65496, 65526,
+    65536,
+};
+
+int SinFixed(int angle)
+{
+int quadrant,degree,fraction,value;
+
+    angle %= 36000;
+    if (angle < 0)
+        angle += 36000;
+    quadrant = angle / 9000;
+    angle %= 9000;
+    if (quadrant & 1)
+        angle = 9000 - angle;
+
+    degree   = angle / 100;
+    fraction = angle % 100;
+    value = SineTable[degree];
+    if (fraction != 0)
+        value += ((SineTable[degree+1] - value) * fraction) / 100;
+
+    return ((quadrant & 2) ? -value : value);
+}
+
+int CosFixed(int angle)
+{
+    return (SinFixed(angle + 9000));
+}
+
+
+// polygon filling with anti-aliased edges
+// this follows the approach used by font-rs: each edge adds the area it covers in each pixel (as the change from
+// the pixel to its left) into the coverage space, and then a running total along each row gives the coverage of
+// every pixel. The edges can be in any order and only the running total has to be done per pixel.
+// co-ordinates in here are 24.8 fixed point (1/256 of a pixel) and pixel n covers n to n+1
+
+// twice the average of max(0, t - x) with x running evenly from xl to xr
+// that is (t-xl)^2/(xr-xl) between them, done with inverse = 2^32/(xr-xl) as the Pi Zero has no divide instruction
+static inline long long CoverRamp(long long t, long long xl, long long xr, unsigned long long inverse)
+{
+    if (t <= xl)
+        return (0);
+    if (t >= xr)
+        return (2*t - xl - xr);
+    return ((long long)(((unsigned long long)((t - xl)*(t - xl)) * inverse) >> 32));
+}
+
+// add one edge within a single pixel row, going from xa at the top to xb at the bottom over a height of dy
+// each pixel gets the difference between the areas left uncovered at its right and left sides.
+// the areas come out as dy x 2 x 256 for a full pixel, hence COVERAGE_FULL
+static void CoverSegment(DisplayContext * display, int row, int xa, int xb, int dy, int dir)
+{
+long long xl,xr,area,lastarea,ramp,nextramp;
+unsigned long long inverse;
+int first,last,i;
+int * cell;
+
+    xl = (xa < xb) ? xa : xb;
+    xr = (xa < xb) ? xb : xa;
+    first = (int)(xl >> 8);
+    last  = (int)(xr >> 8) + 1;
+    cell = display->CoverageSpace + row*COVERAGE_WIDTH;
+
+    if (last == first + 1)
+    {
+        // all within one pixel, which is the usual case for the long edges of a shape
+        area = dy * (((long long)last<<9) - xl - xr);
+        cell[first] += dir * (int)area;
+        cell[last]  += dir * (int)(dy*512 - area);
+    }
+    else
+    {
+        inverse = (1ULL<<32) / (unsigned long long)(xr - xl);
+        lastarea = 0;
+        ramp = 0;
+        for (i = first; i <= last; i++)
+        {
+            nextramp = CoverRamp((long long)(i+1)<<8, xl, xr, inverse);
+            area = dy * (nextramp - ramp);
+            cell[i] += dir * (int)(area - lastarea);
+            lastarea = area;
+            ramp = nextramp;
+        }
+    }
+
+    if (first < display->CoverRowLeft[row])
+        display->CoverRowLeft[row] = first;
+    if (last > display->CoverRowRight[row])
+        display->CoverRowRight[row] = last;
+}
+
+// add an edge of the polygon, clipping it to the screen
+// anything off the left acts as if it were on the left edge (it covers all of every pixel to its right) and
+// anything off the right is moved onto the spare column just past the right edge, which is never drawn.
+// anything above or below has no effect on the pixels on screen, so is dropped
+static void CoverEdge(DisplayContext * display, int x0, int y0, int x1, int y1)
+{
+int dir,temp,row,top,bottom,xa,xb;
+int ycross;
+long long slope;
+
+    if (y0 == y1)
+        return;
+
+    // split the edge where it crosses the left or right of the screen
+    if (((x0 < 0) && (x1 > 0)) || ((x0 > 0) && (x1 < 0)))
+    {
+        ycross = y0 + (int)(((long long)(y1 - y0) * -x0) / (x1 - x0));
+        CoverEdge(display, x0, y0, 0, ycross);
+        CoverEdge(display, 0, ycross, x1, y1);
+        return;
+    }
+    if (((x0 < (240<<8)) && (x1 > (240<<8))) || ((x0 > (240<<8)) && (x1 < (240<<8))))
+    {
+        ycross = y0 + (int)(((long long)(y1 - y0) * ((240<<8) - x0)) / (x1 - x0));
+        CoverEdge(display, x0, y0, 240<<8, ycross);
+        CoverEdge(display, 240<<8, ycross, x1, y1);
+        return;
+    }
+    if ((x0 <= 0) && (x1 <= 0))
+    {
+        x0 = 0;
+        x1 = 0;
+    }
+    if ((x0 >= (240<<8)) && (x1 >= (240<<8)))
+    {
+        x0 = 240<<8;      // still needed so the rows are filled up to the edge of the screen
+        x1 = 240<<8;
+    }
+
+    // work down the screen, the direction is kept so edges going up cancel those going down
+    dir = 1;
+    if (y0 > y1)
+    {
+        temp = x0; x0 = x1; x1 = temp;
+        temp = y0; y0 = y1; y1 = temp;
+        dir = -1;
+    }
+    // only the rows inside the clip rectangle are ever filled, so the rest are not worth covering
+    if ((y1 <= (display->ClipY0<<8)) || (y0 >= ((display->ClipY1+1)<<8)))
+        return;
+
+    // x moves by slope/65536 for each step in y
+    slope = ((long long)(x1 - x0) << 16) / (y1 - y0);
+    for (row = ((y0 < (display->ClipY0<<8)) ? display->ClipY0 : (y0>>8)); (row <= display->ClipY1) && ((row<<8) < y1); row++)
+    {
+        top    = (y0 > (row<<8)) ? y0 : (row<<8);
+        bottom = (y1 < ((row+1)<<8)) ? y1 : ((row+1)<<8);
+        xa = x0 + (int)((slope * (top - y0)) >> 16);
+        xb = (bottom == y1) ? x1 : x0 + (int)((slope * (bottom - y0)) >> 16);
+        CoverSegment(display, row, xa, xb, bottom - top, dir);
+    }
+}
+
+// write the covered pixels, blending the partly covered ones, and clear the coverage space ready for next time
+// the changed area is marked in bands of rows, so a diagonal shape does not mark its whole bounding box
+#define COVER_BAND  16
+static void FillCoverage(DisplayContext * display, unsigned short colour)
+{
+int row,x,acc,coverage,first,last;
+int bandleft,bandright,bandtop;
+int * cell;
+unsigned short intensity[240];
+
+    bandleft = 240;
+    bandright = -1;
+    bandtop = 0;
+    // CoverEdge only covers the rows inside the clip rectangle
+    for (row = display->ClipY0; row <= display->ClipY1; row++)
+    {
+        if (display->CoverRowLeft[row] <= display->CoverRowRight[row])
+        {
+            cell = display->CoverageSpace + row*COVERAGE_WIDTH;
+            last = (display->CoverRowRight[row] < 239) ? display->CoverRowRight[row] : 239;
+            acc = 0;
+            for (x = display->CoverRowLeft[row]; x <= last; x++)
+            {
+                acc += cell[x];
+                cell[x] = 0;
+                coverage = abs(acc);
+                if (coverage > COVERAGE_FULL)
+                    coverage = COVERAGE_FULL;
+                intensity[x] = (coverage + 256) >> 9;   // 256 is fully covered, the same as updatePixel
+            }
+            // then the visible part of the row is mixed in one go
+            first = display->CoverRowLeft[row];
+            if (ClipToDrawable(display, row, &first, &last))
+                BlendRenderSpan(display, display->RenderSpace + row*240 + first, NULL, colour,
+                                intensity + first, 0, last - first + 1);
+            // the spare columns past the right edge
+            cell[240] = 0;
+            cell[241] = 0;
+
+            if (bandright < 0)
+                bandtop = row;
+            if (display->CoverRowLeft[row] < bandleft)
+                bandleft = display->CoverRowLeft[row];
+            if (display->CoverRowRight[row] > bandright)
+                bandright = display->CoverRowRight[row];
+            display->CoverRowLeft[row] = COVERAGE_WIDTH;
+            display->CoverRowRight[row] = -1;
+        }
+
+        if ((bandright >= 0) && (((row % COVER_BAND) == (COVER_BAND-1)) || (row == display->ClipY1)))
+        {
+            MarkDrawnArea(display, bandleft, bandtop, bandright, row);
+            bandleft = 240;
+            bandright = -1;
+        }
+    }
+}
+
+static bool StartCoverage(DisplayContext * display)
+{
+int row;
+
+    if (display->CoverageSpace == NULL)
+    {
+        display->CoverageSpace = calloc(240*COVERAGE_WIDTH, sizeof(int));
+        if (display->CoverageSpace == NULL)
+        {
+            printf("unable to allocate the polygon coverage space\n");
+            return (false);
+        }
+        for (row = 0; row < 240; row++)
+        {
+            display->CoverRowLeft[row] = COVERAGE_WIDTH;
+            display->CoverRowRight[row] = -1;
+        }
+    }
+    return (display->RenderSpace != NULL);
+}
+
+
+// FillPolygonFixed
+// fills a polygon given as count x,y pairs of 16.16 fixed point co-ordinates, the last point joins back to the first
+// the co-ordinates are the pixel centres, the same as the line drawing, and the edges are anti-aliased
+// any shape works, where it crosses itself the overlaps are filled
+void FillPolygonFixed(DisplayContext * display, const int * points, unsigned short count, unsigned short colour)
+{
+int i,j;
+
+    STATS_SCOPE(display, STAT_POLYGON);
+
+    if ((count < 3) || !StartCoverage(display))
+        return;
+
+    for (i = 0; i < count; i++)
+    {
+        j = (i + 1 == count) ? 0 : i + 1;
+        // the half pixel moves from pixel centres to the pixel edges used by the coverage
+        CoverEdge(display, (points[i*2]>>8) + 128, (points[i*2+1]>>8) + 128, (points[j*2]>>8) + 128, (points[j*2+1]>>8) + 128);
+    }
+    FillCoverage(display, colour);
+}
+
+// the same for whole pixel co-ordinates, as array('h') in Python
+void FillPolygonAA(DisplayContext * display, const short * points, unsigned short count, unsigned short colour)
+{
+int fixedpoints[2*64];
+int i,j;
+
+    STATS_SCOPE(display, STAT_POLYGON);
+
+    if ((count < 3) || !StartCoverage(display))
+        return;
+
+    if (count <= 64)
+    {
+        for (i = 0; i < count*2; i++)
+            fixedpoints[i] = points[i]<<16;
+        FillPolygonFixed(display, fixedpoints, count, colour);
+        return;
+    }
+
+    // too many to copy, so add the edges directly
+    for (i = 0; i < count; i++)
+    {
+        j = (i + 1 == count) ? 0 : i + 1;
+        CoverEdge(display, (points[i*2]<<8) + 128, (points[i*2+1]<<8) + 128, (points[j*2]<<8) + 128, (points[j*2+1]<<8) + 128);
+    }
+    FillCoverage(display, colour);
+}
+
+
+// add the points of half a circle around x,y (16.16) to a polygon, starting from the offset nx,ny and
+// going round through dx,dy (the same length, at right angles) to the opposite side
+static int AddHalfCircle(int * points, int x, int y, int nx, int ny, int dx, int dy, int segments)
+{
+int i,angle,c,s;
+
+    for (i = 0; i <= segments; i++)
+    {
+        angle = (i * 18000) / segments;
+        c = CosFixed(angle);
+        s = SinFixed(angle);
+        points[i*2]   = x + (int)(((long long)nx*c + (long long)dx*s) >> 16);
+        points[i*2+1] = y + (int)(((long long)ny*c + (long long)dy*s) >> 16);
+    }
+    return (segments + 1);
+}
+
+
+// DrawLineWideCapped
+// wide line drawn as a single filled polygon, so each pixel is only written once however wide the line is
+// the ends can be left square on to the line (LINE_CAP_BUTT), extended by half the width (LINE_CAP_SQUARE)
+// or rounded (LINE_CAP_ROUND). The end points are 16.16 fixed point
+void DrawLineWideCapped(DisplayContext * display, int x0,int y0, int x1, int y1, unsigned short colour,unsigned short width, int cap)
+{
+long long dx,dy;
+long long length;
+int nx,ny,ex,ey;
+int points[2*(4 + 2*33)];
+int count,segments;
+
+    STATS_SCOPE(display, STAT_LINE_WIDE);
+
+    dx = ((long long)x1 - x0) >> 8;
+    dy = ((long long)y1 - y0) >> 8;
+    length = (long long)SqrtInt((unsigned long long)(dx*dx + dy*dy));       // 24.8
+
+    if (width <= 1)
+    {
+        DrawLineFixed(display, x0,y0, x1,y1,colour,false);
+        return;
+    }
+    if (length == 0)
+    {
+        // no direction to go on, so just a dot for round ends
+        if (cap == LINE_CAP_ROUND)
+            dx = 256, length = 256;
+        else
+        {
+            DrawLineFixed(display, x0,y0, x1,y1,colour,false);
+            return;
+        }
+    }
+
+    // half the width at right angles to the line, and along the line
+    nx = (int)((-dy * width * 32768) / length);
+    ny = (int)(( dx * width * 32768) / length);
+    ex = ny;
+    ey = -nx;
+
+    if (cap == LINE_CAP_SQUARE)
+    {
+        x0 -= ex; y0 -= ey;
+        x1 += ex; y1 += ey;
+    }
+
+    count = 0;
+    points[count*2] = x0 + nx; points[count*2+1] = y0 + ny; count++;
+    if (cap == LINE_CAP_ROUND)
+    {
+        // around 1 segment per pixel of the radius, which keeps the steps under a pixel
+        segments = width/2;
+        if (segments < 4)
+            segments = 4;
+        if (segments > 32)
+            segments = 32;
+        count += AddHalfCircle(points + count*2, x1, y1, nx, ny, ex, ey, segments);
+        count += AddHalfCircle(points + count*2, x0, y0, -nx, -ny, -ex, -ey, segments);
+    }
+    else
+    {
+        points[count*2] = x1 + nx; points[count*2+1] = y1 + ny; count++;
+        points[count*2] = x1 - nx; points[count*2+1] = y1 - ny; count++;
+        points[count*2] = x0 - nx; points[count*2+1] = y0 - ny; count++;
+    }
+    FillPolygonFixed(display, points, count, colour);
+}
+
+
+// FillPieAA
+// a filled segment of a circle, as used for clock face markings
+// the angles are in hundredths of a degree clockwise from 12 o'clock, so 9000 is 3 o'clock
+// a whole circle is drawn if the end is 36000 or more after the start
+void FillPieAA(DisplayContext * display, short x, short y, unsigned short r, int startangle, int endangle, unsigned short colour)
+{
+int points[2*(2 + 128)];
+int count,segments,sweep,i,angle;
+
+    STATS_SCOPE(display, STAT_POLYGON);
+
+    if (r == 0)
+        return;
+    sweep = endangle - startangle;
+    if (sweep < 0)
+        sweep = sweep % 36000 + 36000;
+    if (sweep > 36000)
+        sweep = 36000;
+
+    // keep the steps around the edge to a few pixels at most
+    segments = (int)(((long long)sweep * r) / 18000) + 2;
+    if (segments > 128)
+        segments = 128;
+
+    count = 0;
+    points[count*2] = x<<16; points[count*2+1] = y<<16; count++;
+    for (i = 0; i <= segments; i++)
+    {
+        angle = startangle + (int)(((long long)sweep * i) / segments);
+        points[count*2]   = (x<<16) + r*SinFixed(angle);
+        points[count*2+1] = (y<<16) - r*CosFixed(angle);
+        count++;
+    }
+    FillPolygonFixed(display, points, count, colour);
+}
+
+
+// circles, rings and arcs
+// these are drawn a row at a time straight into the render space rather than as polygons. The centre is on a pixel,
+// and for each row four distances out from the centre column mark where the pixels change: as far as the outer edge
+// touches, as far as is wholly inside it, and the same two for the inner edge. Between those the inside is written
+// as plain runs and only the pixels near an edge have their coverage worked out. Near a circle (r*r - d*d)/2r is the
+// distance to it, so no square root is needed per pixel. An arc adds two straight edges out from the centre, and on
+// each row only the few columns near where they cross are done a pixel at a time, the rest of the row is either
+// wholly in or out of the arc. The radii are 24.8 fixed point, the same as the polygons
+typedef struct
+{
+    int x,y;                            // centre pixel
+    int outer,inner;                    // radii, 24.8, inner 0 for a disc
+    long long outerarea,innerarea;      // squares of the radii, 1/256ths of a pixel squared
+    int outerscale,innerscale;          // 128/r as 16.16, to turn the difference in areas into a distance
+    long long touchlimit,solidlimit;    // squared distances (whole pixels) to the last pixels the outer edge touches
+    long long holelimit,clearlimit;     // and wholly covers, and the last the inner edge does not cover or does not wholly
+    int sweep;                          // hundredths of a degree, 36000 for all the way round
+    int startx,starty,endx,endy;        // 16.16 directions of the straight edges of an arc
+    long long startslope,endslope;      // 16.16 columns they move across for each row down
+    long long startspread,endspread;    // 16.16 columns either side of them that can be partly covered
+    int bandfirst[2],bandlast[2];       // the columns on the current row that are near them
+    unsigned short colour;
+    unsigned short fill;                // the colour as it goes in the render space
+    unsigned short line[240];           // a row of it, copied for the runs
+} RingShape;
+
+#define RING_OUTER      1       // the pixels may be partly over the outer circle
+#define RING_INNER      2       // the inner one
+#define RING_ARC        4       // or the straight edges of an arc
+
+// coverage (256 = all) of a pixel from how far its centre is inside an edge, in 1/256ths of a pixel
+static inline int EdgeCoverage(int distance)
+{
+    if (distance <= -128)
+        return (0);
+    if (distance >= 128)
+        return (256);
+    return (distance + 128);
+}
+
+// the same for a circle, from how much the square of the radius is over the pixel's squared distance
+static inline int CircleCoverage(long long difference, int radius, int scale)
+{
+    if (difference >= radius)
+        return (256);
+    if (difference <= -radius)
+        return (0);
+    return (128 + (((int)difference * scale) >> 16));
+}
+
+// the coverage of the pixel dx,dy from the centre, from the edges it may be over
+// the coverages are multiplied, which keeps the corners of an arc close to the area they cover
+static inline int RingCoverage(const RingShape * ring, int dx, int dy, long long dy2, int edges)
+{
+long long area;
+int cover,start,end;
+
+    cover = 256;
+    area = ((long long)dx*dx + dy2) << 8;
+    if (edges & RING_OUTER)
+        cover = CircleCoverage(ring->outerarea - area, ring->outer, ring->outerscale);
+    if (edges & RING_INNER)
+        cover = (cover * CircleCoverage(area - ring->innerarea, ring->inner, ring->innerscale)) >> 8;
+    if ((edges & RING_ARC) && (cover != 0))
+    {
+        // clockwise of the start edge and anticlockwise of the end one, both for up to half a circle or either for more
+        start = EdgeCoverage((int)(((long long)ring->startx*dy - (long long)ring->starty*dx) >> 8));
+        end   = EdgeCoverage((int)(((long long)ring->endy*dx - (long long)ring->endx*dy) >> 8));
+        if ((ring->sweep <= 18000) ? (end < start) : (end > start))
+            start = end;
+        cover = (cover * start) >> 8;
+    }
+    return (cover);
+}
+
+// the most whole pixels out from the centre column within the squared distance limit, or -1 if there are none
+// this only moves a little from one row to the next so it is stepped on from the last row's, and only found
+// from the square root when it has moved a long way
+static inline int RingReach(int reach, long long limit)
+{
+int steps;
+
+    if (limit < 0)
+        return (-1);
+    for (steps = 0; steps < 4; steps++)
+    {
+        if ((long long)(reach + 1)*(reach + 1) <= limit)
+            reach++;
+        else if ((reach >= 0) && ((long long)reach*reach > limit))
+            reach--;
+        else
+            return (reach);
+    }
+    return ((int)SqrtInt(limit));
+}
+
+// works out the coverage of each pixel from first to last and mixes it in
+// the edges are only a pixel or two wide on most rows, too short for the blend spans to help
+static void RingPixels(DisplayContext * display, const RingShape * ring, int row, int first, int last, int edges)
+{
+unsigned short * destPtr;
+int dy,col,cover;
+long long dy2;
+
+    dy = row - ring->y;
+    dy2 = (long long)dy*dy;
+    destPtr = display->RenderSpace + row*240 + first;
+    for (col = first; col <= last; col++, destPtr++)
+    {
+        cover = RingCoverage(ring, col - ring->x, dy, dy2, edges);
+        if (cover == 256)
+        {
+            *destPtr = ring->fill;
+            COUNT_PIXELS(display, 1);
+        }
+        else if (cover != 0)
+        {
+            *destPtr = ToRender(display, BlendPixel(FromRender(display, *destPtr), ring->colour, cover));
+            COUNT_BLENDS(display, 1);
+        }
+    }
+}
+
+// columns first to last of a row, which are either over the given circles or (with none) wholly between them
+// for an arc they are split where its straight edges cross the row, and between those are either all in or all out
+static void RingZone(DisplayContext * display, const RingShape * ring, int row, int first, int last, int edges)
+{
+int col,end,band;
+
+    if (first > last)
+        return;
+    if (ring->sweep >= 36000)
+    {
+        if (edges != 0)
+            RingPixels(display, ring, row, first, last, edges);
+        else
+        {
+            memcpy(display->RenderSpace + row*240 + first, ring->line, (last - first + 1)*2);
+            COUNT_PIXELS(display, last - first + 1);
+        }
+        return;
+    }
+
+    col = first;
+    while (col <= last)
+    {
+        end = last;
+        for (band = 0; band < 2; band++)
+        {
+            if ((col >= ring->bandfirst[band]) && (col <= ring->bandlast[band]))
+                break;
+            if ((ring->bandfirst[band] > col) && (ring->bandfirst[band] <= end))
+                end = ring->bandfirst[band] - 1;
+        }
+        if (band < 2)
+        {
+            end = (ring->bandlast[band] < last) ? ring->bandlast[band] : last;
+            RingPixels(display, ring, row, col, end, edges | RING_ARC);
+        }
+        else if (RingCoverage(ring, col - ring->x, row - ring->y, 0, RING_ARC) == 256)
+        {
+            if (edges != 0)
+                RingPixels(display, ring, row, col, end, edges);
+            else
+            {
+                memcpy(display->RenderSpace + row*240 + col, ring->line, (end - col + 1)*2);
+                COUNT_PIXELS(display, end - col + 1);
+            }
+        }
+        col = end + 1;
+    }
+}
+
+// one side of the centre, the pixels nearest from near to far out, trimmed to the visible columns first to last
+// the outer and inner edges are done on their own unless they are too close together for a run between them
+static void RingSide(DisplayContext * display, const RingShape * ring, int row, int first, int last, int side,
+                     int near, int far, int clear, int solid)
+{
+int zone,from,to,edges;
+
+    for (zone = 0; zone < 3; zone++)
+    {
+        if (solid <= clear)
+        {
+            if (zone != 0)
+                break;
+            from = near;
+            to = far;
+            edges = RING_OUTER | RING_INNER;
+        }
+        else if (zone == 0)
+        {
+            from = near;
+            to = clear;
+            edges = RING_INNER;
+        }
+        else if (zone == 1)
+        {
+            from = (clear + 1 > near) ? clear + 1 : near;
+            to = solid;
+            edges = 0;
+        }
+        else
+        {
+            from = (solid + 1 > near) ? solid + 1 : near;
+            to = far;
+            edges = RING_OUTER;
+        }
+        if (ring->inner == 0)
+            edges &= ~RING_INNER;
+        if (from > to)
+            continue;
+
+        if (side < 0)
+            RingZone(display, ring, row, (ring->x - to < first) ? first : ring->x - to, (ring->x - from > last) ? last : ring->x - from, edges);
+        else
+            RingZone(display, ring, row, (ring->x + from < first) ? first : ring->x + from, (ring->x + to > last) ? last : ring->x + to, edges);
+    }
+}
+
+// the columns on a row near one straight edge of an arc, a column wider each side to be safe
+// an edge along the row is either near all of it or none of it
+static void ArcEdgeColumns(const RingShape * ring, int along, int across, long long slope, long long spread, int dy,
+                           int * first, int * last)
+{
+long long a,b;
+
+    if (across == 0)
+    {
+        a = ((long long)along*dy) >> 8;
+        *first = ((a > -128) && (a < 128)) ? 0 : 240;
+        *last = 239;
+        return;
+    }
+    a = ring->x + ((slope*dy - spread) >> 16) - 1;
+    b = ring->x + ((slope*dy + spread) >> 16) + 1;
+    *first = (a < -1) ? -1 : ((a > 240) ? 240 : (int)a);
+    *last  = (b < -1) ? -1 : ((b > 240) ? 240 : (int)b);
+}
+
+// the ring between the inner and outer radius (0 inner for a disc), from startangle round sweep hundredths of a degree
+static void FillRingFixed(DisplayContext * display, short x, short y, int outer, int inner, int startangle, int sweep, unsigned short colour)
+{
+RingShape ring;
+long long dy2;
+int row,top,bottom,left,right,dy;
+int touch,solid,hole,clear;
+int bandleft,bandright,bandtop;
+
+    if ((display->RenderSpace == NULL) || (outer <= 0) || (sweep <= 0) || (inner >= outer))
+        return;
+    if (inner < 0)
+        inner = 0;
+
+    ring.x = x;
+    ring.y = y;
+    ring.outer = outer;
+    ring.inner = inner;
+    ring.outerarea = ((long long)outer*outer) >> 8;
+    ring.innerarea = ((long long)inner*inner) >> 8;
+    ring.outerscale = (128 << 16) / outer;
+    ring.innerscale = (inner > 0) ? (128 << 16) / inner : 0;
+    ring.touchlimit = (ring.outerarea + outer - 1) >> 8;
+    ring.solidlimit = (ring.outerarea - outer) >> 8;
+    ring.holelimit  = (ring.innerarea - inner) >> 8;
+    ring.clearlimit = (ring.innerarea + inner - 1) >> 8;
+
+    ring.sweep = (sweep > 36000) ? 36000 : sweep;
+    ring.startx =  SinFixed(startangle);
+    ring.starty = -CosFixed(startangle);
+    ring.endx =  SinFixed(startangle + ring.sweep);
+    ring.endy = -CosFixed(startangle + ring.sweep);
+    ring.startslope = (ring.starty != 0) ? ((long long)ring.startx * 65536) / ring.starty : 0;
+    ring.endslope = (ring.endy != 0) ? ((long long)ring.endx * 65536) / ring.endy : 0;
+    ring.startspread = (ring.starty != 0) ? (128LL << 24) / abs(ring.starty) : 0;
+    ring.endspread = (ring.endy != 0) ? (128LL << 24) / abs(ring.endy) : 0;
+
+    ring.colour = colour;
+    ring.fill = ToRender(display, colour);
+    for (row = 0; row < 240; row++)
+        ring.line[row] = ring.fill;
+
+    top = y - (outer >> 8) - 1;
+    bottom = y + (outer >> 8) + 1;
+    if (top < display->ClipY0)
+        top = display->ClipY0;
+    if (bottom > display->ClipY1)
+        bottom = display->ClipY1;
+
+    touch = solid = hole = clear = -1;
+    bandleft = 240;
+    bandright = -1;
+    bandtop = top;
+    for (row = top; row <= bottom; row++)
+    {
+        dy = row - y;
+        dy2 = (long long)dy*dy;
+
+        // the columns the outer edge touches, trimmed once to what can be seen
+        touch = RingReach(touch, ring.touchlimit - dy2);
+        left = x - touch;
+        right = x + touch;
+        if (left < 0)
+            left = 0;
+        if (right > 239)
+            right = 239;
+        if ((touch >= 0) && (left <= right) && ClipToDrawable(display, row, &left, &right))
+        {
+            solid = RingReach(solid, ring.solidlimit - dy2);
+            if (inner > 0)
+            {
+                hole = RingReach(hole, ring.holelimit - dy2);
+                clear = RingReach(clear, ring.clearlimit - dy2);
+            }
+            if (ring.sweep < 36000)
+            {
+                ArcEdgeColumns(&ring, ring.startx, ring.starty, ring.startslope, ring.startspread, dy,
+                               &ring.bandfirst[0], &ring.bandlast[0]);
+                ArcEdgeColumns(&ring, ring.endx, ring.endy, ring.endslope, ring.endspread, dy,
+                               &ring.bandfirst[1], &ring.bandlast[1]);
+            }
+            // the centre column goes with the left side when there is no hole in this row
+            RingSide(display, &ring, row, left, right, -1, hole + 1, touch, clear, solid);
+            RingSide(display, &ring, row, left, right, 1, (hole >= 0) ? hole + 1 : 1, touch, clear, solid);
+
+            // the changed area is marked in bands of rows, the same as the polygons
+            if (bandright < 0)
+                bandtop = row;
+            if (left < bandleft)
+                bandleft = left;
+            if (right > bandright)
+                bandright = right;
+        }
+
+        if ((bandright >= 0) && (((row % COVER_BAND) == (COVER_BAND-1)) || (row == bottom)))
+        {
+            MarkDrawnArea(display, bandleft, bandtop, bandright, row);
+            bandleft = 240;
+            bandright = -1;
+        }
+    }
+}
+
+// FillCircleAA
+// a filled disc of radius r centred on x,y with an anti-aliased edge
+void FillCircleAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short colour)
+{
+    STATS_SCOPE(display, STAT_RING);
+
+    FillRingFixed(display, x, y, r<<8, 0, 0, 36000, colour);
+}
+
+// DrawRingAA
+// an anti-aliased ring width pixels wide inside radius r, e.g. a bezel or the track of a progress ring
+// if the width is r or more it is a filled disc
+void DrawRingAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short width, unsigned short colour)
+{
+    STATS_SCOPE(display, STAT_RING);
+
+    FillRingFixed(display, x, y, r<<8, (r > width) ? (r - width)<<8 : 0, 0, 36000, colour);
+}
+
+// DrawArcAA
+// part of a ring, e.g. a gauge or progress indicator, with the angles as FillPieAA
+// (hundredths of a degree clockwise from 12 o'clock), and a whole ring if the end is 36000 or more after the start
+void DrawArcAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short width, int startangle, int endangle, unsigned short colour)
+{
+int sweep;
+
+    STATS_SCOPE(display, STAT_RING);
+
+    sweep = endangle - startangle;
+    if (sweep < 0)
+        sweep = sweep % 36000 + 36000;
+    if (sweep > 36000)
+        sweep = 36000;
+    FillRingFixed(display, x, y, r<<8, (r > width) ? (r - width)<<8 : 0, startangle, sweep, colour);
+}
+
+
+void DrawLineWideAA(DisplayContext * display, short x0,short y0, short x1, short y1, unsigned short colour,unsigned short width)
+{
+    STATS_SCOPE(display, STAT_LINE_WIDE);
+
+    DrawLineWideFixed (display, x0<<16,y0<<16 , x1<<16,y1<<16, colour, width);
+}
+
+void DrawLineWideFloat(DisplayContext * display, float x0,float y0, float x1, float y1, unsigned short colour,unsigned short width)
+{
+    STATS_SCOPE(display, STAT_LINE_WIDE);
+
+    DrawLineWideFixed (display, ToFixed(x0),ToFixed(y0) , ToFixed(x1),ToFixed(y1), colour, width);
+}
+
+// the plain wide line, with the ends square on to the line
+void DrawLineWideFixed(DisplayContext * display, int x0,int y0, int x1, int y1, unsigned short colour,unsigned short width)
+{
+    STATS_SCOPE(display, STAT_LINE_WIDE);
+
+    DrawLineWideCapped(display, x0, y0, x1, y1, colour, width, LINE_CAP_BUTT);
+}
+
+
+// text
+// fonts are made by makefont.py, which draws each character once with PIL and packs it as 4 bit coverage
+// (16 levels of anti-aliasing, two pixels to a byte) into an atlas. The file is
+//   "C2PF", version, line height, ascent, glyph count (16 bits each), kerning pair count, atlas size (32 bits)
+//   the glyphs, 16 bytes each sorted by character: code, atlas offset (32 bits), width, height, left, top (8 bits),
+//   advance in 1/16 pixels (16 bits) and 2 spare bytes
+//   the kerning pairs, 12 bytes each sorted by the first then second character: the two codes (32 bits)
+//   and the adjustment in 1/16 pixels (16 bits) with 2 spare bytes
+//   then the atlas, each glyph a row at a time with rows starting on a byte, the first pixel in the high nibble
+// all little endian. The glyph is drawn at left,top from the pen position and the top of the line
+#define FONT_HEADER_SIZE   20
+#define FONT_GLYPH_SIZE    16
+#define FONT_KERN_SIZE     12
+
+typedef struct
+{
+    unsigned int code;
+    unsigned int offset;
+    unsigned char width, height;
+    signed char left, top;
+    unsigned short advance;     // 1/16 pixels
+} FontGlyph;
+
+typedef struct
+{
+    unsigned int first, second;
+    short adjust;               // 1/16 pixels
+} FontKern;
+
+struct FontAtlas
+{
+    unsigned short lineheight;
+    unsigned short ascent;
+    unsigned int glyphcount;
+    unsigned int kerncount;
+    FontGlyph * glyphs;
+    FontKern * kerns;
+    short ascii[128];           // the glyph for each ASCII character, -1 for none, to save searching for them
+    unsigned char * atlas;
+};
+
+
+// LoadFont
+// reads a font made by makefont.py, length is the size of the data. The font is not tied to a display
+// so one can be used for all of them. Returns NULL if the data is not a valid font
+FontAtlas * LoadFont(const unsigned char * data, unsigned int length)
+{
+FontAtlas * font;
+FontGlyph * g;
+FontKern * k;
+const unsigned char * entry;
+unsigned int i,atlassize,size;
+
+    if ((length < FONT_HEADER_SIZE) || (memcmp(data, "C2PF", 4) != 0) || (ReadLE16(data + 4) != 1))
+    {
+        printf("LoadFont not a font made by makefont.py\n");
+        return (NULL);
+    }
+
+    font = (FontAtlas *) calloc(1, sizeof(FontAtlas));
+    if (font == NULL)
+        return (NULL);
+    font->lineheight = ReadLE16(data + 6);
+    font->ascent     = ReadLE16(data + 8);
+    font->glyphcount = ReadLE16(data + 10);
+    font->kerncount  = ReadLE32(data + 12);
+    atlassize        = ReadLE32(data + 16);
+
+    size = FONT_HEADER_SIZE + font->glyphcount*FONT_GLYPH_SIZE;
+    if ((size > length) || (font->kerncount > (length - size)/FONT_KERN_SIZE) ||
+        (atlassize > (length - size - font->kerncount*FONT_KERN_SIZE)))
+    {
+        printf("LoadFont the font data is too short\n");
+        free(font);
+        return (NULL);
+    }
+
+    font->glyphs = (FontGlyph *) malloc(font->glyphcount*sizeof(FontGlyph) + 1);
+    font->kerns  = (FontKern *) malloc(font->kerncount*sizeof(FontKern) + 1);
+    font->atlas  = (unsigned char *) malloc(atlassize + 1);
+    if ((font->glyphs == NULL) || (font->kerns == NULL) || (font->atlas == NULL))
+    {
+        FreeFont(font);
+        return (NULL);
+    }
+
+    memset(font->ascii, 0xFF, sizeof(font->ascii));
+    entry = data + FONT_HEADER_SIZE;
+    for (i = 0; i < font->glyphcount; i++, entry += FONT_GLYPH_SIZE)
+    {
+        g = &font->glyphs[i];
+        g->code    = ReadLE32(entry);
+        g->offset  = ReadLE32(entry + 4);
+        g->width   = entry[8];
+        g->height  = entry[9];
+        g->left    = (signed char)entry[10];
+        g->top     = (signed char)entry[11];
+        g->advance = ReadLE16(entry + 12);
+        // every glyph has to be inside the atlas and in order, for the search
+        if ((g->offset > atlassize) || ((unsigned int)((g->width + 1)/2)*g->height > atlassize - g->offset) ||
+            ((i > 0) && (g->code <= font->glyphs[i-1].code)))
+        {
+            printf("LoadFont glyph %u is not valid\n", i);
+            FreeFont(font);
+            return (NULL);
+        }
+        if (g->code < 128)
+            font->ascii[g->code] = i;
+    }
+    for (i = 0; i < font->kerncount; i++, entry += FONT_KERN_SIZE)
+    {
+        k = &font->kerns[i];
+        k->first  = ReadLE32(entry);
+        k->second = ReadLE32(entry + 4);
+        k->adjust = (short)ReadLE16(entry + 8);
+    }
+    memcpy(font->atlas, entry, atlassize);
+    return (font);
+}
+
+void FreeFont(FontAtlas * font)
+{
+    if (font == NULL)
+        return;
+    free(font->glyphs);
+    free(font->kerns);
+    free(font->atlas);
+    free(font);
+}
+
+// the next character of a UTF-8 string, anything that is not valid UTF-8 is taken a byte at a time as Latin-1
+static unsigned int NextCharacter(const unsigned char ** text)
+{
+const unsigned char * s = *text;
+unsigned int code,extra,i;
+
+    code = *s++;
+    extra = 0;
+    if ((code & 0xE0) == 0xC0)
+        extra = 1;
+    else if ((code & 0xF0) == 0xE0)
+        extra = 2;
+    else if ((code & 0xF8) == 0xF0)
+        extra = 3;
+    if (extra != 0)
+    {
+        for (i = 0; i < extra; i++)
+            if ((s[i] & 0xC0) != 0x80)
+                break;
+        if (i == extra)
+        {
+            code &= (0x3F >> extra);
+            for (i = 0; i < extra; i++)
+                code = (code << 6) | (*s++ & 0x3F);
+        }
+    }
+    *text = s;
+    return (code);
+}
+
+static const FontGlyph * FindGlyph(const FontAtlas * font, unsigned int code)
+{
+int low,high,middle;
+
+    if (code < 128)
+        return ((font->ascii[code] >= 0) ? &font->glyphs[font->ascii[code]] : NULL);
+
+    low = 0;
+    high = (int)font->glyphcount - 1;
+    while (low <= high)
+    {
+        middle = (low + high) / 2;
+        if (font->glyphs[middle].code == code)
+            return (&font->glyphs[middle]);
+        if (font->glyphs[middle].code < code)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return (NULL);
+}
+
+static int FindKerning(const FontAtlas * font, unsigned int first, unsigned int second)
+{
+int low,high,middle;
+const FontKern * k;
+
+    low = 0;
+    high = (int)font->kerncount - 1;
+    while (low <= high)
+    {
+        middle = (low + high) / 2;
+        k = &font->kerns[middle];
+        if ((k->first == first) && (k->second == second))
+            return (k->adjust);
+        if ((k->first < first) || ((k->first == first) && (k->second < second)))
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return (0);
+}
+
+// blends one glyph into the render space with its top left at x,y, each row trimmed to the pixels it covers
+static void DrawGlyph(DisplayContext * display, const FontAtlas * font, const FontGlyph * g, int x, int y, unsigned short colour)
+{
+unsigned short coverage[256];
+const unsigned char * row;
+int line,col,stride,first,last,left,right;
+unsigned int level;
+
+    stride = (g->width + 1) / 2;
+    row = font->atlas + g->offset;
+    for (line = 0; line < g->height; line++, row += stride)
+    {
+        if (((y + line) < 0) || ((y + line) > 239))
+            continue;
+
+        first = -1;
+        last = -1;
+        for (col = 0; col < g->width; col++)
+        {
+            level = (col & 1) ? (row[col/2] & 0x0F) : (row[col/2] >> 4);
+            coverage[col] = (level*273 + 8) >> 4;      // 0 to 15 as 0 to 256, the updatePixel intensities
+            if (level != 0)
+            {
+                if (first < 0)
+                    first = col;
+                last = col;
+            }
+        }
+        if (first < 0)
+            continue;
+
+        left = x + first;
+        right = x + last;
+        if (left < 0)
+            left = 0;
+        if (right > 239)
+            right = 239;
+        if ((left > right) || !ClipToDrawable(display, y + line, &left, &right))
+            continue;
+        BlendRenderSpan(display, display->RenderSpace + left + (y + line)*240, NULL, colour,
+                        coverage + left - x, 0, right - left + 1);
+    }
+}
+
+// lays out the text, drawing it if display is not NULL, and returns the advance and the box around the ink
+static int LayoutText(DisplayContext * display, const FontAtlas * font, int x, int y, const char * text,
+                      unsigned short colour, short * bounds)
+{
+const unsigned char * s = (const unsigned char *) text;
+const FontGlyph * g;
+unsigned int code,previous;
+int pen,gx,gy,x0,y0,x1,y1;
+
+    x0 = y0 = 0x7FFF;
+    x1 = y1 = -0x8000;
+    pen = x * 16;               // 1/16 pixels, so the fractions of the advances and kerning add up
+    previous = 0;
+    while (*s != 0)
+    {
+        code = NextCharacter(&s);
+        g = FindGlyph(font, code);
+        if (g == NULL)
+            g = FindGlyph(font, '?');
+        if (g == NULL)
+            continue;
+
+        if (previous != 0)
+            pen += FindKerning(font, previous, g->code);
+        previous = g->code;
+
+        if ((g->width != 0) && (g->height != 0))
+        {
+            gx = ((pen + 8) >> 4) + g->left;
+            gy = y + g->top;
+            if (display != NULL)
+                DrawGlyph(display, font, g, gx, gy, colour);
+            if (gx < x0)
+                x0 = gx;
+            if (gy < y0)
+                y0 = gy;
+            if ((gx + g->width - 1) > x1)
+                x1 = gx + g->width - 1;
+            if ((gy + g->height - 1) > y1)
+                y1 = gy + g->height - 1;
+        }
+        pen += g->advance;
+    }
+
+    if (x0 > x1)
+    {
+        // nothing to see, e.g. only spaces
+        x0 = y0 = 0;
+        x1 = y1 = -1;
+    }
+    if (bounds != NULL)
+    {
+        bounds[0] = x0;
+        bounds[1] = y0;
+        bounds[2] = x1;
+        bounds[3] = y1;
+    }
+    return (((pen + 8) >> 4) - x);
+}
+
+// DrawText
+// draws UTF-8 text in one colour with its top left at x,y (the top of the line, the baseline is the font's ascent below)
+// the edges are blended with what is already there. bounds (an array of 4 shorts, or NULL) is set to the x0,y0,x1,y1
+// of the area drawn on, which is also all that is marked as changed. Returns how far the text moves along
+int DrawText(DisplayContext * display, FontAtlas * font, short x, short y, const char * text, unsigned short colour, short * bounds)
+{
+short area[4];
+int advance;
+
+    STATS_SCOPE(display, STAT_TEXT);
+
+    if ((display->RenderSpace == NULL) || (font == NULL))
+        return (0);
+
+    advance = LayoutText(display, font, x, y, text, colour, area);
+    if (area[2] >= area[0])
+        MarkDrawnArea(display, area[0], area[1], area[2], area[3]);
+    if (bounds != NULL)
+        memcpy(bounds, area, sizeof(area));
+    return (advance);
+}
+
+// MeasureText
+// the same as DrawText without drawing anything, the text being placed at 0,0
+int MeasureText(FontAtlas * font, const char * text, short * bounds)
+{
+    if (font == NULL)
+        return (0);
+    return (LayoutText(NULL, font, 0, 0, text, 0, bounds));
+}
+
+// the line height and ascent of a font, for placing lines of text
+int GetFontHeight(FontAtlas * font)
+{
+    return ((font != NULL) ? font->lineheight : 0);
+}
+
+int GetFontAscent(FontAtlas * font)
+{
+    return ((font != NULL) ? font->ascent : 0);
+}
+
+
+
+// sprites
+// a small RGB565 image with an alpha channel that can be drawn at any angle and scale about a pivot point, e.g. a
+// watch hand drawn once (by PIL or by hand) and then turned each frame rather than drawn again as lines.
+// each pixel of the render space is mapped back into the sprite (16.16 fixed point) and the sprite sampled there,
+// either the nearest pixel or a bilinear mix of the four around it. The sprite is kept twice, the colours as given
+// for the nearest pixel and premultiplied 8 bit RGBA for the mixing, both with a clear border so the mix needs no checks
+struct Sprite
+{
+    unsigned short width,height;
+    int stride;                     // width + 2, for the border
+    unsigned short * colours;
+    unsigned char * alpha;
+    unsigned int * texels;          // red, green, blue, alpha from the bottom byte up, premultiplied
+};
+
+// LoadSprite
+// pixels are width*height RGB565 values as byte pairs, the same as BlitRGB565, and alpha is width*height bytes
+// (0 clear to 255 solid) or NULL for a solid rectangle. Both are copied, so can be freed after
+Sprite * LoadSprite(const unsigned char * pixels, const unsigned char * alpha, unsigned short width, unsigned short height)
+{
+Sprite * sprite;
+int row,col,size,index;
+unsigned int colour,red,green,blue,a;
+
+    if ((pixels == NULL) || (width == 0) || (height == 0))
+    {
+        printf("LoadSprite needs some pixels\n");
+        return (NULL);
+    }
+    // kept small enough for the positions in the sprite to fit in 16.16
+    if ((width > 4096) || (height > 4096))
+    {
+        printf("LoadSprite %ux%u is too big, 4096x4096 at most\n", width, height);
+        return (NULL);
+    }
+
+    sprite = (Sprite *) calloc(1, sizeof(Sprite));
+    if (sprite == NULL)
+        return (NULL);
+    sprite->width = width;
+    sprite->height = height;
+    sprite->stride = width + 2;
+    size = sprite->stride * (height + 2);
+    sprite->colours = (unsigned short *) calloc(size, sizeof(unsigned short));
+    sprite->alpha   = (unsigned char *) calloc(size, sizeof(unsigned char));
+    sprite->texels  = (unsigned int *) calloc(size, sizeof(unsigned int));
+    if ((sprite->colours == NULL) || (sprite->alpha == NULL) || (sprite->texels == NULL))
+    {
+        FreeSprite(sprite);
+        return (NULL);
+    }
+
+    for (row = 0; row < height; row++)
+    {
+        for (col = 0; col < width; col++)
+        {
+            colour = pixels[(row*width + col)*2] | (pixels[(row*width + col)*2 + 1] << 8);
+            a = (alpha != NULL) ? alpha[row*width + col] : 255;
+            index = (row + 1)*sprite->stride + col + 1;
+            sprite->colours[index] = colour;
+            sprite->alpha[index] = a;
+            // 5 and 6 bits out to 8 by repeating the top bits, then scaled by the alpha
+            red   = ((colour >> 11) << 3) | (colour >> 13);
+            green = (((colour >> 5) & 0x3F) << 2) | ((colour >> 9) & 0x03);
+            blue  = ((colour & 0x1F) << 3) | ((colour >> 2) & 0x07);
+            red   = (red*a + 127) / 255;
+            green = (green*a + 127) / 255;
+            blue  = (blue*a + 127) / 255;
+            sprite->texels[index] = red | (green << 8) | (blue << 16) | (a << 24);
+        }
+    }
+    return (sprite);
+}
+
+void FreeSprite(Sprite * sprite)
+{
+    if (sprite == NULL)
+        return;
+    free(sprite->colours);
+    free(sprite->alpha);
+    free(sprite->texels);
+    free(sprite);
+}
+
+// mixes two premultiplied texels, weight 0 to 256 of the second, red and blue in one step and green and alpha in the other
+static inline unsigned int MixTexels(unsigned int a, unsigned int b, unsigned int weight)
+{
+    return ((((( a       & 0x00FF00FF)*(256 - weight) + ( b       & 0x00FF00FF)*weight) >> 8) & 0x00FF00FF)
+          | (((((a >> 8) & 0x00FF00FF)*(256 - weight) + ((b >> 8) & 0x00FF00FF)*weight)     ) & 0xFF00FF00));
+}
+
+// DrawSpriteFixed
+// draws the sprite turned clockwise by angle (hundredths of a degree, the same as FillPieAA) and scaled by scale
+// (16.16 fixed point, 65536 is the size it is), with the point pivotx,pivoty of the sprite placed at x,y on the screen.
+// All the positions are 16.16 fixed point and pixel n covers n to n+1, so a pivot of 5.5 is the middle of pixel 5.
+// smooth mixes the four nearest sprite pixels for smooth edges, otherwise each pixel takes the nearest one
+// only the pixels the sprite lands on are touched, and only those are marked as changed
+void DrawSpriteFixed(DisplayContext * display, const Sprite * sprite, int x, int y, int pivotx, int pivoty,
+                     int angle, int scale, bool smooth)
+{
+unsigned short line[240],cov[240];
+long long dudx,dvdx,dudy,dvdy,inverse,rowu,rowv,lo,ulimit,vlimit,cx,cy,px,py;
+long long minx,maxx,miny,maxy;
+int sine,cosine,row,top,bottom,left,right,first,last,count,i,corner;
+int u,v,su,sv,fu,fv,iu,iv;
+int bandleft,bandright,bandtop;
+unsigned int texel,a,red,green,blue;
+const unsigned int * t;
+
+    STATS_SCOPE(display, STAT_SPRITE);
+
+    if ((display->RenderSpace == NULL) || (sprite == NULL) || (scale < 256))
+        return;
+
+    sine = SinFixed(angle);
+    cosine = CosFixed(angle);
+
+    // the box the turned sprite lands in, from its corners (a half pixel further out when mixing)
+    lo = smooth ? -32768 : 0;
+    ulimit = ((long long)sprite->width << 16) - lo;
+    vlimit = ((long long)sprite->height << 16) - lo;
+    minx = miny = 0x7FFFFFFFFFFFLL;
+    maxx = maxy = -0x7FFFFFFFFFFFLL;
+    for (corner = 0; corner < 4; corner++)
+    {
+        cx = (((corner & 1) ? ulimit : lo) - pivotx) * scale >> 16;
+        cy = (((corner & 2) ? vlimit : lo) - pivoty) * scale >> 16;
+        px = x + ((cx*cosine - cy*sine) >> 16);
+        py = y + ((cx*sine + cy*cosine) >> 16);
+        if (px < minx) minx = px;
+        if (px > maxx) maxx = px;
+        if (py < miny) miny = py;
+        if (py > maxy) maxy = py;
+    }
+    // a pixel out either way covers the rounding, the rows are trimmed to the sprite exactly below
+    minx = (minx >> 16) - 1;
+    maxx = (maxx >> 16) + 1;
+    top = (miny < (1LL << 16)) ? 0 : (miny >= (240LL << 16)) ? 240 : (int)(miny >> 16) - 1;
+    bottom = (maxy < 0) ? -1 : (maxy >= (239LL << 16)) ? 239 : (int)(maxy >> 16) + 1;
+    if ((minx > 239) || (maxx < 0) || (top > bottom))
+        return;
+    if (minx < 0)
+        minx = 0;
+    if (maxx > 239)
+        maxx = 239;
+
+    // the steps through the sprite for one pixel across and one down, the turn backwards and divided by the scale
+    inverse = (1LL << 32) / scale;
+    dudx = ( cosine*inverse) >> 16;
+    dvdx = (-sine*inverse) >> 16;
+    dudy = ( sine*inverse) >> 16;
+    dvdy = ( cosine*inverse) >> 16;
+
+    bandleft = 240;
+    bandright = -1;
+    bandtop = 0;
+    for (row = top; row <= bottom; row++)
+    {
+        left = (int)minx;
+        right = (int)maxx;
+        if (ClipToDrawable(display, row, &left, &right))
+        {
+            // the sprite position of the middle of the first pixel, then only the part of the row inside the sprite
+            px = ((long long)left << 16) + 32768 - x;
+            py = ((long long)row << 16) + 32768 - y;
+            rowu = pivotx + ((px*dudx + py*dudy) >> 16);
+            rowv = pivoty + ((px*dvdx + py*dvdy) >> 16);
+            first = 0;
+            last = right - left;
+            if (LinearSpan(rowu, dudx, lo, ulimit, &first, &last) && LinearSpan(rowv, dvdx, lo, vlimit, &first, &last))
+            {
+                count = last - first + 1;
+                u = (int)(rowu + first*dudx);
+                v = (int)(rowv + first*dvdx);
+                if (!smooth)
+                {
+                    for (i = 0; i < count; i++, u += (int)dudx, v += (int)dvdx)
+                    {
+                        iu = ((v >> 16) + 1)*sprite->stride + (u >> 16) + 1;
+                        line[i] = sprite->colours[iu];
+                        a = sprite->alpha[iu];
+                        cov[i] = a + (a >> 7);
+                    }
+                }
+                else
+                {
+                    for (i = 0; i < count; i++, u += (int)dudx, v += (int)dvdx)
+                    {
+                        // the sample is between the pixel middles, su,sv is the top left one of the four (-1 to width-1)
+                        su = u - 32768;
+                        sv = v - 32768;
+                        iu = su >> 16;
+                        iv = sv >> 16;
+                        fu = (su >> 8) & 0xFF;
+                        fv = (sv >> 8) & 0xFF;
+                        t = sprite->texels + (iv + 1)*sprite->stride + iu + 1;
+                        // inside a solid part, or in the clear around it, the four are the same and there is nothing to mix
+                        texel = t[0];
+                        if ((texel != t[1]) || (texel != t[sprite->stride]) || (texel != t[sprite->stride + 1]))
+                            texel = MixTexels(MixTexels(texel, t[1], fu), MixTexels(t[sprite->stride], t[sprite->stride + 1], fu), fv);
+                        a = texel >> 24;
+                        cov[i] = a + (a >> 7);
+                        if (a == 0)
+                        {
+                            line[i] = 0;
+                            continue;
+                        }
+                        red   = texel & 0xFF;
+                        green = (texel >> 8) & 0xFF;
+                        blue  = (texel >> 16) & 0xFF;
+                        if (a != 255)
+                        {
+                            // back to the plain colour for the blend, only at the edges
+                            a = (255 << 16) / a;
+                            red   = (red*a + 32768) >> 16;
+                            green = (green*a + 32768) >> 16;
+                            blue  = (blue*a + 32768) >> 16;
+                            if (red > 255) red = 255;
+                            if (green > 255) green = 255;
+                            if (blue > 255) blue = 255;
+                        }
+                        line[i] = ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+                    }
+                }
+                // the clear corners of the sprite are left out, of the blend and of the area changed
+                for (i = 0; (i < count) && (cov[i] == 0); i++)
+                    ;
+                while ((count > i) && (cov[count - 1] == 0))
+                    count--;
+                if (i < count)
+                {
+                    BlendRenderSpan(display, display->RenderSpace + row*240 + left + first + i, line + i, 0, cov + i, 0, count - i);
+                    last = first + count - 1;
+                    first += i;
+
+                    if (bandright < 0)
+                        bandtop = row;
+                    if ((left + first) < bandleft)
+                        bandleft = left + first;
+                    if ((left + last) > bandright)
+                        bandright = left + last;
+                }
+            }
+        }
+
+        if ((bandright >= 0) && (((row % COVER_BAND) == (COVER_BAND-1)) || (row == bottom)))
+        {
+            MarkDrawnArea(display, bandleft, bandtop, bandright, row);
+            bandleft = 240;
+            bandright = -1;
+        }
+    }
+}
+
+// DrawSprite
+// the same in whole pixels, e.g. DrawSprite(display, hand, 120, 120, 5, 85, angle, 65536, true) for a 10 pixel wide hand
+// with its pivot 85 pixels down, whose pixel 5,85 is drawn at 120,120 and the rest turned about its top left corner
+void DrawSprite(DisplayContext * display, const Sprite * sprite, short x, short y, short pivotx, short pivoty,
+                int angle, int scale, bool smooth)
+{
+    STATS_SCOPE(display, STAT_SPRITE);
+
+    DrawSpriteFixed(display, sprite, x * 65536, y * 65536, pivotx * 65536, pivoty * 65536, angle, scale, smooth);
+}
+
+
+
+// ScreenUpdate
+// routine to do the write to the screen as a memory dump from the render space
+void ScreenUpdate(DisplayContext * display)
+{
+DirtyRegion full = {{{0,0,239,239}}, 1};
+
+    STATS_SCOPE(display, STAT_FLUSH);
+
+    if (display->RenderSpace !=NULL)
+    {
+        WaitForFlush(display);
+        SendDirtyRegion(display, display->RenderSpace, &full);        // 240x240
+        SendScrollStart(display, display->ScrollStart);
+        display->ScreenDamage.count = 0;
+    }
+}
+
+
+// ScreenUpdateDirty
+// partial version of the screen update which only sends the areas changed since the last update
+// the changed areas are sent as separate windows, unless one window covering them all is cheaper
+// for a watch face with a restored reference image this is a small fraction of the full screen
+void ScreenUpdateDirty(DisplayContext * display)
+{
+    STATS_SCOPE(display, STAT_FLUSH);
+
+    // with a scrolling area there may be a new start address to send even when no pixels changed
+    if ((display->RenderSpace ==NULL) || ((display->ScreenDamage.count == 0) && (display->ScrollCount == 0)))
+        return;
+
+    WaitForFlush(display);
+    if (display->ScreenDamage.count != 0)
+    {
+        PlanDirtyRegion(&display->ScreenDamage);
+        SendDirtyRegion(display, display->RenderSpace, &display->ScreenDamage);
+    }
+    SendScrollStart(display, display->ScrollStart);
+    display->ScreenDamage.count = 0;
+}
+
+
+// ScreenUpdateAsync
+// the same as ScreenUpdate (or ScreenUpdateDirty if partial is set) but returns as soon as the frame
+// has been handed to the flush thread. The render space can be drawn on straight away.
+// only the areas being sent are copied to the flush space, and if the previous frame is still
+// going out this waits for it first, so drawing can never get more than one frame ahead
+void ScreenUpdateAsync(DisplayContext * display, bool partial)
+{
+int i,y,offset,first,last;
+DirtyRect * r;
+
+    STATS_SCOPE(display, STAT_FLUSH);
+
+    if (display->RenderSpace ==NULL)
+        return;
+
+    WaitForFlush(display);
+    if (!StartFlushThread(display))
+    {
+        // no thread, so just do it the normal way
+        if (partial)
+            ScreenUpdateDirty(display);
+        else
+            ScreenUpdate(display);
+        return;
+    }
+
+    if (!partial)
+    {
+        display->ScreenDamage.rect[0].x0 = 0;
+        display->ScreenDamage.rect[0].y0 = 0;
+        display->ScreenDamage.rect[0].x1 = 239;
+        display->ScreenDamage.rect[0].y1 = 239;
+        display->ScreenDamage.count = 1;
+    }
+    if (display->ScreenDamage.count == 0)
+    {
+        SendScrollStart(display, display->ScrollStart);     // nothing to wait for, the thread is idle
+        return;
+    }
+
+    PlanDirtyRegion(&display->ScreenDamage);
+    for (i = 0; i < display->ScreenDamage.count; i++)
+    {
+        r = &display->ScreenDamage.rect[i];
+        for (y = r->y0; y <= r->y1; y++)
+        {
+            first = r->x0;
+            last = r->x1;
+            if (!ClipToVisible(display, y, &first, &last))
+                continue;
+            offset = first + y*240;
+            memcpy(display->FlushSpace+offset, display->RenderSpace+offset, (last - first + 1)*2);
+        }
+    }
+
+    pthread_mutex_lock(&display->FlushLock);
+    display->FlushRegion = display->ScreenDamage;
+    display->FlushScrollStart = display->ScrollStart;
+    display->FlushPending = true;
+    pthread_cond_signal(&display->FlushWake);
+    pthread_mutex_unlock(&display->FlushLock);
+
+    display->ScreenDamage.count = 0;
+}
+
+// ScreenUpdateMany
+// hands each display's frame to its own flush thread and then waits for them all, so displays on separate
+// buses are sent at the same time and the whole update takes about as long as the slowest one
+// (displays sharing the bcm2835 SPI still take turns, a transfer at a time)
+void ScreenUpdateMany(DisplayContext ** displays, int count, bool partial)
+{
+int i;
+
+    for (i = 0; i < count; i++)
+        ScreenUpdateAsync(displays[i], partial);
+    for (i = 0; i < count; i++)
+        WaitForFlush(displays[i]);
+}
+
+
+// counters of the bytes sent by the screen updates and the bytes the partial updates avoided sending
+// these are 64 bit, so set the restype to c_ulonglong when using from Python. The flush thread adds to them,
+// so they are read once it has finished
+unsigned long long GetFlushBytesSent(DisplayContext * display)
+{
+    WaitForFlush(display);
+    return (display->FlushBytesSent);
+}
+
+unsigned long long GetFlushBytesSaved(DisplayContext * display)
+{
+    WaitForFlush(display);
+    return (display->FlushBytesSaved);
+}
+
+void ResetFlushCounters(DisplayContext * display)
+{
+    WaitForFlush(display);
+    display->FlushBytesSent  = 0;
+    display->FlushBytesSaved = 0;
+}
+
+
+// SetContentDiff
+// keeps a copy of what the panel has and sends only the changed part of each row of an update, for full frames
+// where most of the picture stays the same. threshold is the percentage of the compared pixels that may change
+// before the update is sent as it would have been without the diff (0 always does, 100 never does).
+// it starts comparing after the next full ScreenUpdate, and anything sent to the panel by other means
+// (SetScreenWriteArea and sdoDataBuffer from Python) is not seen, so call it again after doing that
+bool SetContentDiff(DisplayContext * display, bool enable, int threshold)
+{
+    WaitForFlush(display);
+    if (!enable)
+    {
+        if (display->ShadowSpace != NULL)
+            free(display->ShadowSpace);
+        display->ShadowSpace = NULL;
+        display->ShadowValid = false;
+        return (true);
+    }
+
+    if ((threshold < 0) || (threshold > 100))
+    {
+        printf("ERROR - the content diff threshold should be 0 to 100, not %d\n", threshold);
+        return (false);
+    }
+    if (display->ShadowSpace == NULL)
+    {
+        display->ShadowSpace = (unsigned short *) malloc(240*240*2);
+        if (display->ShadowSpace == NULL)
+        {
+            printf("ERROR - display->ShadowSpace was not created\n");
+            return (false);
+        }
+    }
+    display->ShadowValid = false;
+    display->DiffThreshold = threshold;
+    return (true);
+}
 
-// these are equivalent to the above but are based on integer maths with a fix position decimal at the 16bit boundary
-unsigned int fpartI(int x)      // x is 16 bits to 1
+
+// statistics for the content diff, see DIFF_STAT_ in the header
+void GetDiffStats(DisplayContext * display, unsigned long long * stats, int count)
 {
-    return ((unsigned int)((x&0xffff)>>8));
+unsigned long long values[DIFF_STATS];
+int i;
+
+    WaitForFlush(display);
+    values[DIFF_STAT_UPDATES] = display->DiffUpdates;
+    values[DIFF_STAT_COMPARED] = display->DiffCompared;
+    values[DIFF_STAT_CHANGED] = display->DiffChanged;
+    values[DIFF_STAT_ROWS] = display->DiffRows;
+    values[DIFF_STAT_FULL] = display->DiffFull;
+    values[DIFF_STAT_RATIO] = (display->DiffCompared == 0) ? 0 : (display->DiffChanged*1000)/display->DiffCompared;
+    for (i = 0; (i < count) && (i < DIFF_STATS); i++)
+        stats[i] = values[i];
 }
 
-unsigned int rfpartI(int x)     // x is 16 bits to 1
+void ResetDiffStats(DisplayContext * display)
 {
-    return (256 - (unsigned int)((x&0xffff)>>8));
+    WaitForFlush(display);
+    display->DiffUpdates = 0;
+    display->DiffCompared = 0;
+    display->DiffChanged = 0;
+    display->DiffRows = 0;
+    display->DiffFull = 0;
 }
 
 
-// python easy call for access using shorts.  See below for actual algorythm
-void DrawLineAA(short x0,short y0, short x1, short y1, unsigned short colour)
+// SetTearingSync
+// paces the screen updates with the panel's TE pin wired to the given GPIO (BCM numbering), or -1 to stop.
+// call after initCircularDisp, which turns the TE output on. The scan period is measured from the first two
+// pulses, and if there are none (the pin is not connected) it returns false and the updates are not paced.
+// with the emulator backend any pin number uses its software TE pulses (see SetEmulatorScanRate)
+bool SetTearingSync(DisplayContext * display, int pin)
 {
-    DrawLineFloat(x0, y0, x1, y1,colour, false);
+long long first,second;
+
+    WaitForFlush(display);
+    if (!display->Backend->tearsetup(display, pin))
+        return (false);
+    display->TearingPin = pin;
+    if (pin < 0)
+        return (true);
+
+    if (!display->Backend->tearwait(display, 100000, &first) || !display->Backend->tearwait(display, 100000, &second))
+    {
+        printf("no TE pulses seen on GPIO %d\n", pin);
+        display->Backend->tearsetup(display, -1);
+        display->TearingPin = -1;
+        return (false);
+    }
+    display->TearingPeriod = second - first;
+    display->TearingLastEdge = 0;
+    return (true);
 }
 
 
-//version of the line drawing routine that uses floating point mathematics including anti aliasing
-// this code is based on Xiaolin Wu's algorythm, details of which can be found at:
-// https://en.wikipedia.org/wiki/Xiaolin_Wu%27s_line_algorithm
-// this is slower than the raw integer version shown below, but does look much cleaner on the display
-void DrawLineFloat(float x0,float y0, float x1, float y1, unsigned short colour,bool fill)
+// GetTearingStats
+// fills in up to count of the TE_STAT_ values (see the header), the times are in microseconds
+void GetTearingStats(DisplayContext * display, unsigned int * stats, int count)
 {
-bool steep =false;
-float temp;
-float deltax,deltay;
-int gradient ;
-float xend,yend;
-float xgap;
-float xpxl1,ypxl1,xpxl2,ypxl2;
-int x;
-int intery;
+unsigned int values[TE_STATS];
+long long mean,variance;
+int i;
+
+    WaitForFlush(display);              // the paced sending on the flush thread updates these
+    mean = (display->TearingFrames != 0) ? display->TearingLatencySum / display->TearingFrames : 0;
+    variance = (display->TearingFrames != 0) ? display->TearingLatencySquares / display->TearingFrames - (mean/1000)*(mean/1000) : 0;
+
+    values[TE_STAT_FRAMES]       = display->TearingFrames;
+    values[TE_STAT_TIMEOUTS]     = display->TearingTimeouts;
+    values[TE_STAT_MISSED]       = display->TearingMissed;
+    values[TE_STAT_SPLIT]        = display->TearingSplit;
+    values[TE_STAT_OVERRUNS]     = display->TearingOverruns;
+    values[TE_STAT_LATENCY]      = (unsigned int)(mean / 1000);
+    values[TE_STAT_LATENCY_MAX]  = (unsigned int)(display->TearingLatencyMax / 1000);
+    values[TE_STAT_JITTER]       = (variance > 0) ? (unsigned int)sqrt((double)variance) : 0;
+    values[TE_STAT_PERIOD]       = (unsigned int)(display->TearingPeriod / 1000);
+
+    for (i = 0; (i < count) && (i < TE_STATS); i++)
+        stats[i] = values[i];
+}
 
-    if(abs(y1 - y0) > abs(x1 - x0))
-        steep = true;
-    
-    if (steep)      // Y or X as the main direction Steep = true if more Y than X change
-    {
-        temp = y0;
-        y0 = x0;
-        x0 = temp;
+void ResetTearingStats(DisplayContext * display)
+{
+    WaitForFlush(display);
+    display->TearingFrames = 0;
+    display->TearingTimeouts = 0;
+    display->TearingMissed = 0;
+    display->TearingSplit = 0;
+    display->TearingOverruns = 0;
+    display->TearingLatencySum = 0;
+    display->TearingLatencySquares = 0;
+    display->TearingLatencyMax = 0;
+    display->TearingLastEdge = 0;
+}
 
-        temp = y1;
-        y1 = x1;
-        x1 = temp;
-    }
 
-    if (x0 > x1) 
+// frame loop
+// RunFrameLoop calls back to draw each frame at a fixed rate, sends it and then sleeps until the next one is due,
+// so an animation runs at a steady speed with the CPU idle between frames instead of spinning in Python.
+// the deadlines are absolute, so the time taken by each frame does not build up into drift
+
+static int CompareTimes(const void * a, const void * b)
+{
+    return ((*(const unsigned int *)a > *(const unsigned int *)b) - (*(const unsigned int *)a < *(const unsigned int *)b));
+}
+
+// the value below which a percentage of the kept times fall
+static unsigned int Percentile(const unsigned int * times, unsigned int count, unsigned int percent)
+{
+unsigned int sorted[FRAME_HISTORY];
+
+    if (count == 0)
+        return (0);
+    memcpy(sorted, times, count * sizeof(unsigned int));
+    qsort(sorted, count, sizeof(unsigned int), CompareTimes);
+    return (sorted[((count - 1) * percent) / 100]);
+}
+
+
+// RunFrameLoop
+// draws and sends frames at fps until the callback returns false or StopFrameLoop is called.
+// the callback is given the frame number, counted at fps from the start including any frames that were skipped,
+// so frame/fps is the time the frame is for. update is one of the FRAME_UPDATE_ modes, with FRAME_RESTORE added
+// to restore the reference image after each frame is sent. When a frame takes longer than its slot, the
+// frames whose time has already gone are skipped rather than drawn late. returns the number of frames drawn
+int RunFrameLoop(DisplayContext * display, unsigned int fps, FrameCallback callback, int update)
+{
+long long period,start,deadline,drawstart,flushstart,done;
+unsigned int frame,index,skip,drawn;
+
+    if ((fps == 0) || (callback == NULL) || (display->RenderSpace == NULL))
+        return (0);
+
+    period = 1000000000LL / fps;
+    display->FrameLoopStop = false;
+    drawn = 0;
+    frame = 0;
+    start = NowNs();
+    deadline = start;
+    while (!display->FrameLoopStop)
     {
-        temp = x1;
-        x1 = x0;
-        x0 = temp;
+        SleepUntilNs(deadline);
 
-        temp = y1;
-        y1 = y0;
-        y0 = temp;
+        drawstart = NowNs();
+        if (!callback(frame))
+            break;
+
+        flushstart = NowNs();
+        switch (update & 3)
+        {
+            case FRAME_UPDATE_FULL:         ScreenUpdate(display);             break;
+            case FRAME_UPDATE_DIRTY:        ScreenUpdateDirty(display);        break;
+            case FRAME_UPDATE_ASYNC:        ScreenUpdateAsync(display, false);   break;
+            case FRAME_UPDATE_ASYNC_DIRTY:  ScreenUpdateAsync(display, true);    break;
+        }
+        if (update & FRAME_RESTORE)
+            RestoreReferenceImage(display);
+        done = NowNs();
+
+        index = display->FrameCount % FRAME_HISTORY;
+        display->FrameDrawTimes[index]  = (unsigned int)((flushstart - drawstart) / 1000);
+        display->FrameFlushTimes[index] = (unsigned int)((done - flushstart) / 1000);
+        display->FrameCount++;
+        display->FrameBusy += done - drawstart;
+        drawn++;
+
+        // the next frame, or if that is already late the first one still to come
+        frame++;
+        deadline += period;
+        if (done > deadline)
+        {
+            skip = (unsigned int)((done - deadline) / period) + 1;
+            display->FrameDropped += skip;
+            frame += skip;
+            deadline += skip * period;
+        }
     }
-    
-    deltax = x1 - x0;
-    deltay = y1 - y0;
+    WaitForFlush(display);
+    display->FrameElapsed += NowNs() - start;
+    return (drawn);
+}
 
-    if (deltax == 0.0)
-        gradient  = 65536;      // 16 bit nominal 1.0
-    else
-        gradient  = (int)((deltay/deltax)*65536.0);
+// StopFrameLoop
+// ends RunFrameLoop after the current frame, for use from another thread or from within the callback
+void StopFrameLoop(DisplayContext * display)
+{
+    display->FrameLoopStop = true;
+}
 
-    // handle first endpoint
-    xend = round(x0);
-    yend = y0 + ((float)gradient)/65536.0  * (xend - x0);
-    xgap = rfpart(x0 + 0.5);
-    xpxl1 = xend;     // this will be used in the main loop
-    ypxl1 = floor(yend);
+// GetFrameStats
+// fills in up to count of the FRAME_STAT_ values (see the header), the times are in microseconds
+// the percentiles are over the last FRAME_HISTORY frames
+void GetFrameStats(DisplayContext * display, unsigned int * stats, int count)
+{
+unsigned int values[FRAME_STATS];
+unsigned int total[FRAME_HISTORY];
+unsigned int kept,i;
+
+    kept = (display->FrameCount < FRAME_HISTORY) ? display->FrameCount : FRAME_HISTORY;
+    for (i = 0; i < kept; i++)
+        total[i] = display->FrameDrawTimes[i] + display->FrameFlushTimes[i];
+
+    values[FRAME_STAT_FRAMES]    = display->FrameCount;
+    values[FRAME_STAT_DROPPED]   = display->FrameDropped;
+    values[FRAME_STAT_P50]       = Percentile(total, kept, 50);
+    values[FRAME_STAT_P99]       = Percentile(total, kept, 99);
+    values[FRAME_STAT_DRAW_P50]  = Percentile(display->FrameDrawTimes, kept, 50);
+    values[FRAME_STAT_DRAW_P99]  = Percentile(display->FrameDrawTimes, kept, 99);
+    values[FRAME_STAT_FLUSH_P50] = Percentile(display->FrameFlushTimes, kept, 50);
+    values[FRAME_STAT_FLUSH_P99] = Percentile(display->FrameFlushTimes, kept, 99);
+    values[FRAME_STAT_BUSY]      = (display->FrameElapsed != 0) ? (unsigned int)((display->FrameBusy * 100) / display->FrameElapsed) : 0;
+
+    for (i = 0; ((int)i < count) && (i < FRAME_STATS); i++)
+        stats[i] = values[i];
+}
 
-    yend = yend*65536;
-    if (steep)
+void ResetFrameStats(DisplayContext * display)
+{
+    display->FrameCount = 0;
+    display->FrameDropped = 0;
+    display->FrameBusy = 0;
+    display->FrameElapsed = 0;
+}
+
+
+// GetStats
+// copies count of the instrumentation values (STAT_KINDS*STAT_VALUES for all of them, see the header) after any
+// frame still being sent has gone. Returns false, with the values all 0, if the library was built without C2PY_STATS
+bool GetStats(DisplayContext * display, unsigned long long * stats, int count)
+{
+int i;
+
+    WaitForFlush(display);
+    for (i = 0; (i < count) && (i < STAT_KINDS*STAT_VALUES); i++)
     {
-        updatePixel(ypxl1,   xpxl1,  colour, rfpartI(yend) * xgap);
-        updatePixel(ypxl1+1, xpxl1,  colour, fpartI (yend) * xgap);
+#ifdef C2PY_STATS
+        stats[i] = display->Stats[i / STAT_VALUES][i % STAT_VALUES];
+#else
+        stats[i] = 0;
+#endif
     }
-    else
+#ifdef C2PY_STATS
+    return (true);
+#else
+    return (false);
+#endif
+}
+
+void ResetStats(DisplayContext * display)
+{
+#ifdef C2PY_STATS
+    WaitForFlush(display);
+    memset(display->Stats, 0, sizeof(display->Stats));
+    memset(display->StatHistogram, 0, sizeof(display->StatHistogram));
+    display->StatLastFrame = 0;
+#endif
+}
+
+// GetFrameHistogram
+// copies count of the STAT_HISTOGRAM frame time buckets, one for each millisecond
+void GetFrameHistogram(DisplayContext * display, unsigned int * buckets, int count)
+{
+int i;
+
+    WaitForFlush(display);
+    for (i = 0; (i < count) && (i < STAT_HISTOGRAM); i++)
     {
-        updatePixel(xpxl1, ypxl1  ,  colour, rfpartI(yend) * xgap);
-        updatePixel(xpxl1, ypxl1+1,  colour, fpartI(yend) * xgap);
+#ifdef C2PY_STATS
+        buckets[i] = display->StatHistogram[i];
+#else
+        buckets[i] = 0;
+#endif
     }
-    intery = (int)(yend + gradient); // first y-intersection for the main loop
-    
-    // handle second endpoint
-    xend = round(x1);
-    yend = y1 + ((float)gradient)/65536.0 * (xend - x1);
-    xgap = fpart(x1 + 0.5);
-    xpxl2 = xend; //this will be used in the main loop
-    ypxl2 = floor(yend);
+}
 
-    yend = yend*65536;
-    if (steep)
+// StartTrace
+// starts keeping (up to) events primitives and sends for SaveTrace, throwing away any kept before. 0 stops it
+// returns false if there is no room for them, or without C2PY_STATS
+bool StartTrace(DisplayContext * display, unsigned int events)
+{
+#ifdef C2PY_STATS
+TraceEvent * trace;
+
+    WaitForFlush(display);
+    trace = NULL;
+    if (events != 0)
     {
-        updatePixel(ypxl2  , xpxl2, colour, rfpartI(yend) * xgap);
-        updatePixel(ypxl2+1, xpxl2, colour, fpartI(yend) * xgap);
+        trace = (TraceEvent *) malloc(events * sizeof(TraceEvent));
+        if (trace == NULL)
+        {
+            printf("Error unable to create the trace\n");
+            return (false);
+        }
     }
-    else
+    free(display->Trace);
+    display->Trace = trace;
+    display->TraceSize = events;
+    display->TraceCount = 0;
+    return (trace != NULL);
+#else
+    return (false);
+#endif
+}
+
+// SaveTrace
+// writes the kept events as a Chrome trace, complete ("X") events in microseconds from the first one, with the
+// drawing and the updates on one track and the flush thread's sending on another
+bool SaveTrace(DisplayContext * display, const char * path)
+{
+#ifdef C2PY_STATS
+static const char * names[STAT_KINDS] =
+{
+    "pixel", "line", "line AA", "wide line", "polygon", "circle", "ring", "image", "text", "sprite",
+    "fill", "restore", "screen update", "send"
+};
+FILE * file;
+unsigned int i,count;
+long long origin;
+const TraceEvent * e;
+
+    WaitForFlush(display);
+    if (display->Trace == NULL)
     {
-        updatePixel(xpxl2, ypxl2,   colour, rfpartI(yend) * xgap);
-        updatePixel(xpxl2, ypxl2+1, colour, fpartI(yend) * xgap);
+        printf("SaveTrace there is no trace, call StartTrace first\n");
+        return (false);
     }
-    
-    if (fill)
+    file = fopen(path, "w");
+    if (file == NULL)
     {
-        // main loop  but for fill case
-        if (steep)
-        {
-            //printf("steep line\n");
-            for (x = xpxl1 + 1; x < xpxl2; x++)
-            {
-                SetPixel(intery>>16  , x, colour);
-                SetPixel((intery>>16)+1, x, colour);
-                intery = intery + gradient;
-            }
-        }
-        else
-        {
-            //printf("not steep line\n");
-            for (x = xpxl1 + 1;x < xpxl2; x++)
-            { 
-                SetPixel(x, intery>>16,  colour);
-                SetPixel(x, (intery>>16)+1,colour);
-                intery = intery + gradient;
-            } 
-        
-        }
+        printf("SaveTrace unable to create %s\n", path);
+        return (false);
     }
-    else
+
+    count = (display->TraceCount < display->TraceSize) ? display->TraceCount : display->TraceSize;
+    origin = (count != 0) ? display->Trace[0].start : 0;
+    for (i = 1; i < count; i++)
+        if (display->Trace[i].start < origin)
+            origin = display->Trace[i].start;         // the events are kept as they end, not as they start
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"caller\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"flush thread\"}}");
+    for (i = 0; i < count; i++)
     {
-        // main loop  but for single line case
-        if (steep)
-        {
-            //printf("steep line\n");
-            for (x = xpxl1 + 1; x < xpxl2; x++)
-            {
-                updatePixel(intery>>16  , x, colour, rfpartI(intery));
-                updatePixel((intery>>16)+1, x, colour, fpartI(intery));
-                intery = intery + gradient;
-            }
-        }
-        else
-        {
-            //printf("not steep line\n");
-            for (x = xpxl1 + 1;x < xpxl2; x++)
-            { 
-                updatePixel(x, intery>>16,  colour, rfpartI(intery));
-                updatePixel(x, (intery>>16)+1,colour, fpartI(intery));
-                intery = intery + gradient;
-            } 
-        
-        }
+        e = &display->Trace[i];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                names[e->kind], (e->start - origin) / 1000.0, (e->end - e->start) / 1000.0, e->thread);
     }
+    fprintf(file, "\n],\"otherData\":{\"dropped\":%u}}\n", display->TraceCount - count);
+    fclose(file);
+    return (true);
+#else
+    printf("SaveTrace the library was built without C2PY_STATS\n");
+    return (false);
+#endif
 }
 
 
-// DrawLine
-// simple line drawing in the render space
-// allows for lines on and off screen
-// Bresenham's Line Drawing Algorithm is used for this, which provides a fast integer only drawing routine
-// https://www.includehelp.com/computer-graphics/bresenhams-line-drawing-algorithm.aspx explains the logic behind it
-// this has however been optimised for direction and for X or Y priority
-void DrawLineIntMaths(short Xstart,short Ystart, short Xend, short Yend, unsigned short colour)
+// convert a 8 byte set of R G B values into the 16 bit combined 5 Red 6 Green and 5 Blue 
+// patten that is used by the display chip
+unsigned short RGBto16bit(unsigned char Red, unsigned char Green, unsigned char Blue)
 {
-short Xerr,Yerr;
-short Xdelta,Ydelta,Step;
-short incX,incXY,incY;
-short x,y;
-short dir;
-
+    return ( ((Red>>3)<<11) | ((Green>>2)<<5) | (Blue>>3));
+}
 
-    //printf("OLD CODE\n");
-    Xdelta = Xend-Xstart;
-    Ydelta = Yend-Ystart;
 
 
-    if (abs(Xdelta)>abs(Ydelta))
-    {
-        // X direction is larger or equal  
+// draw lists
+// calling from Python costs more per call than most of the lines take to draw, so a whole frame of drawing
+// can be packed into one byte array and run here in a single call. drawlist.py builds these.
+// each command is an opcode byte followed by its values, all little endian 16 bit (signed for co-ordinates)
+#define DL_END          0x00    // stop here, anything after is ignored
+#define DL_LINE         0x01    // x0 y0 x1 y1 colour             DrawLineIntMaths
+#define DL_LINE_AA      0x02    // x0 y0 x1 y1 colour             DrawLineAA
+#define DL_LINE_WIDE    0x03    // x0 y0 x1 y1 colour width       DrawLineWideAA
+#define DL_CIRCLE       0x04    // x y r colour                   DrawCircle
+#define DL_RECT         0x05    // x0 y0 x1 y1 colour             DrawRectangle
+#define DL_PIXEL        0x06    // x y colour                     SetPixel
+#define DL_BLIT         0x07    // x y width height, then width*height pixels     BlitRGB565
+#define DL_UPDATE       0x08    // mode, 0 ScreenUpdate 1 ScreenUpdateDirty 2 async full 3 async partial
+#define DL_RESTORE      0x09    // (nothing)                      RestoreReferenceImage
+#define DL_CLEAR        0x0A    // colour, fills the render space (inside the clip rectangle) without updating the screen
+#define DL_LINE_CAPPED  0x0B    // x0 y0 x1 y1 colour width cap   DrawLineWideCapped
+#define DL_PIE          0x0C    // x y r start end colour         FillPieAA (angles unsigned)
+#define DL_POLYGON      0x0D    // count colour, then count x y pairs     FillPolygonAA
+#define DL_DISC         0x0E    // x y r colour                   FillCircleAA
+#define DL_ARC          0x0F    // x y r width start end colour   DrawArcAA (angles unsigned)
+#define DL_CLIP         0x10    // x0 y0 x1 y1                    PushClipRect
+#define DL_UNCLIP       0x11    // (nothing)                      PopClipRect
+
+static inline short DLValue(const unsigned char * cmds, unsigned int pos)
+{
+    return ((short)(cmds[pos] | (cmds[pos+1]<<8)));
+}
 
-        // make sure the lines always go from lowX to high X
-        // makes the rest of the code simpler
-        if(Xstart>Xend)
-        {
-            short temp=Xend;
-            Xend = Xstart;
-            Xstart=temp;
 
-            temp = Yend;
-            Yend= Ystart;
-            Ystart = temp;
-        }
+// number of 16 bit values after each opcode
+static const unsigned char DLArgCount[] = { 0, 5, 5, 6, 4, 5, 3, 4, 1, 0, 1, 7, 6, 2, 4, 7, 4, 0 };
 
-        Xdelta = Xend-Xstart;
-        Ydelta = Yend-Ystart;
+// DrawListCommandSize
+// the bytes taken by the command at pos, with any pixels or points after it, or 0 if it is unknown or cut short
+static unsigned int DrawListCommandSize(const unsigned char * cmds, unsigned int pos, unsigned int length)
+{
+unsigned int size;
 
-        x = Xstart;
-        y = Ystart;
+    if (cmds[pos] >= sizeof(DLArgCount))
+    {
+        printf("ExecuteDrawList unknown command %d at %u\n", cmds[pos], pos);
+        return (0);
+    }
 
-        if (Yend<Ystart)
+    size = 1 + DLArgCount[cmds[pos]]*2;
+    if ((pos + size) > length)
+    {
+        printf("ExecuteDrawList command at %u is cut short\n", pos);
+        return (0);
+    }
+    if (cmds[pos] == DL_BLIT)
+    {
+        size += (unsigned short)DLValue(cmds, pos + 5) * (unsigned short)DLValue(cmds, pos + 7) * 2;
+        if ((pos + size) > length)
         {
-            dir =-1;
-            Ydelta = -Ydelta;
+            printf("ExecuteDrawList image at %u is cut short\n", pos);
+            return (0);
         }
-        else
+    }
+    else if (cmds[pos] == DL_POLYGON)
+    {
+        size += (unsigned short)DLValue(cmds, pos + 1) * 4;
+        if ((pos + size) > length)
         {
-            dir=1;       
+            printf("ExecuteDrawList polygon at %u is cut short\n", pos);
+            return (0);
         }
-        incX  = 2 * Ydelta;
-        incXY = 2 * (Ydelta - Xdelta);
-        Step  = 2 * Ydelta - Xdelta;
+    }
+    return (size);
+}
 
-        // draw the first pixel and possibly the only one
-        SetPixel(x,y,colour);
 
-        while (x<Xend)
+// RunDrawList
+// runs the commands in a draw list in order, on the caller's thread (ExecuteDrawList below, or for one band of it)
+static int RunDrawList(DisplayContext * display, const unsigned char * cmds, unsigned int length)
+{
+unsigned int pos,size,data;
+int count;
+short v[7];
+int i,n,y,first,last;
+unsigned short * destPtr;
+
+    pos = 0;
+    count = 0;
+    while (pos < length)
+    {
+        if (cmds[pos] == DL_END)
+            break;
+        size = DrawListCommandSize(cmds, pos, length);
+        if (size == 0)
+            return (-1);
+
+        n = DLArgCount[cmds[pos]];
+        data = pos + 1 + n*2;           // where the pixels or points after a command start
+        for (i = 0; i < n; i++)
+            v[i] = DLValue(cmds, pos + 1 + i*2);
+
+        switch (cmds[pos])
         {
-            if (Step<=0)
-            {
-                Step+=incX;
-                x++;
-            }
-            else
-            {
-                Step+=incXY;
-                x++;
-                y+=dir;
-            }
-            SetPixel(x,y,colour);
+            case DL_LINE:
+                DrawLineIntMaths(display, v[0], v[1], v[2], v[3], v[4]);
+                break;
+
+            case DL_LINE_AA:
+                DrawLineAA(display, v[0], v[1], v[2], v[3], v[4]);
+                break;
+
+            case DL_LINE_WIDE:
+                DrawLineWideAA(display, v[0], v[1], v[2], v[3], v[4], v[5]);
+                break;
+
+            case DL_CIRCLE:
+                DrawCircle(display, v[0], v[1], v[2], v[3]);
+                break;
+
+            case DL_RECT:
+                DrawRectangle(display, v[0], v[1], v[2], v[3], v[4]);
+                break;
+
+            case DL_PIXEL:
+                SetPixel(display, v[0], v[1], v[2]);
+                break;
+
+            case DL_BLIT:
+                // the pixels follow the command
+                BlitRGB565(display, v[0], v[1], v[2], v[3], cmds + data);
+                break;
+
+            case DL_UPDATE:
+                if (v[0] == 0)
+                    ScreenUpdate(display);
+                else if (v[0] == 1)
+                    ScreenUpdateDirty(display);
+                else
+                    ScreenUpdateAsync(display, v[0] == 3);
+                break;
+
+            case DL_RESTORE:
+                RestoreReferenceImage(display);
+                break;
+
+            case DL_LINE_CAPPED:
+                DrawLineWideCapped(display, v[0]<<16, v[1]<<16, v[2]<<16, v[3]<<16, v[4], v[5], v[6]);
+                break;
+
+            case DL_PIE:
+                FillPieAA(display, v[0], v[1], v[2], (unsigned short)v[3], (unsigned short)v[4], v[5]);
+                break;
+
+            case DL_DISC:
+                FillCircleAA(display, v[0], v[1], v[2], v[3]);
+                break;
+
+            case DL_ARC:
+                DrawArcAA(display, v[0], v[1], v[2], v[3], (unsigned short)v[4], (unsigned short)v[5], v[6]);
+                break;
+
+            case DL_POLYGON:
+                // the points follow the command, and may not be aligned so are copied out
+                n = (unsigned short)v[0];
+                if (n <= 64)
+                {
+                    short points[2*64];
+                    for (i = 0; i < n*2; i++)
+                        points[i] = DLValue(cmds, data + i*2);
+                    FillPolygonAA(display, points, n, v[1]);
+                }
+                else
+                    printf("ExecuteDrawList polygon at %u has more than 64 points\n", pos);
+                break;
+
+            case DL_CLEAR:
+                if (display->RenderSpace != NULL)
+                {
+                    STATS_SCOPE(display, STAT_FILL);
+
+                    // only the visible part of each row inside the clip, as clearScreenDirect
+                    for (y = display->ClipY0; y <= display->ClipY1; y++)
+                    {
+                        first = 0;
+                        last = 239;
+                        if (!ClipToDrawable(display, y, &first, &last))
+                            continue;
+                        destPtr = display->RenderSpace + first + y*240;
+                        for (i = first; i <= last; i++)
+                            *(destPtr++) = ToRender(display, v[0]);
+                        COUNT_PIXELS(display, last - first + 1);
+                    }
+                    MarkDrawnArea(display, 0, 0, 239, 239);
+                }
+                break;
+
+            case DL_CLIP:
+                PushClipRect(display, v[0], v[1], v[2], v[3]);
+                break;
+
+            case DL_UNCLIP:
+                PopClipRect(display);
+                break;
         }
+        pos += size;
+        count++;
     }
-    else
-    {
-        // y Direction is the mayority
-        if(Ystart>Yend)
-        {
-            short temp=Xend;
-            Xend = Xstart;
-            Xstart=temp;
+    return (count);
+}
 
-            temp = Yend;
-            Yend= Ystart;
-            Ystart = temp;
-        }
 
-        Xdelta = Xend-Xstart;
-        Ydelta = Yend-Ystart;
+// banded drawing
+// on a Pi with more than one core a draw list can be drawn by several threads at once. The render space is cut into
+// bands of rows and every band runs the same commands clipped to its own rows, which the drawing already does for
+// the clip rectangle, so each pixel comes out exactly as it would drawn by one thread.
+// the commands that work on the whole display (the updates, restoring the reference and the clip rectangles) are
+// run by the caller on their own between the runs of drawing, once the bands have all finished
 
-        x = Xstart;
-        y = Ystart;
+// whether a command has to be run on the display's own context with the bands stopped
+static bool DrawListBarrier(unsigned char command)
+{
+    return ((command == DL_UPDATE) || (command == DL_RESTORE) || (command == DL_CLIP) || (command == DL_UNCLIP));
+}
 
-        if (Xend<Xstart)
-        {
-            dir =-1;
-            Xdelta = -Xdelta;
-        }
-        else
+// a band with nothing of the clip rectangle in it has nothing to draw
+static void RunBand(DisplayContext * band, const unsigned char * cmds, unsigned int length)
+{
+    if ((band->ClipX0 <= band->ClipX1) && (band->ClipY0 <= band->ClipY1))
+        RunDrawList(band, cmds, length);
+}
+
+static void * BandThread(void * arg)
+{
+DisplayContext * band = (DisplayContext *) arg;
+DisplayContext * display = band->BandOwner;
+unsigned int seen;
+
+    // the commands handed out before the thread had started were already there when it was made
+    seen = band->BandGeneration;
+    pthread_mutex_lock(&display->BandLock);
+    while (!display->BandStop)
+    {
+        if (display->BandGeneration == seen)
         {
-            dir=1;       
+            pthread_cond_wait(&display->BandWake, &display->BandLock);
+            continue;
         }
-        incY  = 2 * Xdelta;
-        incXY = 2 * (Xdelta - Ydelta);
-        Step  = 2 * Xdelta - Ydelta;
+        seen = display->BandGeneration;
+
+        pthread_mutex_unlock(&display->BandLock);
+        RunBand(band, display->BandCmds, display->BandLength);
+        pthread_mutex_lock(&display->BandLock);
+
+        if (--display->BandPending == 0)
+            pthread_cond_signal(&display->BandDone);
+    }
+    pthread_mutex_unlock(&display->BandLock);
+    return (NULL);
+}
+
+static bool StartBandThreads(DisplayContext * display)
+{
+int i;
 
-        // draw the first pixel and possibly the only one
-        SetPixel(x,y,colour);
+    if (display->BandThreadCount == display->DrawThreads - 1)
+        return (true);
+    StopBandThreads(display);
 
-        while (y<Yend)
+    for (i = 0; i < display->DrawThreads; i++)
+    {
+        display->BandContext[i] = CreateDisplay();
+        if (display->BandContext[i] == NULL)
         {
-            if (Step<=0)
-            {
-                Step+=incY;
-                y++;
-            }
-            else
-            {
-                Step+=incXY;
-                y++;
-                x+=dir;
-            }
-            SetPixel(x,y,colour);
+            StopBandThreads(display);
+            return (false);
+        }
+        display->BandContext[i]->BandOwner = display;
+        display->BandContext[i]->BandGeneration = display->BandGeneration;
+    }
+    // the caller draws the first band itself
+    for (i = 1; i < display->DrawThreads; i++)
+    {
+        if (pthread_create(&display->BandThreadId[i], NULL, BandThread, display->BandContext[i]) != 0)
+        {
+            printf("Error unable to start the drawing threads\n");
+            StopBandThreads(display);
+            return (false);
         }
+        display->BandThreadCount++;
     }
+    return (true);
 }
 
-// routines for drawing lines wider than 1 pixel
-// the first provides a fast integer parameter version which is good for calling in python
-// the second is the one that does the actual work.
-void DrawLineWideAA(short x0,short y0, short x1, short y1, unsigned short colour,unsigned short width)
+static void StopBandThreads(DisplayContext * display)
 {
-    DrawLineWideFloat (x0,y0 , x1,y1, colour, width);
+int i;
+
+    pthread_mutex_lock(&display->BandLock);
+    display->BandStop = true;
+    pthread_cond_broadcast(&display->BandWake);
+    pthread_mutex_unlock(&display->BandLock);
+    for (i = 1; i <= display->BandThreadCount; i++)
+        pthread_join(display->BandThreadId[i], NULL);
+    display->BandThreadCount = 0;
+    display->BandStop = false;
+
+    for (i = 0; i < DRAW_THREADS_MAX; i++)
+    {
+        if (display->BandContext[i] == NULL)
+            continue;
+        // the render and reference spaces are the display's, only the band's own coverage space is freed
+        display->BandContext[i]->RenderSpace = NULL;
+        display->BandContext[i]->ReferenceSpace = NULL;
+        DestroyDisplay(display->BandContext[i]);
+        display->BandContext[i] = NULL;
+    }
 }
 
-void  DrawLineWideFloat(float x0,float y0, float x1, float y1, unsigned short colour,unsigned short width)
-{                            
-float dx,dy,sx,sy;
-float length,err;
-float xoff,yoff;
-float xend,yend;
-float step = 1.5;
-
-    dx = (x1-x0);
-    dy = (y1-y0);
-
-    length = sqrt(dx*dx+dy*dy);        
+// DrawBands
+// runs a piece of a draw list with no barrier commands in it, a band each, and then adds the areas each band changed
+// to the display's own
+static void DrawBands(DisplayContext * display, const unsigned char * cmds, unsigned int length)
+{
+DisplayContext * band;
+int i,j,top,bottom;
+#ifdef C2PY_STATS
+int k,v;
+#endif
 
-    step = (abs(dx) + abs (dy))/length;                   
+    if (length == 0)
+        return;
 
-    if (width <= 1 || length == 0) 
+    for (i = 0; i < display->DrawThreads; i++)
     {
-        DrawLineFloat(x0,y0, x1,y1,colour,false);                    
+        band = display->BandContext[i];
+        top = i*240/display->DrawThreads;
+        bottom = (i + 1)*240/display->DrawThreads - 1;
+
+        band->RenderSpace = display->RenderSpace;
+        band->ReferenceSpace = display->ReferenceSpace;
+        band->PanelByteOrder = display->PanelByteOrder;
+        band->CircularMask = display->CircularMask;
+        memcpy(band->VisibleLeft, display->VisibleLeft, sizeof(band->VisibleLeft));
+        memcpy(band->VisibleRight, display->VisibleRight, sizeof(band->VisibleRight));
+        band->ClipX0 = display->ClipX0;
+        band->ClipX1 = display->ClipX1;
+        band->ClipY0 = (display->ClipY0 > top) ? display->ClipY0 : top;
+        band->ClipY1 = (display->ClipY1 < bottom) ? display->ClipY1 : bottom;
+        BuildDrawSpans(band);
+        band->ScreenDamage.count = 0;
+        band->ReferenceDamage.count = 0;
     }
-    else
-    {
-        dx = dx/(length) / step;
-        dy = -dy/(length) / step;    //flip by 90deg
 
-        width = width * step;
+    pthread_mutex_lock(&display->BandLock);
+    display->BandCmds = cmds;
+    display->BandLength = length;
+    display->BandPending = display->BandThreadCount;
+    display->BandGeneration++;
+    pthread_cond_broadcast(&display->BandWake);
+    pthread_mutex_unlock(&display->BandLock);
 
-        xoff = -dy*(width)/2 +dy;
-        yoff = -dx*(width)/2 +dx;
-        for (int line = 0;line<(width-1);line++)
-        {
-            //DrawLineFloat(x0+xoff,y0+yoff,x1+xoff,y1+yoff,colour);
-            DrawLineFloat(x0+xoff,y0+yoff,x1+xoff,y1+yoff,colour,true);
-            xoff += dy;
-            yoff += dx;
-        }
-        // run antialiased edges
-        xoff = -dy*(width)/2;
-        yoff = -dx*(width)/2;
-        
-        xend = +dy*(width)/2;
-        yend = +dx*(width)/2;
-        //draw long edges
-        DrawLineFloat(x0+xoff,y0+yoff,x1+xoff,y1+yoff,colour,false);
-        DrawLineFloat(x0+xend,y0+yend,x1+xend,y1+yend,colour,false);
-
-        //DrawLineFloat(x0+xoff,y0+yoff,x0+xend,y0+yend,colour,false);
-        //DrawLineFloat(x1+xoff,y1+yoff,x1+xend,y1+yend,colour,false);
-    
-   }
-}
+    RunBand(display->BandContext[0], cmds, length);
 
+    pthread_mutex_lock(&display->BandLock);
+    while (display->BandPending != 0)
+        pthread_cond_wait(&display->BandDone, &display->BandLock);
+    pthread_mutex_unlock(&display->BandLock);
 
+    for (i = 0; i < display->DrawThreads; i++)
+    {
+        band = display->BandContext[i];
+        for (j = 0; j < band->ScreenDamage.count; j++)
+            AddDirtyRect(&display->ScreenDamage, band->ScreenDamage.rect[j].x0, band->ScreenDamage.rect[j].y0,
+                         band->ScreenDamage.rect[j].x1, band->ScreenDamage.rect[j].y1);
+        for (j = 0; j < band->ReferenceDamage.count; j++)
+            AddDirtyRect(&display->ReferenceDamage, band->ReferenceDamage.rect[j].x0, band->ReferenceDamage.rect[j].y0,
+                         band->ReferenceDamage.rect[j].x1, band->ReferenceDamage.rect[j].y1);
+#ifdef C2PY_STATS
+        // the times are added up over the threads, so can come to more than the time taken
+        for (k = 0; k < STAT_KINDS; k++)
+            for (v = 0; v < STAT_VALUES; v++)
+                display->Stats[k][v] += band->Stats[k][v];
+        memset(band->Stats, 0, sizeof(band->Stats));
+#endif
+    }
+}
 
-// ScreenUpdate
-// routine to do the write to the screen as a memory dump from the render space
-void ScreenUpdate(void)
+// DrawListBands
+// ExecuteDrawList with the drawing split between the bands, and the barrier commands run between
+static int DrawListBands(DisplayContext * display, const unsigned char * cmds, unsigned int length)
 {
-    int i;
-    unsigned short * sourcePtr;
+unsigned int pos,start,size;
+int count;
 
-    if (RenderSpace !=NULL)
+    if (display->RenderSpace == NULL)
+        return (RunDrawList(display, cmds, length));
+    if (!StartBandThreads(display))
+    {
+        display->DrawThreads = 1;       // as SetDrawThreads does, rather than trying again for every draw list
+        return (RunDrawList(display, cmds, length));
+    }
+    if (BlendSpan == NULL)
+        ChooseBlendKernel();            // before the threads could all try to
+    if (ConvertRow == NULL)
+        ChooseConvertKernel();
+
+    pos = 0;
+    start = 0;
+    count = 0;
+    while ((pos < length) && (cmds[pos] != DL_END))
     {
-        sourcePtr = RenderSpace;
-        SetScreenWriteArea(0,0,239,239);   // 240x240
-        bcm2835_gpio_write(CIR_DC, HIGH);  
-        for (i=0;i<(240*240);i++)
+        size = DrawListCommandSize(cmds, pos, length);
+        if (size == 0)
+        {
+            DrawBands(display, cmds + start, pos - start);
+            return (-1);
+        }
+        if (DrawListBarrier(cmds[pos]))
         {
-            bcm2835_spi_transfer((*sourcePtr)>>8);
-            bcm2835_spi_transfer((*sourcePtr)&0xff);
-            sourcePtr++;
+            DrawBands(display, cmds + start, pos - start);
+            RunDrawList(display, cmds + pos, size);
+            start = pos + size;
         }
+        pos += size;
+        count++;
     }
+    DrawBands(display, cmds + start, pos - start);
+    return (count);
 }
 
-// convert a 8 byte set of R G B values into the 16 bit combined 5 Red 6 Green and 5 Blue 
-// patten that is used by the display chip
-unsigned short RGBto16bit(unsigned char Red, unsigned char Green, unsigned char Blue)
+
+// ExecuteDrawList
+// runs the commands in a draw list in order, split between threads if SetDrawThreads has been used
+// returns the number of commands run, or -1 if the list is cut short or has an unknown opcode
+// (the commands before the problem will still have been run)
+int ExecuteDrawList(DisplayContext * display, const unsigned char * cmds, unsigned int length)
 {
-    return ( ((Red>>3)<<11) | ((Green>>2)<<5) | (Blue>>3));
+    if (display->DrawThreads > 1)
+        return (DrawListBands(display, cmds, length));
+    return (RunDrawList(display, cmds, length));
 }
 
+// SetDrawThreads
+// the number of threads ExecuteDrawList draws with, 1 (the default) to DRAW_THREADS_MAX, usually the number of cores.
+// the workers are started here and wait for draw lists until exitBCMHardware, or this is called again
+// returns false if the number is out of range or the threads could not be started (it then draws with one)
+bool SetDrawThreads(DisplayContext * display, int threads)
+{
+    if ((threads < 1) || (threads > DRAW_THREADS_MAX))
+    {
+        printf("SetDrawThreads %d is not between 1 and %d\n", threads, DRAW_THREADS_MAX);
+        return (false);
+    }
+
+    StopBandThreads(display);
+    display->DrawThreads = threads;
+    if ((threads > 1) && !StartBandThreads(display))
+    {
+        display->DrawThreads = 1;
+        return (false);
+    }
+    return (true);
+}
@@ -10,57 +10,311 @@
 // 
 // compile and link the bcm library with
 //
-// gcc -shared -o bcm_direct_c2py.so -fPIC bcm_direct_c2py.c -l bcm2835
+// gcc -shared -o bcm_direct_c2py.so -fPIC bcm_direct_c2py.c -l bcm2835 -lpthread -lm
+//
+// or to build without the bcm2835 library, using only the spidev or emulator backends (e.g. off the Pi)
+//
+// gcc -shared -o bcm_direct_c2py.so -fPIC -DNO_BCM2835 bcm_direct_c2py.c -lpthread -lm
+//
+// or with the Makefile, "make" on the Pi (make PI=zero, 3 or 4 to build for another model) and "make host" elsewhere
 //
 // for more details see http://simpaul.com/round_display
 
 
+// display contexts
+// each display has its own render space, pins, SPI device and settings, held in a context that every
+// function below (apart from the colour and maths utilities) takes first, so one program can drive several.
+// from Python set CreateDisplay.restype = c_void_p and pass the value back as c_void_p(display)
+typedef struct DisplayContext DisplayContext;
+
+DisplayContext * CreateDisplay(void);
+void DestroyDisplay(DisplayContext * display);      // calls exitBCMHardware if needed
+// the Pi model and flags the Makefile built the library with, and the options compiled in (restype c_char_p)
+const char * GetBuildInfo(void);
+
+
 // setup and exit commands
 
-bool initBCMHardware(void);
-void initCircularDisp(void);
-void exitBCMHardware(void);
+// choose how the display is driven before calling initBCMHardware
+// "bcm2835" (the default), "spidev" or "spidev:/dev/spidev0.1", or "emulator" for an in-memory GC9A01
+bool SelectBackend(DisplayContext * display, const char * name);
+
+// also before initBCMHardware, the BCM numbers of the D/C and reset pins (24 and 25 by default) and the chip select,
+// 0 or 1 for CE0 or CE1 with the bcm2835 backend (with spidev the device name chooses it, e.g. "spidev:/dev/spidev0.1")
+void SetDisplayPins(DisplayContext * display, int dc, int reset, int chipselect);
+// the SPI clock in Hz, 0 for the usual 32MHz (bcm2835 rounds it down to what the divider can do)
+void SetSpiSpeed(DisplayContext * display, unsigned int hz);
+// the direction of the picture 0 to 3 (default 3, connector at the bottom), before initCircularDisp
+void SetDisplayOrientation(DisplayContext * display, int orientation);
+
+bool initBCMHardware(DisplayContext * display);
+void initCircularDisp(DisplayContext * display);
+void exitBCMHardware(DisplayContext * display);
 
 
 // direct screen update commands 
-void clearScreenDirect(unsigned short bcolour);
-void SetPixelDirect(unsigned short xpos, unsigned short ypos, unsigned short colour);
+void clearScreenDirect(DisplayContext * display, unsigned short bcolour);
+void SetPixelDirect(DisplayContext * display, unsigned short xpos, unsigned short ypos, unsigned short colour);
+
+//display a 240x240 bmp encoded 24 bit image (now any BMP that LoadBMP accepts)
+void RGB240x240Direct(DisplayContext * display, unsigned char * rawdata,bool update );
 
-//display a 240x240 bmp encoded 24 bit image
-void RGB240x240Direct(unsigned char * rawdata,bool update );
+// image loading into the render space, any size, placed with the top left at x,y and cropped to the screen
+// dither adds an ordered dither, which smooths out gradients when reduced to 16 bit colour
+// LoadBMP takes 24 or 32 bit uncompressed BMP files, length is the size of the data (or 0 not to check it)
+bool LoadBMP(DisplayContext * display, const unsigned char * data, unsigned int length, short x, short y, bool dither);
+// LoadRawImage takes rows of plain pixels with no header or padding
+#define IMAGE_RGB888      0     // red green blue bytes
+#define IMAGE_BGR888      1     // blue green red, as in a 24 bit BMP
+#define IMAGE_RGBA8888    2     // red green blue and an unused byte
+#define IMAGE_BGRA8888    3     // blue green red and an unused byte, as in a 32 bit BMP
+#define IMAGE_RGB565      4     // 16 bit little endian, as array('H') holds them
+#define IMAGE_RGB565_BE   5     // 16 bit big endian, the order the display uses
+void LoadRawImage(DisplayContext * display, const unsigned char * data, unsigned short width, unsigned short height, int format, short x, short y, bool bottomup, bool dither);
 
 
 // the following are useful if you are having background image and then overlaying details (such as watch hands etc)
 // copies the refernce current render space to a refernce space
-void SetRefernceImage(void);
+void SetRefernceImage(DisplayContext * display);
 //restore the reference to the render space
-void RestoreReferenceImage(void);
+void RestoreReferenceImage(DisplayContext * display);
 
 
 // offline (to render space) graphics commands
 // co-ordinates can be on or off screen and the visible parts will still be shown
-void DrawCircle (short x0, short y0, short r, unsigned short colour);
-void DrawRectangle(short Xstart,short Ystart, short Xend, short Yend, unsigned short colour);
+void DrawCircle (DisplayContext * display, short x0, short y0, short r, unsigned short colour);
+void DrawRectangle(DisplayContext * display, short Xstart,short Ystart, short Xend, short Yend, unsigned short colour);
 
 
-void SetPixel(short xpos, short ypos, unsigned short colour);
+void SetPixel(DisplayContext * display, short xpos, short ypos, unsigned short colour);
+unsigned short GetPixel(DisplayContext * display, short xpos, short ypos);
+
+// the render space itself, width x height pixels with stride pixels from the start of one row to the next, in the panel's
+// byte order (big endian) if panelorder is set. For writing frames straight into from Python, see renderspace.py,
+// and use MarkDirtyArea or ScreenUpdate to send what was written. restype c_void_p, NULL before initCircularDisp.
+// calling initCircularDisp again clears it but keeps the same memory, exitBCMHardware frees it
+unsigned short * GetRenderSpace(DisplayContext * display, short * width, short * height, short * stride, bool * panelorder);
+
+// copy a block of 16 bit pixels (little endian, as array('H') holds them) into the render space
+void BlitRGB565(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, const unsigned char * pixels);
+
+// blending into the render space, intensity 256 is 100% the new colour
+// a block of one colour with an intensity for each pixel (array('H') of width*height)
+void BlendCoverage(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, unsigned short colour, const unsigned short * coverage);
+// an image mixed with what is there already
+void BlendImageRGB565(DisplayContext * display, short x, short y, unsigned short width, unsigned short height, const unsigned char * pixels, unsigned short intensity);
+// the whole render space towards one colour
+void FadeToColour(DisplayContext * display, unsigned short colour, unsigned short intensity);
+// the blending uses NEON, AVX2 or SSE2 where available. these choose ("scalar", "neon", "sse2", "avx2") and report which
+// (set restype to c_char_p for GetBlendKernel)
+bool SelectBlendKernel(const char * name);
+const char * GetBlendKernel(void);
+// the single pixel version used by the line drawing
+void updatePixel(DisplayContext * display, short x, short y, unsigned short colour, unsigned short intensity);
+
+// keep the renderspace in the display's byte order, so screen updates can send it without converting each pixel
+// colours passed to and from the functions are the same either way
+void SetPanelByteOrder(DisplayContext * display, bool panelorder);
+
+// only fill, copy and send the pixels inside the round panel (the default), or the whole 240x240 square
+void SetCircularMask(DisplayContext * display, bool enable);
+
+// keep all the drawing inside x0,y0 to x1,y1 (inclusive, and inside any clip already pushed) until PopClipRect
+// so a widget can draw into its own part of the screen. Up to 16 can be pushed, false if there are too many
+bool PushClipRect(DisplayContext * display, short x0, short y0, short x1, short y1);
+void PopClipRect(DisplayContext * display);
+
+// hardware scrolling of rows top to top+count-1 (count 0 to stop), orientations 2 and 3 only. ScrollArea moves the
+// picture up by lines (down if negative), fills the rows coming into view with colour and returns the render space row
+// the first of them is kept in. ScrollRow gives the render space row shown on a screen row
+bool SetScrollArea(DisplayContext * display, short top, short count);
+short ScrollArea(DisplayContext * display, short lines, unsigned short colour);
+short ScrollRow(DisplayContext * display, short row);
 
 
 // two line drawing routines, the first is for integer maths but give jagged lines
 // the second uses anti-aliasing for smooth edges, but at the expense of speed
 
-void DrawLineIntMaths (short Xstart,short Ystart, short Xend, short Yend, unsigned short colour);
-void DrawLineAA       (short x0,short y0, short x1, short y1, unsigned short colour);
+void DrawLineIntMaths (DisplayContext * display, short Xstart,short Ystart, short Xend, short Yend, unsigned short colour);
+void DrawLineAA       (DisplayContext * display, short x0,short y0, short x1, short y1, unsigned short colour);
+
+// this is the actual routine, with 16.16 fixed point co-ordinates (i.e. x<<16) for positions between pixels
+void DrawLineFixed    (DisplayContext * display, int Xstart,int Ystart, int Xend, int Yend, unsigned short colour,bool fill);
+// the float version is kept for compatibility, but passing floats seems to have complications in Python so, best to use the above.
+void DrawLineFloat    (DisplayContext * display, float Xstart,float Ystart, float Xend, float Yend, unsigned short colour,bool fill);
+
+//wide line drawing routines, the first being used by Python and the second the actual routine (16.16 fixed point again)
+void DrawLineWideAA(DisplayContext * display, short x0,short y0, short x1, short y1, unsigned short colour,unsigned short width);
+void DrawLineWideFixed(DisplayContext * display, int x0,int y0, int x1, int y1, unsigned short colour,unsigned short width);
+void DrawLineWideFloat(DisplayContext * display, float x0,float y0, float x1, float y1, unsigned short colour,unsigned short width);
 
-// this is the actual routine, but passing floats seems to have complications in Python so, best to use the above.
-void DrawLineFloat    (float Xstart,float Ystart, float Xend, float Yend, unsigned short colour,bool fill);
+// wide lines with a choice of ends, square on (butt, as DrawLineWideAA), extended by half the width, or rounded
+#define LINE_CAP_BUTT     0
+#define LINE_CAP_SQUARE   1
+#define LINE_CAP_ROUND    2
+void DrawLineWideCapped(DisplayContext * display, int x0,int y0, int x1, int y1, unsigned short colour,unsigned short width, int cap);
+
+// filled shapes with anti-aliased edges, each pixel is written once
+// the polygon points are x,y pairs (array('h') from Python), or 16.16 fixed point for the Fixed version
+void FillPolygonAA(DisplayContext * display, const short * points, unsigned short count, unsigned short colour);
+void FillPolygonFixed(DisplayContext * display, const int * points, unsigned short count, unsigned short colour);
+// a segment of a circle, angles in hundredths of a degree clockwise from 12 o'clock
+void FillPieAA(DisplayContext * display, short x, short y, unsigned short r, int startangle, int endangle, unsigned short colour);
+// discs, rings and arcs drawn as runs of rows with anti-aliased edges, a ring is width pixels inside radius r
+void FillCircleAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short colour);
+void DrawRingAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short width, unsigned short colour);
+void DrawArcAA(DisplayContext * display, short x, short y, unsigned short r, unsigned short width, int startangle, int endangle, unsigned short colour);
+
+// sine and cosine in 16.16 fixed point, angle in hundredths of a degree
+int SinFixed(int angle);
+int CosFixed(int angle);
+
+// anti-aliased text, with fonts made from any TrueType font by makefont.py (which needs PIL, the Pi does not)
+// LoadFont takes the font file's data (restype c_void_p in Python) and the font can then be used on any display
+typedef struct FontAtlas FontAtlas;
+FontAtlas * LoadFont(const unsigned char * data, unsigned int length);
+void FreeFont(FontAtlas * font);
+// UTF-8 text with the top left of the line at x,y, bounds (array('h') of 4, or None) gets the x0,y0,x1,y1 drawn on
+// so that only that area needs restoring or sending. Both return how far along the text goes
+int DrawText(DisplayContext * display, FontAtlas * font, short x, short y, const char * text, unsigned short colour, short * bounds);
+int MeasureText(FontAtlas * font, const char * text, short * bounds);
+int GetFontHeight(FontAtlas * font);
+int GetFontAscent(FontAtlas * font);
+
+// sprites, an RGB565 image with alpha (NULL for solid) that can be drawn turned and scaled, e.g. a watch hand
+// pixels are byte pairs as BlitRGB565, the angle is clockwise in hundredths of a degree and scale is 16.16 (65536 = 1:1)
+// the sprite's pixel pivotx,pivoty is drawn at x,y, smooth mixes the nearest four pixels rather than taking the nearest
+typedef struct Sprite Sprite;
+Sprite * LoadSprite(const unsigned char * pixels, const unsigned char * alpha, unsigned short width, unsigned short height);
+void FreeSprite(Sprite * sprite);
+void DrawSprite(DisplayContext * display, const Sprite * sprite, short x, short y, short pivotx, short pivoty,
+                int angle, int scale, bool smooth);
+// the same with the positions all 16.16 fixed point, for smooth movement and pivots between pixels
+void DrawSpriteFixed(DisplayContext * display, const Sprite * sprite, int x, int y, int pivotx, int pivoty,
+                     int angle, int scale, bool smooth);
+
+// run a whole list of drawing commands in one call, see drawlist.py for building the list from Python
+// returns the number of commands run or -1 if the list is invalid
+int ExecuteDrawList(DisplayContext * display, const unsigned char * cmds, unsigned int length);
+// draw the lists with this many threads (1 to 8, the number of cores on a Pi 3 or 4), each drawing a band of rows.
+// the picture is exactly the same as with one, false if the threads could not be started
+bool SetDrawThreads(DisplayContext * display, int threads);
 
-//wide line drawing routines, the first being used by Python and the second the actual routine
-void DrawLineWideAA(short x0,short y0, short x1, short y1, unsigned short colour,unsigned short width);
-void DrawLineWideFloat(float x0,float y0, float x1, float y1, unsigned short colour,unsigned short width);
 
 // update the screen with the changes to the renderspace
-void ScreenUpdate(void);
+void ScreenUpdate(DisplayContext * display);
+
+// partial update, only sends the areas of the renderspace changed since the last update
+// the drawing commands record what they change, use MarkDirtyArea if the renderspace is changed some other way
+void ScreenUpdateDirty(DisplayContext * display);
+
+// double buffered update, the frame is copied and sent by a separate thread so drawing can continue straight away
+// WaitForFlush blocks until the previous frame has been sent
+void ScreenUpdateAsync(DisplayContext * display, bool partial);
+void WaitForFlush(DisplayContext * display);
+// the same for several displays at once, each sent by its own thread so displays on different SPI buses
+// (or spidev devices) are updated together. Waits for all of them to finish
+void ScreenUpdateMany(DisplayContext ** displays, int count, bool partial);
+
+void MarkDirtyArea(DisplayContext * display, short Xstart, short Ystart, short Xend, short Yend);
+
+// bytes sent to the screen and bytes saved by the partial updates (set restype to c_ulonglong in Python)
+unsigned long long GetFlushBytesSent(DisplayContext * display);
+unsigned long long GetFlushBytesSaved(DisplayContext * display);
+void ResetFlushCounters(DisplayContext * display);
+
+// content diff, a copy of the panel's memory is kept and each update sends only the part of each row that changed,
+// or all of it when more than threshold percent changed. Starts after the next full ScreenUpdate. Anything sent
+// with SetScreenWriteArea directly is not in the copy, call SetContentDiff again afterwards
+bool SetContentDiff(DisplayContext * display, bool enable, int threshold);
+// an array of DIFF_STATS unsigned long longs (c_ulonglong in Python), counts since the last reset
+#define DIFF_STAT_UPDATES     0     // updates compared with the copy
+#define DIFF_STAT_COMPARED    1     // pixels compared
+#define DIFF_STAT_CHANGED     2     // of those, pixels sent because they were in a changed part of a row
+#define DIFF_STAT_ROWS        3     // rows with something changed
+#define DIFF_STAT_FULL        4     // updates over the threshold, sent without the diff
+#define DIFF_STAT_RATIO       5     // CHANGED/COMPARED in tenths of a percent
+#define DIFF_STATS            6
+void GetDiffStats(DisplayContext * display, unsigned long long * stats, int count);
+void ResetDiffStats(DisplayContext * display);
+
+// tear free updates, each update waits for the panel's TE pulse on this GPIO (-1 to stop) and is sent behind the scan line
+bool SetTearingSync(DisplayContext * display, int pin);
+// statistics for the paced updates, an array of TE_STATS unsigned ints (c_uint in Python), times in microseconds
+#define TE_STAT_FRAMES        0     // updates started on a TE pulse
+#define TE_STAT_TIMEOUTS      1     // no pulse seen, so sent anyway
+#define TE_STAT_MISSED        2     // scans that went by between updates, when a few apart
+#define TE_STAT_SPLIT         3     // updates too slow for one scan, so sent over more than one
+#define TE_STAT_OVERRUNS      4     // parts that were still being sent when the scan line came round, so may have torn
+#define TE_STAT_LATENCY       5     // mean time from the pulse to starting the update
+#define TE_STAT_LATENCY_MAX   6
+#define TE_STAT_JITTER        7     // standard deviation of that time
+#define TE_STAT_PERIOD        8     // the measured time of one scan
+#define TE_STATS              9
+void GetTearingStats(DisplayContext * display, unsigned int * stats, int count);
+void ResetTearingStats(DisplayContext * display);
+
+// a steady animation loop, the callback draws frame number n (for the time n/fps) into the renderspace and returns
+// true to carry on, then the frame is sent and the loop sleeps until the next is due. Late frames are skipped
+// from Python the callback is CFUNCTYPE(c_bool, c_uint). An exception in it is only printed, so for CTRL C
+// set a signal handler that calls StopFrameLoop (see clock.py)
+typedef bool (*FrameCallback)(unsigned int frame);
+#define FRAME_UPDATE_FULL         0     // ScreenUpdate
+#define FRAME_UPDATE_DIRTY        1     // ScreenUpdateDirty
+#define FRAME_UPDATE_ASYNC        2     // ScreenUpdateAsync(false)
+#define FRAME_UPDATE_ASYNC_DIRTY  3     // ScreenUpdateAsync(true)
+#define FRAME_RESTORE             4     // add to restore the reference image after each frame is sent
+int RunFrameLoop(DisplayContext * display, unsigned int fps, FrameCallback callback, int update);
+void StopFrameLoop(DisplayContext * display);
+// statistics for the frame loop, an array of FRAME_STATS unsigned ints, times in microseconds
+#define FRAME_STAT_FRAMES         0     // frames drawn
+#define FRAME_STAT_DROPPED        1     // frames skipped as their time had gone
+#define FRAME_STAT_P50            2     // drawing and sending time of a frame, median
+#define FRAME_STAT_P99            3     // and 99th percentile
+#define FRAME_STAT_DRAW_P50       4
+#define FRAME_STAT_DRAW_P99       5
+#define FRAME_STAT_FLUSH_P50      6
+#define FRAME_STAT_FLUSH_P99      7
+#define FRAME_STAT_BUSY           8     // percentage of the time spent drawing and sending
+#define FRAME_STATS               9
+void GetFrameStats(DisplayContext * display, unsigned int * stats, int count);
+void ResetFrameStats(DisplayContext * display);
+
+// instrumentation, only in a library built with -DC2PY_STATS (without it GetStats returns false, and nothing else
+// costs anything). Each kind of primitive has STAT_VALUES unsigned long longs (c_ulonglong in Python) at
+// kind*STAT_VALUES, a primitive used by another one counts as part of it. Times are nanoseconds
+#define STAT_PIXEL          0     // SetPixel, SetPixelDirect, updatePixel
+#define STAT_LINE           1     // DrawLineIntMaths, DrawRectangle
+#define STAT_LINE_AA        2     // DrawLineAA, DrawLineFixed, DrawLineFloat
+#define STAT_LINE_WIDE      3     // DrawLineWideAA, DrawLineWideFixed, DrawLineWideFloat, DrawLineWideCapped
+#define STAT_POLYGON        4     // FillPolygonAA, FillPolygonFixed, FillPieAA
+#define STAT_CIRCLE         5     // DrawCircle
+#define STAT_RING           6     // FillCircleAA, DrawRingAA, DrawArcAA
+#define STAT_IMAGE          7     // LoadRawImage, LoadBMP, RGB240x240Direct, BlitRGB565, BlendImageRGB565, BlendCoverage
+#define STAT_TEXT           8     // DrawText
+#define STAT_SPRITE         9     // DrawSprite, DrawSpriteFixed
+#define STAT_FILL          10     // clearScreenDirect, FadeToColour, ScrollArea
+#define STAT_RESTORE       11     // RestoreReferenceImage
+#define STAT_FLUSH         12     // ScreenUpdate, ScreenUpdateDirty, ScreenUpdateAsync, the time the caller spent in them
+#define STAT_SEND          13     // the sending itself, by the caller or the flush thread, and every SPI byte and command
+#define STAT_KINDS         14
+#define STAT_CALLS          0
+#define STAT_PIXELS         1     // pixels written (or for STAT_SEND sent), the clipped ends of lines are counted before clipping
+#define STAT_BLENDED        2     // of those, the ones blended with what was there
+#define STAT_TIME           3
+#define STAT_BYTES          4     // STAT_SEND only
+#define STAT_COMMANDS       5
+#define STAT_VALUES         6
+bool GetStats(DisplayContext * display, unsigned long long * stats, int count);
+void ResetStats(DisplayContext * display);
+// how many frames took each number of milliseconds, from the start of one screen update to the next
+// an array of STAT_HISTOGRAM unsigned ints, the last is everything longer
+#define STAT_HISTOGRAM     64
+void GetFrameHistogram(DisplayContext * display, unsigned int * buckets, int count);
+// keeps the start and length of up to events primitives and sends (0 to stop), and saves them as a Chrome trace
+// JSON file for chrome://tracing or ui.perfetto.dev
+bool StartTrace(DisplayContext * display, unsigned int events);
+bool SaveTrace(DisplayContext * display, const char * path);
 
 
 // utility to convert the 8bit indiviual RGB values to a 16 bit combined value
@@ -70,8 +324,28 @@ unsigned short RGBto16bit(unsigned char Red, unsigned char Green, unsigned char
 // low level commands used for direct access
 // these are only needed if the functions above do not allow the features you need
 
-void SetScreenWriteArea(unsigned char Xstart,unsigned char Ystart,unsigned char Xend,unsigned char Yend);
-void sdoCmdU8( unsigned char byteval);
-void sdoDataU16( unsigned short intval);
-void sdoDataU8( unsigned char byteval);
+void SetScreenWriteArea(DisplayContext * display, unsigned char Xstart,unsigned char Ystart,unsigned char Xend,unsigned char Yend);
+void sdoCmdU8(DisplayContext * display, unsigned char byteval);
+void sdoDataU16(DisplayContext * display, unsigned short intval);
+void sdoDataU8(DisplayContext * display, unsigned char byteval);
+void sdoDataBuffer(DisplayContext * display, const unsigned char * data, unsigned int length);
+
+
+// emulator backend, the SPI clock rate it models (0 for instant) and access to the emulated display
+// frames are saved as PNG if the name ends in .png, otherwise as PPM
+void SetEmulatorClock(DisplayContext * display, unsigned int hz);
+unsigned short EmulatorGetPixel(DisplayContext * display, unsigned short xpos, unsigned short ypos);
+// what the emulated panel shows, which is the display memory moved by any hardware scrolling
+unsigned short EmulatorGetScreenPixel(DisplayContext * display, unsigned short xpos, unsigned short ypos);
+// the emulated panel's scan rate, which times its software TE pulses (0 for none), and how many scans showed a tear
+void SetEmulatorScanRate(DisplayContext * display, unsigned int hz);
+unsigned int EmulatorGetTears(DisplayContext * display);
+bool EmulatorSaveFrame(DisplayContext * display, const char * path);
+
+// size of the blocks used to send pixel data, default 4096 bytes, 0 sends a byte at a time as the original code did
+bool SetTransferChunkSize(DisplayContext * display, unsigned int bytes);
+
+// pixels sent as 16 bits (RGB565, the default) or 12 bits (RGB444, a quarter fewer bytes), optionally dithered
+// the render space stays RGB565 either way
+bool SetTransferFormat(DisplayContext * display, int bits, bool dither);
 
@@ -0,0 +1,779 @@
+# simple benchmarks for the C driver on the circular display
+#
+#
+#  see https://simpaul.com/round_display for details
+#
+
+import sys
+import time
+import math
+import functools
+from drawlist import DrawList
+
+# load in the ability to use c variable types
+from ctypes import *
+
+
+# load the Shared Library for the direct I/O
+circularDisp = CDLL("./bcm_direct_c2py.so")
+
+# each display the library drives has its own context, which is passed first to the display functions
+circularDisp.CreateDisplay.restype = c_void_p
+display = c_void_p(circularDisp.CreateDisplay())
+
+
+print ("benchmarking")
+
+# away from the Pi, build the library with -DNO_BCM2835 and use the emulator backend
+# which takes as long over each transfer as a 32MHz SPI bus would
+backend = None
+#backend = b"emulator"
+# or give the benchmark and backend on the command line, python3 bench.py 18 emulator (as make bench does)
+if (len(sys.argv) > 2):
+  backend = sys.argv[2].encode()
+if (backend != None):
+  circularDisp.SelectBackend(display, backend)
+
+# initialise the hardware driver
+if (circularDisp.initBCMHardware(display)):
+  # then send the commands to configure the display
+  circularDisp.initCircularDisp(display)
+
+  # select which benchmark to run
+  bench = 1
+  if (len(sys.argv) > 1):
+    bench = int(sys.argv[1])
+
+  if(bench==1):
+
+    # full screen update rate, the original byte at a time transfers against the chunked transfers
+    frames = 100
+    for chunk in (0, 256, 4096, 32768):
+      circularDisp.SetTransferChunkSize(display, chunk)
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        circularDisp.ScreenUpdate(display)
+      elapsed = time.perf_counter() - starttime
+      print("chunk {:6d} bytes   {:6.1f} frames per second".format(chunk, frames/elapsed))
+
+  if(bench==2):
+
+    # latency and throughput of the double buffered update against the normal blocking one
+    # the clock hands are drawn over a reference image each frame as in clock.py, with full screen updates
+    # this can be run away from the Pi with the emulator backend (see above)
+    frames = 200
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+    circularDisp.SetRefernceImage(display)
+
+    def DrawHands(frame):
+      angle = frame*math.pi/100.0
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+70*math.sin(angle/12)),int(120-70*math.cos(angle/12)),0x0000,20)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+90*math.sin(angle/4)), int(120-90*math.cos(angle/4)), 0x0000,10)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+110*math.sin(angle)),  int(120-110*math.cos(angle)),  0x001F,6)
+
+    # the extra work stands in for the slower drawing on a Pi Zero, or other work done by the application
+    for extrawork in (0.0, 0.010, 0.020):
+      for asyncupdate in (False, True):
+        calltime = 0.0
+        starttime = time.perf_counter()
+        for frame in range(frames):
+          DrawHands(frame)
+          time.sleep(extrawork)
+          callstart = time.perf_counter()
+          if asyncupdate:
+            circularDisp.ScreenUpdateAsync(display, 0)
+          else:
+            circularDisp.ScreenUpdate(display)
+          calltime += time.perf_counter() - callstart
+          circularDisp.RestoreReferenceImage(display)
+        circularDisp.WaitForFlush(display)
+        elapsed = time.perf_counter() - starttime
+        print("{:18s} {:3.0f}ms extra work  {:6.1f} frames per second   {:6.2f} ms in each update call".format(
+              "ScreenUpdateAsync" if asyncupdate else "ScreenUpdate", 1000*extrawork, frames/elapsed, 1000.0*calltime/frames))
+
+  if(bench==3):
+
+    # the line tests from test.py, called one line at a time from Python against one draw list per test
+    # the draw list is built outside the timing as an application would build it once or while waiting on the display
+    def Lines(draw, width):
+      for centre in range (10):
+        for radius in range(240):
+          if width:
+            draw(12*centre,12*centre,radius,0,radius<<11,width)
+            draw(12*centre,12*centre,0,radius,(radius<<5)&0x07E0,width)
+            draw(12*centre,12*centre,radius,239,radius&0x1F,width)
+            draw(12*centre,12*centre,239,radius,0xffff>>centre,width)
+          else:
+            draw(12*centre,12*centre,radius,0,radius<<11)
+            draw(12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
+            draw(12*centre,12*centre,radius,239,radius&0x1F)
+            draw(12*centre,12*centre,239,radius,0xffff>>centre)
+
+    for name, width in (("DrawLineIntMaths", 0), ("DrawLineAA", 0), ("DrawLineWideAA", 10)):
+      circularDisp.clearScreenDirect(display, 0x0000)
+      starttime = time.perf_counter()
+      Lines(functools.partial(getattr(circularDisp, name), display), width)
+      percall = time.perf_counter() - starttime
+
+      dl = DrawList()
+      builder = {"DrawLineIntMaths":dl.Line, "DrawLineAA":dl.LineAA, "DrawLineWideAA":dl.LineWideAA}[name]
+      buildstart = time.perf_counter()
+      Lines(builder, width)
+      build = time.perf_counter() - buildstart
+      circularDisp.clearScreenDirect(display, 0x0000)
+      starttime = time.perf_counter()
+      dl.Run(circularDisp, display)
+      batched = time.perf_counter() - starttime
+
+      print("{:18s} {:6d} lines   per call {:7.1f} ms   draw list {:7.1f} ms (+{:.1f} ms to build)".format(
+            name, dl.count, 1000*percall, 1000*batched, 1000*build))
+
+  if(bench==4):
+
+    # raw line drawing speed, the test.py test 2 and test 3 patterns drawn into the render space only
+    # the lines go in a draw list so the time is the drawing and not the calls from Python
+    for name, width in (("DrawLineAA", 0), ("DrawLineWideAA", 10)):
+      dl = DrawList()
+      for centre in range (10):
+        for radius in range(240):
+          if width:
+            dl.LineWideAA(12*centre,12*centre,radius,0,radius<<11,width)
+            dl.LineWideAA(12*centre,12*centre,0,radius,(radius<<5)&0x07E0,width)
+            dl.LineWideAA(12*centre,12*centre,radius,239,radius&0x1F,width)
+            dl.LineWideAA(12*centre,12*centre,239,radius,0xffff>>centre,width)
+          else:
+            dl.LineAA(12*centre,12*centre,radius,0,radius<<11)
+            dl.LineAA(12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
+            dl.LineAA(12*centre,12*centre,radius,239,radius&0x1F)
+            dl.LineAA(12*centre,12*centre,239,radius,0xffff>>centre)
+
+      repeats = 5
+      starttime = time.perf_counter()
+      for repeat in range(repeats):
+        dl.Run(circularDisp, display)
+      elapsed = time.perf_counter() - starttime
+      print("{:16s} {:10.0f} lines per second".format(name, repeats*dl.count/elapsed))
+
+  if(bench==5):
+
+    # blending speed in millions of pixels a second for each of the blend kernels built in
+    import array
+    circularDisp.GetBlendKernel.restype = c_char_p
+    coverage = (c_ushort*(240*240))(*[(i*7)%257 for i in range(240*240)])
+    image = (c_ubyte*(240*240*2))(*[i&0xFF for i in range(240*240*2)])
+    repeats = 100
+
+    for kernel in (b"scalar", b"neon", b"sse2", b"avx2"):
+      if not circularDisp.SelectBlendKernel(kernel):
+        continue
+      results = []
+      for name in ("coverage", "image", "fade"):
+        starttime = time.perf_counter()
+        for repeat in range(repeats):
+          if name == "coverage":
+            circularDisp.BlendCoverage(display, 0,0,240,240,0xF800,coverage)
+          elif name == "image":
+            circularDisp.BlendImageRGB565(display, 0,0,240,240,image,100)
+          else:
+            circularDisp.FadeToColour(display, 0x0000,20)
+        elapsed = time.perf_counter() - starttime
+        results.append("{} {:7.1f}".format(name, repeats*240*240/elapsed/1000000.0))
+      print("{:6s} Mpix/s   {}".format(kernel.decode(), "   ".join(results)))
+    circularDisp.SelectBlendKernel(None)
+
+  if(bench==6):
+
+    # image loading for a slideshow, a full screen 24 bit BMP loaded into the render space and then sent to the screen
+    import struct
+    rows = bytearray()
+    for y in range(240):
+      for x in range(240):
+        rows += bytes((x, y, (x+y)&0xFF))
+    bmp = struct.pack("<2sIHHIIiiHHIIiiII", b"BM", 54 + len(rows), 0, 0, 54, 40, 240, 240, 1, 24, 0, len(rows), 2835, 2835, 0, 0) + bytes(rows)
+
+    frames = 200
+    for dither in (0, 1):
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        circularDisp.LoadBMP(display, bmp, len(bmp), 0, 0, dither)
+      loadtime = time.perf_counter() - starttime
+
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        circularDisp.LoadBMP(display, bmp, len(bmp), 0, 0, dither)
+        circularDisp.ScreenUpdate(display)
+      showtime = time.perf_counter() - starttime
+      print("dither {}   {:7.1f} images loaded per second   {:6.1f} per second loaded and shown".format(dither, frames/loadtime, frames/showtime))
+
+  if(bench==7):
+
+    # the clock.py workload with the circular mask on and off, three hands drawn over a reference image each frame
+    # the bytes are counted by the library, and the time includes the SPI transfers (or the emulated ones)
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    frames = 200
+
+    for update in ("ScreenUpdate", "ScreenUpdateDirty"):
+      for mask in (0, 1):
+        circularDisp.SetCircularMask(display, mask)
+        circularDisp.clearScreenDirect(display, 0xFFFF)
+        circularDisp.SetRefernceImage(display)
+        circularDisp.ResetFlushCounters(display)
+        starttime = time.perf_counter()
+        for frame in range(frames):
+          angle = frame*math.pi/100.0
+          circularDisp.DrawLineWideAA(display, 120,120,int(120+70*math.sin(angle/12)),int(120-70*math.cos(angle/12)),0x0000,20)
+          circularDisp.DrawLineWideAA(display, 120,120,int(120+90*math.sin(angle/4)), int(120-90*math.cos(angle/4)), 0x0000,10)
+          circularDisp.DrawLineWideAA(display, 120,120,int(120+110*math.sin(angle)),  int(120-110*math.cos(angle)),  0x001F,6)
+          getattr(circularDisp, update)(display)
+          circularDisp.RestoreReferenceImage(display)
+        elapsed = time.perf_counter() - starttime
+        print("{:18s} mask {}   {:8.0f} bytes per frame   {:6.2f} ms per frame".format(
+              update, "on " if mask else "off", circularDisp.GetFlushBytesSent(display)/frames, 1000*elapsed/frames))
+    circularDisp.SetCircularMask(display, 1)
+
+  if(bench==8):
+
+    # tear free updates paced by the TE pin, the second hand from clock.py sent with full screen updates
+    # with the emulator the TE pulses are made up and it counts the scans that showed a tear, at two SPI clock rates
+    # on the Pi set tepin to the GPIO the TE pin is wired to (the tears can only be counted on the emulator)
+    tepin = 25
+    frames = 120
+    stats = (c_uint*9)()
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+    circularDisp.SetRefernceImage(display)
+
+    for clock in ((32000000, 8000000) if backend == b"emulator" else (0,)):
+      if clock:
+        circularDisp.SetEmulatorClock(display, clock)
+      for pin in (-1, tepin):
+        if not circularDisp.SetTearingSync(display, pin):
+          continue
+        circularDisp.ResetTearingStats(display)
+        tears = circularDisp.EmulatorGetTears(display)
+        starttime = time.perf_counter()
+        for frame in range(frames):
+          angle = frame*math.pi/30.0
+          circularDisp.DrawLineWideAA(display, 120,120,int(120+110*math.sin(angle)),int(120-110*math.cos(angle)),0x001F,6)
+          circularDisp.ScreenUpdate(display)
+          circularDisp.RestoreReferenceImage(display)
+        elapsed = time.perf_counter() - starttime
+        circularDisp.GetTearingStats(display, stats, 9)
+        print("{:8s} {:>5s}MHz  {:5.1f} fps  {:4d} torn scans   missed {:4d} split {:4d} overruns {:3d}   latency {:5d}us (max {:5d}us, jitter {:4d}us)".format(
+              "TE sync" if pin >= 0 else "no sync", str(clock//1000000) if clock else "", frames/elapsed,
+              circularDisp.EmulatorGetTears(display) - tears, stats[2], stats[3], stats[4], stats[5], stats[6], stats[7]))
+    circularDisp.SetTearingSync(display, -1)
+
+  if(bench==9):
+
+    # the clock.py hands as a tight Python loop against the frame loop in the C library at a few frame rates
+    # CPU is the process time against the wall clock time, the frame times are the drawing and sending of each frame
+    seconds = 3.0
+    stats = (c_uint*9)()
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+    circularDisp.SetRefernceImage(display)
+
+    def DrawHands(t):
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+70*math.sin(t/120)),int(120-70*math.cos(t/120)),0x0000,20)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+90*math.sin(t/10)), int(120-90*math.cos(t/10)), 0x0000,10)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120+110*math.sin(t)),   int(120-110*math.cos(t)),   0x001F,6)
+
+    times = []
+    cpustart = time.process_time()
+    starttime = time.perf_counter()
+    while time.perf_counter() - starttime < seconds:
+      framestart = time.perf_counter()
+      DrawHands(framestart)
+      circularDisp.ScreenUpdateDirty(display)
+      circularDisp.RestoreReferenceImage(display)
+      times.append(time.perf_counter() - framestart)
+    elapsed = time.perf_counter() - starttime
+    times.sort()
+    print("while loop        {:6.1f} fps  CPU {:3.0f}%   frame p50 {:6.0f}us p99 {:6.0f}us".format(
+          len(times)/elapsed, 100*(time.process_time()-cpustart)/elapsed, 1000000*times[len(times)//2], 1000000*times[(len(times)*99)//100]))
+
+    for fps in (15, 30, 60):
+      def Frame(frame):
+        DrawHands(frame/fps)
+        return frame < seconds*fps
+      callback = CFUNCTYPE(c_bool, c_uint)(Frame)
+      circularDisp.ResetFrameStats(display)
+      cpustart = time.process_time()
+      starttime = time.perf_counter()
+      drawn = circularDisp.RunFrameLoop(display, fps, callback, 1 + 4)
+      elapsed = time.perf_counter() - starttime
+      circularDisp.GetFrameStats(display, stats, 9)
+      print("RunFrameLoop {:3d}  {:6.1f} fps  CPU {:3.0f}%   frame p50 {:6d}us p99 {:6d}us   dropped {:3d}   busy {:3d}%".format(
+            fps, drawn/elapsed, 100*(time.process_time()-cpustart)/elapsed, stats[2], stats[3], stats[1], stats[8]))
+
+  if(bench==10):
+
+    # several displays, each with its own context, updated one after another against ScreenUpdateMany
+    # which sends them all at once from their flush threads. The extra displays are emulated at 32MHz,
+    # on the Pi give them their own spidev devices (e.g. b"spidev:/dev/spidev1.0") to see the real thing
+    frames = 50
+    displays = [display]
+    for extra in range(3):
+      other = c_void_p(circularDisp.CreateDisplay())
+      circularDisp.SelectBackend(other, b"emulator")
+      circularDisp.initBCMHardware(other)
+      circularDisp.initCircularDisp(other)
+      displays.append(other)
+
+    for count in (1, 2, 4):
+      group = (c_void_p*count)(*displays[:count])
+      for many in (0, 1):
+        starttime = time.perf_counter()
+        for frame in range(frames):
+          for d in displays[:count]:
+            circularDisp.FadeToColour(d, frame*0x0821, 256)
+          if many:
+            circularDisp.ScreenUpdateMany(group, count, 0)
+          else:
+            for d in displays[:count]:
+              circularDisp.ScreenUpdate(d)
+        elapsed = time.perf_counter() - starttime
+        print("{} displays   {:16s} {:6.1f} frames per second on each".format(
+              count, "ScreenUpdateMany" if many else "ScreenUpdate", frames/elapsed))
+
+    for other in displays[1:]:
+      circularDisp.DestroyDisplay(other)
+
+  if(bench==11):
+
+    # text, glyphs per second drawn by the library, and changing a time on a clock face each frame
+    # with DrawText and a partial update, against PIL drawing the whole face and sending all of it
+    import array
+    from PIL import Image, ImageDraw, ImageFont
+    from makefont import MakeFont
+    circularDisp.LoadFont.restype = c_void_p
+    fontpath = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+    text = "The quick brown fox 0123456789"
+
+    for size in (12, 24, 48):
+      data = MakeFont(fontpath, size)
+      font = c_void_p(circularDisp.LoadFont(data, len(data)))
+      circularDisp.clearScreenDirect(display, 0x0000)
+      count = 0
+      starttime = time.perf_counter()
+      while time.perf_counter() - starttime < 1.0:
+        for line in range(10):
+          circularDisp.DrawText(display, font, -20, line*size, text.encode(), 0xFFE0, None)
+        count += 10*len(text)
+      elapsed = time.perf_counter() - starttime
+      print("DrawText size {:2d}   {:9.0f} glyphs per second".format(size, count/elapsed))
+      circularDisp.FreeFont(font)
+
+    frames = 100
+    data = MakeFont(fontpath, 40)
+    font = c_void_p(circularDisp.LoadFont(data, len(data)))
+    pilfont = ImageFont.truetype(fontpath, 40)
+    face = Image.new("RGB", (240, 240), (255, 255, 255))
+    ImageDraw.Draw(face).ellipse((10, 10, 229, 229), outline=(0, 0, 128), width=8)
+    circularDisp.LoadRawImage(display, face.tobytes(), 240, 240, 0, 0, 0, 0, 0)
+    circularDisp.ScreenUpdate(display)
+    circularDisp.SetRefernceImage(display)
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    circularDisp.ResetFlushCounters(display)
+
+    starttime = time.perf_counter()
+    for frame in range(frames):
+      circularDisp.DrawText(display, font, 60, 95, "{:02d}:{:02d}".format(frame//60, frame%60).encode(), 0x0000, None)
+      circularDisp.ScreenUpdateDirty(display)
+      circularDisp.RestoreReferenceImage(display)
+    elapsed = time.perf_counter() - starttime
+    print("DrawText            {:6.1f} frames per second   {:6.0f} bytes per frame".format(
+          frames/elapsed, circularDisp.GetFlushBytesSent(display)/frames))
+
+    circularDisp.ResetFlushCounters(display)
+    starttime = time.perf_counter()
+    for frame in range(frames):
+      image = face.copy()
+      ImageDraw.Draw(image).text((60, 95), "{:02d}:{:02d}".format(frame//60, frame%60), font=pilfont, fill=(0, 0, 0))
+      circularDisp.LoadRawImage(display, image.tobytes(), 240, 240, 0, 0, 0, 0, 0)
+      circularDisp.ScreenUpdate(display)
+    elapsed = time.perf_counter() - starttime
+    print("PIL and full update {:6.1f} frames per second   {:6.0f} bytes per frame".format(
+          frames/elapsed, circularDisp.GetFlushBytesSent(display)/frames))
+    circularDisp.FreeFont(font)
+
+
+  if(bench==12):
+
+    # a 200px progress ring drawn each frame, as the grey track and the arc gone round so far, against
+    # DrawLineWideAA lines and the ways a ring could be drawn before (two pies, or a wide line per few degrees)
+    # the calls all go through a draw list so the time is the drawing, not ctypes
+    frames = 200
+    circularDisp.clearScreenDirect(display, 0x0000)
+
+    def Time(name, add):
+      dl = DrawList()
+      for frame in range(frames):
+        add(dl, frame*36000//frames)
+      starttime = time.perf_counter()
+      for repeat in range(10):
+        dl.Run(circularDisp, display)
+      print("{:32s} {:7.1f} us".format(name, (time.perf_counter() - starttime)/(10*frames)*1e6))
+
+    def Segments(dl, angle):
+      for step in range(0, angle, 1000):
+        a = math.radians(step/100.0)
+        b = math.radians(min(step + 1000, angle)/100.0)
+        dl.LineWideAA(120 + int(94*math.sin(a)), 120 - int(94*math.cos(a)), 120 + int(94*math.sin(b)), 120 - int(94*math.cos(b)), 0x07E0, 12)
+
+    Time("DrawLineWideAA 90px hand", lambda dl, angle: dl.LineWideAA(120,120,120 + angle//400,30,0xFFFF,10))
+    Time("DrawLineWideAA 200px", lambda dl, angle: dl.LineWideAA(20,120 - angle//400,220,120 + angle//400,0xFFFF,12))
+    Time("DrawArcAA progress", lambda dl, angle: dl.Arc(120,120,100,12,0,angle,0x07E0))
+    Time("DrawRingAA track", lambda dl, angle: dl.Ring(120,120,100,12,0x2104))
+    Time("FillCircleAA 200px", lambda dl, angle: dl.Disc(120,120,100,0x001F))
+    Time("FillPieAA 200px", lambda dl, angle: dl.Pie(120,120,100,0,36000,0x001F))
+    Time("progress as two FillPieAA", lambda dl, angle: (dl.Pie(120,120,100,0,angle,0x07E0), dl.Pie(120,120,88,0,angle,0x0000)))
+    Time("progress as a line per 10 degrees", Segments)
+
+  if(bench==13):
+
+    # the clock's three hands as sprites drawn once by PIL and turned each frame, against drawing them
+    # with DrawLineWideAA as clock.py does. Both make three calls a frame, so the ctypes time is the same
+    from PIL import Image, ImageDraw
+    circularDisp.LoadSprite.restype = c_void_p
+    frames = 1000
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+
+    # a hand length pixels from the pivot with round ends, anti-aliased by drawing it 4 times the size
+    def MakeHand(length, width, colour):
+      size = (width + 2, length + width//2 + 2)
+      image = Image.new("L", (size[0]*4, size[1]*4), 0)
+      middle = size[0]*2
+      ImageDraw.Draw(image).line((middle, (width//2 + 1)*4, middle, (length + 1)*4), fill=255, width=width*4)
+      for y in ((width//2 + 1)*4, (length + 1)*4):
+        ImageDraw.Draw(image).ellipse((middle - width*2, y - width*2, middle + width*2, y + width*2), fill=255)
+      alpha = image.resize(size, Image.BOX).tobytes()
+      sprite = c_void_p(circularDisp.LoadSprite(colour.to_bytes(2, "little")*(size[0]*size[1]), alpha, size[0], size[1]))
+      return (sprite, size[0]*32768, (length + 1)*65536)
+
+    hands = ((70, 20, 0x0000, 30), (90, 10, 0x0000, 360), (110, 6, 0x001F, 21600))
+    sprites = [MakeHand(length, width, colour) for length, width, colour, speed in hands]
+
+    for smooth in (0, 1):
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        for (sprite, pivotx, pivoty), (length, width, colour, speed) in zip(sprites, hands):
+          circularDisp.DrawSpriteFixed(display, sprite, 120*65536, 120*65536, pivotx, pivoty, frame*speed//10, 65536, smooth)
+      elapsed = time.perf_counter() - starttime
+      print("DrawSprite {:8s} {:7.1f} us per frame".format("smooth" if smooth else "nearest", elapsed/frames*1e6))
+
+    starttime = time.perf_counter()
+    for frame in range(frames):
+      for length, width, colour, speed in hands:
+        angle = math.radians(frame*speed/1000.0)
+        circularDisp.DrawLineWideAA(display, 120,120, int(120 + length*math.sin(angle)), int(120 - length*math.cos(angle)), colour, width)
+    elapsed = time.perf_counter() - starttime
+    print("DrawLineWideAA      {:7.1f} us per frame".format(elapsed/frames*1e6))
+    for sprite, pivotx, pivoty in sprites:
+      circularDisp.FreeSprite(sprite)
+
+  if(bench==14):
+
+    # lines are clipped before they are drawn, so a line reaching far off the screen costs about the same as the
+    # part that can be seen, and drawing into a widget's clip rectangle only costs the part inside it
+    frames = 200
+    circularDisp.clearScreenDirect(display, 0x0000)
+
+    def Time(name, add):
+      dl = DrawList()
+      for frame in range(frames):
+        add(dl, frame)
+      starttime = time.perf_counter()
+      for repeat in range(10):
+        dl.Run(circularDisp, display)
+      print("{:34s} {:7.2f} us".format(name, (time.perf_counter() - starttime)/(10*frames)*1e6))
+
+    Time("DrawLineIntMaths on screen", lambda dl, f: dl.Line(0,f%240,239,239 - f%240,0xFFFF))
+    Time("DrawLineIntMaths 8x off screen", lambda dl, f: dl.Line(-840,f%240 - 840,1079,1079 - f%240,0xFFFF))
+    Time("DrawLineAA on screen", lambda dl, f: dl.LineAA(0,f%240,239,239 - f%240,0xFFFF))
+    Time("DrawLineAA 8x off screen", lambda dl, f: dl.LineAA(-840,f%240 - 840,1079,1079 - f%240,0xFFFF))
+    Time("DrawLineWideAA on screen", lambda dl, f: dl.LineWideAA(0,f%240,239,239 - f%240,0xFFFF,8))
+    Time("DrawLineWideAA in a 60x60 clip", lambda dl, f: (dl.Clip(90,90,149,149),
+         dl.LineWideAA(0,f%240,239,239 - f%240,0xFFFF,8), dl.Unclip()))
+    Time("FillPieAA r100", lambda dl, f: dl.Pie(120,120,100,0,f*180,0xF800))
+    Time("FillPieAA r100 in a 60x60 clip", lambda dl, f: (dl.Clip(90,90,149,149),
+         dl.Pie(120,120,100,0,f*180,0xF800), dl.Unclip()))
+
+  if(bench==15):
+
+    # full screen update rate sent as RGB565 against RGB444, with and without the dither
+    # the emulator is run at 32MHz, where the bus is what limits the frame rate as it is on the Pi
+    frames = 100
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    if (backend == b"emulator"):
+      circularDisp.SetEmulatorClock(display, 32000000)
+    for name, bits, dither in (("RGB565", 16, 0), ("RGB444", 12, 0), ("RGB444 dithered", 12, 1)):
+      circularDisp.SetTransferFormat(display, bits, dither)
+      circularDisp.ResetFlushCounters(display)
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        circularDisp.MarkDirtyArea(display, 0,0,239,239)
+        circularDisp.ScreenUpdateDirty(display)
+      elapsed = time.perf_counter() - starttime
+      print("{:16s} {:6.1f} frames per second   {:6d} bytes a frame".format(
+            name, frames/elapsed, circularDisp.GetFlushBytesSent(display)//frames))
+    circularDisp.SetTransferFormat(display, 16, 0)
+
+  if(bench==16):
+
+    # a scrolling list, moved 16 rows a step by redrawing the band and sending it all against the hardware scrolling
+    # which only draws and sends the 16 new rows. The emulator is run at 32MHz to time the SPI as on the Pi
+    frames = 60
+    top, count, step = 40, 160, 16
+    if (backend == b"emulator"):
+      circularDisp.SetEmulatorClock(display, 32000000)
+    circularDisp.clearScreenDirect(display, 0x0000)
+    circularDisp.SetRefernceImage(display)
+
+    for scrolling in (False, True):
+      if scrolling and not circularDisp.SetScrollArea(display, top, count):
+        continue
+      circularDisp.ScreenUpdateDirty(display)
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        if scrolling:
+          row = circularDisp.ScrollArea(display, step, 0x0000)
+          circularDisp.DrawLineWideAA(display, 40,row + step//2,200,row + step//2,0xFFFF,step//2)
+        else:
+          circularDisp.RestoreReferenceImage(display)
+          for line in range(count//step):
+            y = top + (line*step + frame*step) % count + step//2
+            circularDisp.DrawLineWideAA(display, 40,y,200,y,0xFFFF,step//2)
+        circularDisp.ScreenUpdateDirty(display)
+      elapsed = time.perf_counter() - starttime
+      print("{:22s} {:6.1f} steps per second".format("hardware scrolling" if scrolling else "redrawn and sent", frames/elapsed))
+    circularDisp.SetScrollArea(display, 0, 0)
+
+  if(bench==17):
+
+    # where a frame's time goes, clock hands over a restored background. Run against a library built with and without
+    # -DC2PY_STATS to see what the counting costs, with it the time, pixels and bytes of each kind of primitive are
+    # shown, then the frame times, and the frames are saved as a trace for chrome://tracing or ui.perfetto.dev
+    frames = 300
+    kinds = ("pixel", "line", "line AA", "wide line", "polygon", "circle", "ring", "image", "text", "sprite",
+             "fill", "restore", "screen update", "send")
+    stats = (c_ulonglong*(len(kinds)*6))()
+    counting = circularDisp.GetStats(display, stats, len(stats))
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+    circularDisp.SetRefernceImage(display)
+    if counting:
+      circularDisp.StartTrace(display, 10000)
+      circularDisp.ResetStats(display)
+
+    starttime = time.perf_counter()
+    for frame in range(frames):
+      angle = frame*math.pi/30.0
+      circularDisp.RestoreReferenceImage(display)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120 + 70*math.sin(angle/60)),int(120 - 70*math.cos(angle/60)),0x0000,20)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120 + 90*math.sin(angle/12)),int(120 - 90*math.cos(angle/12)),0x0000,10)
+      circularDisp.DrawLineWideAA(display, 120,120,int(120 + 110*math.sin(angle)),int(120 - 110*math.cos(angle)),0x001F,6)
+      circularDisp.FillCircleAA(display, 120,120,8,0xF800)
+      circularDisp.ScreenUpdateDirty(display)
+    elapsed = time.perf_counter() - starttime
+    print("{:.1f} us a frame".format(elapsed*1000000/frames))
+
+    if counting:
+      circularDisp.GetStats(display, stats, len(stats))
+      print("{:14s} {:>7s} {:>9s} {:>9s} {:>9s} {:>9s}".format("", "calls", "pixels", "blended", "us", "bytes"))
+      for kind, name in enumerate(kinds):
+        calls, pixels, blended, ns, sent, commands = stats[kind*6:kind*6 + 6]
+        if (calls != 0):
+          print("{:14s} {:7d} {:9d} {:9d} {:9.0f} {:9d}".format(name, calls, pixels, blended, ns/1000, sent))
+      histogram = (c_uint*64)()
+      circularDisp.GetFrameHistogram(display, histogram, len(histogram))
+      print("frame times   " + "  ".join("{}ms {}".format(ms, count) for ms, count in enumerate(histogram) if count != 0))
+      circularDisp.SaveTrace(display, b"c2py_trace.json")
+      circularDisp.StartTrace(display, 0)
+    else:
+      print("built without -DC2PY_STATS, nothing counted")
+
+  if(bench==18):
+
+    # micro benchmarks, millions of pixels a second for each kind of drawing, the image loading and the encoding
+    # of a full screen update. Lines count one pixel a step (AA lines blend two), wide lines their length times the
+    # width and circles their circumference. The drawing is in draw lists so it is the C code being timed, and with
+    # the emulator its clock is set to 0 so the update is the encoding and not the SPI time
+    import struct
+    circularDisp.GetBuildInfo.restype = c_char_p
+    print(circularDisp.GetBuildInfo().decode())
+    if (backend == b"emulator"):
+      circularDisp.SetEmulatorClock(display, 0)
+    circularDisp.SetCircularMask(display, 0)
+    coverage = (c_ushort*(240*240))(*[(i*7)%257 for i in range(240*240)])
+    rows = bytearray()
+    for y in range(240):
+      for x in range(240):
+        rows += bytes((x, y, (x+y)&0xFF))
+    bmp = struct.pack("<2sIHHIIiiHHIIiiII", b"BM", 54 + len(rows), 0, 0, 54, 40, 240, 240, 1, 24, 0, len(rows), 2835, 2835, 0, 0) + bytes(rows)
+
+    def Lines(add):
+      dl = DrawList()
+      for i in range(240):
+        add(dl, 0,i,239,239 - i)
+      return dl
+    lines = Lines(lambda dl, x0, y0, x1, y1: dl.Line(x0,y0,x1,y1,0xFFFF))
+    aalines = Lines(lambda dl, x0, y0, x1, y1: dl.LineAA(x0,y0,x1,y1,0xFFFF))
+    widelines = Lines(lambda dl, x0, y0, x1, y1: dl.LineWideAA(x0,y0,x1,y1,0xFFFF,10))
+    circles = DrawList()
+    for r in range(1, 120):
+      circles.Circle(120,120,r,0xFFFF)
+
+    def Update(bits):
+      circularDisp.SetTransferFormat(display, bits, 0)
+      circularDisp.ScreenUpdate(display)
+
+    tests = (("lines", lambda: lines.Run(circularDisp, display), 240*240),
+             ("AA lines", lambda: aalines.Run(circularDisp, display), 240*240),
+             ("wide lines", lambda: widelines.Run(circularDisp, display), sum(10*math.hypot(239, 239 - 2*i) for i in range(240))),
+             ("circles", lambda: circles.Run(circularDisp, display), sum(2*math.pi*r for r in range(1, 120))),
+             ("blends", lambda: circularDisp.BlendCoverage(display, 0,0,240,240,0xF800,coverage), 240*240),
+             ("BMP load", lambda: circularDisp.LoadBMP(display, bmp, len(bmp), 0, 0, 0), 240*240),
+             ("flush RGB565", lambda: Update(16), 240*240),
+             ("flush RGB444", lambda: Update(12), 240*240))
+    for name, run, pixels in tests:
+      repeats = 0
+      starttime = time.perf_counter()
+      while (time.perf_counter() - starttime < 0.5):
+        run()
+        repeats += 1
+      elapsed = time.perf_counter() - starttime
+      print("{:14s} {:8.1f} Mpix/s".format(name, repeats*pixels/elapsed/1000000.0))
+    circularDisp.SetTransferFormat(display, 16, 0)
+    circularDisp.SetCircularMask(display, 1)
+
+  if(bench==19):
+
+    # a frame built with numpy each time (a moving colour pattern), handed over by writing it straight into the render
+    # space against making a 24 bit BMP of it for RGB240x240Direct, and LoadRawImage copying it in. The hand over is
+    # timed on its own, and the frames per second include making the frame and sending it at the bus speed
+    import numpy
+    import struct
+    from renderspace import RenderArray, RGBto16bit
+    frames = 100
+    y, x = numpy.mgrid[0:240, 0:240]
+    header = struct.pack("<2sIHHIIiiHHIIiiII", b"BM", 54 + 240*240*3, 0, 0, 54, 40, 240, 240, 1, 24, 0, 240*240*3, 2835, 2835, 0, 0)
+    render = RenderArray(circularDisp, display)
+
+    def Frame(frame):
+      red = (x + frame*4) & 0xFF
+      green = (y + frame*2) & 0xFF
+      blue = ((x ^ y) + frame) & 0xFF
+      return red, green, blue
+
+    def ZeroCopy(red, green, blue):
+      render[:, :] = RGBto16bit(red, green, blue)
+
+    def Bitmap(red, green, blue):
+      # bottom up rows of blue, green, red bytes
+      pixels = numpy.dstack((blue, green, red)).astype(numpy.uint8)[::-1]
+      circularDisp.RGB240x240Direct(display, header + pixels.tobytes(), 0)
+
+    def Raw(red, green, blue):
+      circularDisp.LoadRawImage(display, RGBto16bit(red, green, blue).tobytes(), 240, 240, 4, 0, 0, 0, 0)
+
+    for name, handover in (("render space", ZeroCopy), ("BMP", Bitmap), ("LoadRawImage", Raw)):
+      handtime = 0.0
+      starttime = time.perf_counter()
+      for frame in range(frames):
+        red, green, blue = Frame(frame)
+        start = time.perf_counter()
+        handover(red, green, blue)
+        handtime += time.perf_counter() - start
+        circularDisp.ScreenUpdate(display)
+      elapsed = time.perf_counter() - starttime
+      print("{:14s} {:7.0f} us to hand over a frame   {:6.1f} frames per second".format(name, handtime*1000000/frames, frames/elapsed))
+
+  if(bench==20):
+
+    # drawing with more than one thread, the test.py line patterns (tests 1, 2 and 3) and some filled shapes as draw
+    # lists drawn with 1 to 4 threads, each drawing a band of rows. Only the drawing is timed, not the sending, and
+    # the speed up is against one thread. It needs as many cores as threads to gain anything
+    import os
+    patterns = []
+    for name, add in (("lines", lambda dl, x0, y0, x1, y1, colour: dl.Line(x0,y0,x1,y1,colour)),
+                      ("AA lines", lambda dl, x0, y0, x1, y1, colour: dl.LineAA(x0,y0,x1,y1,colour)),
+                      ("wide lines", lambda dl, x0, y0, x1, y1, colour: dl.LineWideAA(x0,y0,x1,y1,colour,10))):
+      dl = DrawList()
+      for centre in range (10):
+        for radius in range(240):
+          add(dl, 12*centre,12*centre,radius,0,radius<<11)
+          add(dl, 12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
+          add(dl, 12*centre,12*centre,radius,239,radius&0x1F)
+          add(dl, 12*centre,12*centre,239,radius,0xffff>>centre)
+      patterns.append((name, dl))
+    dl = DrawList()
+    for r in range(115, 0, -5):
+      dl.Disc(120,120,r,r*0x0841)
+      dl.Arc(120,120,r,3,r*100,r*300,0xFFFF)
+    patterns.append(("discs and arcs", dl))
+
+    print("{} cores".format(os.cpu_count()))
+    for name, dl in patterns:
+      results = []
+      for threads in (1, 2, 3, 4):
+        circularDisp.SetDrawThreads(display, threads)
+        repeats = 0
+        starttime = time.perf_counter()
+        while (time.perf_counter() - starttime < 1.0):
+          dl.Run(circularDisp, display)
+          repeats += 1
+        elapsed = time.perf_counter() - starttime
+        results.append(repeats/elapsed)
+      print("{:14s} ".format(name) + "   ".join("{} threads {:6.1f}/s x{:.2f}".format(threads, rate, rate/results[0])
+                                                for threads, rate in zip((1, 2, 3, 4), results)))
+    circularDisp.SetDrawThreads(display, 1)
+
+  if(bench==21):
+
+    # content diff, full frames sent with ScreenUpdate with and without SetContentDiff. A dashboard where only a
+    # needle and a number change each frame, and a video like frame where most of it moves. With the emulator the
+    # sending takes as long as a 32MHz bus would, so the frames per second show what the diff saves on the wire
+    import numpy
+    from renderspace import RenderArray
+    frames = 100
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    y, x = numpy.mgrid[0:240, 0:240]
+    render = RenderArray(circularDisp, display)
+    background = (((x//20 + y//20) & 1)*0x2104 + 0x1082).astype(numpy.uint16)
+    stats = (c_ulonglong*6)()
+
+    def Dashboard(frame):
+      render[:, :] = background
+      angle = frame*0.05
+      for r in range(10, 100):
+        render[int(120 + r*math.sin(angle)), int(120 + r*math.cos(angle))] = 0xF800
+      render[180:200, 100:140] = (frame*0x0841) & 0xFFFF
+
+    def Video(frame):
+      render[:, :] = ((x + frame*3) ^ (y*2 + frame)) & 0xFFFF
+
+    for name, draw in (("dashboard", Dashboard), ("video", Video)):
+      for threshold in (None, 50):
+        if (threshold == None):
+          circularDisp.SetContentDiff(display, 0, 0)
+        else:
+          circularDisp.SetContentDiff(display, 1, threshold)
+        draw(0)
+        circularDisp.ScreenUpdate(display)
+        circularDisp.ResetDiffStats(display)
+        circularDisp.ResetFlushCounters(display)
+        starttime = time.perf_counter()
+        for frame in range(1, frames + 1):
+          draw(frame)
+          circularDisp.ScreenUpdate(display)
+        elapsed = time.perf_counter() - starttime
+        circularDisp.GetDiffStats(display, stats, len(stats))
+        print("{:10s} diff {:4s} {:6.1f} frames per second {:7d} bytes a frame   {:5.1f}% changed, {} sent whole".format(
+              name, "off" if threshold == None else "on", frames/elapsed, circularDisp.GetFlushBytesSent(display)//frames,
+              stats[5]/10, stats[4]))
+    circularDisp.SetContentDiff(display, 0, 0)
+
+  circularDisp.exitBCMHardware(display)
+else:
+  print ("failed to imitialise the hardware - probably not running as root")
+
+print ("done")
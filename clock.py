@@ -9,6 +9,7 @@
 
 import datetime
 import math
+import signal
 
 # load in the ability to use c variable types 
 from ctypes import *
@@ -16,11 +17,20 @@ from ctypes import *
 # load the Shared Library for the direct I/O 
 circularDisp = CDLL("./bcm_direct_c2py.so")
 
+# each display the library drives has its own context, which is passed first to the display functions
+circularDisp.CreateDisplay.restype = c_void_p
+display = c_void_p(circularDisp.CreateDisplay())
+
 
 # initialise the hardware driver
-if (circularDisp.initBCMHardware()):
+if (circularDisp.initBCMHardware(display)):
   # then send the commands to configure the display
-  circularDisp.initCircularDisp()
+  circularDisp.initCircularDisp(display)
+
+  # if the display's TE pin is wired to a GPIO put its number here, so the hands are sent without tearing
+  tepin = -1
+  if (tepin >= 0):
+    circularDisp.SetTearingSync(display, tepin)
 
 
   #load a sample 240x240 BMP for the background
@@ -30,74 +40,77 @@ if (circularDisp.initBCMHardware()):
 
 
   # load the BMP image data directly
-  circularDisp.RGB240x240Direct(data,1)
+  circularDisp.RGB240x240Direct(display, data,1)
 
   # use this instead if you want a flat colour screens
-  #circularDisp.clearScreenDirect(0xFFFF)
+  #circularDisp.clearScreenDirect(display, 0xFFFF)
 
   # then tell the driver to save the current image as the reference
-  circularDisp.SetRefernceImage()
+  circularDisp.SetRefernceImage(display)
 
-  # use the try to allow clean exit on CTRL C
-  try:
-    while(1):
-        
-      now = datetime.datetime.now()
+  # draws the hands for one frame, called by the frame loop in the C library
+  # the hands are drawn over the restored background, the loop then sends the changed areas and restores it again
+  def DrawFrame(frame):
+    now = datetime.datetime.now()
 
-      # useful commands if you want to see the raw time data
-      # print(str(now))
-      # print ("hour   {}".format(now.hour))
-      # print ("Minute {}".format(now.minute))
-      # print ("Sec    {}".format(now.second))
-      # print ("ms     {}".format(now.microsecond))
+    # useful commands if you want to see the raw time data
+    # print(str(now))
+    # print ("hour   {}".format(now.hour))
+    # print ("Minute {}".format(now.minute))
+    # print ("Sec    {}".format(now.second))
+    # print ("ms     {}".format(now.microsecond))
 
-      # get the seconds, including the fractions of the second to make for a smooth second hand
-      Secf = float(now.second)+((float)(now.microsecond)/1000000.0)
+    # get the seconds, including the fractions of the second to make for a smooth second hand
+    Secf = float(now.second)+((float)(now.microsecond)/1000000.0)
 
-      # calculate the relevant X and Y points for the end of the second hand
-      Secx =  110*math.sin(Secf*math.pi/30.0)  +120.0
-      Secy = -110*math.cos(Secf*math.pi/30.0)  +120.0
+    # calculate the relevant X and Y points for the end of the second hand
+    Secx =  110*math.sin(Secf*math.pi/30.0)  +120.0
+    Secy = -110*math.cos(Secf*math.pi/30.0)  +120.0
 
-      # not work out the minutes, again use the seconds to give a smooth moving minute hand
-      Minf = float(now.minute)+((float)(now.second)/60.0)
+    # not work out the minutes, again use the seconds to give a smooth moving minute hand
+    Minf = float(now.minute)+((float)(now.second)/60.0)
 
-      Minx =  90*math.sin(Minf*math.pi/30.0)  +120.0
-      Miny = -90*math.cos(Minf*math.pi/30.0)  +120.0
+    Minx =  90*math.sin(Minf*math.pi/30.0)  +120.0
+    Miny = -90*math.cos(Minf*math.pi/30.0)  +120.0
 
-      # finaly do the hours based on Hours and minutes for smooth movement
-      Hrf = float(now.hour)+((float)(now.minute)/60.0)
+    # finaly do the hours based on Hours and minutes for smooth movement
+    Hrf = float(now.hour)+((float)(now.minute)/60.0)
 
-      Hrx =  70*math.sin(Hrf*math.pi/6.0)  +120.0
-      Hry = -70*math.cos(Hrf*math.pi/6.0)  +120.0
+    Hrx =  70*math.sin(Hrf*math.pi/6.0)  +120.0
+    Hry = -70*math.cos(Hrf*math.pi/6.0)  +120.0
 
-      # note that the DrawLine commands only write to the render buffer and are not immediatly visible
-      # this gives a better display update for this type of application
+    # note that the DrawLine commands only write to the render buffer and are not immediatly visible
+    # this gives a better display update for this type of application
 
-      # as I used a white clock face, then the main hands will be black
+    # as I used a white clock face, then the main hands will be black
 
-      handcolour = circularDisp.RGBto16bit(0,0,0)   #black
+    handcolour = circularDisp.RGBto16bit(0,0,0)   #black
 
-      circularDisp.DrawLineWideAA(120,120,(int)(Hrx),(int)(Hry),handcolour,20)
+    circularDisp.DrawLineWideAA(display, 120,120,(int)(Hrx),(int)(Hry),handcolour,20)
 
-      circularDisp.DrawLineWideAA(120,120,(int)(Minx),(int)(Miny),handcolour,10)
-      
+    circularDisp.DrawLineWideAA(display, 120,120,(int)(Minx),(int)(Miny),handcolour,10)
+    
 
-      # for the second hand, use a Blue hand colour but make both centre and end wide
-      handcolour = circularDisp.RGBto16bit(0,0,255)   #Blue
-      circularDisp.DrawLineWideAA(120,120,(int)(Secx),(int)(Secy),handcolour,6)
+    # for the second hand, use a Blue hand colour but make both centre and end wide
+    handcolour = circularDisp.RGBto16bit(0,0,255)   #Blue
+    circularDisp.DrawLineWideAA(display, 120,120,(int)(Secx),(int)(Secy),handcolour,6)
 
+    return True
 
-      # tell the driver to write the image data to the screen
-      circularDisp.ScreenUpdate()
+  # keep a reference to the callback for as long as the loop runs
+  drawframe = CFUNCTYPE(c_bool, c_uint)(DrawFrame)
 
-      # now reset the background for the next cycle
-      circularDisp.RestoreReferenceImage()
-     
-  except:
-    print("Exiting")
+  # the loop draws 30 frames a second and sleeps in between rather than redrawing as fast as it can
+  # each frame only the areas changed by the hands (this frame and last) are sent (1 = ScreenUpdateDirty)
+  # and then the background is restored for the next one (+ 4)
+  # CTRL C stops the loop after the frame being drawn (Python only sees it while DrawFrame is running)
+  signal.signal(signal.SIGINT, lambda signum, frame: circularDisp.StopFrameLoop(display))
+  framerate = 30
+  circularDisp.RunFrameLoop(display, framerate, drawframe, 1 + 4)
+  print("Exiting")
 
   # make sure any clean up is done  
-  circularDisp.exitBCMHardware()
+  circularDisp.exitBCMHardware(display)
 else:
   print ("failed to imitialise the hardware - probably not running as root")
 
@@ -0,0 +1,131 @@
+# builds a list of drawing commands for the C driver to run in a single call
+#
+# calling into the C library from Python costs more than drawing most lines, so a frame of drawing
+# can be collected here and then handed over with ExecuteDrawList
+#
+#   dl = DrawList()
+#   dl.LineAA(120,120,200,40,0xF800)
+#   dl.UpdateDirty()
+#   dl.Run(circularDisp, display)
+#
+#  see https://simpaul.com/round_display for details
+#
+
+import struct
+from ctypes import c_ubyte
+
+# the command numbers, these must match the DL_ defines in bcm_direct_c2py.c
+DL_END       = 0x00
+DL_LINE      = 0x01
+DL_LINE_AA   = 0x02
+DL_LINE_WIDE = 0x03
+DL_CIRCLE    = 0x04
+DL_RECT      = 0x05
+DL_PIXEL     = 0x06
+DL_BLIT      = 0x07
+DL_UPDATE    = 0x08
+DL_RESTORE   = 0x09
+DL_CLEAR     = 0x0A
+DL_LINE_CAPPED = 0x0B
+DL_PIE       = 0x0C
+DL_POLYGON   = 0x0D
+DL_DISC      = 0x0E
+DL_ARC       = 0x0F
+DL_CLIP      = 0x10
+DL_UNCLIP    = 0x11
+
+# line ends for LineWideCapped, the same as the LINE_CAP_ values in bcm_direct_c2py.h
+LINE_CAP_BUTT   = 0
+LINE_CAP_SQUARE = 1
+LINE_CAP_ROUND  = 2
+
+
+class DrawList:
+
+  def __init__(self):
+    self.data = bytearray()
+    self.count = 0
+
+  # every value goes as 16 bits, cut down in the same way ctypes does when calling the functions directly
+  def _add(self, command, *values):
+    self.data += struct.pack("<B%dH" % len(values), command, *[v & 0xFFFF for v in values])
+    self.count += 1
+
+  def Clear(self):
+    self.data = bytearray()
+    self.count = 0
+
+  def Line(self, x0, y0, x1, y1, colour):
+    self._add(DL_LINE, x0, y0, x1, y1, colour)
+
+  def LineAA(self, x0, y0, x1, y1, colour):
+    self._add(DL_LINE_AA, x0, y0, x1, y1, colour)
+
+  def LineWideAA(self, x0, y0, x1, y1, colour, width):
+    self._add(DL_LINE_WIDE, x0, y0, x1, y1, colour, width)
+
+  def LineWideCapped(self, x0, y0, x1, y1, colour, width, cap):
+    self._add(DL_LINE_CAPPED, x0, y0, x1, y1, colour, width, cap)
+
+  # angles in hundredths of a degree clockwise from 12 o'clock
+  def Pie(self, x, y, r, startangle, endangle, colour):
+    self._add(DL_PIE, x, y, r, startangle, endangle, colour)
+
+  def Disc(self, x, y, r, colour):
+    self._add(DL_DISC, x, y, r, colour)
+
+  # a ring width pixels wide inside radius r, all the way round or from startangle to endangle as Pie
+  def Ring(self, x, y, r, width, colour):
+    self._add(DL_ARC, x, y, r, width, 0, 36000, colour)
+
+  def Arc(self, x, y, r, width, startangle, endangle, colour):
+    self._add(DL_ARC, x, y, r, width, startangle, endangle, colour)
+
+  # points is a list of (x,y), up to 64 of them
+  def Polygon(self, points, colour):
+    self._add(DL_POLYGON, len(points), colour)
+    for x, y in points:
+      self.data += struct.pack("<2H", x & 0xFFFF, y & 0xFFFF)
+
+  def Circle(self, x, y, r, colour):
+    self._add(DL_CIRCLE, x, y, r, colour)
+
+  def Rectangle(self, x0, y0, x1, y1, colour):
+    self._add(DL_RECT, x0, y0, x1, y1, colour)
+
+  def Pixel(self, x, y, colour):
+    self._add(DL_PIXEL, x, y, colour)
+
+  # pixels is anything holding width*height 16 bit colours, e.g. array('H') or a list
+  def Blit(self, x, y, width, height, pixels):
+    self._add(DL_BLIT, x, y, width, height)
+    self.data += struct.pack("<%dH" % (width*height), *[p & 0xFFFF for p in pixels])
+
+  def Fill(self, colour):
+    self._add(DL_CLEAR, colour)
+
+  # keeps the drawing after it inside x0,y0 to x1,y1 (and any clip already set) until the matching Unclip
+  def Clip(self, x0, y0, x1, y1):
+    self._add(DL_CLIP, x0, y0, x1, y1)
+
+  def Unclip(self):
+    self._add(DL_UNCLIP)
+
+  def RestoreReference(self):
+    self._add(DL_RESTORE)
+
+  def Update(self):
+    self._add(DL_UPDATE, 0)
+
+  def UpdateDirty(self):
+    self._add(DL_UPDATE, 1)
+
+  def UpdateAsync(self, partial=False):
+    self._add(DL_UPDATE, 3 if partial else 2)
+
+  # hand the whole list to the C library to draw on display (from CreateDisplay),
+  # returns the number of commands run (or -1 if the list was rejected)
+  def Run(self, circularDisp, display):
+    buffer = (c_ubyte * len(self.data)).from_buffer(self.data)
+    return circularDisp.ExecuteDrawList(display, buffer, len(self.data))
+
@@ -0,0 +1,75 @@
+# builds a font for the text drawing in the C driver from any font PIL can load
+#
+# each character is drawn once here and packed as 4 bit coverage (16 levels of anti-aliasing) into a small
+# atlas file, which LoadFont in the C library reads, so the Pi itself does not need PIL to show text
+#
+#   python3 makefont.py /usr/share/fonts/truetype/dejavu/DejaVuSans.ttf 24 dejavu24.fnt
+#
+# or from Python, MakeFont(path, size) returns the same data as bytes
+#
+#  see https://simpaul.com/round_display for details
+#
+
+import struct
+import sys
+from PIL import Image, ImageDraw, ImageFont
+
+# the printable ASCII characters and the degree sign, enough for clocks and gauges
+DEFAULT_CHARACTERS = "".join(chr(c) for c in range(32, 127)) + "°"
+
+FONT_VERSION = 1
+
+
+def MakeFont(path, size, characters=DEFAULT_CHARACTERS):
+  font = ImageFont.truetype(path, size)
+  ascent, descent = font.getmetrics()
+  characters = sorted(set(characters))
+
+  glyphs = bytearray()
+  atlas = bytearray()
+  for char in characters:
+    # the box is from the pen position and the top of the line, the same as DrawText uses
+    left, top, right, bottom = font.getbbox(char)
+    width = max(right - left, 0)
+    height = max(bottom - top, 0)
+    offset = len(atlas)
+    if (width == 0) or (height == 0):
+      left = top = width = height = 0
+    else:
+      image = Image.new("L", (width, height), 0)
+      ImageDraw.Draw(image).text((-left, -top), char, font=font, fill=255)
+      pixels = image.tobytes()
+      for row in range(height):
+        levels = [(value*15 + 127)//255 for value in pixels[row*width:(row+1)*width]]
+        if (width & 1):
+          levels.append(0)
+        atlas += bytes((levels[x] << 4) | levels[x+1] for x in range(0, len(levels), 2))
+
+    advance = int(round(font.getlength(char)*16))
+    glyphs += struct.pack("<IIBBbbHxx", ord(char), offset, width, height, left, top, advance)
+
+  # the kerning is whatever the pair's length is over the two on their own
+  kerns = bytearray()
+  kerncount = 0
+  for first in characters:
+    for second in characters:
+      adjust = int(round((font.getlength(first + second) - font.getlength(first) - font.getlength(second))*16))
+      if (adjust != 0):
+        kerns += struct.pack("<IIhxx", ord(first), ord(second), adjust)
+        kerncount += 1
+
+  header = struct.pack("<4sHHHHII", b"C2PF", FONT_VERSION, ascent + descent, ascent, len(characters), kerncount, len(atlas))
+  return bytes(header + glyphs + kerns + atlas)
+
+
+if __name__ == "__main__":
+  if (len(sys.argv) < 4):
+    print("usage: python3 makefont.py font.ttf size output.fnt [characters]")
+    sys.exit(1)
+
+  characters = sys.argv[4] if (len(sys.argv) > 4) else DEFAULT_CHARACTERS
+  data = MakeFont(sys.argv[1], int(sys.argv[2]), characters)
+  file = open(sys.argv[3], "wb")
+  file.write(data)
+  file.close()
+  print("{} characters, {} bytes".format(len(set(characters)), len(data)))
@@ -0,0 +1,50 @@
+# the render space of a display as an array Python can write to directly
+#
+# the C library draws into a 240x240 buffer of 16 bit pixels and sends it from there, this gives that same memory to
+# numpy (or anything that takes a buffer) so a frame can be built with whole array operations and sent with no copy
+#
+#   frame = RenderArray(circularDisp, display)
+#   frame[100:140, :] = 0xF800
+#   circularDisp.MarkDirtyArea(display, 0,100,239,139)
+#   circularDisp.ScreenUpdateDirty(display)
+#
+# the library does not know what was written, so mark it with MarkDirtyArea or send it all with ScreenUpdate.
+# The memory belongs to the display, do not keep the array after exitBCMHardware or DestroyDisplay.
+# with hardware scrolling on, ScrollRow gives the row of the array shown on a screen row
+#
+#  see https://simpaul.com/round_display for details
+#
+
+from ctypes import c_void_p, c_short, c_bool, c_ushort, byref
+
+
+def _GetRenderSpace(circularDisp, display):
+  width, height, stride, panelorder = c_short(), c_short(), c_short(), c_bool()
+  circularDisp.GetRenderSpace.restype = c_void_p
+  address = circularDisp.GetRenderSpace(display, byref(width), byref(height), byref(stride), byref(panelorder))
+  if not address:
+    raise RuntimeError("the display has no render space, call initCircularDisp first")
+  return address, width.value, height.value, stride.value, panelorder.value
+
+
+# a writable memoryview of height rows of stride 16 bit pixels, [y, x] is the pixel at x,y
+# the pixels are as the render space holds them, byte swapped if SetPanelByteOrder is on
+def RenderSpace(circularDisp, display):
+  address, width, height, stride, panelorder = _GetRenderSpace(circularDisp, display)
+  return memoryview((c_ushort*(height*stride)).from_address(address)).cast("B").cast("H", (height, stride))
+
+
+# a numpy uint16 array of height x width, [y, x] is the pixel at x,y. With SetPanelByteOrder on it is big endian
+# so numpy swaps the bytes of the colours written and read, and the values are the same either way
+def RenderArray(circularDisp, display):
+  import numpy
+  address, width, height, stride, panelorder = _GetRenderSpace(circularDisp, display)
+  array = numpy.frombuffer((c_ushort*(height*stride)).from_address(address), dtype=numpy.uint16)
+  if panelorder:
+    array = array.view(">u2")
+  return array.reshape(height, stride)[:, :width]
+
+
+# colours from numpy arrays of red, green and blue (0-255), the same as RGBto16bit
+def RGBto16bit(red, green, blue):
+  return ((red.astype("uint16") >> 3) << 11) | ((green.astype("uint16") >> 2) << 5) | (blue.astype("uint16") >> 3)
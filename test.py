@@ -7,7 +7,12 @@
 #  see https://simpaul.com/round_display for details
 #
 
+import sys
 import datetime
+import os
+import struct
+import tempfile
+import zlib
 
 # load in the ability to use c variable types 
 from ctypes import *
@@ -20,36 +25,103 @@ def DrawCirclePython(x0, y0, r, colour):
   a=0
   b=r	  
   while(a<=b):
-    circularDisp.SetPixelDirect(x0-b,y0-a,colour)
-    circularDisp.SetPixelDirect(x0+b,y0-a,colour)                   
-    circularDisp.SetPixelDirect(x0-a,y0+b,colour)                         
-    circularDisp.SetPixelDirect(x0-a,y0-b,colour)           
-    circularDisp.SetPixelDirect(x0+b,y0+a,colour)                        
-    circularDisp.SetPixelDirect(x0+a,y0-b,colour)       
-    circularDisp.SetPixelDirect(x0+a,y0+b,colour)         
-    circularDisp.SetPixelDirect(x0-b,y0+a,colour)         
+    circularDisp.SetPixelDirect(display, x0-b,y0-a,colour)
+    circularDisp.SetPixelDirect(display, x0+b,y0-a,colour)                   
+    circularDisp.SetPixelDirect(display, x0-a,y0+b,colour)                         
+    circularDisp.SetPixelDirect(display, x0-a,y0-b,colour)           
+    circularDisp.SetPixelDirect(display, x0+b,y0+a,colour)                        
+    circularDisp.SetPixelDirect(display, x0+a,y0-b,colour)       
+    circularDisp.SetPixelDirect(display, x0+a,y0+b,colour)         
+    circularDisp.SetPixelDirect(display, x0-b,y0+a,colour)         
     a+=1
     if((a*a+b*b)>(r*r)):
       b-=1
 
 
+# golden images, the pixel rows of an 8 bit RGB PNG with no filtering, as EmulatorSaveFrame writes them
+def ReadPNG(path):
+  data = open(path, "rb").read()
+  pos = 8
+  idat = b""
+  while (pos < len(data)):
+    length, kind = struct.unpack(">I4s", data[pos:pos + 8])
+    if (kind == b"IDAT"):
+      idat += data[pos + 8:pos + 8 + length]
+    pos += 12 + length
+  return zlib.decompress(idat)
+
+# the same PNG compressed, to keep the golden images small
+def WritePNG(path, rows):
+  def Chunk(kind, data):
+    return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data))
+  header = struct.pack(">IIBBBBB", 240, 240, 8, 2, 0, 0, 0)
+  open(path, "wb").write(b"\x89PNG\r\n\x1a\n" + Chunk(b"IHDR", header) + Chunk(b"IDAT", zlib.compress(rows, 9)) + Chunk(b"IEND", b""))
+
+# compares what an emulated display shows with golden/name.png, a missing one fails. With update on the command
+# line (make golden) it is written instead, look at it before committing it
+def CheckGolden(context, name):
+  global goldenchecked
+  if (golden == None):
+    return
+  goldenchecked = True
+  handle, frame = tempfile.mkstemp(suffix=".png")
+  os.close(handle)
+  circularDisp.EmulatorSaveFrame(context, frame.encode())
+  rows = ReadPNG(frame)
+  os.remove(frame)
+  path = "{}/{}.png".format(golden, name)
+  if update:
+    WritePNG(path, rows)
+    print("golden image {} written".format(path))
+    return
+  if not os.path.exists(path):
+    print("golden image {} FAILED, there is none (make golden writes it)".format(path))
+    return
+  expected = ReadPNG(path)
+  different = sum(1 for i in range(0, len(rows), 3) if rows[i:i + 3] != expected[i:i + 3])
+  print("golden image {} {}".format(path, "passed" if different == 0 else "FAILED, {} pixels differ".format(different)))
+
+
 # load the Shared Library for the direct I/O 
 circularDisp = CDLL("./bcm_direct_c2py.so")
 
+# each display the library drives has its own context, which is passed first to the display functions
+circularDisp.CreateDisplay.restype = c_void_p
+display = c_void_p(circularDisp.CreateDisplay())
+
+# away from the Pi, build the library with -DNO_BCM2835 and use the emulator backend
+# or give the test, backend and golden image directory on the command line, python3 test.py 2 emulator golden
+# (as make test does), and update after it to write the golden images rather than check them (make golden)
+backend = None
+golden = None
+update = False
+goldenchecked = False       # set once a test has checked its own display, otherwise this one is checked at the end
+if (len(sys.argv) > 2):
+  backend = sys.argv[2].encode()
+if (len(sys.argv) > 3):
+  golden = sys.argv[3]
+  update = (len(sys.argv) > 4) and (sys.argv[4] == "update")
+  import random
+  random.seed(2021)         # the same random images every time
+if (backend != None):
+  circularDisp.SelectBackend(display, backend)
+
 
 # simple python code to show a selection of functions in the C library
 print ("testing")
 
 # initialise the hardware driver
-if (circularDisp.initBCMHardware()):
+if (circularDisp.initBCMHardware(display)):
   # then send the commands to configure the display
-  circularDisp.initCircularDisp()
+  circularDisp.initCircularDisp(display)
 
   # clear the screen with a full screen solid colour
-  circularDisp.clearScreenDirect(0x0000)    # this is green
+  circularDisp.clearScreenDirect(display, 0x0000)    # this is green
 
   # select which test to run
   test =2
+  if (len(sys.argv) > 1):
+    test = int(sys.argv[1])
   
   # some timing to see how fast it can work
   starttime = datetime.datetime.now()
@@ -59,11 +131,11 @@ if (circularDisp.initBCMHardware()):
     # do the AA line testing
     for centre in range (10):
       for radius in range(240):
-        circularDisp.DrawLineIntMaths(12*centre,12*centre,radius,0,radius<<11)
-        circularDisp.DrawLineIntMaths(12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
-        circularDisp.DrawLineIntMaths(12*centre,12*centre,radius,239,radius&0x1F)
-        circularDisp.DrawLineIntMaths(12*centre,12*centre,239,radius,0xffff>>centre)
-      #circularDisp.ScreenUpdate()
+        circularDisp.DrawLineIntMaths(display, 12*centre,12*centre,radius,0,radius<<11)
+        circularDisp.DrawLineIntMaths(display, 12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
+        circularDisp.DrawLineIntMaths(display, 12*centre,12*centre,radius,239,radius&0x1F)
+        circularDisp.DrawLineIntMaths(display, 12*centre,12*centre,239,radius,0xffff>>centre)
+      #circularDisp.ScreenUpdate(display)
 
 
   if(test==2):
@@ -71,33 +143,824 @@ if (circularDisp.initBCMHardware()):
     # do the AA line testing
     for centre in range (10):
       for radius in range(240):
-        circularDisp.DrawLineAA(12*centre,12*centre,radius,0,radius<<11)
-        circularDisp.DrawLineAA(12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
-        circularDisp.DrawLineAA(12*centre,12*centre,radius,239,radius&0x1F)
-        circularDisp.DrawLineAA(12*centre,12*centre,239,radius,0xffff>>centre)
-      #circularDisp.ScreenUpdate()
+        circularDisp.DrawLineAA(display, 12*centre,12*centre,radius,0,radius<<11)
+        circularDisp.DrawLineAA(display, 12*centre,12*centre,0,radius,(radius<<5)&0x07E0)
+        circularDisp.DrawLineAA(display, 12*centre,12*centre,radius,239,radius&0x1F)
+        circularDisp.DrawLineAA(display, 12*centre,12*centre,239,radius,0xffff>>centre)
+      #circularDisp.ScreenUpdate(display)
 
   if(test==3):
 
     # do the wide line testing
     for centre in range (10):
       for radius in range(240):
-        circularDisp.DrawLineWideAA(12*centre,12*centre,radius,0,radius<<11,10)
-        circularDisp.DrawLineWideAA(12*centre,12*centre,0,radius,(radius<<5)&0x07E0,10)
-        circularDisp.DrawLineWideAA(12*centre,12*centre,radius,239,radius&0x1F,10)
-        circularDisp.DrawLineWideAA(12*centre,12*centre,239,radius,0xffff>>centre,10)
-      #circularDisp.ScreenUpdate()
+        circularDisp.DrawLineWideAA(display, 12*centre,12*centre,radius,0,radius<<11,10)
+        circularDisp.DrawLineWideAA(display, 12*centre,12*centre,0,radius,(radius<<5)&0x07E0,10)
+        circularDisp.DrawLineWideAA(display, 12*centre,12*centre,radius,239,radius&0x1F,10)
+        circularDisp.DrawLineWideAA(display, 12*centre,12*centre,239,radius,0xffff>>centre,10)
+      #circularDisp.ScreenUpdate(display)
       
+  if(test==4):
+
+    # check the panel byte order option gives exactly the same pixels as the normal render space
+    # the whole square is compared, so the circular mask is turned off
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.SetCircularMask(display, 0)
+    circularDisp.clearScreenDirect(display, 0x0000)
+
+    def DrawPattern():
+      for centre in range (10):
+        for radius in range(0,240,8):
+          circularDisp.DrawLineAA(display, 12*centre,12*centre,radius,0,radius<<11)
+          circularDisp.DrawLineWideAA(display, 12*centre,12*centre,0,radius,(radius<<5)&0x07E0,5)
+          circularDisp.DrawLineIntMaths(display, 12*centre,12*centre,239,radius,0xffff>>centre)
+        circularDisp.DrawCircle(display, 120,120,10*centre,0xf81f)
+
+    def ReadPixels():
+      return [circularDisp.GetPixel(display, x,y) for y in range(240) for x in range(240)]
+
+    circularDisp.SetPanelByteOrder(display, 0)
+    DrawPattern()
+    native = ReadPixels()
+
+    # the existing image should survive the conversion
+    circularDisp.SetPanelByteOrder(display, 1)
+    converted = ReadPixels()
+
+    # and drawing the same again in the panel byte order should give the same result
+    circularDisp.clearScreenDirect(display, 0x0000)
+    DrawPattern()
+    panel = ReadPixels()
+    circularDisp.SetPanelByteOrder(display, 0)
+    restored = ReadPixels()
+
+    if (native == converted) and (native == panel) and (native == restored):
+      print("panel byte order check passed")
+    else:
+      print("panel byte order check FAILED")
+
+  if(test==5):
+
+    # filled shapes, a clock face made from pie segments and hands with different ends
+    circularDisp.clearScreenDirect(display, 0xFFFF)
+    circularDisp.FillPieAA(display, 120,120,119,0,36000,0x0010)
+    circularDisp.FillPieAA(display, 120,120,110,0,36000,0xFFFF)
+    for hour in range(12):
+      # a thin slice of a circle for each hour mark, with the inner part covered again below
+      circularDisp.FillPieAA(display, 120,120,108,hour*3000-150,hour*3000+150,0x0000)
+    circularDisp.FillPieAA(display, 120,120,92,0,36000,0xFFFF)
+
+    # a quarter segment to show the time remaining
+    circularDisp.FillPieAA(display, 120,120,60,0,9000,0xFD20)
+
+    # hands, 16.16 fixed point end points
+    circularDisp.DrawLineWideCapped(display, 120<<16,120<<16,170<<16,80<<16,0x0000,14,2)    # round ends
+    circularDisp.DrawLineWideCapped(display, 120<<16,120<<16,80<<16,40<<16,0x0000,8,1)      # square ends
+    circularDisp.DrawLineWideCapped(display, 120<<16,120<<16,60<<16,170<<16,0xF800,4,0)     # butt ends
+
+    # and a polygon for an arrow head
+    arrow = (c_short*8)(200,200, 228,210, 216,216, 210,228)
+    circularDisp.FillPolygonAA(display, arrow,4,0x07E0)
+
+  if(test==6):
+
+    # check each of the blend kernels gives exactly the same pixels as the single pixel updatePixel
+    import random
+    import array
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.GetBlendKernel.restype = c_char_p
+    circularDisp.SetCircularMask(display, 0)
+
+    width = 240
+    height = 40
+    image = array.array('H', [random.randrange(65536) for i in range(width*height)])
+    overlay = array.array('H', [random.randrange(65536) for i in range(width*height)])
+    coverage = array.array('H', [random.randrange(300) for i in range(width*height)])
+    imagebytes = (c_ubyte*(width*height*2)).from_buffer(image)
+    overlaybytes = (c_ubyte*(width*height*2)).from_buffer(overlay)
+    coveragevalues = (c_ushort*(width*height)).from_buffer(coverage)
+
+    def ReadPixels():
+      return [circularDisp.GetPixel(display, x,y) for y in range(height) for x in range(width)]
+
+    # the expected results, one pixel at a time
+    circularDisp.BlitRGB565(display, 0,0,width,height,imagebytes)
+    for i in range(width*height):
+      circularDisp.updatePixel(display, i%width,i//width,0x5A3C,coverage[i])
+    expectcoverage = ReadPixels()
+
+    circularDisp.BlitRGB565(display, 0,0,width,height,imagebytes)
+    for i in range(width*height):
+      circularDisp.updatePixel(display, i%width,i//width,overlay[i],100)
+    expectimage = ReadPixels()
+
+    for panelorder in (0, 1):
+      circularDisp.SetPanelByteOrder(display, panelorder)
+      for kernel in (b"scalar", b"neon", b"sse2", b"avx2"):
+        if not circularDisp.SelectBlendKernel(kernel):
+          continue
+        circularDisp.BlitRGB565(display, 0,0,width,height,imagebytes)
+        circularDisp.BlendCoverage(display, 0,0,width,height,0x5A3C,coveragevalues)
+        coverageok = (ReadPixels() == expectcoverage)
+        circularDisp.BlitRGB565(display, 0,0,width,height,imagebytes)
+        circularDisp.BlendImageRGB565(display, 0,0,width,height,overlaybytes,100)
+        imageok = (ReadPixels() == expectimage)
+        print("{:6s} panel order {}  {}".format(kernel.decode(), panelorder, "passed" if (coverageok and imageok) else "FAILED"))
+    circularDisp.SetPanelByteOrder(display, 0)
+    circularDisp.SelectBlendKernel(None)
+
+  if(test==7):
+
+    # image loading, BMP files built here in each of the layouts LoadBMP takes and checked against RGBto16bit
+    import random
+    import struct
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.SetCircularMask(display, 0)
+
+    def MakeBMP(width, height, bits, topdown, bitfields, pixels):
+      stride = ((width*bits + 31)//32)*4
+      headersize = 40 + (12 if bitfields else 0)
+      offset = 14 + headersize
+      rows = []
+      for y in range(height):
+        row = bytearray()
+        for x in range(width):
+          r,g,b = pixels[y*width + x]
+          row += bytes((b,g,r)) if bits == 24 else bytes((b,g,r,255))
+        rows.append(bytes(row) + bytes(stride - len(row)))
+      if not topdown:
+        rows.reverse()
+      data = b"".join(rows)
+      header = struct.pack("<2sIHHI", b"BM", offset + len(data), 0, 0, offset)
+      info = struct.pack("<IiiHHIIiiII", 40, width, -height if topdown else height, 1, bits, 3 if bitfields else 0, len(data), 2835, 2835, 0, 0)
+      if bitfields:
+        info += struct.pack("<III", 0x00FF0000, 0x0000FF00, 0x000000FF)
+      return header + info + data
+
+    width = 101
+    height = 57
+    pixels = [(random.randrange(256), random.randrange(256), random.randrange(256)) for i in range(width*height)]
+    for bits, topdown, bitfields in ((24, False, False), (24, True, False), (32, False, False), (32, True, True)):
+      bmp = MakeBMP(width, height, bits, topdown, bitfields, pixels)
+      circularDisp.clearScreenDirect(display, 0x0000)
+      loaded = circularDisp.LoadBMP(display, bmp, len(bmp), 150, -20, 0)
+      ok = loaded
+      for y in range(height):
+        for x in range(width):
+          if (150 + x < 240) and (y - 20 >= 0):
+            r,g,b = pixels[y*width + x]
+            if circularDisp.GetPixel(display, 150 + x, y - 20) != circularDisp.RGBto16bit(r,g,b):
+              ok = False
+      print("{} bit BMP {:9s}{}  {}".format(bits, "top down" if topdown else "bottom up", " bit fields" if bitfields else "", "passed" if ok else "FAILED"))
+
+  if(test==8):
+
+    # the circular mask, the same drawing with it on and off should look the same inside the circle
+    # and the masked version should send less to the screen
+    import array
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    image = array.array('H', [(i*37)&0xFFFF for i in range(200*100)])
+    imagebytes = (c_ubyte*(200*100*2)).from_buffer(image)
+    coverage = array.array('H', [(i*7)%257 for i in range(240*240)])
+    coveragevalues = (c_ushort*(240*240)).from_buffer(coverage)
+
+    def DrawAndSend(mask):
+      circularDisp.SetCircularMask(display, mask)
+      circularDisp.clearScreenDirect(display, 0x0000)
+      circularDisp.BlitRGB565(display, -30,10,200,100,imagebytes)
+      circularDisp.BlendCoverage(display, 0,0,240,240,0xF81F,coveragevalues)
+      circularDisp.FillPieAA(display, 120,120,130,4500,13500,0x07E0)
+      circularDisp.FadeToColour(display, 0x001F,40)
+      circularDisp.ResetFlushCounters(display)
+      circularDisp.ScreenUpdate(display)
+      return circularDisp.GetFlushBytesSent(display)
+
+    def Inside(x, y):
+      return (x-119.5)**2 + (y-119.5)**2 < 119.5**2
+
+    fullbytes = DrawAndSend(0)
+    full = [circularDisp.GetPixel(display, x,y) for y in range(240) for x in range(240)]
+    maskbytes = DrawAndSend(1)
+    masked = [circularDisp.GetPixel(display, x,y) for y in range(240) for x in range(240)]
+    same = all((full[y*240+x] == masked[y*240+x]) for y in range(240) for x in range(240) if Inside(x,y))
+    print("circular mask {}   {} bytes sent for a full update against {}".format("passed" if same else "FAILED", maskbytes, fullbytes))
+
+  if(test==9):
+
+    # display contexts, a second (emulated) display is drawn on and updated alongside this one
+    # and neither should see anything of the other's drawing
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.clearScreenDirect(display, 0x0000)
+      circularDisp.clearScreenDirect(second, 0xFFFF)
+      circularDisp.FillPieAA(display, 120,120,100,0,9000,0xF800)
+      circularDisp.DrawLineWideAA(second, 20,120,220,120,0x001F,30)
+      displays = (c_void_p*2)(display, second)
+      circularDisp.ScreenUpdateMany(displays, 2, 1)
+
+      first = all(circularDisp.GetPixel(display, x,y) in (0x0000, 0xF800) or (x >= 120 and y <= 120)
+                  for y in range(0,240,3) for x in range(0,240,3))
+      other = all(circularDisp.GetPixel(second, x,y) == circularDisp.EmulatorGetPixel(second, x,y)
+                  for y in range(0,240,3) for x in range(0,240,3))
+      other = other and circularDisp.GetPixel(second, 180,60) == 0xFFFF and circularDisp.GetPixel(second, 180,120) == 0x001F
+      print("display contexts {}".format("passed" if (first and other) else "FAILED"))
+      CheckGolden(second, "test9_second")
+      goldenchecked = False         # this display is checked too
+    circularDisp.DestroyDisplay(second)
+
+  if(test==10):
+
+    # text, drawn by the library from a font made by makefont.py and by PIL straight from the TrueType font
+    # the two should match to within the 16 levels of the font's anti-aliasing
+    import array
+    from PIL import Image, ImageDraw, ImageFont
+    from makefont import MakeFont
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.LoadFont.restype = c_void_p
+    fontpath = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+    circularDisp.SetCircularMask(display, 0)
+
+    for size, text in ((24, "12:34 AVATAR Wave"), (40, "Tj,fy 45°")):
+      data = MakeFont(fontpath, size)
+      font = c_void_p(circularDisp.LoadFont(data, len(data)))
+      circularDisp.clearScreenDirect(display, 0x0000)
+      bounds = array.array('h', [0]*4)
+      advance = circularDisp.DrawText(display, font, 10, 100, text.encode(), 0xFFFF, (c_short*4).from_buffer(bounds))
+      circularDisp.ScreenUpdateDirty(display)
+
+      image = Image.new("L", (240, 240), 0)
+      ImageDraw.Draw(image).text((10, 100), text, font=ImageFont.truetype(fontpath, size), fill=255)
+      pil = image.load()
+      worst = 0
+      outside = 0
+      for y in range(240):
+        for x in range(240):
+          green = (circularDisp.GetPixel(display, x,y) >> 5) & 0x3F
+          worst = max(worst, abs(green - pil[x,y]*63//255))
+          if (green != 0) and not ((bounds[0] <= x <= bounds[2]) and (bounds[1] <= y <= bounds[3])):
+            outside += 1
+      circularDisp.FreeFont(font)
+      passed = (worst <= 4) and (outside == 0)
+      print("text {:2d} {}   advance {} bounds {}   largest difference {} of 63".format(
+            size, "passed" if passed else "FAILED", advance, list(bounds), worst))
+    circularDisp.SetCircularMask(display, 1)
+
+  if(test==11):
+
+    # discs, rings and arcs, checked against the area of each pixel they cover worked out here from 8x8 samples
+    import math
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.SetCircularMask(display, 0)
+
+    def Inside(px, py, x, y, r, width, start, end):
+      dx = px - x
+      dy = py - y
+      d = math.hypot(dx, dy)
+      if (d > r) or (d < r - width):
+        return False
+      if (end - start) >= 36000:
+        return True
+      angle = (math.degrees(math.atan2(dx, -dy))*100 - start) % 36000
+      return angle <= ((end - start) % 36000)
+
+    for name, shape in (("disc", (120, 120, 100, 100, 0, 36000)), ("ring", (117, 121, 90, 12, 0, 36000)),
+                        ("arc", (120, 120, 110, 20, 4500, 29000)), ("small arc", (60, 80, 30, 6, 33000, 39000))):
+      x, y, r, width, start, end = shape
+      circularDisp.clearScreenDirect(display, 0x0000)
+      if (name == "disc"):
+        circularDisp.FillCircleAA(display, x, y, r, 0xFFFF)
+      elif (end - start) >= 36000:
+        circularDisp.DrawRingAA(display, x, y, r, width, 0xFFFF)
+      else:
+        circularDisp.DrawArcAA(display, x, y, r, width, start, end, 0xFFFF)
+      circularDisp.ScreenUpdateDirty(display)
+
+      worst = 0
+      for py in range(max(y - r - 2, 0), min(y + r + 3, 240)):
+        for px in range(max(x - r - 2, 0), min(x + r + 3, 240)):
+          area = sum(Inside(px + (i + 0.5)/8 - 0.5, py + (j + 0.5)/8 - 0.5, x, y, r, width, start, end)
+                     for i in range(8) for j in range(8))
+          green = (circularDisp.GetPixel(display, px,py) >> 5) & 0x3F
+          worst = max(worst, abs(green - area*63//64))
+      print("{:9s} {}   largest difference {} of 63".format(name, "passed" if (worst <= 6) else "FAILED", worst))
+    circularDisp.SetCircularMask(display, 1)
+
+  if(test==12):
+
+    # sprites, a quarter turn at a time lands each sprite pixel exactly on a screen pixel, so it can be checked
+    # against where it should be, and mixing the four nearest pixels then gives the same as taking the nearest
+    import math
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.LoadSprite.restype = c_void_p
+    circularDisp.SetCircularMask(display, 0)
+
+    width, height = 13, 7
+    pixels = bytearray()
+    alpha = bytearray()
+    for j in range(height):
+      for i in range(width):
+        pixels += ((i*7919 + j*104729) & 0xFFFF | 0x0821).to_bytes(2, "little")
+        alpha.append(0 if ((i + j) % 5 == 0) else 255)
+    sprite = c_void_p(circularDisp.LoadSprite(bytes(pixels), bytes(alpha), width, height))
+
+    def Screen():
+      return [circularDisp.GetPixel(display, x,y) for y in range(240) for x in range(240)]
+
+    x, y, pivotx, pivoty = 100, 80, 3, 2
+    for angle in (0, 9000, 18000, 27000):
+      sin = round(math.sin(math.radians(angle/100)))
+      cos = round(math.cos(math.radians(angle/100)))
+      expected = [0]*(240*240)
+      for j in range(height):
+        for i in range(width):
+          if alpha[j*width + i]:
+            u = i + 0.5 - pivotx
+            v = j + 0.5 - pivoty
+            expected[int(math.floor(y + u*sin + v*cos))*240 + int(math.floor(x + u*cos - v*sin))] = \
+              pixels[(j*width + i)*2] | (pixels[(j*width + i)*2 + 1] << 8)
+      results = []
+      for smooth in (0, 1):
+        circularDisp.clearScreenDirect(display, 0x0000)
+        circularDisp.DrawSprite(display, sprite, x, y, pivotx, pivoty, angle, 65536, smooth)
+        circularDisp.ScreenUpdateDirty(display)
+        results.append(Screen())
+      print("sprite {:3d} degrees {}".format(angle//100, "passed" if (results[0] == expected and results[1] == expected) else "FAILED"))
+
+    # any other angle and scale only draws inside the turned rectangle, and draws on most of it
+    for angle, scale in ((3000, 98304), (13750, 40000), (31234, 200000)):
+      circularDisp.clearScreenDirect(display, 0x0000)
+      circularDisp.DrawSprite(display, sprite, x, y, pivotx, pivoty, angle, scale, 1)
+      circularDisp.ScreenUpdateDirty(display)
+      screen = Screen()
+      sin = math.sin(math.radians(angle/100))
+      cos = math.cos(math.radians(angle/100))
+      outside = 0
+      drawn = 0
+      for py in range(240):
+        for px in range(240):
+          # back into the sprite, allowing the half pixel the mixing reaches past the edge
+          dx = px + 0.5 - x
+          dy = py + 0.5 - y
+          u = (dx*cos + dy*sin)*65536/scale + pivotx
+          v = (dy*cos - dx*sin)*65536/scale + pivoty
+          inside = (-0.51 <= u < width + 0.51) and (-0.51 <= v < height + 0.51)
+          if screen[py*240 + px] != 0:
+            drawn += 1
+            if not inside:
+              outside += 1
+      area = width*height*(scale/65536)**2
+      passed = (outside == 0) and (drawn > area*0.6)
+      print("sprite {:6.2f} degrees x{:.2f} {}   {} pixels drawn".format(angle/100, scale/65536, "passed" if passed else "FAILED", drawn))
+    circularDisp.FreeSprite(sprite)
+    circularDisp.SetCircularMask(display, 1)
+
+  if(test==13):
+
+    # clip rectangles, everything drawn inside a clip is the same as drawing it without one and keeping only
+    # the part inside, and nothing outside it changes. The second clip is nested and so kept inside the first
+    from drawlist import DrawList
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.SetCircularMask(display, 0)
+
+    def Screen():
+      return [circularDisp.GetPixel(display, x,y) for y in range(240) for x in range(240)]
+
+    def Draw(dl):
+      dl.Line(-1,120,239,30,0xFFFF)
+      dl.Line(-500,-400,700,600,0xF800)
+      dl.LineAA(120,-1,60,239,0x07E0)
+      dl.LineAA(-1000,130,1000,90,0x001F)
+      dl.Circle(100,110,70,0xFFE0)
+      dl.Rectangle(30,40,200,190,0x07FF)
+      dl.LineWideAA(20,200,220,60,0xF81F,9)
+      dl.Disc(150,150,40,0x8410)
+      dl.Pie(80,80,60,4500,20000,0x4208)
+
+    for name, clips in (("one clip", ((50,60,170,150),)), ("nested", ((50,60,170,150), (100,-20,300,100))),
+                        ("empty", ((50,60,170,150), (180,0,239,239))), ("off screen", ((-40,-40,60,300),))):
+      inside = lambda x, y: all((x0 <= x <= x1) and (y0 <= y <= y1) for x0, y0, x1, y1 in clips)
+      circularDisp.clearScreenDirect(display, 0x0000)
+      dl = DrawList()
+      Draw(dl)
+      dl.Run(circularDisp, display)
+      whole = Screen()
+
+      circularDisp.clearScreenDirect(display, 0x0000)
+      dl = DrawList()
+      for clip in clips:
+        dl.Clip(*clip)
+      Draw(dl)
+      for clip in clips:
+        dl.Unclip()
+      dl.Run(circularDisp, display)
+      clipped = Screen()
+
+      expected = [whole[y*240 + x] if inside(x, y) else 0 for y in range(240) for x in range(240)]
+      drawn = sum(1 for pixel in clipped if pixel != 0)
+      print("clip {:10s} {}   {} pixels drawn".format(name, "passed" if (clipped == expected) else "FAILED", drawn))
+    circularDisp.SetCircularMask(display, 1)
+
+  if(test==14):
+
+    # RGB444 transfers, an emulated display is sent a picture with 12 bits per pixel and what it shows should be
+    # each pixel cut down (and dithered) the same way here, in about three quarters of the bytes
+    import array
+    import random
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    bayer = ((0, 8, 2, 10), (12, 4, 14, 6), (3, 11, 1, 9), (15, 7, 13, 5))
+
+    def Expected(colour, x, y, dither):
+      red, green, blue = colour >> 11, (colour >> 5) & 0x3F, colour & 0x1F
+      if dither:
+        level = bayer[y & 3][x & 3]
+        red, green, blue = min(red + (level >> 3), 31), min(green + (level >> 2), 63), min(blue + (level >> 3), 31)
+      red, green, blue = red >> 1, green >> 2, blue >> 1
+      return (((red << 1) | (red >> 3)) << 11) | (((green << 2) | (green >> 2)) << 5) | ((blue << 1) | (blue >> 3))
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      pixels = array.array('H', [random.randrange(65536) for i in range(240*240)])
+
+      for name, bits, dither in (("16 bit", 16, 0), ("12 bit", 12, 0), ("12 bit dithered", 12, 1)):
+        circularDisp.SetTransferFormat(second, bits, dither)
+        circularDisp.LoadRawImage(second, pixels.tobytes(), 240, 240, 4, 0, 0, 0, 0)
+        circularDisp.ResetFlushCounters(second)
+        circularDisp.ScreenUpdate(second)
+        sent = circularDisp.GetFlushBytesSent(second)
+
+        # then odd sized areas, so the pixel pairs run on from one row to the next and end on half a pair
+        circularDisp.DrawRectangle(second, 31,40,63,52,0xFFFF)
+        circularDisp.SetPixel(second, 100,7,0x8410)
+        circularDisp.SetPixelDirect(second, 200,201,0x7BEF)
+        circularDisp.ScreenUpdateDirty(second)
+
+        if (bits == 16):
+          expect = lambda colour, x, y: colour
+        else:
+          expect = lambda colour, x, y: Expected(colour, x, y, dither)
+        passed = all(circularDisp.EmulatorGetPixel(second, x,y) == expect(circularDisp.GetPixel(second, x,y), x, y)
+                     for y in range(240) for x in range(240))
+        print("transfer {:16s} {}   {} bytes for a full update".format(name, "passed" if passed else "FAILED", sent))
+      CheckGolden(second, "test14")
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
+  if(test==15):
+
+    # hardware scrolling, an emulated display scrolls a band of stripes a step at a time, filling each new step with
+    # the next colour. What the panel shows should be the stripes moved along, and the render space row ScrollRow gives
+    # for each screen row, with only the new rows sent each step. Both orientations that can scroll are tried
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.EmulatorGetScreenPixel.restype = c_ushort
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    top, count, step = 40, 160, 16
+    colours = [0xF800, 0x07E0, 0x001F, 0xFFE0, 0x07FF, 0xF81F, 0xFFFF, 0x8410]
+
+    def Inside(x, y):
+      return (x-119.5)**2 + (y-119.5)**2 < 119.5**2
+
+    for orientation in (3, 2):
+      second = c_void_p(circularDisp.CreateDisplay())
+      circularDisp.SelectBackend(second, b"emulator")
+      circularDisp.SetEmulatorClock(second, 0)
+      circularDisp.SetDisplayOrientation(second, orientation)
+      if (circularDisp.initBCMHardware(second)):
+        circularDisp.initCircularDisp(second)
+        circularDisp.clearScreenDirect(second, 0x0000)
+        circularDisp.SetScrollArea(second, top, count)
+        circularDisp.ScreenUpdateDirty(second)
+        shown = [0x0000]*count
+        passed = True
+        sent = 0
+        for frame, lines in enumerate([step]*12 + [-step]*3 + [step]):
+          colour = colours[frame % len(colours)]
+          row = circularDisp.ScrollArea(second, lines, colour)
+          circularDisp.DrawLineIntMaths(second, 0,row,239,row,0x0000)
+          circularDisp.ResetFlushCounters(second)
+          circularDisp.ScreenUpdateDirty(second)
+          sent = max(sent, circularDisp.GetFlushBytesSent(second))
+          if (lines > 0):
+            shown = shown[lines:] + [0x0000] + [colour]*(lines - 1)
+          else:
+            shown = [0x0000] + [colour]*(-lines - 1) + shown[:lines]
+          passed = passed and all(circularDisp.EmulatorGetScreenPixel(second, 120,top + i) == shown[i] for i in range(count))
+          passed = passed and all(circularDisp.EmulatorGetScreenPixel(second, x,y) ==
+                                  circularDisp.GetPixel(second, x,circularDisp.ScrollRow(second, y))
+                                  for y in range(0,240,3) for x in range(240) if Inside(x,y))
+        circularDisp.SetScrollArea(second, 0, 0)
+        print("scrolling orientation {} {}   at most {} bytes a step".format(orientation, "passed" if passed else "FAILED", sent))
+        CheckGolden(second, "test15_{}".format(orientation))
+        circularDisp.exitBCMHardware(second)
+      circularDisp.DestroyDisplay(second)
+
+  if(test==16):
+
+    # instrumentation, only in a library built with -DC2PY_STATS. An emulated display draws things with known pixel
+    # counts, the counters should say the same, the bytes sent should match the flush counters and the trace should load
+    import json
+    STAT_VALUES, STAT_KINDS = 6, 14
+    STAT_PIXEL, STAT_LINE, STAT_FILL, STAT_FLUSH, STAT_SEND = 0, 1, 10, 12, 13
+    STAT_CALLS, STAT_PIXELS, STAT_BYTES = 0, 1, 4
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    stats = (c_ulonglong*(STAT_KINDS*STAT_VALUES))()
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if not circularDisp.GetStats(second, stats, len(stats)):
+      print("stats not built in (-DC2PY_STATS), skipped")
+      goldenchecked = True      # nothing drawn to check
+    elif (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      circularDisp.StartTrace(second, 1000)
+      circularDisp.ResetStats(second)
+      circularDisp.ResetFlushCounters(second)
+      circularDisp.clearScreenDirect(second, 0x0000)
+      for i in range(10):
+        circularDisp.SetPixel(second, 10 + i,20,0xFFFF)
+      circularDisp.DrawLineIntMaths(second, 20,30,219,30,0xF800)
+      circularDisp.DrawLineIntMaths(second, 30,40,30,139,0x07E0)
+      for frame in range(5):
+        circularDisp.SetPixel(second, 100,100 + frame,0x001F)
+        circularDisp.ScreenUpdateDirty(second)
+      circularDisp.GetStats(second, stats, len(stats))
+      value = lambda kind, index: stats[kind*STAT_VALUES + index]
+
+      passed = (value(STAT_PIXEL, STAT_CALLS) == 15) and (value(STAT_PIXEL, STAT_PIXELS) == 15)
+      passed = passed and (value(STAT_LINE, STAT_CALLS) == 2) and (value(STAT_LINE, STAT_PIXELS) == 300)
+      passed = passed and (value(STAT_FILL, STAT_PIXELS) == 240*240) and (value(STAT_FLUSH, STAT_CALLS) == 5)
+      passed = passed and (value(STAT_SEND, STAT_BYTES) == circularDisp.GetFlushBytesSent(second))
+      passed = passed and (240*240 + 5 <= value(STAT_SEND, STAT_PIXELS) <= value(STAT_SEND, STAT_BYTES)//2)
+      histogram = (c_uint*64)()
+      circularDisp.GetFrameHistogram(second, histogram, len(histogram))
+      passed = passed and (sum(histogram) == 4)     # the times between the updates
+
+      circularDisp.SaveTrace(second, b"/tmp/c2py_trace.json")
+      events = json.load(open("/tmp/c2py_trace.json"))["traceEvents"]
+      names = set(event["name"] for event in events if event["ph"] == "X")
+      passed = passed and {"pixel", "line", "fill", "screen update", "send"} <= names
+      print("stats {}   {} bytes sent in {} commands, {} trace events".format("passed" if passed else "FAILED",
+            value(STAT_SEND, STAT_BYTES), value(STAT_SEND, 5), len(events)))
+      CheckGolden(second, "test16")
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
+  if(test==17):
+
+    # numpy straight into the render space, a pattern written through the array (and the memoryview) and sent with
+    # MarkDirtyArea should be what GetPixel reads back and what an emulated display shows, in either byte order
+    import numpy
+    from renderspace import RenderSpace, RenderArray, RGBto16bit
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+    y, x = numpy.mgrid[0:240, 0:240]
+    pattern = RGBto16bit(x, y, (x*y) & 0xFF)
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      for panelorder in (0, 1):
+        circularDisp.SetPanelByteOrder(second, panelorder)
+        circularDisp.clearScreenDirect(second, 0x0000)
+        frame = RenderArray(circularDisp, second)
+        frame[20:200, 30:220] = pattern[20:200, 30:220]
+        circularDisp.MarkDirtyArea(second, 30,20,219,199)
+        circularDisp.ScreenUpdateDirty(second)
+        expected = numpy.zeros((240, 240), dtype=numpy.uint16)
+        expected[20:200, 30:220] = pattern[20:200, 30:220]
+        passed = all(circularDisp.GetPixel(second, x,y) == expected[y, x] and
+                     circularDisp.EmulatorGetPixel(second, x,y) == expected[y, x] for y in range(240) for x in range(240))
+
+        # the memoryview holds the pixels as stored, so swapped in the panel's byte order
+        pixels = RenderSpace(circularDisp, second)
+        colour = 0x1234 if not panelorder else 0x3412
+        pixels[3, 5] = colour
+        passed = passed and circularDisp.GetPixel(second, 5,3) == 0x1234 and pixels[100, 100] == (frame[100, 100] if not panelorder else
+                 ((int(frame[100, 100]) >> 8) | ((int(frame[100, 100]) & 0xFF) << 8)))
+        print("render space panel order {} {}".format(panelorder, "passed" if passed else "FAILED"))
+      CheckGolden(second, "test17")
+
+      # initialised again the render space is cleared but is the same memory, so the array still draws into it
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      passed = not frame.any()
+      frame[7, 9] = 0xF81F
+      passed = passed and circularDisp.GetPixel(second, 9,7) == 0xF81F
+      print("render space initialised again {}".format("passed" if passed else "FAILED"))
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
+  if(test==18):
+
+    # drawing with several threads, each drawing a band of rows, should give exactly the same picture as one thread
+    # and send the same to the panel. A draw list of every kind of command is run with 1 to 4 threads and compared
+    import array
+    import numpy
+    from drawlist import DrawList, LINE_CAP_ROUND
+    from renderspace import RenderArray
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+    sprite = array.array('H', [(i*37) & 0xFFFF for i in range(30*20)])
+
+    def Pattern():
+      dl = DrawList()
+      dl.Fill(0x0000)
+      dl.RestoreReference()
+      for centre in range (10):
+        for radius in range(0,240,8):
+          dl.LineAA(12*centre,12*centre,radius,0,radius<<11)
+          dl.LineWideAA(12*centre,12*centre,0,radius,(radius<<5)&0x07E0,10)
+          dl.Line(12*centre,12*centre,239,radius,0xffff>>centre)
+          dl.LineWideCapped(12*centre,239 - 12*centre,radius,radius//2,0xF81F,7,LINE_CAP_ROUND)
+        dl.Circle(120,120,10*centre + 5,0xf81f)
+      dl.UpdateDirty()
+      dl.Pie(120,120,100,4500,20000,0x07FF)
+      dl.Disc(60,170,37,0xFFE0)
+      dl.Arc(120,120,90,12,30000,9000,0x8410)
+      dl.Polygon([(10,10),(230,40),(180,230),(40,200),(120,110)], 0x39E7)
+      dl.Clip(50,100,190,140)
+      dl.Disc(120,120,60,0xF800)
+      dl.Rectangle(40,90,200,150,0xFFFF)
+      dl.Unclip()
+      dl.Blit(100,30,30,20,sprite)
+      dl.Blit(200,115,30,20,sprite)
+      for x in range(0,240,7):
+        dl.Pixel(x,(x*5) % 240,0xFFFF)
+      dl.UpdateDirty()
+      return dl
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.clearScreenDirect(second, 0x0000)
+      circularDisp.DrawLineWideAA(second, 0,0,239,239,0x001F,40)
+      circularDisp.SetRefernceImage(second)
+      dl = Pattern()
+      results = []
+      for threads in (1, 2, 3, 4):
+        circularDisp.clearScreenDirect(second, 0x1234)
+        RenderArray(circularDisp, second)[:, :] = 0x1234     # and the corners, which the lines blend with
+        circularDisp.SetDrawThreads(second, threads)
+        count = dl.Run(circularDisp, second)
+        render = RenderArray(circularDisp, second).copy()
+        panel = [circularDisp.EmulatorGetPixel(second, x,y) for y in range(240) for x in range(240)]
+        results.append((render, panel))
+        if (threads > 1):
+          passed = (count == dl.count) and numpy.array_equal(render, results[0][0]) and (panel == results[0][1])
+          print("drawing with {} threads {}".format(threads, "passed" if passed else "FAILED"))
+      CheckGolden(second, "test18")
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
+  if(test==19):
+
+    # content diff, full frames with a small part changed should send only that part and still leave the panel showing
+    # the frame, a mostly changed frame should be sent whole, and the async updates should diff the same way
+    import numpy
+    from renderspace import RenderArray
+    DIFF_STAT_UPDATES, DIFF_STAT_CHANGED, DIFF_STAT_FULL, DIFF_STAT_RATIO, DIFF_STATS = 0, 2, 4, 5, 6
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+    circularDisp.GetFlushBytesSent.restype = c_ulonglong
+    stats = (c_ulonglong*DIFF_STATS)()
+    y, x = numpy.mgrid[0:240, 0:240]
+    pattern = ((x*y) & 0xFFFF).astype(numpy.uint16)
+
+    def Shown(display):
+      render = RenderArray(circularDisp, display)
+      return all(circularDisp.EmulatorGetPixel(display, x,y) == render[y, x] for y in range(240) for x in range(240))
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      passed = circularDisp.SetContentDiff(second, 1, 50) and not circularDisp.SetContentDiff(second, 1, 101)
+      frame = RenderArray(circularDisp, second)
+      frame[:, :] = pattern
+      circularDisp.ScreenUpdate(second)       # the first full update fills the copy
+      circularDisp.ResetDiffStats(second)
+      sent = 0
+      for step in range(5):
+        frame[100 + step, 50:90] ^= 0xFFFF
+        frame[10:20, 200 - step] = 0xF800
+        circularDisp.ResetFlushCounters(second)
+        circularDisp.ScreenUpdate(second)
+        sent = max(sent, circularDisp.GetFlushBytesSent(second))
+      passed = passed and (sent < 240*240*2//20) and Shown(second)
+      circularDisp.GetDiffStats(second, stats, DIFF_STATS)
+      passed = passed and (stats[DIFF_STAT_UPDATES] == 5) and (stats[DIFF_STAT_FULL] == 0)
+      print("content diff small changes {}   at most {} bytes an update, {}/1000 changed".format(
+            "passed" if passed else "FAILED", sent, stats[DIFF_STAT_RATIO]))
+
+      frame[:200, :] ^= 0x5555
+      circularDisp.ScreenUpdate(second)
+      circularDisp.GetDiffStats(second, stats, DIFF_STATS)
+      passed = (stats[DIFF_STAT_FULL] == 1) and Shown(second)
+
+      # pixels sent directly go in the copy too, so sending the same frame again has nothing to send
+      circularDisp.SetPixelDirect(second, 120,120,0x07E0)
+      circularDisp.ResetFlushCounters(second)
+      circularDisp.ScreenUpdate(second)
+      passed = passed and (circularDisp.GetFlushBytesSent(second) == 0) and Shown(second)
+      print("content diff full frame fallback {}".format("passed" if passed else "FAILED"))
+
+      for step in range(5):
+        frame[30 + 7*step:35 + 7*step, 60:180] = 0x001F*step
+        circularDisp.ScreenUpdateAsync(second, 0)
+      circularDisp.WaitForFlush(second)
+      passed = Shown(second)
+      circularDisp.SetContentDiff(second, 0, 0)
+      frame[:, :] = 0x1234
+      circularDisp.ResetFlushCounters(second)
+      circularDisp.ScreenUpdate(second)
+      passed = passed and (circularDisp.GetFlushBytesSent(second) >= 240*240*2) and Shown(second)
+      print("content diff async {}".format("passed" if passed else "FAILED"))
+      CheckGolden(second, "test19")
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
+  if(test==20):
+
+    # an async update as the very first update, so the flush thread is the first to need the transfer buffer.
+    # On a new display, again after closing and opening it, and from the frame loop. Hanging here is failing
+    circularDisp.GetPixel.restype = c_ushort
+    circularDisp.EmulatorGetPixel.restype = c_ushort
+
+    def Shown(context):
+      return all(circularDisp.EmulatorGetPixel(context, x,y) == circularDisp.GetPixel(context, x,y)
+                 for y in range(0,240,2) for x in range(240))
+
+    def Frame(frame):
+      if (frame == 3):
+        return False
+      circularDisp.DrawLineWideAA(second, 20,40 + 20*frame,220,40 + 20*frame,0x07E0,8)
+      return True
+
+    second = c_void_p(circularDisp.CreateDisplay())
+    circularDisp.SelectBackend(second, b"emulator")
+    circularDisp.SetEmulatorClock(second, 0)
+    for name in ("new display", "opened again", "frame loop"):
+      if (circularDisp.initBCMHardware(second)):
+        circularDisp.initCircularDisp(second)
+        circularDisp.SetCircularMask(second, 0)
+        circularDisp.DrawLineAA(second, 10,10,229,200,0xFFFF)
+        if (name == "frame loop"):
+          callback = CFUNCTYPE(c_bool, c_uint)(Frame)
+          circularDisp.RunFrameLoop(second, 30, callback, 2)
+        else:
+          circularDisp.ScreenUpdateAsync(second, 0)
+        circularDisp.WaitForFlush(second)
+        print("async first update {:12s} {}".format(name, "passed" if Shown(second) else "FAILED"))
+        if (name == "frame loop"):
+          CheckGolden(second, "test20")
+        circularDisp.exitBCMHardware(second)
+
+    # the bus calls from Python wait for a frame still being sent (at the speed of a 32MHz bus) rather than
+    # sending their window and pixel in the middle of it
+    if (circularDisp.initBCMHardware(second)):
+      circularDisp.initCircularDisp(second)
+      circularDisp.SetCircularMask(second, 0)
+      circularDisp.SetEmulatorClock(second, 32000000)
+      circularDisp.DrawLineAA(second, 10,10,229,200,0xFFFF)
+      circularDisp.ScreenUpdateAsync(second, 0)
+      circularDisp.SetScreenWriteArea(second, 5,6,5,6)
+      circularDisp.sdoDataU16(second, 0xF800)
+      circularDisp.WaitForFlush(second)
+      passed = (circularDisp.EmulatorGetPixel(second, 5,6) == 0xF800) and (circularDisp.EmulatorGetPixel(second, 5,5) == 0)
+      passed = passed and all(circularDisp.EmulatorGetPixel(second, x,y) == circularDisp.GetPixel(second, x,y)
+                              for y in range(7,240,2) for x in range(240))
+      print("bus calls during an async update {}".format("passed" if passed else "FAILED"))
+      circularDisp.exitBCMHardware(second)
+    circularDisp.DestroyDisplay(second)
+
   if (test ==0):
-    circularDisp.DrawLineAA(120,120,239,120,0xFFFF)
-    circularDisp.DrawLineAA(120,120,0,120,0xFFFF)
-    circularDisp.DrawLineAA(120,120,120,0,0xFFFF)
-    circularDisp.DrawLineAA(120,120,120,239,0xFFFF)
+    circularDisp.DrawLineAA(display, 120,120,239,120,0xFFFF)
+    circularDisp.DrawLineAA(display, 120,120,0,120,0xFFFF)
+    circularDisp.DrawLineAA(display, 120,120,120,0,0xFFFF)
+    circularDisp.DrawLineAA(display, 120,120,120,239,0xFFFF)
 
-    circularDisp.DrawLineAA(110,120,239,120,0xFFFF)
-    circularDisp.DrawLineAA(110,120,-1,120,0xf800)
-    circularDisp.DrawLineAA(110,120,120,-1,0x07E0)
-    circularDisp.DrawLineAA(110,120,120,239,0x07E0)
+    circularDisp.DrawLineAA(display, 110,120,239,120,0xFFFF)
+    circularDisp.DrawLineAA(display, 110,120,-1,120,0xf800)
+    circularDisp.DrawLineAA(display, 110,120,120,-1,0x07E0)
+    circularDisp.DrawLineAA(display, 110,120,120,239,0x07E0)
 
 
   # some timing to see how fast it can work
@@ -105,10 +968,12 @@ if (circularDisp.initBCMHardware()):
   print("lines time End: ")
   print(str(now-starttime))
 
-  circularDisp.ScreenUpdate()
+  circularDisp.ScreenUpdate(display)
+  if ((backend == b"emulator") and not goldenchecked):
+    CheckGolden(display, "test{}".format(test))
 
 
-  circularDisp.exitBCMHardware()
+  circularDisp.exitBCMHardware(display)
 else:
   print ("failed to imitialise the hardware - probably not running as root")
 